@@ -0,0 +1,160 @@
+// Blocklist load benchmark: compiled trie vs. the former uthash table (one
+// malloc + strdup per entry). Writes a synthetic hosts file, then loads it in
+// a fresh child process per loader and reports time and resident memory.
+//
+// Usage: ./bench-blacklist-load [entries] [hosts file to use instead]
+
+#include "blacklist.h"
+#include "log.h"
+#include <sys/wait.h>
+#include <time.h>
+#include <uthash.h>
+
+typedef struct {
+  char *key;
+  UT_hash_handle hh; // makes this structure hashable
+} hash_entry;
+
+static const char *tlds[] = {"com", "net", "org", "io", "de", "ru", "co.uk"};
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+// Current and peak resident set size of this process
+static void resident_bytes(size_t *current, size_t *peak) {
+  *current = 0;
+  *peak = 0;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == NULL) {
+    return;
+  }
+  char line[128];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    size_t kib = 0;
+    if (sscanf(line, "VmRSS: %zu kB", &kib) == 1) {
+      *current = kib << 10;
+    } else if (sscanf(line, "VmHWM: %zu kB", &kib) == 1) {
+      *peak = kib << 10;
+    }
+  }
+  fclose(f);
+}
+
+static void random_label(char *out, const size_t len, unsigned *seed) {
+  for (size_t i = 0; i < len; i++) {
+    out[i] = (char)('a' + rand_r(seed) % 26);
+  }
+  out[len] = '\0';
+}
+
+// Ad/tracker lists are dominated by "<host>.<domain>.<tld>" names
+static bool write_hosts(const char *path, const size_t entries) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return false;
+  }
+  unsigned seed = 42;
+  char domain[16];
+  fprintf(f, "# synthetic blocklist\n127.0.0.1 localhost\n");
+  for (size_t i = 0; i < entries; i++) {
+    char host[16];
+    if (i % 4 == 0) { // a few hosts per domain, like real lists
+      random_label(domain, 4 + (size_t)(rand_r(&seed) % 10), &seed);
+    }
+    random_label(host, 2 + (size_t)(rand_r(&seed) % 8), &seed);
+    fprintf(f, "0.0.0.0 %s.%s.%s\n", host, domain,
+            tlds[rand_r(&seed) % (sizeof(tlds) / sizeof(tlds[0]))]);
+  }
+  return fclose(f) == 0;
+}
+
+static size_t load_trie(const char *path) {
+  struct blacklist_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  struct trie_builder builder;
+  struct trie trie;
+  trie_builder_init(&builder);
+  if (!blacklist_load_file(&builder, path, &stats) ||
+      !trie_build(&builder, &trie)) {
+    return 0;
+  }
+  return stats.added;
+}
+
+// What populate_blacklist() used to do, fed from the same file
+static size_t load_uthash(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  hash_entry *table = NULL;
+  char *line = NULL;
+  size_t cap = 0;
+  while (getline(&line, &cap, f) > 0) {
+    char addr[64];
+    char name[DOMAIN_MAX + 1];
+    if (line[0] == '#' || sscanf(line, "%63s %253s", addr, name) != 2 ||
+        strcmp(name, "localhost") == 0) {
+      continue;
+    }
+    hash_entry *entry = malloc(sizeof(hash_entry));
+    entry->key = strdup(name);
+    HASH_ADD_KEYPTR(hh, table, entry->key, strlen(entry->key), entry);
+  }
+  free(line);
+  fclose(f);
+  return HASH_COUNT(table);
+}
+
+static void run(const char *label, size_t (*load)(const char *),
+                const char *path) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    size_t base = 0;
+    size_t peak = 0;
+    size_t kept = 0;
+    resident_bytes(&base, &peak);
+    double start = now_ms();
+    size_t entries = load(path);
+    double ms = now_ms() - start;
+    resident_bytes(&kept, &peak);
+    double kept_mib = (double)(kept - base) / (1 << 20);
+    double millions = (double)entries / 1e6;
+    printf("%-20s %9zu %8.0f %9.1f %9.1f %8.0f %10.1f\n", label, entries, ms,
+           (double)(peak - base) / (1 << 20), kept_mib,
+           millions > 0 ? ms / millions : 0.,
+           millions > 0 ? kept_mib / millions : 0.);
+    fflush(stdout);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[]) {
+  log_set_level(LOG_LEVEL_ERROR);
+  size_t entries = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  char path[] = "/tmp/bench-blacklist-XXXXXX";
+  const char *file = argc > 2 ? argv[2] : path;
+
+  if (argc <= 2) {
+    int fd = mkstemp(path);
+    if (fd < 0 || close(fd) < 0 || !write_hosts(path, entries)) {
+      perror("synthetic hosts file");
+      return 1;
+    }
+  }
+
+  printf("%-20s %9s %8s %9s %9s %8s %10s\n", "loader", "entries", "ms",
+         "peak MiB", "kept MiB", "ms/M", "kept MiB/M");
+  run("uthash strdup (old)", load_uthash, file);
+  run("compiled trie", load_trie, file);
+
+  if (argc <= 2) {
+    unlink(path);
+  }
+  return 0;
+}
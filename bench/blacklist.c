@@ -0,0 +1,163 @@
+// Blacklist lookup benchmark: reversed-label trie vs. the former uthash table
+// (one malloc + strdup per entry, HASH_FIND_STR on the full name).
+//
+// Usage: ./bench-blacklist [entries] [lookups]
+
+#include "config.h"
+#include "log.h"
+#include "trie.h"
+#include <time.h>
+#include <uthash.h>
+
+typedef struct {
+  char *key;
+  UT_hash_handle hh; // makes this structure hashable
+} hash_entry;
+
+static const char *tlds[] = {"com", "net", "org", "io", "de", "ru", "co.uk"};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void random_label(char *out, const size_t len, unsigned *seed) {
+  for (size_t i = 0; i < len; i++) {
+    out[i] = (char)('a' + rand_r(seed) % 26);
+  }
+  out[len] = '\0';
+}
+
+// "<label>[.<label>].<tld>", the shape of typical blocklist entries
+static void random_domain(char *out, const size_t cap, unsigned *seed) {
+  char first[16];
+  char second[16];
+  random_label(first, 4 + (size_t)(rand_r(seed) % 10), seed);
+  random_label(second, 3 + (size_t)(rand_r(seed) % 6), seed);
+  const char *tld = tlds[rand_r(seed) % (sizeof(tlds) / sizeof(tlds[0]))];
+  if (rand_r(seed) % 2) {
+    snprintf(out, cap, "%s.%s.%s", second, first, tld);
+  } else {
+    snprintf(out, cap, "%s.%s", first, tld);
+  }
+}
+
+// The old lookup extended to parent domains: one hash lookup per suffix
+static bool hash_match_suffixes(hash_entry *table, const char *domain) {
+  hash_entry *entry = NULL;
+  for (const char *p = domain; p != NULL; p = strchr(p, '.')) {
+    if (*p == '.') {
+      p++;
+    }
+    HASH_FIND_STR(table, p, entry);
+    if (entry != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  log_set_level(LOG_LEVEL_ERROR);
+  size_t entries = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  size_t lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+  unsigned seed = 42;
+
+  char(*names)[DOMAIN_AVG] = calloc(entries, DOMAIN_AVG);
+  char(*queries)[DOMAIN_AVG + 8] = calloc(lookups, DOMAIN_AVG + 8);
+  if (names == NULL || queries == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < entries; i++) {
+    random_domain(names[i], DOMAIN_AVG, &seed);
+  }
+  // A third exact hits, a third subdomains of entries, a third misses
+  for (size_t i = 0; i < lookups; i++) {
+    const char *name = names[(size_t)rand_r(&seed) % entries];
+    switch (i % 3) {
+    case 0:
+      snprintf(queries[i], DOMAIN_AVG + 8, "%s", name);
+      break;
+    case 1:
+      snprintf(queries[i], DOMAIN_AVG + 8, "www.%s", name);
+      break;
+    default:
+      random_domain(queries[i], DOMAIN_AVG + 8, &seed);
+    }
+  }
+
+  double start = now_ns();
+  hash_entry *table = NULL;
+  for (size_t i = 0; i < entries; i++) {
+    hash_entry *entry = malloc(sizeof(hash_entry));
+    entry->key = strdup(names[i]);
+    HASH_ADD_KEYPTR(hh, table, entry->key, strlen(entry->key), entry);
+  }
+  double hash_build = now_ns() - start;
+
+  start = now_ns();
+  struct trie_builder builder;
+  struct trie trie;
+  trie_builder_init(&builder);
+  for (size_t i = 0; i < entries; i++) {
+    // Entries block the name itself and everything below it
+    char wildcard[DOMAIN_AVG + 2];
+    snprintf(wildcard, sizeof(wildcard), "*.%s", names[i]);
+    trie_builder_add(&builder, names[i], strlen(names[i]));
+    trie_builder_add(&builder, wildcard, strlen(wildcard));
+  }
+  trie_build(&builder, &trie);
+  double trie_build_ns = now_ns() - start;
+
+  size_t hits = 0;
+  start = now_ns();
+  for (size_t i = 0; i < lookups; i++) {
+    hash_entry *entry = NULL;
+    HASH_FIND_STR(table, queries[i], entry);
+    hits += entry != NULL;
+  }
+  double hash_exact = (now_ns() - start) / (double)lookups;
+  size_t hash_exact_hits = hits;
+
+  hits = 0;
+  start = now_ns();
+  for (size_t i = 0; i < lookups; i++) {
+    hits += hash_match_suffixes(table, queries[i]);
+  }
+  double hash_suffix = (now_ns() - start) / (double)lookups;
+  size_t hash_suffix_hits = hits;
+
+  hits = 0;
+  start = now_ns();
+  for (size_t i = 0; i < lookups; i++) {
+    hits += trie_match(&trie, queries[i]);
+  }
+  double trie_lookup = (now_ns() - start) / (double)lookups;
+
+  printf("entries: %zu, lookups: %zu (1/3 exact, 1/3 subdomain, 1/3 miss)\n",
+         entries, lookups);
+  printf("%-28s %12s %12s %10s\n", "matcher", "build ms", "ns/lookup",
+         "matched");
+  printf("%-28s %12.2f %12.1f %10zu\n", "uthash exact (old)", hash_build / 1e6,
+         hash_exact, hash_exact_hits);
+  printf("%-28s %12.2f %12.1f %10zu\n", "uthash per-suffix", hash_build / 1e6,
+         hash_suffix, hash_suffix_hits);
+  printf("%-28s %12.2f %12.1f %10zu\n", "reversed-label trie",
+         trie_build_ns / 1e6, trie_lookup, hits);
+  printf("trie: %zu nodes, %zu label bytes, %zu index slots\n",
+         trie.node_count, trie.labels_len,
+         trie.index != NULL ? trie.index_mask + 1 : 0);
+
+  trie_free(&trie);
+  hash_entry *entry = NULL;
+  hash_entry *tmp = NULL;
+  HASH_ITER(hh, table, entry, tmp) {
+    HASH_DEL(table, entry);
+    free(entry->key);
+    free(entry);
+  }
+  free(names);
+  free(queries);
+  return 0;
+}
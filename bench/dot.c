@@ -0,0 +1,418 @@
+// Upstream transport cost: plain UDP vs. DNS over TLS on one persistent,
+// pipelined tcp_conn, against a stub resolver in a second thread that echoes
+// every query back as its answer. Reports the latency of each query and the
+// CPU time the querying thread spends on it, with one query in flight and
+// with [window] in flight, and what a full and a resumed TLS handshake cost.
+//
+// Usage: ./bench-dot [queries] [window] [handshakes]
+
+#include "config.h"
+#include "log.h"
+#include "tcp-conn.h"
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define BENCH_NAME "bench.test"
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static double cpu_ns(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 +
+         (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+}
+
+// Self-signed certificate for BENCH_NAME, made up in memory
+static X509 *make_certificate(EVP_PKEY **key) {
+  *key = EVP_EC_gen("P-256");
+  X509 *cert = X509_new();
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_NAME *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)BENCH_NAME, -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509_set_pubkey(cert, *key);
+  X509_sign(cert, *key, EVP_sha256());
+  return cert;
+}
+
+struct stub {
+  int udp;         // bound UDP socket
+  int tcp;         // listening TCP socket
+  SSL_CTX *ctx;    // server context with the certificate
+  uint16_t port;   // same port for both
+};
+
+static void answer(char *msg) { msg[2] = (char)(msg[2] | 0x80); }
+
+static void *stub_udp(void *arg) {
+  struct stub *stub = arg;
+  char buf[RESPONSE_MAX];
+  struct sockaddr_storage from;
+  for (;;) {
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(stub->udp, buf, sizeof(buf), 0,
+                           (struct sockaddr *)&from, &from_len);
+    if (len < DNS_HEADER_SIZE) {
+      continue;
+    }
+    answer(buf);
+    sendto(stub->udp, buf, (size_t)len, 0, (struct sockaddr *)&from,
+           from_len);
+  }
+  return NULL;
+}
+
+// One connection at a time, every whole query read is answered in one write
+static void *stub_tls(void *arg) {
+  struct stub *stub = arg;
+  static char in[1 << 16];
+  static char out[1 << 16];
+  for (;;) {
+    int fd = accept(stub->tcp, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    SSL *ssl = SSL_new(stub->ctx);
+    SSL_set_fd(ssl, fd);
+    size_t have = 0;
+    if (SSL_accept(ssl) == 1) {
+      for (;;) {
+        int got = SSL_read(ssl, in + have, (int)(sizeof(in) - have));
+        if (got <= 0) {
+          break;
+        }
+        have += (size_t)got;
+        size_t pos = 0;
+        size_t out_len = 0;
+        while (have - pos >= 2) {
+          size_t len = (size_t)((uint8_t)in[pos] << 8 | (uint8_t)in[pos + 1]);
+          if (have - pos < 2 + len || out_len + 2 + len > sizeof(out)) {
+            break;
+          }
+          memcpy(out + out_len, in + pos, 2 + len);
+          answer(out + out_len + 2);
+          out_len += 2 + len;
+          pos += 2 + len;
+        }
+        memmove(in, in + pos, have - pos);
+        have -= pos;
+        if (out_len > 0 && SSL_write(ssl, out, (int)out_len) <= 0) {
+          break;
+        }
+      }
+      SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(fd);
+    ERR_clear_error();
+  }
+  return NULL;
+}
+
+static void stub_start(struct stub *stub, X509 *cert, EVP_PKEY *key) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  stub->tcp = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(stub->tcp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  socklen_t addr_len = sizeof(addr);
+  if (bind(stub->tcp, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(stub->tcp, 16) < 0 ||
+      getsockname(stub->tcp, (struct sockaddr *)&addr, &addr_len) < 0) {
+    perror("stub tcp");
+    exit(1);
+  }
+  stub->port = ntohs(addr.sin_port);
+  stub->udp = socket(AF_INET, SOCK_DGRAM, 0);
+  if (bind(stub->udp, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("stub udp");
+    exit(1);
+  }
+
+  stub->ctx = SSL_CTX_new(TLS_server_method());
+  SSL_CTX_use_certificate(stub->ctx, cert);
+  SSL_CTX_use_PrivateKey(stub->ctx, key);
+  pthread_t thread;
+  pthread_create(&thread, NULL, stub_udp, stub);
+  pthread_detach(thread);
+  pthread_create(&thread, NULL, stub_tls, stub);
+  pthread_detach(thread);
+}
+
+// "q<n>.example.com" A query with the ID n
+static size_t make_query(char *out, const uint16_t id) {
+  memset(out, 0, DNS_HEADER_SIZE);
+  out[0] = (char)(id >> 8);
+  out[1] = (char)id;
+  out[2] = 0x01; // RD
+  out[5] = 1;    // QDCOUNT
+  int len = snprintf(out + DNS_HEADER_SIZE + 1, 16, "q%u", id);
+  out[DNS_HEADER_SIZE] = (char)len;
+  char *p = out + DNS_HEADER_SIZE + 1 + len;
+  memcpy(p, "\7example\3com\0\0\1\0\1", 17);
+  return (size_t)(p + 17 - out);
+}
+
+struct run {
+  struct ev_loop *loop;
+  size_t total;     // queries to send
+  size_t window;    // queries in flight
+  size_t sent;      // queries sent so far
+  size_t answered;  // answers received so far
+  double *sent_at;  // per ID
+  double *latency;  // per answer
+  int udp;          // connected UDP socket, or -1
+  struct tcp_conn conn; // DoT connection
+};
+
+static void send_next(struct run *run) {
+  char query[REQUEST_AVG];
+  uint16_t id = (uint16_t)run->sent;
+  size_t len = make_query(query, id);
+  run->sent_at[id] = now_ns();
+  run->sent++;
+  if (run->udp >= 0) {
+    send(run->udp, query, len, 0);
+  } else if (!tcp_conn_send(&run->conn, query, len)) {
+    fprintf(stderr, "send buffer full\n");
+    exit(1);
+  }
+}
+
+static void got_answer(struct run *run, const char *msg) {
+  uint16_t id = (uint16_t)((uint8_t)msg[0] << 8 | (uint8_t)msg[1]);
+  run->latency[run->answered++] = now_ns() - run->sent_at[id];
+  if (run->sent < run->total) {
+    send_next(run);
+  }
+  if (run->answered == run->total) {
+    ev_break(run->loop, EVBREAK_ALL);
+  }
+}
+
+static void udp_event(struct ev_loop *loop, ev_io *obs, int revents) {
+  struct run *run = obs->data;
+  char buf[RESPONSE_MAX];
+  ssize_t len;
+  while ((len = recv(run->udp, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    got_answer(run, buf);
+  }
+}
+
+static void tls_event(struct ev_loop *loop, ev_io *obs, int revents) {
+  struct run *run = obs->data;
+  struct tcp_conn *conn = &run->conn;
+  if (((revents & EV_WRITE) && !tcp_conn_flush(conn)) ||
+      ((revents & EV_READ) && !tcp_conn_read(conn))) {
+    fprintf(stderr, "TLS connection failed\n");
+    exit(1);
+  }
+  if (!conn->handshaking && run->total == 0) {
+    ev_break(loop, EVBREAK_ALL); // only the handshake was asked for
+    return;
+  }
+  size_t offset = 0;
+  char *msg = NULL;
+  size_t len = 0;
+  while (tcp_conn_message(conn, &offset, &msg, &len)) {
+    got_answer(run, msg);
+  }
+  tcp_conn_consume(conn, offset);
+}
+
+static SSL_SESSION *last_session;
+
+static int keep_session(SSL *ssl, SSL_SESSION *session) {
+  SSL_SESSION_free(last_session);
+  last_session = session;
+  return 1;
+}
+
+static void tls_connect(struct run *run, SSL_CTX *ctx, const uint16_t port,
+                        const bool resume) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  bool connecting = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0;
+  SSL *ssl = SSL_new(ctx);
+  SSL_set_tlsext_host_name(ssl, BENCH_NAME);
+  SSL_set1_host(ssl, BENCH_NAME);
+  if (resume && last_session != NULL) {
+    SSL_set_session(ssl, last_session);
+  }
+  if (!tcp_conn_open(&run->conn, fd, connecting, tls_event, run) ||
+      !tcp_conn_start_tls(&run->conn, ssl)) {
+    fprintf(stderr, "TLS setup failed\n");
+    exit(1);
+  }
+}
+
+static int compare(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(const char *name, struct run *run, const double cpu) {
+  qsort(run->latency, run->total, sizeof(double), compare);
+  double sum = 0;
+  for (size_t i = 0; i < run->total; i++) {
+    sum += run->latency[i];
+  }
+  printf("%-22s %6zu %10.1f %10.1f %10.1f %10.2f\n", name, run->window,
+         sum / (double)run->total / 1e3,
+         run->latency[run->total / 2] / 1e3,
+         run->latency[run->total * 99 / 100] / 1e3,
+         cpu / (double)run->total / 1e3);
+}
+
+static void measure(struct run *run, const char *name, SSL_CTX *ctx,
+                    const uint16_t port, const bool tls) {
+  run->sent = 0;
+  run->answered = 0;
+  ev_io udp_observer;
+  if (tls) {
+    run->udp = -1;
+    tls_connect(run, ctx, port, true);
+  } else {
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    run->udp = socket(AF_INET, SOCK_DGRAM, 0);
+    connect(run->udp, (struct sockaddr *)&addr, sizeof(addr));
+    ev_io_init(&udp_observer, udp_event, run->udp, EV_READ);
+    udp_observer.data = run;
+    ev_io_start(run->loop, &udp_observer);
+  }
+
+  // The handshake is not part of the queries
+  if (tls) {
+    size_t total = run->total;
+    run->total = 0;
+    ev_run(run->loop, 0);
+    run->total = total;
+  }
+  double cpu = cpu_ns();
+  for (size_t i = 0; i < run->window && run->sent < run->total; i++) {
+    send_next(run);
+  }
+  ev_run(run->loop, 0);
+  cpu = cpu_ns() - cpu;
+  report(name, run, cpu);
+
+  if (tls) {
+    tcp_conn_close(&run->conn);
+  } else {
+    ev_io_stop(run->loop, &udp_observer);
+    close(run->udp);
+  }
+}
+
+static double handshakes(struct run *run, SSL_CTX *ctx, const uint16_t port,
+                         const bool resume, const size_t count,
+                         double *cpu, size_t *reused) {
+  run->total = 0;
+  double elapsed = 0;
+  *cpu = 0;
+  *reused = 0;
+  for (size_t i = 0; i < count; i++) {
+    double start = now_ns();
+    double cpu_start = cpu_ns();
+    tls_connect(run, ctx, port, resume);
+    ev_run(run->loop, 0);
+    elapsed += now_ns() - start;
+    *cpu += cpu_ns() - cpu_start;
+    *reused += (size_t)SSL_session_reused(run->conn.ssl);
+    // TLS 1.3 tickets follow the handshake, one round trip picks them up
+    run->total = 1;
+    run->sent = 0;
+    run->answered = 0;
+    send_next(run);
+    ev_run(run->loop, 0);
+    run->total = 0;
+    tcp_conn_close(&run->conn);
+  }
+  *cpu /= (double)count;
+  return elapsed / (double)count;
+}
+
+int main(int argc, char *argv[]) {
+  log_set_level(LOG_LEVEL_ERROR);
+  size_t queries = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+  size_t window = argc > 2 ? strtoul(argv[2], NULL, 10) : 32;
+  size_t count = argc > 3 ? strtoul(argv[3], NULL, 10) : 200;
+  if (queries == 0 || window == 0 || window > 4096 || count == 0) {
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  EVP_PKEY *key = NULL;
+  X509 *cert = make_certificate(&key);
+  struct stub stub;
+  stub_start(&stub, cert, key);
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  X509_STORE_add_cert(SSL_CTX_get_cert_store(ctx), cert);
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, keep_session);
+
+  struct run run = {.loop = EV_DEFAULT, .total = queries};
+  run.sent_at = calloc(1 << 16, sizeof(double));
+  run.latency = calloc(queries, sizeof(double));
+  if (run.sent_at == NULL || run.latency == NULL) {
+    return 1;
+  }
+  tcp_conn_init(&run.conn, run.loop, 2 + TCP_MESSAGE_MAX, TCP_SEND_MAX);
+
+  printf("queries: %zu per run, stub resolver on 127.0.0.1:%u\n", queries,
+         stub.port);
+  printf("%-22s %6s %10s %10s %10s %10s\n", "transport", "window", "mean us",
+         "p50 us", "p99 us", "cpu us/q");
+  run.window = 1;
+  measure(&run, "UDP", ctx, stub.port, false);
+  measure(&run, "DoT, one connection", ctx, stub.port, true);
+  run.window = window;
+  measure(&run, "UDP", ctx, stub.port, false);
+  measure(&run, "DoT, one connection", ctx, stub.port, true);
+
+  double full_cpu = 0;
+  double resumed_cpu = 0;
+  size_t full_reused = 0;
+  size_t reused = 0;
+  double full = handshakes(&run, ctx, stub.port, false, count, &full_cpu,
+                           &full_reused);
+  double resumed = handshakes(&run, ctx, stub.port, true, count, &resumed_cpu,
+                              &reused);
+  printf("%-22s %10s %10s %10s\n", "TLS handshake", "us", "cpu us",
+         "resumed");
+  printf("%-22s %10.1f %10.1f %10zu\n", "full", full / 1e3, full_cpu / 1e3,
+         full_reused);
+  printf("%-22s %10.1f %10.1f %10zu\n", "resumed", resumed / 1e3,
+         resumed_cpu / 1e3, reused);
+
+  tcp_conn_free(&run.conn);
+  SSL_SESSION_free(last_session);
+  SSL_CTX_free(ctx);
+  free(run.sent_at);
+  free(run.latency);
+  return 0;
+}
@@ -0,0 +1,454 @@
+// The per-packet kernels of the query path, each timed on its own over a
+// corpus of generated queries: realistic name shapes, A/AAAA/HTTPS, most
+// with an EDNS0 OPT record, a tenth of them for blacklisted names. Reports
+// ns/op and, where perf_event_open() is allowed, cycles, instructions, cache
+// misses and branch misses per op. The last two rows are the whole request
+// front end: the former two passes (dotted name, then the cache key) against
+// the one pass of packet_question_parse(). "json" as the third argument
+// prints one JSON object per kernel instead of the table, to keep and compare
+// between commits.
+//
+// Usage: ./bench-kernels [packets] [rounds] [json]
+
+#include "config.h"
+#include "dns-packet.h"
+#include "dns-server.h"
+#include "log.h"
+#include "trie.h"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+enum {
+  KERNEL_BLACKLIST = 50000, // blacklist entries, each also as a wildcard
+  KERNEL_COUNTERS = 4,      // hardware events read around each kernel
+};
+
+static const char *tlds[] = {"com", "net", "org", "io", "de", "ru", "co.uk"};
+static const char *counter_names[KERNEL_COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"};
+static const uint64_t counter_events[KERNEL_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+// Queries and what the kernels need besides them
+struct corpus {
+  char (*queries)[REQUEST_AVG];      // wire format queries
+  size_t *lengths;                   // length of each query
+  char (*names)[DOMAIN_AVG];         // name of each query, dotted
+  struct packet_question *questions; // each query read in one pass
+  size_t count;                      // number of queries
+  struct dns_server server;          // only its blacklist is set
+  char rx[RESPONSE_MAX];             // receive buffer responses are built in
+};
+
+// Runs a kernel on query i, returns something that depends on its result
+typedef size_t (*kernel_fn)(struct corpus *restrict corpus, const size_t i);
+
+struct kernel {
+  const char *name;
+  kernel_fn run;
+};
+
+// Hardware counters of the calling thread, fd -1 where unavailable
+struct counters {
+  int fds[KERNEL_COUNTERS];
+  uint64_t values[KERNEL_COUNTERS];
+};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void random_label(char *out, const size_t len, unsigned *seed) {
+  for (size_t i = 0; i < len; i++) {
+    out[i] = (char)('a' + rand_r(seed) % 26);
+  }
+  out[len] = '\0';
+}
+
+// "<label>.<tld>", "www.<label>.<tld>" or a deeper CDN-style name
+static void random_name(char *out, const size_t cap, unsigned *seed) {
+  char first[16];
+  char second[16];
+  char third[8];
+  random_label(first, 4 + (size_t)(rand_r(seed) % 10), seed);
+  random_label(second, 3 + (size_t)(rand_r(seed) % 6), seed);
+  random_label(third, 2 + (size_t)(rand_r(seed) % 4), seed);
+  const char *tld = tlds[rand_r(seed) % (sizeof(tlds) / sizeof(tlds[0]))];
+  switch (rand_r(seed) % 10) {
+  case 0:
+  case 1:
+  case 2:
+  case 3:
+    snprintf(out, cap, "www.%s.%s", first, tld);
+    break;
+  case 4:
+  case 5:
+  case 6:
+    snprintf(out, cap, "%s.%s", first, tld);
+    break;
+  default:
+    snprintf(out, cap, "%s.%s.%s.%s", third, second, first, tld);
+  }
+}
+
+// Query for name as a stub resolver sends it, with an OPT record mostly
+static size_t make_query(char *out, const char *name, unsigned *seed) {
+  memset(out, 0, DNS_HEADER_SIZE);
+  out[0] = (char)rand_r(seed);
+  out[1] = (char)rand_r(seed);
+  out[2] = 0x01; // RD
+  out[5] = 1;    // QDCOUNT
+  size_t len = DNS_HEADER_SIZE;
+  for (const char *label = name; *label != '\0';) {
+    size_t label_len = strcspn(label, ".");
+    out[len++] = (char)label_len;
+    memcpy(out + len, label, label_len);
+    len += label_len;
+    label += label_len;
+    label += *label == '.';
+  }
+  out[len++] = 0;
+  unsigned pick = (unsigned)rand_r(seed) % 10;
+  uint16_t qtype = pick < 6 ? DNS_TYPE_A : pick < 9 ? DNS_TYPE_AAAA : 65;
+  out[len++] = (char)(qtype >> 8);
+  out[len++] = (char)qtype;
+  memcpy(out + len, "\0\1", 2); // IN
+  len += 2;
+  if (rand_r(seed) % 5 != 0) {
+    out[11] = 1; // ARCOUNT
+    memcpy(out + len, "\0\0\51\20\0\0\0\0\0\0\0", 11); // OPT, 4096 bytes
+    len += 11;
+  }
+  return len;
+}
+
+static bool corpus_init(struct corpus *restrict corpus, const size_t count,
+                        struct trie *restrict trie) {
+  unsigned seed = 42;
+  memset(corpus, 0, sizeof(*corpus));
+  corpus->count = count;
+  corpus->queries = calloc(count, REQUEST_AVG);
+  corpus->lengths = calloc(count, sizeof(size_t));
+  corpus->names = calloc(count, DOMAIN_AVG);
+  corpus->questions = calloc(count, sizeof(struct packet_question));
+  char(*entries)[DOMAIN_AVG] = calloc(KERNEL_BLACKLIST, DOMAIN_AVG);
+  if (corpus->queries == NULL || corpus->lengths == NULL ||
+      corpus->names == NULL || corpus->questions == NULL || entries == NULL) {
+    free(entries);
+    return false;
+  }
+
+  struct trie_builder builder;
+  trie_builder_init(&builder);
+  for (size_t i = 0; i < KERNEL_BLACKLIST; i++) {
+    char wildcard[DOMAIN_AVG + 2];
+    random_name(entries[i], DOMAIN_AVG, &seed);
+    snprintf(wildcard, sizeof(wildcard), "*.%s", entries[i]);
+    trie_builder_add(&builder, entries[i], strlen(entries[i]));
+    trie_builder_add(&builder, wildcard, strlen(wildcard));
+  }
+  if (!trie_build(&builder, trie)) {
+    free(entries);
+    return false;
+  }
+  corpus->server.blacklist = trie;
+
+  // A tenth blacklisted: half entries, half names below them
+  for (size_t i = 0; i < count; i++) {
+    const char *entry = entries[(size_t)rand_r(&seed) % KERNEL_BLACKLIST];
+    if (i % 20 == 0) {
+      snprintf(corpus->names[i], DOMAIN_AVG, "%s", entry);
+    } else if (i % 20 == 10) {
+      snprintf(corpus->names[i], DOMAIN_AVG, "ads.%s", entry);
+    } else {
+      random_name(corpus->names[i], DOMAIN_AVG, &seed);
+    }
+    corpus->lengths[i] = make_query(corpus->queries[i], corpus->names[i],
+                                    &seed);
+    packet_question_parse(corpus->queries[i], corpus->lengths[i],
+                          &corpus->questions[i]);
+  }
+  free(entries);
+  return true;
+}
+
+static void corpus_free(struct corpus *restrict corpus) {
+  free(corpus->queries);
+  free(corpus->lengths);
+  free(corpus->names);
+  free(corpus->questions);
+}
+
+// The copy into the receive buffer the response kernels start with, as
+// recvmmsg() would make it; subtract it from theirs
+static size_t run_copy(struct corpus *restrict corpus, const size_t i) {
+  memcpy(corpus->rx, corpus->queries[i], corpus->lengths[i]);
+  return (uint8_t)corpus->rx[1];
+}
+
+static size_t run_parse_domain_name(struct corpus *restrict corpus,
+                                    const size_t i) {
+  char domain[DOMAIN_MAX + 1];
+  bool ok = parse_domain_name(corpus->queries[i], corpus->lengths[i],
+                              DNS_HEADER_SIZE, domain, sizeof(domain));
+  return ok + (uint8_t)domain[0];
+}
+
+// validate_request() of dns-proxy.c, which is static: the question count,
+// then the name into a DOMAIN_AVG buffer
+static size_t run_validate_request(struct corpus *restrict corpus,
+                                   const size_t i) {
+  const char *req = corpus->queries[i];
+  const struct dns_header *header = (const struct dns_header *)req;
+  char domain[DOMAIN_AVG];
+  if (ntohs(header->qd_count) == 0) {
+    return 0;
+  }
+  bool ok = parse_domain_name(req, corpus->lengths[i], sizeof(*header),
+                              domain, DOMAIN_AVG);
+  return ok + (uint8_t)domain[0];
+}
+
+static size_t run_is_blacklisted(struct corpus *restrict corpus,
+                                 const size_t i) {
+  return is_blacklisted(&corpus->server, corpus->names[i]);
+}
+
+static size_t run_question_key(struct corpus *restrict corpus,
+                               const size_t i) {
+  char key[QUESTION_KEY_MAX];
+  size_t key_len = 0;
+  packet_question_key(corpus->queries[i], corpus->lengths[i], key, &key_len);
+  return key_len;
+}
+
+static size_t run_question_parse(struct corpus *restrict corpus,
+                                 const size_t i) {
+  struct packet_question question;
+  bool ok = packet_question_parse(corpus->queries[i], corpus->lengths[i],
+                                  &question);
+  return ok + question.key_len;
+}
+
+static size_t run_is_question_blacklisted(struct corpus *restrict corpus,
+                                          const size_t i) {
+  return is_question_blacklisted(&corpus->server, &corpus->questions[i]);
+}
+
+// What proxy_handle_request() did before the first branch: the dotted name,
+// the blacklist on it, then a second walk for the cache key
+static size_t run_two_pass(struct corpus *restrict corpus, const size_t i) {
+  char domain[DOMAIN_AVG];
+  char key[QUESTION_KEY_MAX];
+  size_t key_len = 0;
+  const char *req = corpus->queries[i];
+  if (ntohs(((const struct dns_header *)req)->qd_count) == 0 ||
+      !parse_domain_name(req, corpus->lengths[i], DNS_HEADER_SIZE, domain,
+                         DOMAIN_AVG)) {
+    return 0;
+  }
+  if (is_blacklisted(&corpus->server, domain)) {
+    return 1;
+  }
+  packet_question_key(corpus->queries[i], corpus->lengths[i], key, &key_len);
+  return key_len;
+}
+
+// What it does now
+static size_t run_one_pass(struct corpus *restrict corpus, const size_t i) {
+  struct packet_question question;
+  if (!packet_question_parse(corpus->queries[i], corpus->lengths[i],
+                             &question)) {
+    return 0;
+  }
+  if (is_question_blacklisted(&corpus->server, &question)) {
+    return 1;
+  }
+  return question.key_len;
+}
+
+static size_t run_udp_size(struct corpus *restrict corpus, const size_t i) {
+  return packet_udp_size(corpus->queries[i], corpus->lengths[i]);
+}
+
+static size_t run_blocked_response(struct corpus *restrict corpus,
+                                   const size_t i) {
+  memcpy(corpus->rx, corpus->queries[i], corpus->lengths[i]);
+  return packet_make_response(corpus->rx, corpus->lengths[i], NXDOMAIN);
+}
+
+static size_t run_redirect_response(struct corpus *restrict corpus,
+                                    const size_t i) {
+  static const unsigned char a[4] = {10, 0, 0, 1};
+  static const unsigned char aaaa[16] = {[15] = 1};
+  char *rx = corpus->rx;
+  memcpy(rx, corpus->queries[i], corpus->lengths[i]);
+  uint16_t type = packet_question_type(rx, corpus->lengths[i]);
+  size_t len = packet_make_response(rx, corpus->lengths[i], NOERROR);
+  if (type == DNS_TYPE_A) {
+    return packet_append_answer(rx, len, RESPONSE_MAX, type, a, sizeof(a),
+                                REDIRECT_TTL);
+  }
+  if (type == DNS_TYPE_AAAA) {
+    return packet_append_answer(rx, len, RESPONSE_MAX, type, aaaa,
+                                sizeof(aaaa), REDIRECT_TTL);
+  }
+  return len;
+}
+
+static const struct kernel kernels[] = {
+    {"copy (baseline)", run_copy},
+    {"parse_domain_name", run_parse_domain_name},
+    {"validate_request", run_validate_request},
+    {"is_blacklisted", run_is_blacklisted},
+    {"packet_question_key", run_question_key},
+    {"packet_udp_size", run_udp_size},
+    {"blocked response", run_blocked_response},
+    {"redirect response", run_redirect_response},
+    {"packet_question_parse", run_question_parse},
+    {"is_question_blacklisted", run_is_question_blacklisted},
+    {"front end, two passes", run_two_pass},
+    {"front end, one pass", run_one_pass},
+};
+
+static void counters_open(struct counters *restrict counters) {
+  int leader = -1;
+  for (int i = 0; i < KERNEL_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = counter_events[i];
+    attr.disabled = leader < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counters->fds[i] =
+        (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (leader < 0 && counters->fds[i] >= 0) {
+      leader = counters->fds[i];
+    }
+  }
+}
+
+static void counters_start(struct counters *restrict counters) {
+  for (int i = 0; i < KERNEL_COUNTERS; i++) {
+    if (counters->fds[i] >= 0) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+    }
+  }
+  for (int i = 0; i < KERNEL_COUNTERS; i++) {
+    if (counters->fds[i] >= 0) {
+      // Enabling the leader starts the whole group
+      ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+      break;
+    }
+  }
+}
+
+static void counters_stop(struct counters *restrict counters) {
+  for (int i = 0; i < KERNEL_COUNTERS; i++) {
+    if (counters->fds[i] >= 0) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      break;
+    }
+  }
+  for (int i = 0; i < KERNEL_COUNTERS; i++) {
+    counters->values[i] = 0;
+    if (counters->fds[i] >= 0 &&
+        read(counters->fds[i], &counters->values[i], sizeof(uint64_t)) !=
+            sizeof(uint64_t)) {
+      counters->values[i] = 0;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  log_set_level(LOG_LEVEL_ERROR);
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 4096;
+  size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 500;
+  bool json = argc > 3 && strcmp(argv[3], "json") == 0;
+  if (count == 0 || rounds == 0) {
+    return 1;
+  }
+
+  struct corpus *corpus = malloc(sizeof(*corpus));
+  struct trie trie;
+  if (corpus == NULL || !corpus_init(corpus, count, &trie)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  struct counters counters;
+  counters_open(&counters);
+  bool counted = counters.fds[0] >= 0;
+
+  if (!json) {
+    printf("packets: %zu x %zu rounds, %d blacklist entries, perf counters "
+           "%s\n",
+           count, rounds, KERNEL_BLACKLIST,
+           counted ? "on" : "unavailable");
+    printf("%-24s %9s %9s %9s %9s %9s\n", "kernel", "ns/op", "cycles",
+           "instr", "cache-mis", "br-miss");
+  }
+
+  size_t sink = 0;
+  size_t total = count * rounds;
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    const struct kernel *kernel = &kernels[k];
+    // One round to warm the caches and branch predictors
+    for (size_t i = 0; i < count; i++) {
+      sink += kernel->run(corpus, i);
+    }
+    counters_start(&counters);
+    double start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+      for (size_t i = 0; i < count; i++) {
+        sink += kernel->run(corpus, i);
+      }
+    }
+    double ns = (now_ns() - start) / (double)total;
+    counters_stop(&counters);
+
+    if (json) {
+      printf("{\"kernel\": \"%s\", \"packets\": %zu, \"rounds\": %zu, "
+             "\"ns_per_op\": %.2f",
+             kernel->name, count, rounds, ns);
+      for (int c = 0; c < KERNEL_COUNTERS; c++) {
+        if (counters.fds[c] >= 0) {
+          printf(", \"%s_per_op\": %.2f", counter_names[c],
+                 (double)counters.values[c] / (double)total);
+        } else {
+          printf(", \"%s_per_op\": null", counter_names[c]);
+        }
+      }
+      printf("}\n");
+      continue;
+    }
+    printf("%-24s %9.1f", kernel->name, ns);
+    for (int c = 0; c < KERNEL_COUNTERS; c++) {
+      if (counters.fds[c] >= 0) {
+        printf(" %9.2f", (double)counters.values[c] / (double)total);
+      } else {
+        printf(" %9s", "-");
+      }
+    }
+    printf("\n");
+  }
+  if (!json) {
+    printf("checksum: %zu\n", sink);
+  }
+
+  for (int c = 0; c < KERNEL_COUNTERS; c++) {
+    if (counters.fds[c] >= 0) {
+      close(counters.fds[c]);
+    }
+  }
+  trie_free(&trie);
+  corpus_free(corpus);
+  free(corpus);
+  return 0;
+}
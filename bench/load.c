@@ -0,0 +1,341 @@
+// Open-loop UDP load generator: sends A queries at a fixed rate whether or
+// not the answers keep up, so a slow proxy shows as latency and loss instead
+// of a lower send rate. Query k is due at k / qps seconds; names are
+// "<rank>.<zone>" with the rank drawn from a distribution:
+//
+//   uniform:N   every one of N names equally often
+//   zipf:N:s    N names, the one of rank r s-times less popular than r - 1
+//   file:PATH   the names in PATH, one per line, replayed in order
+//
+// A zone the proxy blacklists measures blocked queries, a zone the stub
+// upstream (bench-stub) drops measures timeouts, zipf measures the cache and
+// a uniform draw from a huge N measures forwarding. The random numbers have a
+// fixed seed, so runs send the same names. Waits up to 5 s after the last
+// send for late answers, then reports what came back and the latency
+// percentiles of the answered queries.
+//
+// Usage: ./bench-load [ip:port] [qps] [seconds] [names] [zone]
+
+#include "config.h"
+#include "include.h"
+#include "log.h"
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+
+enum {
+  LOAD_SOCKETS = 8,     // source ports, each with its own 16-bit IDs
+  LOAD_BATCH = 64,      // datagrams per sendmmsg() and recvmmsg()
+  LOAD_DRAIN_S = 5,     // seconds to wait for answers after the last send
+  LOAD_IDS = 1 << 16,   // in-flight queries per source port
+  LOAD_QUERY_MAX = 300, // bytes of a query with the longest name
+};
+
+// Query names to draw from
+struct names {
+  enum { NAMES_UNIFORM, NAMES_ZIPF, NAMES_FILE } kind;
+  uint64_t count;   // names, or lines of the file
+  double exponent;  // zipf s
+  char **lines;     // replayed names
+  uint64_t next;    // next line to replay
+  uint64_t state;   // xorshift64* state
+};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static double next_random(struct names *restrict names) {
+  names->state ^= names->state >> 12;
+  names->state ^= names->state << 25;
+  names->state ^= names->state >> 27;
+  return (double)((names->state * 0x2545F4914F6CDD1DULL) >> 11) * 0x1p-53;
+}
+
+static uint64_t draw_rank(struct names *restrict names) {
+  double u = next_random(names);
+  if (names->kind == NAMES_UNIFORM) {
+    return (uint64_t)(u * (double)names->count);
+  }
+  // Inverse of the continuous bounded power law, close to Zipf and O(1)
+  double n = (double)names->count;
+  double s = names->exponent;
+  double x = fabs(s - 1.) < 1e-9
+                 ? pow(n, u)
+                 : pow((pow(n, 1. - s) - 1.) * u + 1., 1. / (1. - s));
+  uint64_t rank = (uint64_t)x - 1;
+  return rank < names->count ? rank : names->count - 1;
+}
+
+static bool names_parse(struct names *restrict names,
+                        const char *restrict spec) {
+  memset(names, 0, sizeof(*names));
+  names->state = 0x9E3779B97F4A7C15ULL;
+  if (strncmp(spec, "uniform:", 8) == 0) {
+    names->kind = NAMES_UNIFORM;
+    names->count = strtoull(spec + 8, NULL, 10);
+    return names->count > 0;
+  }
+  if (strncmp(spec, "zipf:", 5) == 0) {
+    char *end = NULL;
+    names->kind = NAMES_ZIPF;
+    names->count = strtoull(spec + 5, &end, 10);
+    names->exponent = *end == ':' ? strtod(end + 1, NULL) : 1.;
+    return names->count > 0 && names->exponent > 0.;
+  }
+  if (strncmp(spec, "file:", 5) != 0) {
+    return false;
+  }
+  FILE *file = fopen(spec + 5, "r");
+  if (file == NULL) {
+    return false;
+  }
+  names->kind = NAMES_FILE;
+  char line[DOMAIN_MAX + 2];
+  uint64_t cap = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+    if (names->count == cap) {
+      cap = cap ? cap * 2 : 1024;
+      names->lines = realloc(names->lines, cap * sizeof(char *));
+    }
+    names->lines[names->count++] = strdup(line);
+  }
+  fclose(file);
+  return names->count > 0;
+}
+
+// Writes the next query into msg and returns its length
+static size_t make_query(struct names *restrict names,
+                         const char *restrict zone, const uint16_t id,
+                         char *restrict msg) {
+  char name[DOMAIN_MAX + 32];
+  if (names->kind == NAMES_FILE) {
+    snprintf(name, sizeof(name), "%s",
+             names->lines[names->next++ % names->count]);
+  } else {
+    snprintf(name, sizeof(name), "%" PRIu64 ".%s", draw_rank(names), zone);
+  }
+  memset(msg, 0, DNS_HEADER_SIZE);
+  msg[0] = (char)(id >> 8);
+  msg[1] = (char)id;
+  msg[2] = 0x01; // RD
+  msg[5] = 1;    // QDCOUNT
+  size_t len = DNS_HEADER_SIZE;
+  for (char *label = name; *label != '\0' && len < LOAD_QUERY_MAX - 70;) {
+    size_t label_len = strcspn(label, ".");
+    label_len = label_len < 63 ? label_len : 63;
+    msg[len++] = (char)label_len;
+    memcpy(msg + len, label, label_len);
+    len += label_len;
+    label += label_len;
+    label += *label == '.';
+  }
+  msg[len++] = 0;
+  const char tail[] = {0, 1, 0, 1}; // QTYPE A, QCLASS IN
+  memcpy(msg + len, tail, sizeof(tail));
+  return len + sizeof(tail);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static bool parse_server(const char *restrict arg,
+                         struct sockaddr_in *restrict addr) {
+  char ip[INET_ADDRSTRLEN];
+  const char *colon = strchr(arg, ':');
+  size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+  if (len >= sizeof(ip)) {
+    return false;
+  }
+  memcpy(ip, arg, len);
+  ip[len] = '\0';
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(colon ? (uint16_t)strtoul(colon + 1, NULL, 10) : 53);
+  return inet_pton(AF_INET, ip, &addr->sin_addr) == 1;
+}
+
+int main(int argc, char *argv[]) {
+  log_set_level(LOG_LEVEL_ERROR);
+  const char *server = argc > 1 ? argv[1] : "127.0.0.1:5353";
+  double qps = argc > 2 ? strtod(argv[2], NULL) : 20000.;
+  double seconds = argc > 3 ? strtod(argv[3], NULL) : 5.;
+  const char *spec = argc > 4 ? argv[4] : "zipf:100000:1.1";
+  const char *zone = argc > 5 ? argv[5] : "bench.test";
+
+  struct sockaddr_in addr;
+  struct names names;
+  if (!parse_server(server, &addr) || qps <= 0. || seconds <= 0.) {
+    fprintf(stderr, "Usage: %s [ip:port] [qps] [seconds] [names] [zone]\n",
+            argv[0]);
+    return 1;
+  }
+  if (!names_parse(&names, spec)) {
+    fprintf(stderr, "Invalid names %s, use uniform:N, zipf:N:s or "
+                    "file:PATH\n", spec);
+    return 1;
+  }
+
+  struct pollfd fds[LOAD_SOCKETS];
+  for (int i = 0; i < LOAD_SOCKETS; i++) {
+    fds[i].fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    fds[i].events = POLLIN;
+    int bufsize = 4 << 20;
+    setsockopt(fds[i].fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(fds[i].fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    if (connect(fds[i].fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "Cannot reach %s: %s\n", server, strerror(errno));
+      return 1;
+    }
+  }
+
+  uint64_t total = (uint64_t)(qps * seconds);
+  double *sent_at = malloc(LOAD_SOCKETS * LOAD_IDS * sizeof(double));
+  double *latencies = malloc((total + 1) * sizeof(double));
+  if (sent_at == NULL || latencies == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  for (size_t i = 0; i < (size_t)LOAD_SOCKETS * LOAD_IDS; i++) {
+    sent_at[i] = -1.; // not in flight
+  }
+
+  static char out[LOAD_BATCH][LOAD_QUERY_MAX];
+  static char in[LOAD_BATCH][REQUEST_MAX];
+  struct mmsghdr msgs[LOAD_BATCH];
+  struct iovec iovs[LOAD_BATCH];
+  uint16_t next_id[LOAD_SOCKETS] = {0};
+  unsigned next_sock = 0;
+  uint64_t sent = 0;
+  uint64_t send_failed = 0;
+  uint64_t reused = 0;
+  uint64_t answered = 0;
+  uint64_t unexpected = 0;
+  uint64_t rcodes[4] = {0}; // NOERROR, NXDOMAIN, SERVFAIL, other
+  double interval = 1e9 / qps;
+  double start = now_ns();
+  double last_send = start;
+  double last_answer = start;
+
+  for (;;) {
+    double now = now_ns();
+    if (sent == total &&
+        (answered == sent - send_failed ||
+         now > last_send + LOAD_DRAIN_S * 1e9)) {
+      break;
+    }
+
+    // Everything due by now, each batch from the next source port
+    while (sent < total && start + (double)sent * interval <= now) {
+      unsigned sock = next_sock++ % LOAD_SOCKETS;
+      unsigned count = 0;
+      for (; count < LOAD_BATCH && sent + count < total &&
+             start + (double)(sent + count) * interval <= now;
+           count++) {
+        uint16_t id = next_id[sock]++;
+        iovs[count].iov_base = out[count];
+        iovs[count].iov_len = make_query(&names, zone, id, out[count]);
+        memset(&msgs[count].msg_hdr, 0, sizeof(msgs[count].msg_hdr));
+        msgs[count].msg_hdr.msg_iov = &iovs[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        // From when it was due, so a sender falling behind counts too
+        double *slot = &sent_at[sock * LOAD_IDS + id];
+        reused += *slot >= 0.;
+        *slot = start + (double)(sent + count) * interval;
+      }
+      int res = sendmmsg(fds[sock].fd, msgs, count, 0);
+      unsigned done = res > 0 ? (unsigned)res : 0;
+      for (unsigned m = done; m < count; m++) {
+        uint16_t id = (uint16_t)(next_id[sock] - count + m);
+        sent_at[sock * LOAD_IDS + id] = -1.;
+      }
+      send_failed += count - done;
+      sent += count;
+      last_send = now;
+    }
+
+    for (unsigned sock = 0; sock < LOAD_SOCKETS; sock++) {
+      for (;;) {
+        for (unsigned m = 0; m < LOAD_BATCH; m++) {
+          iovs[m] = (struct iovec){.iov_base = in[m], .iov_len = REQUEST_MAX};
+          memset(&msgs[m].msg_hdr, 0, sizeof(msgs[m].msg_hdr));
+          msgs[m].msg_hdr.msg_iov = &iovs[m];
+          msgs[m].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(fds[sock].fd, msgs, LOAD_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+          break;
+        }
+        double at = now_ns();
+        for (int m = 0; m < n; m++) {
+          const unsigned char *msg = (const unsigned char *)in[m];
+          uint16_t id = (uint16_t)(msg[0] << 8 | msg[1]);
+          double *slot = &sent_at[sock * LOAD_IDS + id];
+          if (msgs[m].msg_len < DNS_HEADER_SIZE || *slot < 0.) {
+            unexpected++;
+            continue;
+          }
+          latencies[answered++] = at - *slot;
+          *slot = -1.;
+          unsigned rcode = msg[3] & 0x0F;
+          rcodes[rcode == NOERROR    ? 0
+                 : rcode == NXDOMAIN ? 1
+                 : rcode == SERVFAIL ? 2
+                                     : 3]++;
+        }
+        last_answer = at;
+      }
+    }
+
+    // Sleep until the next query is due, or for answers while draining
+    double wake = sent < total ? start + (double)sent * interval
+                               : last_send + LOAD_DRAIN_S * 1e9;
+    double left = wake - now_ns();
+    left = left > 0. ? left : 0.;
+    struct timespec wait = {.tv_sec = (time_t)(left / 1e9)};
+    wait.tv_nsec = (long)(left - (double)wait.tv_sec * 1e9);
+    ppoll(fds, LOAD_SOCKETS, &wait, NULL);
+  }
+
+  double send_s = (last_send - start) / 1e9;
+  double answer_s = (last_answer - start) / 1e9;
+  uint64_t lost = sent - send_failed - answered;
+  printf("target %.0f q/s for %.1f s, names %s under %s\n", qps, seconds,
+         spec, names.kind == NAMES_FILE ? "(replayed)" : zone);
+  printf("sent       %10" PRIu64 "   %10.0f q/s\n", sent,
+         send_s > 0. ? (double)sent / send_s : 0.);
+  printf("answered   %10" PRIu64 "   %10.0f q/s\n", answered,
+         answer_s > 0. ? (double)answered / answer_s : 0.);
+  printf("lost       %10" PRIu64 "   %10.3f %%\n", lost,
+         sent ? 100. * (double)lost / (double)sent : 0.);
+  if (send_failed || reused || unexpected) {
+    printf("not sent %" PRIu64 ", IDs reused in flight %" PRIu64
+           ", unexpected answers %" PRIu64 "\n",
+           send_failed, reused, unexpected);
+  }
+  printf("rcode      NOERROR %" PRIu64 ", NXDOMAIN %" PRIu64
+         ", SERVFAIL %" PRIu64 ", other %" PRIu64 "\n",
+         rcodes[0], rcodes[1], rcodes[2], rcodes[3]);
+  if (answered > 0) {
+    qsort(latencies, answered, sizeof(double), compare_double);
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    printf("latency   ");
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+      size_t at = (size_t)(quantiles[i] * (double)(answered - 1));
+      printf(" p%g %.3f ms,", quantiles[i] * 100., latencies[at] / 1e6);
+    }
+    printf(" max %.3f ms\n", latencies[answered - 1] / 1e6);
+  }
+  free(latencies);
+  free(sent_at);
+  return 0;
+}
@@ -0,0 +1,218 @@
+// Stub authoritative upstream for load tests: answers every A query with
+// 192.0.2.1 (TTL 300) and everything else with an empty NOERROR, after a
+// fixed delay, and drops a share of the queries at random. Names under
+// drop.test are never answered, so the proxy times them out; names under
+// nx.test get NXDOMAIN. Listens on every given address, one socket each, so
+// that upstream_resolver[] in src/config.c can list them as separate
+// resolvers; port 53 needs root. Prints its counters on Ctrl+C.
+//
+// Usage: ./bench-stub [addresses] [port] [delay_ms] [loss_percent]
+
+#include "config.h"
+#include "dns-packet.h"
+#include "dns-server.h"
+#include "log.h"
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+enum {
+  STUB_SOCKETS = RESOLVERS * 4, // addresses listened on at most
+  STUB_BATCH = 64,              // datagrams per recvmmsg()
+  STUB_QUEUE = 16384,           // delayed answers, a power of two
+};
+
+// Answer waiting for its delay to pass
+struct pending {
+  double due;
+  int fd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  size_t len;
+  char msg[REQUEST_MAX];
+};
+
+static volatile sig_atomic_t stop;
+static struct pending queue[STUB_QUEUE];
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void on_signal(int sig) { stop = 1; }
+
+static bool ends_with(const char *name, const char *zone) {
+  size_t len = strlen(name);
+  size_t zone_len = strlen(zone);
+  return len >= zone_len && strcmp(name + len - zone_len, zone) == 0 &&
+         (len == zone_len || name[len - zone_len - 1] == '.');
+}
+
+// Turns the query into its answer in place, 0 if it is not answered
+static size_t answer(char *msg, const size_t len) {
+  char name[DOMAIN_MAX + 1];
+  if (len < DNS_HEADER_SIZE ||
+      !parse_domain_name(msg, len, DNS_HEADER_SIZE, name, sizeof(name))) {
+    return 0;
+  }
+  if (ends_with(name, "drop.test")) {
+    return 0;
+  }
+  if (ends_with(name, "nx.test")) {
+    return packet_make_response(msg, len, NXDOMAIN);
+  }
+  uint16_t type = packet_question_type(msg, len);
+  size_t resp_len = packet_make_response(msg, len, NOERROR);
+  msg[2] = (char)(msg[2] | 0x04); // AA
+  if (resp_len > 0 && type == DNS_TYPE_A) {
+    const unsigned char addr[] = {192, 0, 2, 1};
+    resp_len = packet_append_answer(msg, resp_len, REQUEST_MAX, type, addr,
+                                    sizeof(addr), 300);
+  }
+  return resp_len;
+}
+
+static int listen_on(const char *addr, const uint16_t port) {
+  struct sockaddr_storage sa;
+  memset(&sa, 0, sizeof(sa));
+  struct sockaddr_in *in = (struct sockaddr_in *)&sa;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&sa;
+  socklen_t sa_len = sizeof(*in);
+  if (inet_pton(AF_INET, addr, &in->sin_addr) == 1) {
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+  } else if (inet_pton(AF_INET6, addr, &in6->sin6_addr) == 1) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    sa_len = sizeof(*in6);
+  } else {
+    fprintf(stderr, "%s is not an IP address\n", addr);
+    return -1;
+  }
+  int fd = socket(sa.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  int bufsize = 4 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+  if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sa_len) < 0) {
+    fprintf(stderr, "Cannot listen on %s:%u: %s\n", addr, port,
+            strerror(errno));
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  log_set_level(LOG_LEVEL_ERROR);
+  const char *list = argc > 1 ? argv[1] : "127.0.0.2,127.0.0.3,127.0.0.4";
+  char addrs[256];
+  snprintf(addrs, sizeof(addrs), "%s", list);
+  uint16_t port = argc > 2 ? (uint16_t)strtoul(argv[2], NULL, 10) : 53;
+  double delay = argc > 3 ? strtod(argv[3], NULL) * 1e6 : 0.;
+  double loss = argc > 4 ? strtod(argv[4], NULL) / 100. : 0.;
+
+  struct pollfd fds[STUB_SOCKETS];
+  nfds_t nfds = 0;
+  for (char *save = NULL, *addr = strtok_r(addrs, ",", &save);
+       addr != NULL && nfds < STUB_SOCKETS;
+       addr = strtok_r(NULL, ",", &save)) {
+    fds[nfds].fd = listen_on(addr, port);
+    fds[nfds].events = POLLIN;
+    if (fds[nfds++].fd < 0) {
+      return 1;
+    }
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  printf("answering on %s port %u after %.1f ms, %.1f%% lost\n", list, port,
+         delay / 1e6, loss * 100.);
+  fflush(stdout);
+
+  struct mmsghdr msgs[STUB_BATCH];
+  struct iovec iovs[STUB_BATCH];
+  uint64_t received = 0;
+  uint64_t answered = 0;
+  uint64_t unanswered = 0;
+  uint64_t lost = 0;
+  uint64_t overflow = 0;
+  size_t head = 0;
+  size_t tail = 0;
+  unsigned seed = 1;
+  while (!stop) {
+    double now = now_ns();
+    for (; head != tail && queue[head & (STUB_QUEUE - 1)].due <= now;
+         head++) {
+      struct pending *p = &queue[head & (STUB_QUEUE - 1)];
+      sendto(p->fd, p->msg, p->len, 0, (struct sockaddr *)&p->addr,
+             p->addr_len);
+      answered++;
+    }
+
+    struct timespec wait = {.tv_sec = 1};
+    if (head != tail) {
+      double left = queue[head & (STUB_QUEUE - 1)].due - now;
+      wait.tv_sec = (time_t)(left / 1e9);
+      wait.tv_nsec = (long)(left - (double)wait.tv_sec * 1e9);
+    }
+    if (ppoll(fds, nfds, &wait, NULL) <= 0) {
+      continue;
+    }
+
+    for (nfds_t i = 0; i < nfds; i++) {
+      if (!(fds[i].revents & POLLIN)) {
+        continue;
+      }
+      // Receive straight into the free slots of the queue
+      unsigned room = STUB_QUEUE - (unsigned)(tail - head);
+      unsigned batch = room < STUB_BATCH ? room : STUB_BATCH;
+      for (unsigned m = 0; m < batch; m++) {
+        struct pending *p = &queue[(tail + m) & (STUB_QUEUE - 1)];
+        iovs[m] = (struct iovec){.iov_base = p->msg, .iov_len = REQUEST_MAX};
+        memset(&msgs[m].msg_hdr, 0, sizeof(msgs[m].msg_hdr));
+        msgs[m].msg_hdr.msg_iov = &iovs[m];
+        msgs[m].msg_hdr.msg_iovlen = 1;
+        msgs[m].msg_hdr.msg_name = &p->addr;
+        msgs[m].msg_hdr.msg_namelen = sizeof(p->addr);
+      }
+      if (batch == 0) {
+        char drain[REQUEST_MAX];
+        overflow += recv(fds[i].fd, drain, sizeof(drain), 0) > 0;
+        continue;
+      }
+      int n = recvmmsg(fds[i].fd, msgs, batch, MSG_DONTWAIT, NULL);
+      double at = now_ns() + delay;
+      for (int m = 0; m < n; m++) {
+        received++;
+        if ((double)rand_r(&seed) / RAND_MAX < loss) {
+          lost++;
+          continue;
+        }
+        char *msg = iovs[m].iov_base;
+        size_t len = answer(msg, msgs[m].msg_len);
+        if (len == 0) {
+          unanswered++;
+          continue;
+        }
+        // Datagrams skipped before leave a gap, close it
+        struct pending *p = &queue[tail & (STUB_QUEUE - 1)];
+        if (p->msg != msg) {
+          memcpy(p->msg, msg, len);
+          memcpy(&p->addr, msgs[m].msg_hdr.msg_name,
+                 msgs[m].msg_hdr.msg_namelen);
+        }
+        p->len = len;
+        p->addr_len = msgs[m].msg_hdr.msg_namelen;
+        p->fd = fds[i].fd;
+        p->due = at;
+        tail++;
+      }
+    }
+  }
+
+  printf("received %" PRIu64 ", answered %" PRIu64 ", never answered %" PRIu64
+         ", lost on purpose %" PRIu64 ", dropped with the queue full %" PRIu64
+         "\n",
+         received, answered, unanswered, lost, overflow);
+  return 0;
+}
@@ -0,0 +1,160 @@
+// UDP backends of the server compared: libev readiness with
+// recvmmsg()/sendmmsg() vs. io_uring with a multishot receive and batched
+// sends. The server runs in a thread of its own and answers every query by
+// echoing it back; the main thread keeps [window] queries in flight. Reports
+// throughput, the CPU time of the server thread and the syscalls it made per
+// query, counting one poll per loop iteration.
+//
+// Usage: ./bench-uring [queries] [window]
+
+#include "config.h"
+#include "dns-server.h"
+#include "log.h"
+#include "uring.h"
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static double cpu_ns(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 +
+         (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+}
+
+struct backend {
+  struct ev_loop *loop;
+  struct dns_server server;
+  struct uring ring;
+  ev_async stop;
+  double cpu; // of the loop thread while it ran
+};
+
+static void echo(void *srv, void *data, const struct sockaddr *addr,
+                 const uint16_t tx_id, char *restrict req,
+                 const size_t req_len) {
+  req[2] = (char)(req[2] | 0x80); // QR
+  server_send_response(srv, addr, req, req_len);
+}
+
+static void stop(struct ev_loop *loop, ev_async *obs, int revents) {
+  ev_break(loop, EVBREAK_ALL);
+}
+
+static void *run(void *arg) {
+  struct backend *b = arg;
+  double start = cpu_ns();
+  ev_run(b->loop, 0);
+  b->cpu = cpu_ns() - start;
+  return NULL;
+}
+
+// "q<n>.example.com" A query with the ID n
+static size_t make_query(char *out, const uint16_t id) {
+  memset(out, 0, DNS_HEADER_SIZE);
+  out[0] = (char)(id >> 8);
+  out[1] = (char)id;
+  out[2] = 0x01; // RD
+  out[5] = 1;    // QDCOUNT
+  int len = snprintf(out + DNS_HEADER_SIZE + 1, 16, "q%u", id);
+  out[DNS_HEADER_SIZE] = (char)len;
+  char *p = out + DNS_HEADER_SIZE + 1 + len;
+  memcpy(p, "\7example\3com\0\0\1\0\1", 17);
+  return (size_t)(p + 17 - out);
+}
+
+// Keeps window queries in flight until every one was answered or lost
+static size_t load(const uint16_t port, const size_t queries,
+                   const size_t window) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  struct timeval timeout = {.tv_sec = 1};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+
+  char query[REQUEST_AVG];
+  char answer[RESPONSE_MAX];
+  size_t sent = 0;
+  size_t answered = 0;
+  while (sent < window && sent < queries) {
+    send(fd, query, make_query(query, (uint16_t)sent++), 0);
+  }
+  while (answered < sent) {
+    if (recv(fd, answer, sizeof(answer), 0) < 0) {
+      break; // the rest was lost
+    }
+    answered++;
+    if (sent < queries) {
+      send(fd, query, make_query(query, (uint16_t)sent++), 0);
+    }
+  }
+  close(fd);
+  return answered;
+}
+
+static void measure(const char *name, const bool uring, const size_t queries,
+                    const size_t window) {
+  struct backend b;
+  memset(&b, 0, sizeof(b));
+  b.loop = ev_loop_new(EVFLAG_AUTO);
+  if (uring && !uring_init(&b.ring, b.loop)) {
+    printf("%-10s io_uring unavailable\n", name);
+    ev_loop_destroy(b.loop);
+    return;
+  }
+  server_init(&b.server, b.loop, echo, "127.0.0.1", 0, NULL, NULL,
+              BATCH_DEFAULT, false, uring ? &b.ring : NULL);
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  getsockname(b.server.sockfd, (struct sockaddr *)&addr, &addr_len);
+  ev_async_init(&b.stop, stop);
+  ev_async_start(b.loop, &b.stop);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, run, &b);
+  double start = now_ns();
+  size_t answered = load(ntohs(addr.sin_port), queries, window);
+  double elapsed = now_ns() - start;
+  ev_async_send(b.loop, &b.stop);
+  pthread_join(thread, NULL);
+
+  server_stop(&b.server);
+  if (uring) {
+    uring_free(&b.ring);
+  }
+  const struct udp_stats *st = &b.server.stats;
+  double syscalls = (double)ev_iteration(b.loop) +
+                    (double)(st->rx_calls + st->tx_calls) +
+                    (double)b.ring.stats.enters;
+  printf("%-10s %6zu %12.0f %12.2f %12.2f %8zu\n", name, window,
+         (double)answered / elapsed * 1e9, b.cpu / (double)answered / 1e3,
+         syscalls / (double)answered, queries - answered);
+  server_cleanup(&b.server);
+  ev_loop_destroy(b.loop);
+}
+
+int main(int argc, char *argv[]) {
+  log_set_level(LOG_LEVEL_ERROR);
+  size_t queries = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+  size_t window = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+  if (queries == 0 || window == 0) {
+    return 1;
+  }
+
+  printf("queries: %zu per run\n", queries);
+  printf("%-10s %6s %12s %12s %12s %8s\n", "backend", "window", "queries/s",
+         "cpu us/q", "syscalls/q", "lost");
+  measure("libev", false, queries, 1);
+  measure("io_uring", true, queries, 1);
+  measure("libev", false, queries, window);
+  measure("io_uring", true, queries, window);
+  return 0;
+}
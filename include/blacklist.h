@@ -0,0 +1,127 @@
+#ifndef BLACKLIST_H
+#define BLACKLIST_H
+
+#include "config.h"
+#include "include.h"
+#include "trie.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+/**
+ * @brief Counters of one blacklist load
+ */
+struct blacklist_stats {
+  size_t files;   /**< Files read */
+  size_t lines;   /**< Lines read from all files */
+  size_t added;   /**< Names added, duplicates included */
+  size_t skipped; /**< Malformed names and local host names */
+};
+
+/**
+ * @brief Hands a freshly built blacklist to every worker
+ */
+typedef void (*blacklist_publish_cb)(struct trie *next, void *data);
+
+/**
+ * @brief Background rebuild of the blacklist and deferred release of the old
+ *
+ * RCU-style: a thread builds the new trie while queries keep using the old
+ * one. The main loop then publishes it to every worker, each worker switches
+ * its dns_server.blacklist on its own loop and acknowledges. Once the last
+ * worker has switched no lookup can still be running on the old trie, and
+ * the main loop frees it.
+ */
+struct blacklist_reload {
+  struct ev_loop *loop;         /**< Main loop, runs the callbacks */
+  const struct options *opts;   /**< Where the list is loaded from */
+  pthread_t thread;             /**< Builder thread */
+  bool running;                 /**< A reload has not finished yet */
+  bool again;                   /**< Another SIGHUP came in meanwhile */
+  struct trie *next;            /**< Built by the thread, NULL on failure */
+  struct trie *retired;         /**< Previous list, freed after all acks */
+  atomic_uint pending;          /**< Workers still on the retired list */
+  double started_at;            /**< ev_time() when the reload was requested */
+  double published_at;          /**< ev_time() when the workers were told */
+  ev_async built_observer;      /**< Builder thread is done */
+  ev_async switched_observer;   /**< Last worker has switched */
+  unsigned workers;             /**< Number of workers to wait for */
+  blacklist_publish_cb publish; /**< Hands next to workers */
+  void *publish_data;           /**< Passed to publish */
+};
+
+extern struct trie *_Atomic blacklist; // list new workers start with
+
+/**
+ * @brief Add every name of a blocklist file to a builder
+ *
+ * Understands hosts files ("0.0.0.0 ads.example.com tracker.example.com")
+ * and plain lists with one or more names per line. Everything after '#' is a
+ * comment. Names of the loopback/broadcast entries found in every hosts file,
+ * such as localhost, are skipped. Names follow the trie syntax: "example.com"
+ * blocks that name only, "*.example.com" everything below it.
+ *
+ * @param builder Builder to add to
+ * @param path Path of the file
+ * @param stats Counters to update
+ * @return false if the file could not be read or memory ran out
+ */
+bool blacklist_load_file(struct trie_builder *restrict builder,
+                         const char *restrict path,
+                         struct blacklist_stats *restrict stats);
+
+/**
+ * @brief Compile the built-in BLACKLIST and every -f file into a trie
+ *
+ * With -i the precompiled image is mapped instead and nothing is parsed.
+ *
+ * @param opts Options naming the blocklist files or image
+ * @param trie Receives the compiled blacklist
+ * @return false if a file could not be read or memory ran out
+ */
+bool blacklist_load(const struct options *restrict opts,
+                    struct trie *restrict trie);
+
+/**
+ * @brief Prepare reloads on the main loop
+ * @param reload Reload state
+ * @param loop Main loop
+ * @param opts Options naming the blocklist files or image
+ * @param workers Number of workers that acknowledge a switch
+ * @param publish Called on the main loop to hand a new trie to every worker
+ * @param data Passed to publish
+ */
+void blacklist_reload_init(struct blacklist_reload *restrict reload,
+                           struct ev_loop *loop,
+                           const struct options *restrict opts,
+                           const unsigned workers,
+                           blacklist_publish_cb publish, void *data);
+
+/**
+ * @brief Start rebuilding the blacklist in the background
+ *
+ * Returns at once. A request during a running reload is remembered and
+ * served when that reload has finished.
+ *
+ * @param reload Reload state
+ */
+void blacklist_reload_start(struct blacklist_reload *restrict reload);
+
+/**
+ * @brief Acknowledge that a worker no longer uses the previous blacklist
+ *
+ * Called by every worker on its own loop right after switching.
+ *
+ * @param reload Reload state
+ */
+void blacklist_reload_ack(struct blacklist_reload *restrict reload);
+
+/**
+ * @brief Wait for a running rebuild and release everything
+ *
+ * Only call after the workers have stopped.
+ *
+ * @param reload Reload state
+ */
+void blacklist_reload_stop(struct blacklist_reload *restrict reload);
+
+#endif // BLACKLIST_H
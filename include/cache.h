@@ -0,0 +1,168 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "include.h"
+#include <uthash.h>
+
+enum {
+  CACHE_TTL_MAX = 86400,   // entries never outlive a day, whatever the TTL
+  CACHE_STALE_TTL = 30,    // TTL of stale answers, as RFC 8767 recommends
+  CACHE_PREFETCH_HITS = 2, // hits before an entry is worth refreshing
+}; // cache constants
+
+/**
+ * @brief One cached upstream response
+ */
+struct cache_entry {
+  char *key;         /**< Question key, points into data */
+  uint16_t key_len;  /**< Length of the key */
+  uint16_t len;      /**< Length of the stored response */
+  double stored_at;  /**< ev_now() when the response was stored */
+  double expires_at; /**< stored_at + smallest TTL of the response */
+  uint32_t ttl;      /**< Smallest TTL of the response when stored */
+  uint32_t hits;     /**< Hits since stored */
+  bool prefetched;   /**< A refresh was already asked for */
+  size_t size;       /**< Bytes charged against the budget */
+  UT_hash_handle hh; /**< makes this structure hashable */
+  char data[];       /**< Key followed by the wire-format response */
+};
+
+/**
+ * @brief Cache counters
+ */
+struct cache_stats {
+  uint64_t hits;      /**< Requests answered from the cache */
+  uint64_t misses;    /**< Requests that had to go upstream */
+  uint64_t inserts;   /**< Responses stored */
+  uint64_t evictions; /**< Entries dropped to stay within the budget */
+  uint64_t expired;   /**< Entries dropped because their TTL ran out */
+  uint64_t stale;     /**< Failed queries answered with expired entries */
+  uint64_t prefetch;  /**< Hits that asked for a refresh */
+};
+
+/**
+ * @brief Answer cache keyed on (qname, qtype, qclass)
+ *
+ * The hash keeps entries in least recently used order: a hit re-inserts the
+ * entry at the tail, eviction starts at the head. Expired entries are kept
+ * for another stale seconds, within the same budget, to answer queries that
+ * fail upstream (RFC 8767). A negative cache holds NXDOMAIN and NODATA
+ * answers instead of positive ones, under a budget of its own so that they
+ * cannot push positive answers out. One cache of each kind per worker, so no
+ * locking is needed.
+ */
+struct cache {
+  struct cache_entry *entries; /**< Hash table, oldest entry first */
+  size_t budget;               /**< Memory budget in bytes, 0 disables */
+  size_t used;                 /**< Bytes currently charged */
+  uint32_t stale;              /**< Seconds expired entries are kept */
+  uint32_t ttl_max;            /**< Cap on the TTL of stored entries */
+  uint8_t prefetch;            /**< Refresh in the last % of the TTL */
+  bool negative;               /**< Holds NXDOMAIN and NODATA answers */
+  struct cache_stats stats;    /**< Counters */
+};
+
+/**
+ * @brief Initialize an empty cache
+ * @param cache Cache to initialize
+ * @param budget Memory budget in bytes, 0 disables caching
+ * @param stale Seconds an entry is kept after its TTL ran out, 0 disables
+ * serving stale answers
+ * @param prefetch Percentage of the TTL left at which a hit asks for the
+ * entry to be refreshed, 0 disables prefetching
+ */
+void cache_init(struct cache *restrict cache, const size_t budget,
+                const uint32_t stale, const uint8_t prefetch);
+
+/**
+ * @brief Initialize an empty negative cache (RFC 2308)
+ *
+ * Negative answers are neither served stale nor prefetched.
+ *
+ * @param cache Cache to initialize
+ * @param budget Memory budget in bytes, 0 disables negative caching
+ * @param ttl_max Cap on the negative TTL in seconds
+ */
+void cache_init_negative(struct cache *restrict cache, const size_t budget,
+                         const uint32_t ttl_max);
+
+/**
+ * @brief Answer a request from the cache
+ *
+ * Copies the cached response into out, patches in the request's transaction
+ * ID, question (to keep the client's letter case) and RD flag, and reduces
+ * every TTL by the time the entry has spent in the cache. Expired entries are
+ * misses.
+ *
+ * @param cache Cache to search
+ * @param key Question key of the request (see packet_question_key())
+ * @param key_len Length of the key
+ * @param req The client's request
+ * @param now Current event loop time
+ * @param out Buffer receiving the response
+ * @param out_len Capacity of out
+ * @param refresh Set to true on the first hit from CACHE_PREFETCH_HITS on
+ * that falls into the prefetch share of the TTL, untouched otherwise
+ * @return Length of the response written to out, 0 on a miss
+ */
+size_t cache_lookup(struct cache *restrict cache, const char *restrict key,
+                    const size_t key_len, const char *restrict req,
+                    const double now, char *restrict out, const size_t out_len,
+                    bool *restrict refresh);
+
+/**
+ * @brief Answer a query that failed upstream, stale entries included
+ *
+ * Like cache_lookup(), but without a request to copy from: the question
+ * keeps the letter case it was stored with. Stale entries get every TTL
+ * capped at CACHE_STALE_TTL.
+ *
+ * @param cache Cache to search
+ * @param key Question key of the query
+ * @param key_len Length of the key
+ * @param id Transaction ID to patch in, host order
+ * @param now Current event loop time
+ * @param out Buffer receiving the response
+ * @param out_len Capacity of out
+ * @return Length of the response written to out, 0 if nothing is cached
+ */
+size_t cache_lookup_stale(struct cache *restrict cache,
+                          const char *restrict key, const size_t key_len,
+                          const uint16_t id, const double now,
+                          char *restrict out, const size_t out_len);
+
+/**
+ * @brief Store an upstream response
+ *
+ * A positive cache only stores complete NOERROR responses with at least one
+ * answer and a non-zero TTL, for their smallest TTL. A negative cache only
+ * stores NXDOMAIN responses and NOERROR responses without answers that carry
+ * an SOA record, for the SOA's negative TTL. Least recently used entries are
+ * evicted to make room.
+ *
+ * @param cache Cache to store into
+ * @param key Question key of the response
+ * @param key_len Length of the key
+ * @param res Wire-format response
+ * @param res_len Length of the response
+ * @param now Current event loop time
+ */
+void cache_store(struct cache *restrict cache, const char *restrict key,
+                 const size_t key_len, const char *restrict res,
+                 const size_t res_len, const double now);
+
+/**
+ * @brief Release every entry
+ * @param cache Cache to clear
+ */
+void cache_free(struct cache *restrict cache);
+
+/**
+ * @brief Log the cache counters
+ * @param name Human readable owner of the cache
+ * @param cache Cache to report on
+ */
+void cache_stats_log(const char *restrict name,
+                     const struct cache *restrict cache);
+
+#endif // CACHE_H
@@ -1,24 +1,19 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define BLACKLISTED_DOMAINS 3
+#define BLACKLISTED_DOMAINS 6
 extern const char *BLACKLIST[BLACKLISTED_DOMAINS];
 #define RESOLVERS 3
 extern const char *upstream_resolver[RESOLVERS];
-#define REDIRECT 0 // binary format, 0 -> redirect is not set, 1 -> otherwise
+extern const uint16_t upstream_timeout_ms[RESOLVERS]; // SERVFAIL after that
+extern const char *upstream_tls_name[RESOLVERS]; // certificate name with -T
 
-/* #define REDIRECT_COUNT
- * unused, you must uncomment and change type to
- * extern const char* redirect_to[REDIRECT_COUNT]
- * WARN but it requires a little of adjustment in
- * src/dns-proxy.c -> proxy_handle_request() function
- */
-
-extern const char *redirect_to;
-
-extern const uint8_t BLACKLISTED_RESPONSE;
+extern const uint8_t BLACKLISTED_RESPONSE; // unless -r redirects instead
 
 enum {
   NOERROR = 0,  // all good
@@ -34,24 +29,68 @@ enum {
 }; // DNS response codes
 
 enum {
-  REQUEST_AVG = 128,    // average DNS request packet size
-  REQUEST_MAX = 512,    // reasonable for UDP
-  RESPONSE_AVG = 128,   // average response size is 40 bytes
-  RESPONSE_MAX = 512,   // reasonable for UDP
-  DOMAIN_AVG = 50,      // most of domain names are 7-15 characters long
-  DOMAIN_MAX = 253,     // will happen once in an eternity
-  DNS_HEADER_SIZE = 12, // RFC
+  REQUEST_AVG = 128,        // average DNS request packet size
+  REQUEST_MAX = 512,        // reasonable for UDP
+  RESPONSE_AVG = 128,       // average response size is 40 bytes
+  RESPONSE_MAX = 4096,      // EDNS0 UDP payload we accept and advertise
+  UDP_PAYLOAD_MIN = 512,    // what clients without EDNS0 take (RFC 1035)
+  DOMAIN_AVG = 50,          // most of domain names are 7-15 characters long
+  DOMAIN_MAX = 253,         // will happen once in an eternity
+  DNS_HEADER_SIZE = 12,     // RFC
   DNS_CLASS_IN = 1,
+  BATCH_DEFAULT = 32,       // datagrams per recvmmsg/sendmmsg call
+  BATCH_MAX = 1024,         // UIO_MAXIOV, kernel limit for one call
+  WORKERS_MAX = 256,        // upper bound for -w
+  CACHE_DEFAULT_MB = 32,    // answer cache budget for all workers together
+  BLACKLIST_FILES_MAX = 16, // upper bound for repeated -f
+  INFLIGHT_DEFAULT = 4096,  // upstream queries in flight per worker
+  INFLIGHT_MAX = 32768,     // keeps a bit of the query ID for the generation
+  HEDGE_DEFAULT = 5,        // hedged queries per 100 sent upstream
+  STALE_DEFAULT = 86400,    // seconds answers are kept past their TTL
+  PREFETCH_DEFAULT = 10,    // refresh hot names in the last 10% of the TTL
+  NEGATIVE_DEFAULT_MB = 4,  // NXDOMAIN/NODATA cache budget for all workers
+  NEGATIVE_TTL_CAP = 3600,  // default cap on the TTL of negative answers
+  TCP_CLIENTS_MAX = 64,     // client TCP connections per worker
+  TCP_IDLE_TIMEOUT = 10,    // seconds a quiet client connection stays open
+  TCP_POOL_SIZE = 2,        // pipelined TCP connections per upstream
+  DOT_PORT = 853,           // DNS over TLS (RFC 7858)
 }; // networking constants
 
+enum {
+  REDIRECT_A = 1 << 0,    // -r was given an IPv4 address
+  REDIRECT_AAAA = 1 << 1, // -r was given an IPv6 address
+  REDIRECT_TTL = 300,     // TTL of the synthesized answers
+}; // redirect constants
+
 struct options {
   const char *listen_addr;
   uint16_t listen_port;
   uint16_t fallback_port;
   uint8_t BLACKLISTED_RESPONSE;
   uint8_t log_level;
+  uint16_t batch_size; // 1 -> one datagram per syscall
+  uint16_t workers;    // event loops, one per thread
+  size_t cache_size;   // answer cache budget in bytes, split among workers
+  uint16_t inflight;   // upstream queries in flight per worker
+  uint8_t hedging;     // hedges per 100 upstream queries, 0 disables
+  uint32_t stale;      // seconds answers are served stale, 0 disables
+  uint8_t prefetch;    // % of the TTL left when hot names are refreshed
+  size_t neg_size;     // NXDOMAIN/NODATA cache budget, split the same way
+  uint32_t neg_ttl;    // cap on the TTL of negative answers in seconds
+  const char *blacklist_files[BLACKLIST_FILES_MAX]; // hosts/domain lists
+  uint8_t blacklist_file_count;
+  const char *blacklist_image; // compiled list, replaces BLACKLIST and files
+  uint8_t redirect;              // REDIRECT_A | REDIRECT_AAAA, 0 -> rcode
+  struct in_addr redirect_a;     // answer to blocked A queries
+  struct in6_addr redirect_aaaa; // answer to blocked AAAA queries
+  bool tls;                      // reach upstreams over DNS over TLS
+  const char *tls_ca;            // CA file for -T, NULL -> system store
+  bool uring;                    // UDP through io_uring instead of libev
+  const char *metrics;           // Prometheus endpoint, NULL -> none
 };
 
 void options_init(struct options *opt);
+/* parses command line flags into opt, returns false on invalid usage */
+bool options_parse(struct options *opt, int argc, char *const argv[]);
 
 #endif // CONFIG_H
@@ -1,49 +1,96 @@
 #ifndef DNS_CLIENT
 #define DNS_CLIENT
 
-#include "hash.h"
+#include "config.h"
+#include "metrics.h"
+#include "tcp-conn.h"
+#include "transaction.h"
+#include "udp-batch.h"
+#include "uring.h"
 
 struct dns_client;
 
+enum {
+  UPSTREAM_BAND_PERCENT = 125,   // share traffic within 125% of the best
+  UPSTREAM_SLACK_US = 1000,      // scores closer than that count as equal
+  UPSTREAM_PROBE_INTERVAL = 128, // every 128th query goes to a slower one
+  HEDGE_BURST = 16,              // hedges that may be sent back to back
+  HEDGE_DELAY_MIN_US = 1000,     // never hedge a query younger than that
+}; // upstream selection constants
+
 /**
  * @brief Callback function type for DNS responses
  *
  * @param clt Pointer to the dns_client structure
  * @param data User-defined callback data
  * @param addr Address of the responding DNS server
- * @param response Buffer containing the DNS response
+ * @param response Buffer containing the DNS response, may be modified in
+ * place
  * @param res_len Length of the response buffer
  * @param tx_id Transaction ID of the DNS query
  */
 typedef void (*res_callback)(void *clt, void *data, const struct sockaddr *addr,
-                             const uint16_t tx_id,
-                             const char *restrict response,
+                             const uint16_t tx_id, char *restrict response,
                              const size_t res_len);
 
 /**
  * @brief Structure representing a DNS resolver
+ *
+ * The smoothed RTT and loss rate give every resolver a score, the time a
+ * query sent there is expected to take until it is answered or given up on:
+ * (1 - loss) * srtt + loss * timeout_s. srtt + 4 * rttvar, the retransmission
+ * timeout of RFC 6298, bounds the RTTs usually seen and is how long a query
+ * waits before it is hedged.
  */
 struct resolver {
+  const char *name;             /**< Address as configured */
+  const char *tls_name;         /**< Name its certificate must carry */
   struct sockaddr_storage addr; /**< Address of the resolver */
   socklen_t addrlen;            /**< Length of the resolver's address */
+  double timeout_s;             /**< How long to wait for an answer */
+  double srtt;                  /**< EWMA of the RTT in seconds, gain 1/8 */
+  double rttvar;                /**< EWMA of |RTT - srtt|, gain 1/4 */
+  double loss;                  /**< EWMA of timeouts per query, gain 1/32 */
+  uint64_t selected;            /**< Queries sent here */
+  uint64_t probes;              /**< Of those, sent to probe a slow resolver */
+  uint64_t hedges;              /**< Hedges of slow queries sent here */
+  uint64_t hedges_won;          /**< Of those, answered first */
+  uint64_t answered;            /**< Answers accepted */
+  uint64_t timeouts;            /**< Queries that got no answer in time */
+  unsigned next_tcp;            /**< Pooled connection used last */
+  SSL_SESSION *tls_session;     /**< Last TLS session, resumed next time */
+  uint64_t tls_handshakes;      /**< TLS handshakes completed */
+  uint64_t tls_resumed;         /**< Of those, resuming a session */
   int socket;                   /**< Socket file descriptor */
   ev_io observer;               /**< Event loop I/O watcher */
+  struct uring_recv uring_rx;   /**< Multishot receive on socket */
 };
 
 /**
  * @brief Structure representing a DNS client
  */
 struct dns_client {
-  struct ev_loop *loop;                 /**< Event loop */
-  void *cb_data;                        /**< User-defined callback data */
-  res_callback callback;                /**< Response callback function */
-  int sockfd;                           /**< Socket file descriptor */
-  struct resolver resolvers[RESOLVERS]; /**< Array of DNS resolvers */
-  transaction_hash_entry
-      *transactions;         /**< Hash table of ongoing transactions */
-  ev_io observer;            /**< Event loop I/O watcher */
-  ev_timer timeout_observer; /**< Event loop timer for timeouts */
-  double timeout_s;          /**< Timeout in seconds */
+  struct ev_loop *loop;                   /**< Event loop */
+  void *cb_data;                          /**< User-defined callback data */
+  res_callback callback;                  /**< Response callback function */
+  int sockfd;                             /**< Socket file descriptor */
+  struct resolver resolvers[RESOLVERS];   /**< Array of DNS resolvers */
+  struct transaction_table *transactions; /**< Queries in flight */
+  ev_io observer;                         /**< Event loop I/O watcher */
+  ev_timer timeout_observer;              /**< Fires at timeout_at */
+  double timeout_at;                      /**< Next deadline to check */
+  unsigned next_resolver;                 /**< Last resolver selected */
+  uint64_t queries;                       /**< Queries sent, paces probes */
+  double hedge_ratio;                     /**< Hedges allowed per query */
+  double hedge_tokens;                    /**< Hedges that may be sent now */
+  uint64_t hedges_capped;                 /**< Hedges held back by the cap */
+  struct udp_batch rx;                    /**< Responses received per wakeup */
+  struct udp_stats stats;                 /**< Batched I/O counters */
+  struct tcp_conn *tcp;                   /**< TCP_POOL_SIZE per resolver */
+  struct tcp_stats tcp_stats;             /**< TCP counters */
+  SSL_CTX *tls;                           /**< DNS over TLS, NULL for UDP */
+  struct uring *uring;                    /**< io_uring backend, or NULL */
+  struct metrics *metrics;                /**< Live counters, or NULL */
 };
 
 /**
@@ -53,23 +100,49 @@ struct dns_client {
  * @param loop Event loop
  * @param cb Callback function for DNS responses
  * @param data User-defined callback data
- * @param transactions Pointer to the transactions hash table
+ * @param transactions Table of queries in flight, expired ones are reported
+ * to the callback with a NULL response
+ * @param batch_size Datagrams received per recvmmsg() call
+ * @param hedging Hedged queries allowed per 100 sent, 0 disables hedging;
+ * the table must keep requests for hedges and TCP retries to happen
+ * @param tls Send every query over DNS over TLS instead of UDP
+ * @param tls_ca CA certificates to verify resolvers with, NULL for the
+ * system's
+ * @param uring Ring to receive and send datagrams with instead of libev
+ * readiness, recvmmsg() and sendto(), NULL for the latter
  */
 void client_init(struct dns_client *clt, struct ev_loop *loop,
                  res_callback callback, void *data,
-                 transaction_hash_entry *restrict transactions);
+                 struct transaction_table *restrict transactions,
+                 const unsigned batch_size, const unsigned hedging,
+                 const bool tls, const char *restrict tls_ca,
+                 struct uring *restrict uring);
 
 /**
  * @brief Sends a DNS request to an upstream resolver.
  *
- * This function sends a DNS request to one of the upstream resolvers using a
- * simple round-robin selection method. It also records the send time for the
- * transaction if the transaction info is found.
+ * This function sends a DNS request to one of the upstream resolvers and arms
+ * the transaction's timeout with that resolver's timeout. The resolvers whose
+ * score is within UPSTREAM_BAND_PERCENT of the best take turns; every
+ * UPSTREAM_PROBE_INTERVAL-th query goes to one of the others instead, so that
+ * a resolver that has recovered is noticed. The request must already carry
+ * the upstream ID of its transaction.
+ *
+ * If the query is still unanswered after the resolver's hedge delay, the same
+ * request goes to the best of the other resolvers as well; the first answer
+ * wins. Each query sent earns a fraction of a hedge and each hedge spends a
+ * whole one, so hedges never exceed the configured share of the queries by
+ * more than HEDGE_BURST.
+ *
+ * With DNS over TLS the request is queued on one of the resolver's pooled
+ * connections instead, which stay open and carry any number of queries at
+ * once; answers come back in any order and are matched by ID like answers
+ * over UDP.
  *
  * @param client Pointer to the dns_client structure.
  * @param dns_req Pointer to the DNS request buffer.
  * @param req_len Length of the DNS request.
- * @param tx_id Transaction ID for the DNS request.
+ * @param tx Transaction of the DNS request.
  *
  * @note This function uses the restrict keyword for pointers to indicate they
  * don't alias.
@@ -79,11 +152,51 @@ void client_init(struct dns_client *clt, struct ev_loop *loop,
  *
  * @see dns_client
  * @see resolver
- * @see transaction_info
- * @see find_transaction
+ * @see transaction_begin
  */
 void client_send_request(struct dns_client *clt, const char *dns_req,
-                         const size_t req_len, const uint16_t tx_id);
+                         const size_t req_len, struct transaction *tx);
+
+/**
+ * @brief Ask a truncated query again over TCP
+ *
+ * Sends the kept request, under the same ID, over one of TCP_POOL_SIZE
+ * connections to the resolver the query first went to. The connections are
+ * opened on first use and stay open for any number of pipelined queries, so
+ * the handshake is paid once for many retries; answers come back through the
+ * callback like answers over UDP. The transaction's timeout starts over and
+ * no hedge is sent any more.
+ *
+ * @param clt Pointer to the dns_client structure
+ * @param tx Transaction whose UDP answer had the TC bit set
+ * @return false if the request was not kept, the query was retried over TCP
+ * already or the connection failed
+ */
+bool client_retry_tcp(struct dns_client *restrict clt,
+                      struct transaction *restrict tx);
+
+/**
+ * @brief Account an accepted answer to the resolver that sent it
+ *
+ * Updates the resolver's smoothed RTT, RTT variation and loss rate. For a
+ * hedged query the answer is told apart by its source address. Answers over
+ * TCP are left out, their RTT includes the retry.
+ *
+ * @param clt Pointer to the dns_client structure
+ * @param tx Transaction that was answered, before it ends
+ * @param addr Address the answer came from
+ */
+void client_record_answer(struct dns_client *restrict clt,
+                          const struct transaction *restrict tx,
+                          const struct sockaddr *restrict addr);
+
+/**
+ * @brief Log RTT, loss rate, selection and hedge counts of every resolver
+ * @param name Human readable owner of the client
+ * @param clt Pointer to the dns_client structure
+ */
+void client_stats_log(const char *restrict name,
+                      const struct dns_client *restrict clt);
 
 /**
  * @brief Clean up resources used by a DNS client
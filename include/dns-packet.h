@@ -0,0 +1,220 @@
+#ifndef DNS_PACKET_H
+#define DNS_PACKET_H
+
+#include "include.h"
+
+enum {
+  DNS_TYPE_A = 1,        // IPv4 address
+  DNS_TYPE_SOA = 6,      // start of authority, closes negative answers
+  DNS_TYPE_AAAA = 28,    // IPv6 address
+  DNS_TYPE_OPT = 41,     // EDNS0 pseudo record, its TTL field holds flags
+  QUESTION_KEY_MAX = 259,  // longest wire name (255) + QTYPE + QCLASS
+  QUESTION_LABELS_MAX = 127 // labels of the longest name, one byte each
+}; // wire format constants
+
+/**
+ * @brief Location of one resource record inside a message
+ */
+struct packet_rr {
+  size_t offset;       /**< Offset of the owner name */
+  size_t ttl_offset;   /**< Offset of the 32-bit TTL field */
+  size_t rdata_offset; /**< Offset of RDATA */
+  uint16_t type;       /**< RR type */
+  uint16_t rclass;     /**< RR class */
+  uint32_t ttl;        /**< TTL in host order */
+  uint16_t rdlength;   /**< Length of RDATA */
+};
+
+/**
+ * @brief First question of a query, read in one pass
+ *
+ * The key is what packet_question_key() builds. The offsets and hashes of
+ * the labels in it let the blacklist be matched from the key as it is,
+ * without a dotted copy of the name.
+ */
+struct packet_question {
+  char key[QUESTION_KEY_MAX];           /**< Folded QNAME, QTYPE, QCLASS */
+  size_t key_len;                       /**< Bytes in key */
+  uint8_t labels[QUESTION_LABELS_MAX];  /**< Length byte of each label */
+  uint32_t hashes[QUESTION_LABELS_MAX]; /**< trie_hash_step() of each */
+  unsigned label_count;                 /**< Labels, the root not counted */
+};
+
+/**
+ * @brief Skip a (possibly compressed) domain name
+ * @param msg DNS message
+ * @param len Length of the message
+ * @param offset Offset of the name
+ * @return Offset right after the name, 0 if the name is malformed
+ */
+size_t packet_skip_name(const char *restrict msg, const size_t len,
+                        const size_t offset);
+
+/**
+ * @brief Build a lookup key from the first question of a message
+ *
+ * The key is the wire-format QNAME folded to lower case followed by QTYPE and
+ * QCLASS. Compressed question names are rejected.
+ *
+ * @param msg DNS message
+ * @param len Length of the message
+ * @param key Buffer of at least QUESTION_KEY_MAX bytes
+ * @param key_len Receives the key length, which equals the question length
+ * @return true if the message has a well-formed question
+ */
+bool packet_question_key(const char *restrict msg, const size_t len,
+                         char *restrict key, size_t *restrict key_len);
+
+/**
+ * @brief Validate, fold and hash the first question of a message
+ *
+ * One walk over the QNAME checks every label, folds it to lower case into
+ * the key and hashes it for trie_match_labels(). Names up to the full 255
+ * bytes are accepted; compressed question names are rejected.
+ *
+ * @param msg DNS message
+ * @param len Length of the message
+ * @param question Receives the key and the labels
+ * @return true if the message has a well-formed question
+ */
+bool packet_question_parse(const char *restrict msg, const size_t len,
+                           struct packet_question *restrict question);
+
+/**
+ * @brief Turn a query into the response to it, in place
+ *
+ * Sets QR and RA and the response code, keeps OPCODE, RD and the first
+ * question as sent and cuts off everything after it. Answers can then be
+ * added with packet_append_answer().
+ *
+ * @param msg The query, overwritten with the response
+ * @param len Length of the query
+ * @param rcode Response code
+ * @return Length of the response, 0 if the query has no well-formed question
+ */
+size_t packet_make_response(char *restrict msg, const size_t len,
+                            const uint8_t rcode);
+
+/**
+ * @brief Append an answer record about the question to a response, in place
+ *
+ * The owner name is a compression pointer to the question and the class is
+ * the question's.
+ *
+ * @param msg Response made by packet_make_response()
+ * @param len Length of the response
+ * @param cap Capacity of the buffer holding msg
+ * @param type Type of the record
+ * @param rdata RDATA of the record
+ * @param rdlength Length of rdata
+ * @param ttl TTL of the record
+ * @return New length of the response, 0 if the record does not fit
+ */
+size_t packet_append_answer(char *restrict msg, const size_t len,
+                            const size_t cap, const uint16_t type,
+                            const void *restrict rdata,
+                            const uint16_t rdlength, const uint32_t ttl);
+
+/**
+ * @brief QTYPE of the first question
+ * @param msg DNS message
+ * @param len Length of the message
+ * @return The type, 0 if the question is malformed
+ */
+uint16_t packet_question_type(const char *restrict msg, const size_t len);
+
+/**
+ * @brief Offset of the first resource record, right after the questions
+ * @param msg DNS message
+ * @param len Length of the message
+ * @return Offset of the answer section, 0 if the question section is malformed
+ */
+size_t packet_records_offset(const char *restrict msg, const size_t len);
+
+/**
+ * @brief Decode the resource record at *pos and advance past it
+ * @param msg DNS message
+ * @param len Length of the message
+ * @param pos Offset of the record, updated to the next one
+ * @param rr Receives the decoded record
+ * @return true if a complete record was decoded
+ */
+bool packet_rr_next(const char *restrict msg, const size_t len,
+                    size_t *restrict pos, struct packet_rr *restrict rr);
+
+/**
+ * @brief Smallest TTL of all records except OPT
+ * @param msg DNS message
+ * @param len Length of the message
+ * @param min_ttl Receives the smallest TTL, UINT32_MAX if there are no records
+ * @return true if every record counted in the header was decoded
+ */
+bool packet_min_ttl(const char *restrict msg, const size_t len,
+                    uint32_t *restrict min_ttl);
+
+/**
+ * @brief TTL of a negative answer from the SOA in its authority section
+ *
+ * As in RFC 2308, the smaller of the SOA record's own TTL and the MINIMUM
+ * field of its RDATA.
+ *
+ * @param msg DNS message
+ * @param len Length of the message
+ * @param ttl Receives the negative TTL
+ * @return true if the authority section holds a well-formed SOA record
+ */
+bool packet_negative_ttl(const char *restrict msg, const size_t len,
+                         uint32_t *restrict ttl);
+
+/**
+ * @brief Subtract elapsed seconds from the TTL of every record except OPT
+ * @param msg DNS message, modified in place
+ * @param len Length of the message
+ * @param elapsed Seconds to subtract, TTLs do not go below zero
+ */
+void packet_age_ttls(char *restrict msg, const size_t len,
+                     const uint32_t elapsed);
+
+/**
+ * @brief Lower the TTL of every record except OPT to at most a given value
+ * @param msg DNS message, modified in place
+ * @param len Length of the message
+ * @param ttl Largest TTL in seconds
+ */
+void packet_cap_ttls(char *restrict msg, const size_t len, const uint32_t ttl);
+
+/**
+ * @brief Largest UDP message the sender of a message takes
+ * @param msg DNS message
+ * @param len Length of the message
+ * @return The UDP payload size of its OPT record, UDP_PAYLOAD_MIN if it has
+ * none or a smaller one
+ */
+uint16_t packet_udp_size(const char *restrict msg, const size_t len);
+
+/**
+ * @brief Change the UDP payload size advertised by the OPT record, if any
+ * @param msg DNS message, modified in place
+ * @param len Length of the message
+ * @param size UDP payload size to advertise
+ */
+void packet_set_udp_size(char *restrict msg, const size_t len,
+                         const uint16_t size);
+
+/**
+ * @brief Copy the truncated form of a response that is too large
+ *
+ * The copy has the TC bit set and holds the header, the first question and
+ * the OPT record if there is one, so that the client retries over TCP.
+ *
+ * @param msg The response
+ * @param len Length of the response
+ * @param out Buffer receiving the truncated response
+ * @param out_len Capacity of out
+ * @return Length of the truncated response, 0 if msg is malformed or out is
+ * too small
+ */
+size_t packet_truncate(const char *restrict msg, const size_t len,
+                       char *restrict out, const size_t out_len);
+
+#endif // DNS_PACKET_H
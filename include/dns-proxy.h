@@ -1,9 +1,19 @@
 #ifndef DNS_PROXY
 #define DNS_PROXY
 
+#include "cache.h"
 #include "dns-client.h"
 #include "dns-server.h"
 #include "include.h"
+#include "metrics.h"
+
+/**
+ * @brief Proxy counters
+ */
+struct proxy_stats {
+  uint64_t truncated;   /**< Answers cut down to fit the client's UDP size */
+  uint64_t upstream_tc; /**< Answers that came truncated from upstream */
+};
 
 /**
  * @brief Structure representing a DNS proxy.
@@ -11,9 +21,14 @@
  * Contains the event loop, client, server, and timeout configuration.
  */
 struct dns_proxy {
-  struct ev_loop *loop;      /**< Event loop used by the proxy. */
-  struct dns_client *client; /**< Pointer to the DNS client. */
-  struct dns_server *server; /**< Pointer to the DNS server. */
+  struct ev_loop *loop;       /**< Event loop used by the proxy. */
+  struct dns_client *client;  /**< Pointer to the DNS client. */
+  struct dns_server *server;  /**< Pointer to the DNS server. */
+  struct cache *cache;        /**< Answer cache, consulted before forwarding */
+  struct cache *negative;     /**< NXDOMAIN/NODATA cache, consulted next */
+  const struct options *opts; /**< Redirect addresses of blocked names */
+  struct proxy_stats stats;   /**< Counters */
+  struct metrics *metrics;    /**< Live counters, or NULL */
 };
 
 /**
@@ -27,17 +42,27 @@ struct dns_proxy {
  * @param clt Pointer to the initialized dns_client structure.
  * @param srv Pointer to the initialized dns_server structure.
  * @param loop Pointer to the libev event loop (ev_loop) structure.
+ * @param cache Pointer to the initialized answer cache.
+ * @param negative Pointer to the initialized negative cache.
+ * @param opts Pointer to the options, which must outlive the proxy.
+ * @param metrics Live counters of the proxy and the client, NULL keeps none.
  */
 void proxy_init(struct dns_proxy *restrict prx, struct dns_client *restrict clt,
-                struct dns_server *restrict srv, struct ev_loop *loop);
+                struct dns_server *restrict srv, struct ev_loop *loop,
+                struct cache *restrict cache, struct cache *restrict negative,
+                const struct options *restrict opts,
+                struct metrics *restrict metrics);
 
 /**
  * @brief Handles a DNS request.
  *
  * Checks if the domain is in the blacklist. If not blacklisted, the request is
- * forwarded upstream. If the domain is blacklisted, a pre-defined response from
- * the configuration is returned or IF the redirection flag is set changes
- * the query to a pre-defined domain name
+ * answered from the cache or forwarded upstream on a cache miss, under an ID
+ * taken from the worker's transaction table; when the table is full the
+ * client gets SERVFAIL.
+ * If the domain is blacklisted, the pre-defined response code from the
+ * configuration is returned, or with -r an answer pointing to the redirect
+ * address, built locally without going upstream
  *
  * @param prx Pointer to the dns_proxy structure.
  * @param addr Pointer to the sockaddr structure containing the client's
@@ -53,21 +78,25 @@ void proxy_handle_request(void *restrict prx, void *restrict data,
 /**
  * @brief Handles a DNS response.
  *
- * Checks if the transaction id is present in the
- * hash table, and if so sends the response back to client
- * else logs the error message to stderr
+ * Looks the upstream ID up in the transaction table and checks that the
+ * response answers the question that was sent. If so, restores the client's
+ * ID, stores the response in the answer or the negative cache and sends it
+ * back to the client, else
+ * drops it and logs a warning. Answers larger than a client advertised in
+ * its EDNS0 OPT record (512 bytes without one) reach it truncated, clients
+ * asking over TCP get them whole. A truncated upstream answer is not passed
+ * on but asked again over TCP (see client_retry_tcp()).
  *
  * @param prx Pointer to the dns_proxy structure.
- * @param addr Pointer to the sockaddr structure containing the client's
- * address.
- * @param tx_id The transaction ID of the DNS request.
- * @param dns_res Pointer to the DNS response packet.
+ * @param addr Pointer to the sockaddr structure containing the upstream
+ * resolver's address.
+ * @param tx_id The upstream ID of the DNS response.
+ * @param dns_res Pointer to the DNS response packet, modified in place.
  * @param dns_res_len Length of the DNS response packet.
  */
 void proxy_handle_response(void *restrict prx, void *restrict data,
                            const struct sockaddr *addr, const uint16_t tx_id,
-                           const char *restrict dns_res,
-                           const size_t dns_res_len);
+                           char *restrict dns_res, const size_t dns_res_len);
 
 /**
  * @brief Stops the DNS proxy.
@@ -78,4 +107,12 @@ void proxy_handle_response(void *restrict prx, void *restrict data,
  */
 void proxy_stop(const struct dns_proxy *restrict prx);
 
+/**
+ * @brief Log the proxy counters
+ * @param name Human readable owner of the proxy
+ * @param prx Pointer to the dns_proxy structure
+ */
+void proxy_stats_log(const char *restrict name,
+                     const struct dns_proxy *restrict prx);
+
 #endif // DNS_PROXY
@@ -1,8 +1,13 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include "hash.h"
+#include "config.h"
+#include "dns-packet.h"
 #include "include.h"
+#include "tcp-conn.h"
+#include "trie.h"
+#include "udp-batch.h"
+#include "uring.h"
 
 #pragma pack(push, 1)
 /**
@@ -35,8 +40,35 @@ struct dns_question {
 
 struct dns_server;
 
+/**
+ * @brief Address handed to the callback for a request received over TCP
+ *
+ * Stands in for the client's address wherever one is kept, so that the
+ * response finds its way back to the connection; the generation tells a
+ * connection from a later one in the same slot.
+ */
+struct tcp_peer {
+  sa_family_t family;  /**< AF_UNSPEC, never a real address family */
+  uint16_t slot;       /**< Index into dns_server.tcp */
+  uint32_t generation; /**< Generation of the slot the request came from */
+};
+
+/**
+ * @brief Client connection of the TCP listener
+ */
+struct tcp_client {
+  struct tcp_conn conn;      /**< Length-prefixed messages */
+  struct dns_server *server; /**< Server the connection belongs to */
+  uint32_t generation;       /**< Bumped whenever the slot is closed */
+  ev_timer idle;             /**< Closes the connection when it goes quiet */
+};
+
 /**
  * @brief Callback function type for DNS requests
+ *
+ * dns_req lies in a receive buffer of RESPONSE_MAX bytes that the callback
+ * may turn into the response in place. For a request received over TCP addr
+ * holds a struct tcp_peer.
  */
 typedef void (*req_callback)(void *restrict srv, void *restrict data,
                              const struct sockaddr *addr, const uint16_t tx_id,
@@ -46,17 +78,33 @@ typedef void (*req_callback)(void *restrict srv, void *restrict data,
  * @brief DNS server structure
  */
 struct dns_server {
-  struct ev_loop *loop;        /**< Event loop */
-  void *cb_data;               /**< Additional data for callback */
-  req_callback cb;             /**< Callback function */
-  int sockfd;                  /**< Socket file descriptor */
-  socklen_t addrlen;           /**< Address length */
-  ev_io observer;              /**< Event loop observer */
-  const hash_entry *blacklist; /**< Blacklist */
+  struct ev_loop *loop;         /**< Event loop */
+  void *cb_data;                /**< Additional data for callback */
+  req_callback cb;              /**< Callback function */
+  int sockfd;                   /**< Socket file descriptor */
+  socklen_t addrlen;            /**< Address length */
+  ev_io observer;               /**< Event loop observer */
+  ev_prepare flush_observer;    /**< Flushes queued responses before polling */
+  const struct trie *blacklist; /**< Blacklist, swapped on reload */
+  struct udp_batch rx;          /**< Requests received per wakeup */
+  struct udp_batch tx;          /**< Responses waiting for sendmmsg() */
+  struct udp_stats stats;       /**< Batched I/O counters */
+  struct uring *uring;          /**< io_uring backend, NULL for libev */
+  struct uring_recv uring_rx;   /**< Multishot receive on sockfd */
+  int tcp_fd;                   /**< Listening TCP socket */
+  ev_io tcp_observer;           /**< Accepts TCP connections */
+  struct tcp_client *tcp;       /**< TCP_CLIENTS_MAX connection slots */
+  char *tcp_request;            /**< Request taken out of a connection */
+  struct tcp_stats tcp_stats;   /**< TCP counters */
 };
 
 /**
  * @brief Initialize the DNS server
+ *
+ * Listens on UDP and on TCP at the same address. TCP connections may carry
+ * any number of queries, answered in the order the answers come in
+ * (RFC 7766); at most TCP_CLIENTS_MAX are open per server.
+ *
  * @param srv Pointer to dns_server struct
  * @param loop Event loop
  * @param callback Callback function for requests
@@ -64,19 +112,37 @@ struct dns_server {
  * @param listen_port Listen port
  * @param fallback_port Fallback port
  * @param data User-defined data
- * @param blacklist Blacklist hash map
+ * @param blacklist Blacklist trie
+ * @param batch_size Datagrams received/sent per recvmmsg()/sendmmsg() call
+ * @param reuseport Bind with SO_REUSEPORT so that every worker gets a socket
+ * @param uring Ring to receive and send datagrams with instead of libev
+ * readiness and recvmmsg()/sendmmsg(), NULL for the latter; TCP stays on
+ * libev either way
  */
 void server_init(struct dns_server *restrict srv, struct ev_loop *loop,
                  req_callback callback, const char *restrict listen_addr,
                  const uint16_t listen_port, void *restrict data,
-                 const hash_entry *restrict blacklist);
+                 const struct trie *restrict blacklist,
+                 const unsigned batch_size, const bool reuseport,
+                 struct uring *restrict uring);
 
 /**
- * @brief Check if a domain is blacklisted
+ * @brief Check if a domain or one of its parent domains is blacklisted
+ * @param srv Server whose current blacklist is used
  * @param domain Domain name to check
  * @return true if blacklisted, false otherwise
  */
-bool is_blacklisted(const char *restrict domain);
+bool is_blacklisted(const struct dns_server *restrict srv,
+                    const char *restrict domain);
+
+/**
+ * @brief is_blacklisted() for a question read by packet_question_parse()
+ * @param srv Server whose current blacklist is used
+ * @param question Question of the request
+ * @return true if the name or one of its parent domains is blacklisted
+ */
+bool is_question_blacklisted(const struct dns_server *restrict srv,
+                             const struct packet_question *restrict question);
 
 /**
  * @brief Parse a domain name from a DNS request
@@ -91,17 +157,39 @@ bool parse_domain_name(const char *restrict dns_req, const size_t dns_req_len,
                        const size_t offset, char *restrict domain,
                        const size_t domain_max_len);
 
+/**
+ * @brief Check whether a request came in over TCP
+ * @param addr Address the server handed to the callback
+ * @return true for a struct tcp_peer
+ */
+static inline bool server_is_tcp(const struct sockaddr *addr) {
+  return addr->sa_family == AF_UNSPEC;
+}
+
 /**
  * @brief Send a DNS response
+ *
+ * The response is copied into the server's send batch, or queued on the
+ * ring, and goes out with the rest of the batch, at the latest right before
+ * the event loop polls again.
+ * A response to a TCP peer goes to its connection instead and is dropped if
+ * that connection has closed in the meantime.
+ *
  * @param srv Pointer to dns_server struct
  * @param raddr Recipient address
  * @param buffer Response buffer
  * @param buflen Length of response buffer
  */
-void server_send_response(const struct dns_server *restrict srv,
+void server_send_response(struct dns_server *restrict srv,
                           const struct sockaddr *raddr,
                           const char *restrict buffer, const size_t buflen);
 
+/**
+ * @brief Send every queued response with sendmmsg(), or submit it on the ring
+ * @param srv Pointer to dns_server struct
+ */
+void server_flush_responses(struct dns_server *restrict srv);
+
 /**
  * @brief Stop the event loop
  * @param srv Pointer to dns_server struct
@@ -112,6 +200,6 @@ void server_stop(struct dns_server *restrict srv);
  * @brief Clean up server resources
  * @param srv Pointer to dns_server struct
  */
-void server_cleanup(const struct dns_server *restrict srv);
+void server_cleanup(struct dns_server *restrict srv);
 
 #endif // SERVER_H
@@ -2,6 +2,7 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -15,21 +16,55 @@ typedef enum {
   LOG_LEVEL_TRACE
 } log_lvl;
 
+// Most verbose level compiled in, a log_lvl value; calls above it and their
+// arguments compile away. Build with -DLOG_COMPILE_LEVEL=5 to get TRACE.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 3 // LOG_LEVEL_INFO
+#endif
+
+enum {
+  LOG_MSG_MAX = 480,    // bytes of one formatted message, longer is cut
+  LOG_RING_SIZE = 1024, // records queued per thread, a power of two
+  LOG_IDLE_MS = 10,     // writer sleep while every queue is empty
+}; // logging constants
+
+extern log_lvl log_level; // most verbose level written at run time
+
 void log_set_level(log_lvl level);
 void log_message(log_lvl level, const char *file, int line, const char *format,
-                 ...);
-
-#define LOG_FATAL(...)                                                         \
-  log_message(LOG_LEVEL_FATAL, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_ERROR(...)                                                         \
-  log_message(LOG_LEVEL_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_WARN(...)                                                          \
-  log_message(LOG_LEVEL_WARN, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_INFO(...)                                                          \
-  log_message(LOG_LEVEL_INFO, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_DEBUG(...)                                                         \
-  log_message(LOG_LEVEL_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_TRACE(...)                                                         \
-  log_message(LOG_LEVEL_TRACE, __FILE__, __LINE__, __VA_ARGS__)
+                 ...) __attribute__((format(printf, 4, 5)));
+
+/**
+ * @brief Start the background writer
+ *
+ * Until then, and after log_stop(), every message is written by the calling
+ * thread. Afterwards each thread formats its messages into a queue of its
+ * own without locking, and the writer adds the time stamps and writes them
+ * out in batches. A full queue drops messages and the writer reports how
+ * many; FATAL messages are written synchronously after everything queued.
+ *
+ * @return false if the thread could not be started, logging stays
+ * synchronous then
+ */
+bool log_start(void);
+
+/**
+ * @brief Write everything queued, stop the writer and release the queues
+ *
+ * Must run after every other thread that logs has been joined.
+ */
+void log_stop(void);
+
+#define LOG_AT(level, ...)                                                     \
+  ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level                        \
+       ? log_message((level), __FILE__, __LINE__, __VA_ARGS__)                 \
+       : (void)0)
+
+#define LOG_FATAL(...) LOG_AT(LOG_LEVEL_FATAL, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
 
 #endif // LOG_H
@@ -0,0 +1,208 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "config.h"
+#include "include.h"
+#include <stdatomic.h>
+#include <time.h>
+
+enum {
+  METRICS_SUB_BUCKETS = 4,      // histogram buckets per power of two, two bits
+  METRICS_OCTAVES = 36,         // powers of two of nanoseconds, up to ~137 s
+  METRICS_BUCKETS = METRICS_SUB_BUCKETS * METRICS_OCTAVES,
+  METRICS_EXPORT_FROM = 7,      // first bucket boundary exported, 128 ns
+  METRICS_CLIENTS = 8,          // scrapes served at once
+  METRICS_REQUEST_MAX = 1024,   // bytes of an HTTP request head
+  METRICS_RESPONSE_MAX = 65536, // bytes of one scrape
+  METRICS_TIMEOUT = 5,          // seconds a scrape may take
+}; // metrics constants
+
+/**
+ * @brief Counter or gauge written by one worker, read by the exporter
+ *
+ * Only the owning worker ever writes it, so an update is a relaxed load and
+ * store, no locked read-modify-write; the exporter reads it with a relaxed
+ * load from the main thread.
+ */
+typedef atomic_uint_least64_t metrics_counter;
+
+/**
+ * @brief Latency histogram in the manner of HdrHistogram
+ *
+ * Bucket i counts nanosecond values of one of METRICS_SUB_BUCKETS equal
+ * parts of a power of two, so every bucket is a fixed fraction of its values
+ * wide and recording one is a bit scan and a shift. Values below
+ * METRICS_SUB_BUCKETS nanoseconds get a bucket each, values beyond the last
+ * octave land in the last bucket.
+ */
+struct metrics_histogram {
+  metrics_counter buckets[METRICS_BUCKETS]; /**< Values per bucket */
+  metrics_counter count;                    /**< Values recorded */
+  metrics_counter sum_ns;                   /**< Their sum in nanoseconds */
+};
+
+/**
+ * @brief Counters of one upstream resolver in one worker
+ */
+struct metrics_upstream {
+  metrics_counter queries;      /**< Queries sent there first */
+  metrics_counter hedges;       /**< Hedges of slow queries sent there */
+  metrics_counter answers;      /**< Answers accepted */
+  metrics_counter timeouts;     /**< Queries that got no answer in time */
+  struct metrics_histogram rtt; /**< Time to an accepted UDP answer */
+};
+
+/**
+ * @brief Live counters of one worker
+ *
+ * Each worker updates its own, the metrics exporter on the main loop adds
+ * up those of every worker on each scrape. Gauges and the counters already
+ * kept elsewhere are copied in once per loop iteration instead of on the
+ * query path.
+ */
+struct metrics {
+  metrics_counter queries;                      /**< Requests handled */
+  metrics_counter malformed;                    /**< Dropped as malformed */
+  metrics_counter blocked;                      /**< For blacklisted names */
+  metrics_counter cache_hits;                   /**< Answered from a cache */
+  metrics_counter servfail;                     /**< Answered with SERVFAIL */
+  metrics_counter stale;                        /**< Answered stale */
+  metrics_counter in_flight;                    /**< Gauge: upstream queries */
+  metrics_counter cache_bytes;                  /**< Gauge: bytes cached */
+  metrics_counter rx_dropped;                   /**< Datagrams too large */
+  metrics_counter tx_dropped;                   /**< Datagrams not sent */
+  struct metrics_histogram reply;               /**< Query to answer */
+  struct metrics_histogram blacklist;           /**< Blacklist lookups */
+  struct metrics_upstream upstreams[RESOLVERS]; /**< Per resolver */
+};
+
+/**
+ * @brief One scrape connection
+ */
+struct metrics_scrape {
+  struct metrics_exporter *exporter; /**< Exporter it was accepted by */
+  int fd;                            /**< Connection, -1 while unused */
+  ev_io observer;                    /**< Readable, then writable */
+  ev_timer timeout;                  /**< Closes a scrape that stalls */
+  char request[METRICS_REQUEST_MAX]; /**< Request head received so far */
+  size_t request_len;                /**< Bytes in request */
+  char *response;                    /**< METRICS_RESPONSE_MAX, or NULL */
+  size_t response_len;               /**< Bytes in response */
+  size_t sent;                       /**< Bytes of it written */
+};
+
+/**
+ * @brief Prometheus endpoint on the main loop
+ *
+ * Answers GET /metrics over plain HTTP on a local TCP or Unix socket with
+ * the sum of every worker's counters in the Prometheus text format. The
+ * scrape runs on the loop it was accepted on and only reads the workers'
+ * counters, so it costs the query path nothing.
+ */
+struct metrics_exporter {
+  struct ev_loop *loop;                           /**< Event loop */
+  int fd;                                         /**< Listening, or -1 */
+  const char *path;                               /**< Unix socket, or NULL */
+  ev_io observer;                                 /**< Accepts connections */
+  const struct metrics *const *sources;           /**< One per worker */
+  unsigned count;                                 /**< Number of sources */
+  struct metrics_scrape scrapes[METRICS_CLIENTS]; /**< Connections */
+  uint64_t served;                                /**< Scrapes answered */
+};
+
+// Only the owning worker writes, so no read-modify-write is needed
+static inline void metrics_add(metrics_counter *restrict counter,
+                               const uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static inline void metrics_set(metrics_counter *restrict counter,
+                               const uint64_t value) {
+  atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+/**
+ * @brief Monotonic time in seconds for measuring what ev_now() cannot
+ */
+static inline double metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Record a duration
+ * @param hist Histogram owned by the calling worker
+ * @param seconds Duration, negative counts as 0
+ */
+static inline void metrics_observe(struct metrics_histogram *restrict hist,
+                                   const double seconds) {
+  uint64_t ns = seconds > 0. ? (uint64_t)(seconds * 1e9) : 0;
+  unsigned bucket = (unsigned)ns;
+  if (ns >= METRICS_SUB_BUCKETS) {
+    // The two bits below the highest pick the part of the power of two
+    unsigned msb = 63u - (unsigned)__builtin_clzll(ns);
+    bucket = (msb - 1) * METRICS_SUB_BUCKETS +
+             (unsigned)((ns >> (msb - 2)) & (METRICS_SUB_BUCKETS - 1));
+    bucket = bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+  }
+  metrics_add(&hist->buckets[bucket], 1);
+  metrics_add(&hist->count, 1);
+  metrics_add(&hist->sum_ns, ns);
+}
+
+/**
+ * @brief Value below which a share of the recorded durations lies
+ * @param hist Histogram to read
+ * @param quantile Share, 0..1
+ * @return Upper bound of the bucket holding the quantile in seconds, 0 if
+ * nothing was recorded
+ */
+double metrics_quantile(const struct metrics_histogram *restrict hist,
+                        const double quantile);
+
+/**
+ * @brief Write the sum of a set of workers' counters in the Prometheus text
+ * format
+ * @param sources Counters of each worker
+ * @param count Number of sources
+ * @param out Buffer to write to
+ * @param cap Capacity of out
+ * @return Bytes written, at most cap - 1; the text is cut short if it does
+ * not fit
+ */
+size_t metrics_render(const struct metrics *const *sources,
+                      const unsigned count, char *restrict out,
+                      const size_t cap);
+
+/**
+ * @brief Listen for scrapes on the loop
+ * @param exp Exporter to initialize
+ * @param loop Event loop to serve scrapes on
+ * @param addr "ip:port", "[ipv6]:port" or the path of a Unix socket
+ * @param sources Counters of each worker, must outlive the exporter
+ * @param count Number of sources
+ * @return false if the address is invalid or cannot be listened on
+ */
+bool metrics_exporter_init(struct metrics_exporter *restrict exp,
+                           struct ev_loop *loop, const char *restrict addr,
+                           const struct metrics *const *sources,
+                           const unsigned count);
+
+/**
+ * @brief Close the listening socket and every scrape, remove a Unix socket
+ * @param exp Exporter to stop, may not have been set up
+ */
+void metrics_exporter_stop(struct metrics_exporter *restrict exp);
+
+/**
+ * @brief Log the latency quantiles of a worker
+ * @param name Human readable owner of the counters
+ * @param metrics Counters to report on
+ */
+void metrics_stats_log(const char *restrict name,
+                       const struct metrics *restrict metrics);
+
+#endif // METRICS_H
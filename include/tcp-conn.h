@@ -0,0 +1,169 @@
+#ifndef TCP_CONN_H
+#define TCP_CONN_H
+
+#include "include.h"
+#include <openssl/ssl.h>
+
+enum {
+  TCP_MESSAGE_MAX = 65535, // a 16-bit length prefixes every message
+  TCP_SEND_MAX = 16384,    // framed messages waiting for the socket
+}; // tcp connection constants
+
+/**
+ * @brief Counters for the TCP connections of one side of a worker
+ */
+struct tcp_stats {
+  uint64_t connections; /**< Connections accepted or established */
+  uint64_t refused;     /**< Connections refused or that failed to open */
+  uint64_t rx_messages; /**< Messages received */
+  uint64_t tx_messages; /**< Messages queued for sending */
+  uint64_t tx_dropped;  /**< Messages that did not fit, connection closed */
+};
+
+/**
+ * @brief Non-blocking TCP connection carrying length-prefixed DNS messages
+ *
+ * Any number of messages may be in flight in both directions (RFC 7766).
+ * Received bytes collect in the receive buffer until whole messages can be
+ * taken out; messages sent are written right away as far as the socket takes
+ * them, the rest waits in the send buffer until the socket is writable. The
+ * buffers are allocated on first use and kept when the connection closes, so
+ * a slot that is opened again allocates nothing.
+ *
+ * With TLS (RFC 7858) the same framing runs inside the session. Messages
+ * sent are not written right away then but collected until the socket is
+ * writable, so that a burst of queries shares a TLS record.
+ */
+struct tcp_conn {
+  struct ev_loop *loop; /**< Event loop */
+  int fd;               /**< Socket, -1 while closed */
+  bool connecting;      /**< connect() has not completed yet */
+  char *rbuf;           /**< Received bytes not handled yet */
+  size_t rlen;          /**< Bytes in rbuf */
+  size_t rcap;          /**< Capacity of rbuf */
+  char *wbuf;           /**< Framed messages not written yet */
+  size_t wlen;          /**< Bytes in wbuf */
+  size_t wcap;          /**< Capacity of wbuf */
+  SSL *ssl;             /**< TLS session over the socket, or NULL */
+  bool handshaking;     /**< TLS handshake has not completed yet */
+  bool want_write;      /**< Handshake waits for the socket to be writable */
+  ev_io observer;       /**< Readable, and writable while wbuf is not empty */
+};
+
+/**
+ * @brief Set up a closed connection
+ * @param conn Connection to initialize
+ * @param loop Event loop the connection will run on
+ * @param rcap Receive buffer size, bounds the largest message received
+ * @param wcap Send buffer size
+ */
+void tcp_conn_init(struct tcp_conn *restrict conn, struct ev_loop *loop,
+                   const size_t rcap, const size_t wcap);
+
+/**
+ * @brief Start watching a connected or connecting socket
+ *
+ * The callback runs with EV_READ when data arrived and with EV_WRITE when a
+ * pending connect() completed or the send buffer may drain; it is expected to
+ * call tcp_conn_flush() for the latter.
+ *
+ * @param conn Closed connection
+ * @param fd Non-blocking stream socket, owned by the connection from now on
+ * @param connecting connect() returned EINPROGRESS
+ * @param cb Callback of the watcher
+ * @param data Stored in the watcher's data field
+ * @return false if the buffers could not be allocated, fd is closed then
+ */
+bool tcp_conn_open(struct tcp_conn *restrict conn, const int fd,
+                   const bool connecting,
+                   void (*cb)(struct ev_loop *, ev_io *, int),
+                   void *restrict data);
+
+/**
+ * @brief Run TLS over an opened connection
+ *
+ * The handshake starts as soon as the socket is connected and completes in
+ * the background, messages sent in the meantime wait for it.
+ *
+ * @param conn Connection opened by tcp_conn_open()
+ * @param ssl Client session with its peer name and any session to resume
+ * set, owned by the connection from now on
+ * @return false if ssl could not take the socket, the connection is closed
+ */
+bool tcp_conn_start_tls(struct tcp_conn *restrict conn, SSL *ssl);
+
+/**
+ * @brief Read what the socket has into the receive buffer
+ *
+ * Advances the TLS handshake while there is one.
+ *
+ * @param conn Open connection
+ * @return false if the peer closed the connection, it failed or a message
+ * is larger than the receive buffer
+ */
+bool tcp_conn_read(struct tcp_conn *restrict conn);
+
+/**
+ * @brief Next whole message in the receive buffer
+ * @param conn Open connection
+ * @param offset Where to look, advanced past the message
+ * @param msg Receives the message, valid until tcp_conn_consume()
+ * @param len Receives the length of the message
+ * @return false if no whole message starts at offset
+ */
+bool tcp_conn_message(struct tcp_conn *restrict conn, size_t *restrict offset,
+                      char **msg, size_t *restrict len);
+
+/**
+ * @brief Drop the messages that were taken from the receive buffer
+ *
+ * Data TLS decrypted already but did not fit into the receive buffer is read
+ * on the next loop iteration, the socket would not report it.
+ *
+ * @param conn Open connection
+ * @param offset Bytes handled, as left by tcp_conn_message()
+ */
+void tcp_conn_consume(struct tcp_conn *restrict conn, const size_t offset);
+
+/**
+ * @brief Send one message
+ * @param conn Open connection
+ * @param msg Message without the length prefix
+ * @param len Length of the message
+ * @return false if the socket failed or the message does not fit into the
+ * send buffer
+ */
+bool tcp_conn_send(struct tcp_conn *restrict conn, const char *restrict msg,
+                   const size_t len);
+
+/**
+ * @brief Write as much of the send buffer as the socket takes
+ *
+ * Completes a pending connect(), and advances the TLS handshake, first.
+ *
+ * @param conn Open connection
+ * @return false if the connection failed
+ */
+bool tcp_conn_flush(struct tcp_conn *restrict conn);
+
+/**
+ * @brief Close the socket and forget buffered data, keeping the buffers
+ * @param conn Connection to close, may already be closed
+ */
+void tcp_conn_close(struct tcp_conn *restrict conn);
+
+/**
+ * @brief Close the connection and release its buffers
+ * @param conn Connection to release
+ */
+void tcp_conn_free(struct tcp_conn *restrict conn);
+
+/**
+ * @brief Log the counters of a set of connections
+ * @param name Human readable owner of the counters
+ * @param stats Counters to log
+ */
+void tcp_stats_log(const char *restrict name,
+                   const struct tcp_stats *restrict stats);
+
+#endif // TCP_CONN_H
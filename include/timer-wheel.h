@@ -0,0 +1,102 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "include.h"
+
+enum {
+  TIMER_WHEEL_HZ = 4000,                     // ticks per second, 250 us each
+  TIMER_WHEEL_BITS = 6,                      // slot index bits per level
+  TIMER_WHEEL_SLOTS = 1 << TIMER_WHEEL_BITS, // one 64-bit bitmap per level
+  TIMER_WHEEL_LEVELS = 4,                    // 64^4 ticks, about 70 minutes
+}; // timer wheel constants
+
+/**
+ * @brief A deadline, embedded in whatever it times out
+ */
+struct timer_entry {
+  struct timer_entry *next;   /**< Next entry in the same slot */
+  struct timer_entry **pprev; /**< Link pointing here, NULL if not pending */
+  uint64_t expires;           /**< Tick the entry is due at */
+  uint16_t slot;              /**< level * TIMER_WHEEL_SLOTS + index */
+};
+
+/**
+ * @brief Called for every entry that is due, after it has been removed
+ */
+typedef void (*timer_wheel_cb)(struct timer_entry *entry, void *data);
+
+/**
+ * @brief Hierarchical timer wheel driven by event loop time
+ *
+ * Level 0 has one slot per tick; a slot of level n covers 64^n ticks and is
+ * cascaded into the lower levels when the wheel reaches it. Adding and
+ * cancelling are O(1). Expiring skips empty slots through the occupancy
+ * bitmaps, so it costs O(entries due + entries cascaded), not O(elapsed
+ * ticks) or O(pending).
+ */
+struct timer_wheel {
+  /** Entries of every level and slot */
+  struct timer_entry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  uint64_t occupied[TIMER_WHEEL_LEVELS]; /**< Bit per non-empty slot */
+  uint64_t tick;                         /**< Ticks since base */
+  double base;                           /**< Event loop time of tick 0 */
+  size_t count;                          /**< Pending entries */
+};
+
+/**
+ * @brief Initialize an empty wheel
+ * @param wheel Wheel to initialize
+ * @param now Current event loop time, becomes tick 0
+ */
+void timer_wheel_init(struct timer_wheel *restrict wheel, const double now);
+
+/**
+ * @brief Schedule an entry that is not pending
+ *
+ * The deadline is rounded up to the next tick, so an entry never expires
+ * early; deadlines that already passed expire on the next tick.
+ *
+ * @param wheel Wheel to add to
+ * @param entry Entry to schedule
+ * @param deadline Event loop time the entry is due at
+ */
+void timer_wheel_add(struct timer_wheel *restrict wheel,
+                     struct timer_entry *restrict entry,
+                     const double deadline);
+
+/**
+ * @brief Remove an entry, does nothing if it is not pending
+ * @param wheel Wheel the entry was added to
+ * @param entry Entry to remove
+ */
+void timer_wheel_cancel(struct timer_wheel *restrict wheel,
+                        struct timer_entry *restrict entry);
+
+/**
+ * @brief Advance the wheel and hand every entry due by now to the callback
+ *
+ * The callback may add and cancel entries.
+ *
+ * @param wheel Wheel to advance
+ * @param now Current event loop time
+ * @param cb Called for each due entry
+ * @param data Passed to cb
+ * @return Number of entries that expired
+ */
+size_t timer_wheel_expire(struct timer_wheel *restrict wheel, const double now,
+                          timer_wheel_cb cb, void *data);
+
+/**
+ * @brief When the wheel next has to be advanced
+ *
+ * That is the earliest level-0 deadline or the earliest cascade of a higher
+ * level, whichever comes first.
+ *
+ * @param wheel Wheel to inspect
+ * @param at Receives the event loop time
+ * @return false if no entry is pending
+ */
+bool timer_wheel_next(const struct timer_wheel *restrict wheel,
+                      double *restrict at);
+
+#endif // TIMER_WHEEL_H
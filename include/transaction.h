@@ -0,0 +1,249 @@
+#ifndef TRANSACTION_H
+#define TRANSACTION_H
+
+#include "dns-packet.h"
+#include "include.h"
+#include "timer-wheel.h"
+
+enum {
+  TRANSACTION_ID_SPACE = 1 << 16,   // DNS message IDs
+  TRANSACTION_NONE = UINT32_MAX,    // end of the free list
+  TRANSACTION_NO_HEDGE = UINT8_MAX, // no second resolver was asked
+}; // transaction table constants
+
+/**
+ * @brief One upstream query in flight
+ *
+ * The upstream ID is the slot index in the low bits and a random generation
+ * in the remaining high bits, so a late answer to the previous user of the
+ * slot does not match. A hedged query is sent to a second resolver with the
+ * same ID; whichever answer comes first ends the transaction and the other
+ * one no longer matches. A query answered with the TC bit set goes to the
+ * same resolver again over TCP, still with the same ID. Clients asking the
+ * same question while it is in flight wait on it instead of starting
+ * transactions of their own.
+ */
+struct transaction {
+  struct sockaddr_storage client_addr; /**< Where the answer goes */
+  socklen_t client_addr_len;           /**< Length of client_addr, or 0 */
+  uint32_t next_free;                  /**< Next free slot while unused */
+  uint32_t next_pending;               /**< Next slot in the same bucket */
+  uint32_t waiters;                    /**< First waiter, TRANSACTION_NONE */
+  double sent_at;                      /**< ev_now() when sent upstream */
+  double hedged_at;                    /**< ev_now() when the hedge was sent */
+  struct timer_entry timer;            /**< Hedge delay, then timeout */
+  uint64_t question;                   /**< Hash of the question key */
+  uint16_t client_id;                  /**< Client's ID, host order */
+  uint16_t udp_size;                   /**< Client's UDP payload size */
+  uint16_t id;                         /**< ID sent upstream, host order */
+  uint16_t request_len;                /**< Request kept to resend, or 0 */
+  uint16_t key_len;                    /**< Length of the question key */
+  uint8_t resolver;                    /**< Resolver the query was sent to */
+  uint8_t hedge;                       /**< Hedged to, TRANSACTION_NO_HEDGE */
+  bool hedge_due;                      /**< timer is set to the hedge delay */
+  bool over_tcp;                       /**< Asked again over TCP */
+  bool in_use;                         /**< Slot holds a query in flight */
+};
+
+/**
+ * @brief A client waiting for the answer to a query already in flight
+ */
+struct transaction_waiter {
+  struct sockaddr_storage addr; /**< Where the answer goes */
+  socklen_t addr_len;           /**< Length of addr */
+  uint32_t next;                /**< Next waiter, TRANSACTION_NONE */
+  uint16_t client_id;           /**< Client's ID, host order */
+  uint16_t udp_size;            /**< Client's UDP payload size */
+};
+
+/**
+ * @brief Transaction table counters
+ */
+struct transaction_stats {
+  uint64_t started;   /**< Queries sent upstream */
+  uint64_t coalesced; /**< Queries that waited on one already in flight */
+  uint64_t expired;   /**< Queries that got no answer in time */
+  uint64_t full;      /**< Queries refused because every slot was in use */
+  uint64_t stray;     /**< Answers with an unknown ID or another question */
+};
+
+/**
+ * @brief Fixed-capacity table of upstream queries in flight
+ *
+ * All slots are allocated up front and unused ones are chained into a free
+ * list, so starting, finding and ending a transaction is O(1) and never
+ * allocates. Transactions are also chained into hash buckets by question,
+ * and waiters come from a pool of their own with one entry per slot. One
+ * table per worker, so no locking is needed.
+ */
+struct transaction_table {
+  struct transaction *slots;          /**< capacity slots */
+  uint32_t capacity;                  /**< Number of slots, at most 2^15 */
+  uint32_t free_head;                 /**< First free slot, TRANSACTION_NONE */
+  uint32_t in_use;                    /**< Slots currently in flight */
+  uint16_t slot_mask;                 /**< ID bits holding the slot index */
+  uint16_t generation_mask;           /**< ~slot_mask, the generation bits */
+  uint64_t rng;                       /**< xorshift64* state for generations */
+  uint64_t seed;                      /**< Random basis of the question hash */
+  uint32_t *buckets;                  /**< slot_mask + 1 pending chains */
+  char *keys;                         /**< QUESTION_KEY_MAX bytes per slot */
+  struct transaction_waiter *waiters; /**< capacity waiters */
+  uint32_t waiter_free;               /**< First free waiter */
+  char *requests;                     /**< request_max per slot, or NULL */
+  size_t request_max;                 /**< Longest request kept to resend */
+  struct timer_wheel timeouts;        /**< Deadlines of the queries in flight */
+  struct transaction_stats stats;     /**< Counters */
+};
+
+/**
+ * @brief Allocate every slot of a table
+ * @param table Table to initialize
+ * @param capacity Queries in flight, 1..2^15
+ * @param request_max Bytes per slot to keep the request in for resending it,
+ * 0 keeps none
+ * @param now Current event loop time, starts the timeout wheel
+ * @return false if memory ran out
+ */
+bool transaction_table_init(struct transaction_table *restrict table,
+                            const unsigned capacity, const size_t request_max,
+                            const double now);
+
+/**
+ * @brief Take a free slot for a query about to go upstream
+ * @param table Table to take the slot from
+ * @param addr Client address, NULL for a query no client waits for
+ * @param addr_len Length of addr, 0 if addr is NULL
+ * @param client_id ID the client chose, host order
+ * @param udp_size Largest UDP answer the client takes (see packet_udp_size())
+ * @param key Question key of the query (see packet_question_key())
+ * @param key_len Length of the key
+ * @param now Current event loop time
+ * @return The transaction, its id is the ID to send upstream; NULL if full
+ */
+struct transaction *
+transaction_begin(struct transaction_table *restrict table,
+                  const struct sockaddr *restrict addr,
+                  const socklen_t addr_len, const uint16_t client_id,
+                  const uint16_t udp_size, const char *restrict key,
+                  const size_t key_len, const double now);
+
+/**
+ * @brief Find the transaction that already asks a question upstream
+ * @param table Table to search
+ * @param key Question key (see packet_question_key())
+ * @param key_len Length of the key
+ * @return The transaction, NULL if the question is not in flight
+ */
+struct transaction *
+transaction_pending(const struct transaction_table *restrict table,
+                    const char *restrict key, const size_t key_len);
+
+/**
+ * @brief Question key a transaction was started with
+ * @param table Table the transaction belongs to
+ * @param tx Transaction in flight
+ * @param key_len Receives the length of the key
+ * @return The key, valid until the transaction ends
+ */
+const char *transaction_key(const struct transaction_table *restrict table,
+                            const struct transaction *restrict tx,
+                            size_t *restrict key_len);
+
+/**
+ * @brief Let another client wait for the answer to a transaction
+ * @param table Table the transaction belongs to
+ * @param tx Transaction in flight
+ * @param addr Client address
+ * @param addr_len Length of addr
+ * @param client_id ID the client chose, host order
+ * @param udp_size Largest UDP answer the client takes
+ * @return false if every waiter is taken
+ */
+bool transaction_wait(struct transaction_table *restrict table,
+                      struct transaction *restrict tx,
+                      const struct sockaddr *restrict addr,
+                      const socklen_t addr_len, const uint16_t client_id,
+                      const uint16_t udp_size);
+
+/**
+ * @brief First client waiting on a transaction besides the one that started
+ * it
+ * @param table Table the transaction belongs to
+ * @param tx Transaction in flight
+ * @return The waiter, NULL if there is none
+ */
+const struct transaction_waiter *
+transaction_first_waiter(const struct transaction_table *restrict table,
+                         const struct transaction *restrict tx);
+
+/**
+ * @brief Next client waiting on the same transaction
+ * @param table Table the transaction belongs to
+ * @param waiter Current waiter
+ * @return The waiter, NULL after the last one
+ */
+const struct transaction_waiter *
+transaction_next_waiter(const struct transaction_table *restrict table,
+                        const struct transaction_waiter *restrict waiter);
+
+/**
+ * @brief Find the transaction an upstream answer belongs to
+ * @param table Table to search
+ * @param id ID of the answer, host order
+ * @return The transaction, NULL if no query with that ID is in flight
+ */
+struct transaction *transaction_find(struct transaction_table *restrict table,
+                                     const uint16_t id);
+
+/**
+ * @brief The transaction a timeout belongs to
+ * @param entry Timer of a transaction
+ * @return The transaction
+ */
+struct transaction *transaction_of_timer(struct timer_entry *restrict entry);
+
+/**
+ * @brief Space in which a transaction keeps its request
+ * @param table Table the transaction belongs to
+ * @param tx Transaction in flight
+ * @return request_max bytes, NULL if the table keeps no requests
+ */
+char *transaction_request(struct transaction_table *restrict table,
+                          const struct transaction *restrict tx);
+
+/**
+ * @brief Check that an answer is about the question that was sent
+ * @param table Table the transaction belongs to
+ * @param tx Transaction found by ID
+ * @param key Question key of the answer
+ * @param key_len Length of the key
+ * @return true if the questions are the same
+ */
+bool transaction_matches(struct transaction_table *restrict table,
+                         const struct transaction *restrict tx,
+                         const char *restrict key, const size_t key_len);
+
+/**
+ * @brief Return a slot and its waiters to the free lists and cancel its
+ * timeout
+ * @param table Table the transaction belongs to
+ * @param tx Transaction that was answered or has expired
+ */
+void transaction_end(struct transaction_table *restrict table,
+                     struct transaction *restrict tx);
+
+/**
+ * @brief Release the slots
+ * @param table Table to release
+ */
+void transaction_table_free(struct transaction_table *restrict table);
+
+/**
+ * @brief Log the transaction counters
+ * @param name Human readable owner of the table
+ * @param table Table to report on
+ */
+void transaction_stats_log(const char *restrict name,
+                           const struct transaction_table *restrict table);
+
+#endif // TRANSACTION_H
@@ -0,0 +1,191 @@
+#ifndef TRIE_H
+#define TRIE_H
+
+#include "include.h"
+
+enum {
+  TRIE_EXACT = 1,    // "example.com" blocks exactly that name
+  TRIE_WILDCARD = 2, // "*.example.com" blocks every name below it
+}; // node flags
+
+enum {
+  TRIE_SCAN_MAX = 8 // nodes with more children go through the edge index
+}; // lookup tuning
+
+enum {
+  TRIE_IMAGE_VERSION = 2 // bump on any change of the image layout or hash
+}; // image format
+
+enum {
+  TRIE_HASH_SEED = 2166136261U // FNV-1a offset basis
+}; // label hash
+
+/**
+ * @brief One byte of the label hash the edge index is keyed by
+ *
+ * FNV-1a over the lower-cased label, so a caller that folds a name byte by
+ * byte can hash its labels in the same pass: start each label from
+ * TRIE_HASH_SEED and feed it every folded byte.
+ */
+static inline uint32_t trie_hash_step(const uint32_t hash,
+                                      const unsigned char c) {
+  return (hash ^ c) * 16777619U;
+}
+
+/**
+ * @brief One label of the trie
+ *
+ * The children of a node are stored next to each other. A lookup step scans
+ * that block when it is small and probes the edge index of the trie when it
+ * is wide, like the second level below "com".
+ */
+struct trie_node {
+  uint32_t label;       /**< Offset of the label in the label arena */
+  uint32_t children;    /**< Index of the first child */
+  uint32_t child_count; /**< Number of children */
+  uint8_t label_len;    /**< Length of the label */
+  uint8_t flags;        /**< TRIE_EXACT and/or TRIE_WILDCARD */
+};
+
+/**
+ * @brief Read-only trie over reversed domain labels
+ *
+ * "www.example.com" is stored as the path com -> example -> www, so one walk
+ * from the root over the labels of a name, right to left, visits every parent
+ * domain of that name.
+ */
+struct trie {
+  struct trie_node *nodes; /**< nodes[0] is the root */
+  size_t node_count;       /**< Number of nodes */
+  char *labels;            /**< Label arena */
+  size_t labels_len;       /**< Size of the label arena */
+  size_t entries;          /**< Number of names added */
+  uint32_t *index;         /**< Open-addressing table of wide node children */
+  size_t index_mask;       /**< Size of index minus one */
+  void *image;             /**< Mapping the arrays point into, if mapped */
+  size_t image_len;        /**< Length of the mapping */
+};
+
+/**
+ * @brief Collects names before they are compiled into a trie
+ *
+ * Names are stored reversed and lower-cased in one growing arena, so adding a
+ * name costs no allocation of its own.
+ */
+struct trie_builder {
+  char *names;       /**< Reversed names, '\0' terminated */
+  size_t names_len;  /**< Bytes used in names */
+  size_t names_cap;  /**< Capacity of names */
+  uint32_t *offsets; /**< Start of each name, top bit marks a wildcard */
+  size_t count;      /**< Number of names */
+  size_t cap;        /**< Capacity of offsets */
+};
+
+/**
+ * @brief Initialize an empty builder
+ * @param builder Builder to initialize
+ */
+void trie_builder_init(struct trie_builder *restrict builder);
+
+/**
+ * @brief Add a name to the builder
+ *
+ * "example.com" matches only that name, "*.example.com" matches every name
+ * below example.com but not example.com itself. A trailing dot is ignored.
+ *
+ * @param builder Builder to add to
+ * @param domain Dotted domain name, optionally prefixed with "*."
+ * @param len Length of domain
+ * @return false if the name is malformed or memory ran out
+ */
+bool trie_builder_add(struct trie_builder *restrict builder,
+                      const char *restrict domain, size_t len);
+
+/**
+ * @brief Release a builder without building
+ * @param builder Builder to release
+ */
+void trie_builder_free(struct trie_builder *restrict builder);
+
+/**
+ * @brief Compile the collected names into a trie
+ *
+ * The builder is consumed and left empty. The trie keeps one copy of every
+ * distinct label path only, not the full names.
+ *
+ * @param builder Builder holding the names
+ * @param trie Receives the compiled trie
+ * @return false if memory ran out
+ */
+bool trie_build(struct trie_builder *restrict builder,
+                struct trie *restrict trie);
+
+/**
+ * @brief Check whether a name or one of its parent domains is in the trie
+ * @param trie Trie to search
+ * @param domain Dotted domain name, compared case-insensitively
+ * @return true if an exact entry equals the name or a wildcard entry covers it
+ */
+bool trie_match(const struct trie *restrict trie, const char *restrict domain);
+
+/**
+ * @brief trie_match() for a name already split into lower-case labels
+ *
+ * Walks the labels right to left straight from the caller's buffer, with
+ * the hashes the caller computed, so nothing is copied, folded or hashed
+ * again.
+ *
+ * @param trie Trie to search
+ * @param name Wire-format name, lower case: length bytes followed by labels
+ * @param labels Offset in name of each label's length byte, left to right
+ * @param hashes trie_hash_step() hash of each label
+ * @param count Number of labels, the root not counted
+ * @return true if an exact entry equals the name or a wildcard entry covers it
+ */
+bool trie_match_labels(const struct trie *restrict trie,
+                       const char *restrict name,
+                       const uint8_t *restrict labels,
+                       const uint32_t *restrict hashes, const unsigned count);
+
+/**
+ * @brief Write a compiled trie to a binary image
+ *
+ * The image is a header followed by the node array, the label arena and the
+ * edge index exactly as they sit in memory, so trie_map() can use it in
+ * place. It is only valid on machines with the same byte order and struct
+ * layout, which the header records. The file is written next to the target
+ * and renamed over it, so a running proxy never sees a partial image.
+ *
+ * @param trie Compiled trie
+ * @param path Path of the image
+ * @return false if the image could not be written
+ */
+bool trie_save(const struct trie *restrict trie, const char *restrict path);
+
+/**
+ * @brief Map a binary image written by trie_save() read-only
+ *
+ * Only the header is read and checked, so this takes constant time and no
+ * heap whatever the size of the list. The pages are shared with every other
+ * process mapping the same file and faulted in on first use.
+ *
+ * @param trie Receives the mapped trie
+ * @param path Path of the image
+ * @return false if the file is missing or not a compatible image
+ */
+bool trie_map(struct trie *restrict trie, const char *restrict path);
+
+/**
+ * @brief Memory held by a trie
+ * @param trie Compiled trie
+ * @return Bytes used by nodes, labels and the edge index
+ */
+size_t trie_size(const struct trie *restrict trie);
+
+/**
+ * @brief Release a trie, built or mapped
+ * @param trie Trie to release
+ */
+void trie_free(struct trie *restrict trie);
+
+#endif // TRIE_H
@@ -0,0 +1,112 @@
+#ifndef UDP_BATCH_H
+#define UDP_BATCH_H
+
+#include "include.h"
+
+/**
+ * @brief Counters for batched UDP I/O on one socket set
+ */
+struct udp_stats {
+  uint64_t rx_calls;     /**< recvmmsg() calls that returned datagrams */
+  uint64_t rx_datagrams; /**< Datagrams received */
+  uint64_t rx_truncated; /**< Of those, too large for a slot and dropped */
+  uint64_t tx_calls;     /**< sendmmsg()/sendto() calls */
+  uint64_t tx_datagrams; /**< Datagrams sent */
+  uint64_t tx_dropped;   /**< Datagrams that could not be sent */
+};
+
+/**
+ * @brief Preallocated message vector for recvmmsg()/sendmmsg()
+ *
+ * Holds `size` slots, each with its own buffer of `slot_len` bytes and its own
+ * peer address. For receiving, every slot is re-armed before each call; for
+ * sending, slots are filled one by one and flushed together.
+ */
+struct udp_batch {
+  unsigned size;                  /**< Number of slots */
+  unsigned pending;               /**< Slots queued for sending */
+  size_t slot_len;                /**< Capacity of one slot buffer */
+  struct mmsghdr *msgs;           /**< Message headers, one per slot */
+  struct iovec *iovs;             /**< I/O vectors, one per slot */
+  struct sockaddr_storage *addrs; /**< Peer addresses, one per slot */
+  char *buffers;                  /**< size * slot_len bytes */
+};
+
+/**
+ * @brief Allocate the slots of a batch
+ * @param batch Batch to initialize
+ * @param size Number of datagrams per call (at least 1)
+ * @param slot_len Capacity of each slot buffer
+ * @return true on success, false if allocation failed
+ */
+bool udp_batch_init(struct udp_batch *restrict batch, const unsigned size,
+                    const size_t slot_len);
+
+/**
+ * @brief Release the slots of a batch
+ * @param batch Batch to release
+ */
+void udp_batch_free(struct udp_batch *restrict batch);
+
+/**
+ * @brief Receive up to batch->size datagrams with a single recvmmsg()
+ *
+ * Datagrams cut off at slot_len are counted and reported with a length of 0.
+ *
+ * @param batch Batch to receive into
+ * @param fd Non-blocking datagram socket
+ * @param stats Counters to update
+ * @return Number of datagrams received, 0 if none were ready
+ */
+unsigned udp_batch_recv(struct udp_batch *restrict batch, const int fd,
+                        struct udp_stats *restrict stats);
+
+/**
+ * @brief Buffer of a received slot
+ * @param batch Batch that was filled by udp_batch_recv()
+ * @param i Slot index
+ * @return Pointer to the slot buffer
+ */
+static inline char *udp_batch_buffer(const struct udp_batch *batch,
+                                     const unsigned i) {
+  return batch->buffers + (size_t)i * batch->slot_len;
+}
+
+/**
+ * @brief Copy a datagram into the next free send slot
+ *
+ * Flushes the batch first if every slot is already taken.
+ *
+ * @param batch Batch used for sending
+ * @param fd Socket the batch is flushed to
+ * @param addr Recipient address
+ * @param addrlen Length of the recipient address
+ * @param buffer Datagram payload
+ * @param buflen Length of the payload
+ * @param stats Counters to update
+ * @return true if queued, false if the payload does not fit in a slot
+ */
+bool udp_batch_queue(struct udp_batch *restrict batch, const int fd,
+                     const struct sockaddr *addr, const socklen_t addrlen,
+                     const char *restrict buffer, const size_t buflen,
+                     struct udp_stats *restrict stats);
+
+/**
+ * @brief Send every queued datagram with as few sendmmsg() calls as possible
+ * @param batch Batch used for sending
+ * @param fd Non-blocking datagram socket
+ * @param stats Counters to update
+ */
+void udp_batch_flush(struct udp_batch *restrict batch, const int fd,
+                     struct udp_stats *restrict stats);
+
+/**
+ * @brief Log the counters of a socket set
+ * @param name Human readable owner of the counters
+ * @param batch_size Configured batch size
+ * @param stats Counters to log
+ */
+void udp_stats_log(const char *restrict name, const unsigned batch_size,
+                   const struct udp_stats *restrict stats);
+
+#endif // UDP_BATCH_H
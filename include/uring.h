@@ -0,0 +1,190 @@
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+#include "include.h"
+#include "udp-batch.h"
+#include <linux/io_uring.h>
+
+enum {
+  URING_ENTRIES = 256,   // submission queue, the completion queue is 4x larger
+  URING_BUFFERS = 512,   // provided receive buffers, a power of two
+  URING_ARENA = 1 << 20, // bytes of datagrams on their way, twice over
+}; // io_uring constants
+
+struct uring;
+
+/**
+ * @brief Callback for a datagram received through the ring
+ *
+ * msg lies in a provided buffer with RESPONSE_MAX bytes of room that the
+ * callback may turn into the response in place; the buffer goes back to the
+ * kernel once the callback returns.
+ */
+typedef void (*uring_recv_cb)(void *restrict data, char *restrict msg,
+                              const size_t len, const struct sockaddr *addr);
+
+/**
+ * @brief Counters of one ring
+ */
+struct uring_stats {
+  uint64_t enters;      /**< io_uring_enter() calls */
+  uint64_t submitted;   /**< Requests they submitted */
+  uint64_t completions; /**< Completions handled */
+  uint64_t rearmed;     /**< Multishot receives armed again */
+  uint64_t no_buffers;  /**< Of those, because the buffers ran out */
+  uint64_t fallbacks;   /**< Datagrams sent with sendto(), no room left */
+};
+
+/**
+ * @brief Datagram socket with a multishot receive armed on it
+ */
+struct uring_recv {
+  struct uring *ring;      /**< Ring the receive runs on */
+  int fd;                  /**< Datagram socket */
+  uring_recv_cb cb;        /**< Called for every datagram */
+  void *data;              /**< Passed to cb */
+  struct udp_stats *stats; /**< Counters of the socket set */
+  struct msghdr msg;       /**< Room for the peer address in each buffer */
+  struct uring_recv *next; /**< Next receive waiting to be armed */
+  bool armed;              /**< A receive is in flight */
+};
+
+/**
+ * @brief Datagram on its way out, followed by its payload in a send arena
+ *
+ * The kernel reads both until the send completes.
+ */
+struct uring_send {
+  struct msghdr msg;            /**< Message header handed to the kernel */
+  struct iovec iov;             /**< The payload right after this header */
+  struct sockaddr_storage addr; /**< Recipient */
+  struct udp_stats *stats;      /**< Counters of the socket set */
+  unsigned arena;               /**< Arena the send lies in */
+};
+
+/**
+ * @brief Memory the datagrams of a burst are copied into back to back
+ *
+ * Starts over once every send in it has completed.
+ */
+struct uring_arena {
+  char *base;       /**< URING_ARENA bytes */
+  size_t used;      /**< Bytes taken by sends */
+  unsigned sending; /**< Sends in it that have not completed */
+};
+
+/**
+ * @brief io_uring backend of one event loop
+ *
+ * Every datagram socket gets one multishot receive that stays armed and
+ * picks its buffers from a ring of provided buffers, so datagrams arrive
+ * without a syscall each. Sends are queued as requests and submitted
+ * together right before the loop polls again. The loop watches the ring's
+ * file descriptor, which becomes readable whenever completions are waiting;
+ * a busy loop therefore makes one io_uring_enter() and one poll per
+ * iteration, however many datagrams it handles. One ring per worker, so no
+ * locking is needed.
+ */
+struct uring {
+  int fd;                             /**< Ring, -1 while not set up */
+  struct ev_loop *loop;               /**< Event loop */
+  unsigned *sq_head;                  /**< Consumed by the kernel */
+  unsigned *sq_tail;                  /**< Produced by us */
+  unsigned *sq_flags;                 /**< IORING_SQ_* */
+  unsigned *sq_array;                 /**< Submission queue entry indexes */
+  unsigned sq_mask;                   /**< sq_entries - 1 */
+  unsigned sq_entries;                /**< Size of the submission queue */
+  struct io_uring_sqe *sqes;          /**< Submission queue entries */
+  unsigned *cq_head;                  /**< Consumed by us */
+  unsigned *cq_tail;                  /**< Produced by the kernel */
+  unsigned cq_mask;                   /**< Completion queue size - 1 */
+  struct io_uring_cqe *cqes;          /**< Completion queue entries */
+  void *sq_map;                       /**< Mapping of the submission queue */
+  size_t sq_map_len;                  /**< Length of sq_map */
+  void *cq_map;                       /**< Mapping of the completion queue */
+  size_t cq_map_len;                  /**< Length of cq_map, 0 if shared */
+  size_t sqes_len;                    /**< Length of the sqes mapping */
+  struct io_uring_buf_ring *buf_ring; /**< Buffers handed to the kernel */
+  char *buffers;                      /**< URING_BUFFERS receive buffers */
+  size_t buf_len;                     /**< Length of one receive buffer */
+  uint16_t buf_tail;                  /**< Buffers handed over so far */
+  struct uring_arena arenas[2];       /**< Filled in turns */
+  unsigned arena;                     /**< Arena being filled */
+  unsigned armed;                     /**< Receives in flight */
+  struct uring_recv *rearm;           /**< Receives waiting to be armed */
+  bool stopping;                      /**< Completions are only drained */
+  ev_io observer;                     /**< Completions are waiting */
+  ev_prepare submit_observer;         /**< Submits before the loop polls */
+  struct uring_stats stats;           /**< Counters */
+};
+
+/**
+ * @brief Set up a ring, its receive buffers and send arenas
+ * @param ring Ring to initialize
+ * @param loop Event loop the ring is watched from
+ * @return false if the kernel has no io_uring with provided buffer rings,
+ * or memory ran out; nothing is left allocated then
+ */
+bool uring_init(struct uring *restrict ring, struct ev_loop *loop);
+
+/**
+ * @brief Arm a multishot receive on a datagram socket
+ *
+ * The receive stays armed for the lifetime of the ring and is armed again
+ * whenever the kernel ends it, e.g. because the buffers ran out.
+ *
+ * @param ring Ring to receive with
+ * @param recv Receive to arm, must stay in place while the ring runs
+ * @param fd Datagram socket
+ * @param cb Called for every datagram
+ * @param data Passed to cb
+ * @param stats Counters of the socket set
+ */
+void uring_recv_start(struct uring *restrict ring,
+                      struct uring_recv *restrict recv, const int fd,
+                      uring_recv_cb cb, void *data,
+                      struct udp_stats *restrict stats);
+
+/**
+ * @brief Queue a datagram, submitted with the rest before the loop polls
+ * @param ring Ring to send with
+ * @param fd Datagram socket
+ * @param addr Recipient address
+ * @param addrlen Length of the recipient address
+ * @param buffer Datagram payload, copied
+ * @param buflen Length of the payload, at most RESPONSE_MAX
+ * @param stats Counters of the socket set
+ * @return false if both arenas are full or the payload does not fit, the
+ * caller sends it itself then
+ */
+bool uring_send(struct uring *restrict ring, const int fd,
+                const struct sockaddr *addr, const socklen_t addrlen,
+                const char *restrict buffer, const size_t buflen,
+                struct udp_stats *restrict stats);
+
+/**
+ * @brief Submit every queued request with one io_uring_enter()
+ * @param ring Ring to submit
+ */
+void uring_submit(struct uring *restrict ring);
+
+/**
+ * @brief Cancel everything in flight, wait for it and release the ring
+ *
+ * Must run in the thread that owns the loop, before the sockets the ring
+ * receives on are closed.
+ *
+ * @param ring Ring to release, may not have been set up
+ */
+void uring_free(struct uring *restrict ring);
+
+/**
+ * @brief Log the counters of a ring
+ * @param name Human readable owner of the ring
+ * @param ring Ring to report on
+ */
+void uring_stats_log(const char *restrict name,
+                     const struct uring *restrict ring);
+
+#endif // URING_H
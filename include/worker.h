@@ -0,0 +1,93 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "blacklist.h"
+#include "config.h"
+#include "dns-proxy.h"
+#include <pthread.h>
+
+/**
+ * @brief One event loop with its own listener, upstream sockets and proxy
+ *
+ * Worker 0 runs on the default loop in the main thread, every other worker
+ * runs its own loop in a dedicated thread. Workers share nothing but the
+ * read-only blacklist, which each worker switches on its own loop when a
+ * reload publishes a new one; the kernel spreads client datagrams across
+ * their SO_REUSEPORT listening sockets.
+ */
+struct worker {
+  unsigned id;                           /**< Worker index, 0 is main */
+  pthread_t thread;                      /**< Runs the loop (id > 0) */
+  struct ev_loop *loop;                  /**< Event loop owned by the worker */
+  struct dns_server server;              /**< SO_REUSEPORT listener */
+  struct dns_client client;              /**< Upstream sockets */
+  struct dns_proxy proxy;                /**< Glue between server and client */
+  struct cache cache;                    /**< Answer cache of this worker */
+  struct cache negative;                 /**< NXDOMAIN/NODATA answers */
+  struct transaction_table transactions; /**< Upstream queries in flight */
+  struct uring uring;                    /**< UDP I/O with -U, fd -1 if not */
+  struct metrics metrics;                /**< Live counters, read with -m */
+  ev_prepare metrics_observer;           /**< Copies gauges in with -m */
+  ev_async stop_observer;                /**< Wakes the loop up to stop it */
+  ev_async reload_observer;              /**< Wakes the loop to switch lists */
+  struct trie *_Atomic next_blacklist;   /**< Published by a reload */
+  struct blacklist_reload *reload;       /**< Acknowledged after a switch */
+  const struct options *opts;            /**< Shared, read-only options */
+};
+
+/**
+ * @brief Initialize a worker on an existing loop in the calling thread
+ * @param w Worker to initialize
+ * @param id Worker index
+ * @param loop Event loop the worker runs on
+ * @param opts Options shared by all workers
+ * @param reload Reload state the worker acknowledges blacklist switches to
+ */
+void worker_init(struct worker *restrict w, const unsigned id,
+                 struct ev_loop *loop, const struct options *restrict opts,
+                 struct blacklist_reload *restrict reload);
+
+/**
+ * @brief Start a worker with its own loop in a new thread
+ *
+ * Signals stay blocked in the new thread, so SIGINT is only ever handled by
+ * the default loop in the main thread.
+ *
+ * @param w Worker to start
+ * @param id Worker index, must be greater than 0
+ * @param opts Options shared by all workers
+ * @param reload Reload state the worker acknowledges blacklist switches to
+ * @return true if the thread was started
+ */
+bool worker_spawn(struct worker *restrict w, const unsigned id,
+                  const struct options *restrict opts,
+                  struct blacklist_reload *restrict reload);
+
+/**
+ * @brief Hand a new blacklist to a worker, which switches on its own loop
+ *
+ * Safe to call from any thread. The worker acknowledges the switch through
+ * blacklist_reload_ack().
+ *
+ * @param w Running worker
+ * @param next New blacklist
+ */
+void worker_publish_blacklist(struct worker *restrict w, struct trie *next);
+
+/**
+ * @brief Stop a spawned worker and wait for its thread to finish
+ * @param w Worker started with worker_spawn()
+ */
+void worker_join(struct worker *restrict w);
+
+/**
+ * @brief Stop watchers, log counters and release the worker's resources
+ *
+ * Must run in the thread that owns the worker, as watchers can only be
+ * stopped from the thread running their loop.
+ *
+ * @param w Worker to clean up
+ */
+void worker_cleanup(struct worker *restrict w);
+
+#endif // WORKER_H
@@ -21,6 +21,7 @@ pkgs.mkShell {
       libcxx
       uthash
       libev
+      openssl
       dnsperf
       valgrind
       dig
@@ -32,6 +33,7 @@ pkgs.mkShell {
     export C_INCLUDE_PATH=${pkgs.lib.makeSearchPathOutput "dev" "include" [
       pkgs.libev
       pkgs.uthash
+      pkgs.openssl
       pkgs.dnsperf
       pkgs.valgrind
       llvmPackages.clang
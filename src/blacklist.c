@@ -0,0 +1,333 @@
+#include "blacklist.h"
+#include "log.h"
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct trie *_Atomic blacklist = NULL;
+
+// Names every stock hosts file maps to itself, never blocked
+static const char *const local_names[] = {
+    "localhost",
+    "localhost.localdomain",
+    "local",
+    "broadcasthost",
+    "ip6-localhost",
+    "ip6-loopback",
+    "ip6-localnet",
+    "ip6-mcastprefix",
+    "ip6-allnodes",
+    "ip6-allrouters",
+    "ip6-allhosts",
+    "0.0.0.0",
+};
+
+static bool is_local_name(const char *restrict name, const size_t len) {
+  for (size_t i = 0; i < sizeof(local_names) / sizeof(local_names[0]); i++) {
+    if (strlen(local_names[i]) == len &&
+        strncasecmp(local_names[i], name, len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The first column of a hosts file line
+static bool is_address(const char *restrict token, const size_t len) {
+  char buf[INET6_ADDRSTRLEN];
+  if (len >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, token, len);
+  buf[len] = '\0';
+
+  struct in6_addr addr;
+  return inet_pton(AF_INET, buf, &addr) == 1 ||
+         inet_pton(AF_INET6, buf, &addr) == 1;
+}
+
+static inline bool is_blank(const char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool parse_line(struct trie_builder *restrict builder,
+                       const char *restrict line, const char *restrict end,
+                       struct blacklist_stats *restrict stats) {
+  const char *comment = memchr(line, '#', (size_t)(end - line));
+  if (comment != NULL) {
+    end = comment;
+  }
+
+  bool first = true;
+  const char *p = line;
+  while (p < end) {
+    while (p < end && is_blank(*p)) {
+      p++;
+    }
+    const char *token = p;
+    while (p < end && !is_blank(*p)) {
+      p++;
+    }
+    size_t len = (size_t)(p - token);
+    if (len == 0) {
+      break;
+    }
+    if (first && is_address(token, len)) {
+      first = false;
+      continue; // hosts file, the names follow the address
+    }
+    first = false;
+
+    if (is_local_name(token, len)) {
+      stats->skipped++;
+    } else if (trie_builder_add(builder, token, len)) {
+      stats->added++;
+    } else if (builder->count == builder->cap ||
+               builder->names_len + len + 1 > builder->names_cap) {
+      // The builder grows before it validates, so a full builder means the
+      // allocation failed rather than the name being malformed
+      return false;
+    } else {
+      stats->skipped++;
+      LOG_DEBUG("Skipping malformed blacklist entry \"%.*s\"\n", (int)len,
+                token);
+    }
+  }
+  return true;
+}
+
+bool blacklist_load_file(struct trie_builder *restrict builder,
+                         const char *restrict path,
+                         struct blacklist_stats *restrict stats) {
+  LOG_TRACE("blacklist_load_file(builder ptr: %p, path: %s, stats ptr: %p)\n",
+            builder, path, stats);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_ERROR("Failed to open blacklist %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    LOG_ERROR("Failed to stat blacklist %s: %s\n", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  stats->files++;
+  if (st.st_size == 0) {
+    close(fd);
+    return true;
+  }
+
+  // Parse straight from the page cache, no copy of the file is made
+  size_t size = (size_t)st.st_size;
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOG_ERROR("Failed to map blacklist %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  bool ok = true;
+  const char *p = data;
+  const char *end = data + size;
+  while (ok && p < end) {
+    const char *eol = memchr(p, '\n', (size_t)(end - p));
+    if (eol == NULL) {
+      eol = end;
+    }
+    stats->lines++;
+    ok = parse_line(builder, p, eol, stats);
+    p = eol + 1;
+  }
+
+  munmap(data, size);
+  if (!ok) {
+    LOG_ERROR("Out of memory while loading blacklist %s\n", path);
+  }
+  return ok;
+}
+
+bool blacklist_load(const struct options *restrict opts,
+                    struct trie *restrict trie) {
+  LOG_TRACE("blacklist_load(opts ptr: %p, trie ptr: %p)\n", opts, trie);
+  const double start = ev_time();
+  if (opts->blacklist_image != NULL) {
+    if (!trie_map(trie, opts->blacklist_image)) {
+      return false;
+    }
+    LOG_INFO("Blacklist: %zu names, %zu trie nodes, mapped %.1f MiB of %s in "
+             "%.2f ms\n",
+             trie->entries, trie->node_count,
+             (double)trie->image_len / (1 << 20), opts->blacklist_image,
+             (ev_time() - start) * 1e3);
+    return true;
+  }
+
+  struct blacklist_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  struct trie_builder builder;
+  trie_builder_init(&builder);
+
+  for (int i = 0; i < BLACKLISTED_DOMAINS; i++) {
+    if (trie_builder_add(&builder, BLACKLIST[i], strlen(BLACKLIST[i]))) {
+      stats.added++;
+    } else {
+      stats.skipped++;
+      LOG_WARN("Skipping malformed blacklist entry \"%s\"\n", BLACKLIST[i]);
+    }
+  }
+  for (uint8_t i = 0; i < opts->blacklist_file_count; i++) {
+    if (!blacklist_load_file(&builder, opts->blacklist_files[i], &stats)) {
+      trie_builder_free(&builder);
+      return false;
+    }
+  }
+
+  if (!trie_build(&builder, trie)) {
+    LOG_ERROR("Out of memory while building the blacklist\n");
+    trie_builder_free(&builder);
+    return false;
+  }
+  LOG_INFO("Blacklist: %zu names from %zu file(s) and config (%zu lines, %zu "
+           "skipped), %zu trie nodes in %.1f MiB, loaded in %.0f ms\n",
+           stats.added, stats.files, stats.lines, stats.skipped,
+           trie->node_count, (double)trie_size(trie) / (1 << 20),
+           (ev_time() - start) * 1e3);
+  return true;
+}
+
+static void *reload_thread(void *arg) {
+  struct blacklist_reload *reload = (struct blacklist_reload *)arg;
+  LOG_TRACE("reload_thread(reload ptr: %p)\n", reload);
+  struct trie *next = malloc(sizeof(*next));
+  if (next != NULL && !blacklist_load(reload->opts, next)) {
+    free(next);
+    next = NULL;
+  }
+  reload->next = next;
+  ev_async_send(reload->loop, &reload->built_observer);
+  return NULL;
+}
+
+static void reload_finish(struct blacklist_reload *restrict reload) {
+  reload->running = false;
+  reload->next = NULL;
+  if (reload->again) {
+    reload->again = false;
+    blacklist_reload_start(reload);
+  }
+}
+
+// Main loop: the builder is done, publish the new list
+static void reload_built_cb(struct ev_loop *loop, ev_async *obs, int revents) {
+  LOG_TRACE("reload_built_cb(loop ptr: %p, obs ptr: %p, revents: %d)\n", loop,
+            obs, revents);
+  struct blacklist_reload *reload = (struct blacklist_reload *)obs->data;
+  pthread_join(reload->thread, NULL);
+  if (reload->next == NULL) {
+    LOG_ERROR("Blacklist reload failed, keeping the current list\n");
+    reload_finish(reload);
+    return;
+  }
+
+  reload->retired = atomic_exchange(&blacklist, reload->next);
+  atomic_store(&reload->pending, reload->workers);
+  reload->published_at = ev_time();
+  reload->publish(reload->next, reload->publish_data);
+}
+
+// Main loop: the last worker has switched, nobody can use the old list now
+static void reload_switched_cb(struct ev_loop *loop, ev_async *obs,
+                               int revents) {
+  LOG_TRACE("reload_switched_cb(loop ptr: %p, obs ptr: %p, revents: %d)\n",
+            loop, obs, revents);
+  struct blacklist_reload *reload = (struct blacklist_reload *)obs->data;
+  const double now = ev_time();
+  LOG_INFO("Blacklist reloaded: %zu names in %zu trie nodes (was %zu names), "
+           "built in %.0f ms, %u worker(s) switched in %.2f ms\n",
+           reload->next->entries, reload->next->node_count,
+           reload->retired->entries,
+           (reload->published_at - reload->started_at) * 1e3, reload->workers,
+           (now - reload->published_at) * 1e3);
+  trie_free(reload->retired);
+  free(reload->retired);
+  reload->retired = NULL;
+  reload_finish(reload);
+}
+
+void blacklist_reload_init(struct blacklist_reload *restrict reload,
+                           struct ev_loop *loop,
+                           const struct options *restrict opts,
+                           const unsigned workers,
+                           blacklist_publish_cb publish, void *data) {
+  LOG_TRACE("blacklist_reload_init(reload ptr: %p, loop ptr: %p, opts ptr: %p, "
+            "workers: %u)\n",
+            reload, loop, opts, workers);
+  memset(reload, 0, sizeof(*reload));
+  reload->loop = loop;
+  reload->opts = opts;
+  reload->workers = workers;
+  reload->publish = publish;
+  reload->publish_data = data;
+  atomic_init(&reload->pending, 0);
+
+  ev_async_init(&reload->built_observer, reload_built_cb);
+  reload->built_observer.data = reload;
+  ev_async_start(loop, &reload->built_observer);
+  ev_async_init(&reload->switched_observer, reload_switched_cb);
+  reload->switched_observer.data = reload;
+  ev_async_start(loop, &reload->switched_observer);
+}
+
+void blacklist_reload_start(struct blacklist_reload *restrict reload) {
+  LOG_TRACE("blacklist_reload_start(reload ptr: %p)\n", reload);
+  if (reload->running) {
+    LOG_INFO("Blacklist reload already running, another one will follow\n");
+    reload->again = true;
+    return;
+  }
+  reload->running = true;
+  reload->started_at = ev_time();
+
+  // Signals stay with the main thread, like in the workers
+  sigset_t all;
+  sigset_t old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int res = pthread_create(&reload->thread, NULL, reload_thread, reload);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (res != 0) {
+    LOG_ERROR("Failed to start blacklist reload: %s\n", strerror(res));
+    reload->running = false;
+  }
+}
+
+void blacklist_reload_ack(struct blacklist_reload *restrict reload) {
+  LOG_TRACE("blacklist_reload_ack(reload ptr: %p)\n", reload);
+  if (atomic_fetch_sub(&reload->pending, 1) == 1) {
+    ev_async_send(reload->loop, &reload->switched_observer);
+  }
+}
+
+void blacklist_reload_stop(struct blacklist_reload *restrict reload) {
+  LOG_TRACE("blacklist_reload_stop(reload ptr: %p)\n", reload);
+  ev_async_stop(reload->loop, &reload->built_observer);
+  ev_async_stop(reload->loop, &reload->switched_observer);
+  if (!reload->running) {
+    return;
+  }
+  if (reload->retired == NULL) {
+    // Not published yet, the builder may still be running
+    pthread_join(reload->thread, NULL);
+    if (reload->next != NULL) {
+      trie_free(reload->next);
+      free(reload->next);
+    }
+  } else {
+    trie_free(reload->retired); // The workers are gone
+    free(reload->retired);
+  }
+  reload->running = false;
+}
@@ -0,0 +1,226 @@
+#include "cache.h"
+#include "config.h"
+#include "dns-packet.h"
+#include "dns-server.h"
+#include "log.h"
+
+static inline void cache_remove(struct cache *restrict cache,
+                                struct cache_entry *restrict entry) {
+  HASH_DEL(cache->entries, entry);
+  cache->used -= entry->size;
+  free(entry);
+}
+
+void cache_init(struct cache *restrict cache, const size_t budget,
+                const uint32_t stale, const uint8_t prefetch) {
+  LOG_TRACE("cache_init(cache ptr: %p, budget: %zu, stale: %u, prefetch: %u)\n",
+            cache, budget, stale, prefetch);
+  memset(cache, 0, sizeof(*cache));
+  cache->budget = budget;
+  cache->stale = stale;
+  cache->ttl_max = CACHE_TTL_MAX;
+  cache->prefetch = prefetch;
+}
+
+void cache_init_negative(struct cache *restrict cache, const size_t budget,
+                         const uint32_t ttl_max) {
+  LOG_TRACE("cache_init_negative(cache ptr: %p, budget: %zu, ttl_max: %u)\n",
+            cache, budget, ttl_max);
+  cache_init(cache, budget, 0, 0);
+  cache->ttl_max = ttl_max;
+  cache->negative = true;
+}
+
+// Move to the tail, the head is evicted first
+static inline void cache_touch(struct cache *restrict cache,
+                               struct cache_entry *restrict entry) {
+  HASH_DEL(cache->entries, entry);
+  HASH_ADD_KEYPTR(hh, cache->entries, entry->key, entry->key_len, entry);
+}
+
+size_t cache_lookup(struct cache *restrict cache, const char *restrict key,
+                    const size_t key_len, const char *restrict req,
+                    const double now, char *restrict out, const size_t out_len,
+                    bool *restrict refresh) {
+  LOG_TRACE("cache_lookup(cache ptr: %p, key ptr: %p, key_len: %zu, req ptr: "
+            "%p, now: %f, out ptr: %p, out_len: %zu, refresh ptr: %p)",
+            cache, key, key_len, req, now, out, out_len, refresh);
+  if (cache->budget == 0) {
+    return 0;
+  }
+
+  struct cache_entry *entry = NULL;
+  HASH_FIND(hh, cache->entries, key, key_len, entry);
+  if (entry == NULL) {
+    cache->stats.misses++;
+    return 0;
+  }
+  if (now >= entry->expires_at) {
+    // Kept until the stale period is over too
+    if (now >= entry->expires_at + cache->stale) {
+      cache_remove(cache, entry);
+      cache->stats.expired++;
+    }
+    cache->stats.misses++;
+    return 0;
+  }
+  if (entry->len > out_len) {
+    cache->stats.misses++;
+    return 0;
+  }
+
+  cache_touch(cache, entry);
+  cache->stats.hits++;
+
+  // A name still asked for near the end of its TTL is worth refreshing once
+  entry->hits++;
+  double left = entry->expires_at - now;
+  if (cache->prefetch > 0 && !entry->prefetched &&
+      entry->hits >= CACHE_PREFETCH_HITS &&
+      left * 100. <= (double)entry->ttl * cache->prefetch) {
+    entry->prefetched = true;
+    cache->stats.prefetch++;
+    *refresh = true;
+  }
+
+  memcpy(out, entry->data + entry->key_len, entry->len);
+  memcpy(out, req, sizeof(uint16_t)); // transaction ID
+  out[2] = (char)((out[2] & ~0x01) | (req[2] & 0x01)); // RD
+  // Same name modulo letter case, echo the client's spelling
+  memcpy(out + DNS_HEADER_SIZE, req + DNS_HEADER_SIZE, key_len);
+  packet_age_ttls(out, entry->len, (uint32_t)(now - entry->stored_at));
+  return entry->len;
+}
+
+size_t cache_lookup_stale(struct cache *restrict cache,
+                          const char *restrict key, const size_t key_len,
+                          const uint16_t id, const double now,
+                          char *restrict out, const size_t out_len) {
+  LOG_TRACE("cache_lookup_stale(cache ptr: %p, key ptr: %p, key_len: %zu, id: "
+            "%u, now: %f, out ptr: %p, out_len: %zu)",
+            cache, key, key_len, id, now, out, out_len);
+  if (cache->budget == 0) {
+    return 0;
+  }
+
+  struct cache_entry *entry = NULL;
+  HASH_FIND(hh, cache->entries, key, key_len, entry);
+  if (entry == NULL || now >= entry->expires_at + cache->stale ||
+      entry->len > out_len) {
+    return 0;
+  }
+  cache_touch(cache, entry);
+
+  memcpy(out, entry->data + entry->key_len, entry->len);
+  *(uint16_t *)out = htons(id);
+  if (now < entry->expires_at) {
+    // Still fresh, e.g. a refresh that timed out
+    packet_age_ttls(out, entry->len, (uint32_t)(now - entry->stored_at));
+  } else {
+    packet_cap_ttls(out, entry->len, CACHE_STALE_TTL);
+    cache->stats.stale++;
+  }
+  return entry->len;
+}
+
+void cache_store(struct cache *restrict cache, const char *restrict key,
+                 const size_t key_len, const char *restrict res,
+                 const size_t res_len, const double now) {
+  LOG_TRACE("cache_store(cache ptr: %p, key ptr: %p, key_len: %zu, res ptr: "
+            "%p, res_len: %zu, now: %f)",
+            cache, key, key_len, res, res_len, now);
+  if (cache->budget == 0 || res_len < DNS_HEADER_SIZE ||
+      res_len > UINT16_MAX) {
+    return;
+  }
+
+  const struct dns_header *header = (const struct dns_header *)res;
+  if (!header->qr || header->tc) {
+    return;
+  }
+  bool nodata = header->rcode == NOERROR && ntohs(header->ans_count) == 0;
+  bool negative = header->rcode == NXDOMAIN || nodata;
+  if (negative != cache->negative ||
+      (!negative && header->rcode != NOERROR)) {
+    return;
+  }
+
+  uint32_t ttl = 0;
+  if (negative ? !packet_negative_ttl(res, res_len, &ttl)
+               : !packet_min_ttl(res, res_len, &ttl)) {
+    return;
+  }
+  if (ttl == 0) {
+    return;
+  }
+  if (ttl > cache->ttl_max) {
+    ttl = cache->ttl_max;
+  }
+
+  size_t size = sizeof(struct cache_entry) + key_len + res_len;
+  if (size > cache->budget) {
+    return;
+  }
+
+  struct cache_entry *entry = NULL;
+  HASH_FIND(hh, cache->entries, key, key_len, entry);
+  if (entry != NULL) {
+    cache_remove(cache, entry);
+  }
+
+  struct cache_entry *tmp = NULL;
+  HASH_ITER(hh, cache->entries, entry, tmp) {
+    if (cache->used + size <= cache->budget) {
+      break;
+    }
+    cache_remove(cache, entry);
+    cache->stats.evictions++;
+  }
+
+  entry = malloc(size);
+  if (entry == NULL) {
+    LOG_ERROR("Failed cache_entry allocation\n");
+    return;
+  }
+  entry->key = entry->data;
+  entry->key_len = (uint16_t)key_len;
+  entry->len = (uint16_t)res_len;
+  entry->stored_at = now;
+  entry->expires_at = now + ttl;
+  entry->ttl = ttl;
+  entry->hits = 0;
+  entry->prefetched = false;
+  entry->size = size;
+  memcpy(entry->data, key, key_len);
+  memcpy(entry->data + key_len, res, res_len);
+  if (cache->negative) {
+    // The SOA may say to keep it longer than its MINIMUM allows
+    packet_cap_ttls(entry->data + key_len, res_len, ttl);
+  }
+
+  HASH_ADD_KEYPTR(hh, cache->entries, entry->key, entry->key_len, entry);
+  cache->used += size;
+  cache->stats.inserts++;
+}
+
+void cache_free(struct cache *restrict cache) {
+  LOG_TRACE("cache_free(cache ptr: %p)\n", cache);
+  struct cache_entry *entry = NULL;
+  struct cache_entry *tmp = NULL;
+  HASH_ITER(hh, cache->entries, entry, tmp) { cache_remove(cache, entry); }
+}
+
+void cache_stats_log(const char *restrict name,
+                     const struct cache *restrict cache) {
+  LOG_TRACE("cache_stats_log(name: %s, cache ptr: %p)", name, cache);
+  const struct cache_stats *st = &cache->stats;
+  double lookups = (double)(st->hits + st->misses);
+  LOG_INFO("%s: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit rate), "
+           "%" PRIu64 " inserts, %" PRIu64 " evictions, %" PRIu64
+           " expired, %" PRIu64 " stale answers, %" PRIu64
+           " prefetches, %u entries using %zu of %zu bytes\n",
+           name, st->hits, st->misses,
+           lookups > 0 ? 100. * (double)st->hits / lookups : 0., st->inserts,
+           st->evictions, st->expired, st->stale, st->prefetch,
+           HASH_COUNT(cache->entries), cache->used, cache->budget);
+}
@@ -1,5 +1,9 @@
 #include "config.h"
+#include "cache.h"
 #include "log.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 void options_init(struct options *opts) {
   log_set_level(LOG_LEVEL_INFO);
@@ -7,6 +11,218 @@ void options_init(struct options *opts) {
   opts->listen_addr = "127.0.0.1";
   opts->listen_port = 53;
   opts->fallback_port = 5353;
+  opts->batch_size = BATCH_DEFAULT;
+  opts->workers = 1;
+  opts->cache_size = (size_t)CACHE_DEFAULT_MB << 20;
+  opts->inflight = INFLIGHT_DEFAULT;
+  opts->hedging = HEDGE_DEFAULT;
+  opts->stale = STALE_DEFAULT;
+  opts->prefetch = PREFETCH_DEFAULT;
+  opts->neg_size = (size_t)NEGATIVE_DEFAULT_MB << 20;
+  opts->neg_ttl = NEGATIVE_TTL_CAP;
+  opts->blacklist_file_count = 0;
+  opts->blacklist_image = NULL;
+  opts->redirect = 0;
+  opts->tls = false;
+  opts->tls_ca = NULL;
+  opts->uring = false;
+  opts->metrics = NULL;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-b batch_size] [-w workers] [-c cache_mb] "
+          "[-q inflight] [-H hedge_percent] [-s stale_seconds] "
+          "[-p prefetch_percent] [-n negative_mb] [-t negative_ttl] "
+          "[-f file]... [-i image] [-r address]... [-T] [-C ca_file] [-U] "
+          "[-m address]\n"
+          "  -b  datagrams received/sent per syscall, 1..%d (default %d)\n"
+          "  -w  worker threads, each with its own event loop and sockets, "
+          "1..%d,\n"
+          "      0 -> one per online CPU (default 1)\n"
+          "  -c  answer cache budget in MiB for all workers, 0 disables "
+          "(default %d)\n"
+          "  -q  upstream queries in flight per worker, 1..%d (default %d),\n"
+          "      further queries are answered with SERVFAIL\n"
+          "  -H  at most this many queries per 100 are also sent to a second\n"
+          "      resolver when the first is slow to answer, 0..100, 0 "
+          "disables\n"
+          "      (default %d)\n"
+          "  -s  seconds a cached answer is kept past its TTL to answer "
+          "queries\n"
+          "      that fail upstream, 0 disables (default %d)\n"
+          "  -p  refresh a cached answer that is still asked for when less "
+          "than\n"
+          "      this percentage of its TTL is left, 0..100, 0 disables "
+          "(default %d)\n"
+          "  -n  NXDOMAIN/NODATA cache budget in MiB for all workers, 0 "
+          "disables\n"
+          "      (default %d)\n"
+          "  -t  longest time in seconds a negative answer is cached, "
+          "whatever its\n"
+          "      SOA says (default %d)\n"
+          "  -f  blocklist in hosts or one-domain-per-line format, added to "
+          "the\n"
+          "      built-in BLACKLIST, repeat for up to %d files\n"
+          "  -i  blacklist image from blacklist-compiler, used instead of the\n"
+          "      built-in BLACKLIST and -f\n"
+          "  -r  answer blocked A or AAAA queries with this address instead "
+          "of an\n"
+          "      error, once per address family\n"
+          "  -T  send every upstream query over DNS over TLS, port %d, on\n"
+          "      persistent connections; certificates must match\n"
+          "      upstream_tls_name\n"
+          "  -C  CA certificates in PEM to verify upstreams with, instead of "
+          "the\n"
+          "      system store\n"
+          "  -U  receive and send UDP through io_uring (Linux 6.0 or later)\n"
+          "      instead of readiness callbacks and recvmmsg/sendmmsg\n"
+          "  -m  serve Prometheus metrics over HTTP on ip:port, [ipv6]:port "
+          "or a\n"
+          "      Unix socket path\n",
+          prog, BATCH_MAX, BATCH_DEFAULT, WORKERS_MAX, CACHE_DEFAULT_MB,
+          INFLIGHT_MAX, INFLIGHT_DEFAULT, HEDGE_DEFAULT,
+          STALE_DEFAULT, PREFETCH_DEFAULT, NEGATIVE_DEFAULT_MB,
+          NEGATIVE_TTL_CAP, BLACKLIST_FILES_MAX, DOT_PORT);
+}
+
+bool options_parse(struct options *opts, int argc, char *const argv[]) {
+  LOG_TRACE("options_parse(opts ptr: %p, argc: %d, argv ptr: %p)\n", opts,
+            argc, argv);
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "b:w:c:q:H:s:p:n:t:f:i:r:TC:Um:h")) != -1) {
+    switch (opt) {
+    case 'b': {
+      long batch = strtol(optarg, NULL, 10);
+      if (batch < 1 || batch > BATCH_MAX) {
+        LOG_ERROR("Batch size must be within 1..%d\n", BATCH_MAX);
+        return false;
+      }
+      opts->batch_size = (uint16_t)batch;
+      break;
+    }
+    case 'w': {
+      long workers = strtol(optarg, NULL, 10);
+      if (workers == 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+      }
+      if (workers < 1 || workers > WORKERS_MAX) {
+        LOG_ERROR("Worker count must be within 1..%d\n", WORKERS_MAX);
+        return false;
+      }
+      opts->workers = (uint16_t)workers;
+      break;
+    }
+    case 'c': {
+      long cache_mb = strtol(optarg, NULL, 10);
+      if (cache_mb < 0 || cache_mb > 1 << 20) {
+        LOG_ERROR("Cache size must be within 0..%d MiB\n", 1 << 20);
+        return false;
+      }
+      opts->cache_size = (size_t)cache_mb << 20;
+      break;
+    }
+    case 'q': {
+      long inflight = strtol(optarg, NULL, 10);
+      if (inflight < 1 || inflight > INFLIGHT_MAX) {
+        LOG_ERROR("In-flight limit must be within 1..%d\n", INFLIGHT_MAX);
+        return false;
+      }
+      opts->inflight = (uint16_t)inflight;
+      break;
+    }
+    case 'H': {
+      long percent = strtol(optarg, NULL, 10);
+      if (percent < 0 || percent > 100) {
+        LOG_ERROR("Hedge rate must be within 0..100 percent\n");
+        return false;
+      }
+      opts->hedging = (uint8_t)percent;
+      break;
+    }
+    case 's': {
+      long stale = strtol(optarg, NULL, 10);
+      if (stale < 0 || stale > 7 * STALE_DEFAULT) {
+        LOG_ERROR("Stale period must be within 0..%d seconds\n",
+                  7 * STALE_DEFAULT);
+        return false;
+      }
+      opts->stale = (uint32_t)stale;
+      break;
+    }
+    case 'p': {
+      long percent = strtol(optarg, NULL, 10);
+      if (percent < 0 || percent > 100) {
+        LOG_ERROR("Prefetch share must be within 0..100 percent\n");
+        return false;
+      }
+      opts->prefetch = (uint8_t)percent;
+      break;
+    }
+    case 'n': {
+      long negative_mb = strtol(optarg, NULL, 10);
+      if (negative_mb < 0 || negative_mb > 1 << 20) {
+        LOG_ERROR("Negative cache size must be within 0..%d MiB\n", 1 << 20);
+        return false;
+      }
+      opts->neg_size = (size_t)negative_mb << 20;
+      break;
+    }
+    case 't': {
+      long ttl = strtol(optarg, NULL, 10);
+      if (ttl < 1 || ttl > CACHE_TTL_MAX) {
+        LOG_ERROR("Negative TTL cap must be within 1..%d seconds\n",
+                  CACHE_TTL_MAX);
+        return false;
+      }
+      opts->neg_ttl = (uint32_t)ttl;
+      break;
+    }
+    case 'f':
+      if (opts->blacklist_file_count == BLACKLIST_FILES_MAX) {
+        LOG_ERROR("At most %d blacklist files are supported\n",
+                  BLACKLIST_FILES_MAX);
+        return false;
+      }
+      opts->blacklist_files[opts->blacklist_file_count++] = optarg;
+      break;
+    case 'i':
+      opts->blacklist_image = optarg;
+      break;
+    case 'r':
+      if (inet_pton(AF_INET, optarg, &opts->redirect_a) == 1) {
+        opts->redirect |= REDIRECT_A;
+      } else if (inet_pton(AF_INET6, optarg, &opts->redirect_aaaa) == 1) {
+        opts->redirect |= REDIRECT_AAAA;
+      } else {
+        LOG_ERROR("Redirect target %s is not an IPv4 or IPv6 address\n",
+                  optarg);
+        return false;
+      }
+      break;
+    case 'T':
+      opts->tls = true;
+      break;
+    case 'C':
+      opts->tls_ca = optarg;
+      break;
+    case 'U':
+      opts->uring = true;
+      break;
+    case 'm':
+      opts->metrics = optarg;
+      break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      return false;
+    }
+  }
+  if (opts->blacklist_image != NULL && opts->blacklist_file_count > 0) {
+    LOG_ERROR("-i and -f are exclusive, compile the files into the image\n");
+    return false;
+  }
+  return true;
 }
 
 /* IF YOU WANT TO ADD ANY RESOLVER OR DOMAINS(TO BLACKLIST) THEN YOU MUST CHANGE
@@ -19,36 +235,33 @@ const char *upstream_resolver[] = {
     "9.9.9.9",
 }; // "1.1.1.1"};
 
+/* How long to wait for each resolver above before answering SERVFAIL, in the
+ * same order
+ */
+const uint16_t upstream_timeout_ms[] = {
+    4000,
+    4000,
+    4000,
+};
+
+/* Name each resolver above presents in its certificate, checked with -T
+ */
+const char *upstream_tls_name[] = {
+    "dns.google",
+    "dns.google",
+    "dns.quad9.net",
+};
+
+/* "example.com" blocks exactly that name, "*.example.com" blocks every
+ * subdomain of it (www.example.com, m.example.com, ...) but not example.com
+ */
 const char *BLACKLIST[] = {
     "youtube.com",
+    "*.youtube.com",
     "google.com",
+    "*.google.com",
     "microsoft.com",
+    "*.microsoft.com",
 };
 
 const uint8_t BLACKLISTED_RESPONSE = NXDOMAIN;
-
-// you must provide redirect domain name in format: "\x07example\x03com\x00"
-// (length of fist label, second label and null terminator in HEX, conversion
-// table below)
-const char *redirect_to = "\x0Atorproject\x03org\x00";
-/*
- * Hexadecimal <-> Decimal
- * Hexadecimal format:  \x*num**num*
- * Example 10(Decimal) = \x0A(Hexadecimal)
- * 0<->0
- * 1<->1
- * 2<->2
- * 3<->3
- * 4<->4
- * 5<->5
- * 6<->6
- * 7<->7
- * 8<->8
- * 9<->9
- * A<->10
- * B<->11
- * C<->12
- * D<->13
- * E<->14
- * F<->15
- */
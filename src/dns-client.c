@@ -1,17 +1,21 @@
 #include "dns-client.h"
 #include "config.h" /* Main configuration file */
-#include "hash.h"
 #include "log.h"
+#include <stddef.h>
 
 static void client_handle_timeout(struct ev_loop *loop, ev_timer *watcher,
                                   int revents);
 
+static inline void client_schedule_timeout(struct dns_client *restrict clt,
+                                           const double at);
+
 /**
  * @brief Handles receiving DNS response for a client.
  *
  * This function is called when there's data available to be read from the
- * client's socket. It receives the DNS response, performs basic validation, and
- * invokes the client's callback with the received data.
+ * client's socket. It drains up to the configured batch size of DNS responses
+ * with a single recvmmsg(), performs basic validation, and invokes the
+ * client's callback for each received datagram.
  *
  * @param loop Pointer to the event loop.
  * @param obs Pointer to the I/O watcher object.
@@ -32,45 +36,272 @@ static void client_receive_response(struct ev_loop *loop, ev_io *obs,
   struct dns_client *clt = NULL;
   clt = (struct dns_client *)obs->data;
 
-  char buffer[REQUEST_AVG + 1];
-  memset(buffer, 0, sizeof(buffer));
-  struct sockaddr_storage saddr;
-  socklen_t src_addrlen = sizeof(saddr);
+  unsigned count = udp_batch_recv(&clt->rx, obs->fd, &clt->stats);
+
+  for (unsigned i = 0; i < count; i++) {
+    char *buffer = udp_batch_buffer(&clt->rx, i);
+    size_t len = clt->rx.msgs[i].msg_len;
+    if (len < sizeof(uint16_t)) {
+      continue; // Silently drop malformed packets
+    }
 
-  ssize_t len = recvfrom(obs->fd, buffer, REQUEST_AVG, 0,
-                         (struct sockaddr *)&saddr, &src_addrlen);
+    uint16_t tx_id = ntohs(*((uint16_t *)buffer));
+    clt->callback((void *)clt, clt->cb_data,
+                  (struct sockaddr *)&clt->rx.addrs[i], tx_id, buffer, len);
+  }
+}
+
+// Hands a datagram the ring received to the callback, like
+// client_receive_response() does for each datagram of a batch
+static void client_uring_response(void *restrict data, char *restrict msg,
+                                  const size_t len,
+                                  const struct sockaddr *addr) {
+  LOG_TRACE("client_uring_response(data ptr: %p, msg ptr: %p, len: %zu, "
+            "addr ptr: %p)",
+            data, msg, len, addr);
+  struct dns_client *clt = (struct dns_client *)data;
+  if (len < sizeof(uint16_t)) {
+    return; // Silently drop malformed packets
+  }
+  uint16_t tx_id = ntohs(*((uint16_t *)msg));
+  clt->callback((void *)clt, clt->cb_data, addr, tx_id, msg, len);
+}
 
-  if (len < 0) {
-    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-      LOG_ERROR("Recvfrom failed: %s\n", strerror(errno));
+// Hands every whole answer on a pooled TCP connection to the callback, as if
+// it had come over UDP from the resolver
+static void client_tcp_event(struct ev_loop *loop, ev_io *obs, int revents) {
+  LOG_TRACE("client_tcp_event(loop ptr: %p, obs ptr: %p, revents: %d)", loop,
+            obs, revents);
+  struct dns_client *clt = (struct dns_client *)obs->data;
+  struct tcp_conn *conn =
+      (struct tcp_conn *)((char *)obs - offsetof(struct tcp_conn, observer));
+  struct resolver *res = &clt->resolvers[(conn - clt->tcp) / TCP_POOL_SIZE];
+  bool handshaking = conn->handshaking;
+
+  // Queries still waiting on a closed connection simply time out
+  if ((revents & EV_WRITE) && !tcp_conn_flush(conn)) {
+    LOG_WARN("TCP connection to %s failed: %s\n", res->name, strerror(errno));
+    clt->tcp_stats.refused++;
+    tcp_conn_close(conn);
+    return;
+  }
+  if ((revents & EV_READ) && !tcp_conn_read(conn)) {
+    if (handshaking) {
+      clt->tcp_stats.refused++;
     }
+    tcp_conn_close(conn);
     return;
   }
-  if (len < (int)sizeof(uint16_t)) {
-    return; // Silently drop malformed packets
+  if (handshaking && !conn->handshaking) {
+    res->tls_handshakes++;
+    res->tls_resumed += SSL_session_reused(conn->ssl) == 1;
+  }
+  if (!(revents & EV_READ)) {
+    return;
   }
 
-  uint16_t tx_id = ntohs(*((uint16_t *)buffer));
-  clt->callback((void *)clt, clt->cb_data, (struct sockaddr *)&saddr, tx_id,
-                buffer, len);
+  size_t offset = 0;
+  char *msg = NULL;
+  size_t len = 0;
+  while (tcp_conn_message(conn, &offset, &msg, &len)) {
+    clt->tcp_stats.rx_messages++;
+    if (len < sizeof(uint16_t)) {
+      continue; // Silently drop malformed messages
+    }
+    uint16_t tx_id = ntohs(*((uint16_t *)msg));
+    clt->callback((void *)clt, clt->cb_data, (struct sockaddr *)&res->addr,
+                  tx_id, msg, len);
+    if (conn->fd < 0) {
+      return;
+    }
+  }
+  tcp_conn_consume(conn, offset);
+}
+
+// Keeps the newest session of a resolver to resume on its next connection
+static int client_tls_new_session(SSL *ssl, SSL_SESSION *session) {
+  struct resolver *res = (struct resolver *)SSL_get_app_data(ssl);
+  if (res->tls_session != NULL) {
+    SSL_SESSION_free(res->tls_session);
+  }
+  res->tls_session = session;
+  return 1; // the reference is ours now
+}
+
+static SSL_CTX *client_tls_context(const char *restrict ca_file) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  if (ctx == NULL) {
+    LOG_FATAL("Failed to create TLS context\n");
+    exit(-1);
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  int loaded = ca_file != NULL
+                   ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL)
+                   : SSL_CTX_set_default_verify_paths(ctx);
+  if (loaded != 1) {
+    LOG_FATAL("Failed to load CA certificates %s\n",
+              ca_file != NULL ? ca_file : "of the system");
+    exit(-1);
+  }
+  // tcp_conn writes its send buffer like a socket, partly and from wherever
+  // the unwritten rest has moved
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // Resolvers drop idle connections without close_notify; messages are
+  // framed, so nothing can be cut off unnoticed, and an abrupt close would
+  // make the session unusable for resumption
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, client_tls_new_session);
+  return ctx;
+}
+
+// Client side of a TLS session with the resolver, resuming the last one
+static bool client_start_tls(struct dns_client *restrict clt,
+                             struct resolver *restrict res,
+                             struct tcp_conn *restrict conn) {
+  SSL *ssl = SSL_new(clt->tls);
+  if (ssl == NULL) {
+    tcp_conn_close(conn);
+    return false;
+  }
+  SSL_set_app_data(ssl, res);
+  if (SSL_set_tlsext_host_name(ssl, res->tls_name) != 1 ||
+      SSL_set1_host(ssl, res->tls_name) != 1) {
+    SSL_free(ssl);
+    tcp_conn_close(conn);
+    return false;
+  }
+  if (res->tls_session != NULL) {
+    SSL_set_session(ssl, res->tls_session);
+  }
+  return tcp_conn_start_tls(conn, ssl);
+}
+
+// Next connection of the resolver's pool, connected on first use
+static struct tcp_conn *client_tcp_conn(struct dns_client *restrict clt,
+                                        const unsigned resolver) {
+  struct resolver *res = &clt->resolvers[resolver];
+  res->next_tcp = (res->next_tcp + 1) % TCP_POOL_SIZE;
+  struct tcp_conn *conn = &clt->tcp[resolver * TCP_POOL_SIZE + res->next_tcp];
+  if (conn->fd >= 0) {
+    return conn;
+  }
+
+  // Same address, over TLS on the port of its own
+  struct sockaddr_storage addr = res->addr;
+  if (clt->tls != NULL && addr.ss_family == AF_INET) {
+    ((struct sockaddr_in *)&addr)->sin_port = htons(DOT_PORT);
+  } else if (clt->tls != NULL && addr.ss_family == AF_INET6) {
+    ((struct sockaddr_in6 *)&addr)->sin6_port = htons(DOT_PORT);
+  }
+
+  int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+  if (fd < 0) {
+    LOG_ERROR("Error creating TCP socket: %s\n", strerror(errno));
+    clt->tcp_stats.refused++;
+    return NULL;
+  }
+  bool connecting = false;
+  if (connect(fd, (struct sockaddr *)&addr, res->addrlen) < 0) {
+    if (errno != EINPROGRESS) {
+      LOG_WARN("TCP connection to %s failed: %s\n", res->name,
+               strerror(errno));
+      close(fd);
+      clt->tcp_stats.refused++;
+      return NULL;
+    }
+    connecting = true;
+  }
+  if (!tcp_conn_open(conn, fd, connecting, client_tcp_event, clt) ||
+      (clt->tls != NULL && !client_start_tls(clt, res, conn))) {
+    clt->tcp_stats.refused++;
+    return NULL;
+  }
+  clt->tcp_stats.connections++;
+  return conn;
+}
+
+// Queues a message on the resolver's pool, moving on to the next connection
+// while one has no room left
+static bool client_send_tcp(struct dns_client *restrict clt,
+                            const unsigned resolver,
+                            const char *restrict dns_req,
+                            const size_t req_len) {
+  for (unsigned i = 0; i < TCP_POOL_SIZE; i++) {
+    struct tcp_conn *conn = client_tcp_conn(clt, resolver);
+    if (conn != NULL && tcp_conn_send(conn, dns_req, req_len)) {
+      clt->tcp_stats.tx_messages++;
+      return true;
+    }
+  }
+  clt->tcp_stats.tx_dropped++;
+  return false;
 }
 
 void client_init(struct dns_client *restrict clt, struct ev_loop *loop,
                  res_callback callback, void *restrict data,
-                 transaction_hash_entry *restrict transactions) {
+                 struct transaction_table *restrict transactions,
+                 const unsigned batch_size, const unsigned hedging,
+                 const bool tls, const char *restrict tls_ca,
+                 struct uring *restrict uring) {
   LOG_TRACE(
       "client_init(client ptr: %p, loop ptr: %p, cb ptr: %p, data ptr: %p, "
-      "transactions ptr: %p)\n",
-      clt, loop, callback, data, transactions);
+      "transactions ptr: %p, batch_size: %u, hedging: %u, tls: %d, tls_ca: "
+      "%s, uring ptr: %p)\n",
+      clt, loop, callback, data, transactions, batch_size, hedging, tls,
+      tls_ca != NULL ? tls_ca : "(system)", uring);
 
   clt->loop = loop;
   clt->callback = callback;
   clt->cb_data = data;
   clt->transactions = transactions;
+  clt->next_resolver = 0;
+  clt->queries = 0;
+  // Hedging needs a second resolver and the request kept to resend it
+  clt->hedge_ratio = RESOLVERS > 1 && transactions->requests != NULL
+                         ? hedging / 100.
+                         : 0.;
+  clt->hedge_tokens = 0.;
+  clt->hedges_capped = 0;
+  memset(&clt->stats, 0, sizeof(clt->stats));
+  memset(&clt->tcp_stats, 0, sizeof(clt->tcp_stats));
+  clt->tls = tls ? client_tls_context(tls_ca) : NULL;
+  clt->uring = uring;
+  clt->metrics = NULL;
+
+  if (!udp_batch_init(&clt->rx, batch_size, RESPONSE_MAX)) {
+    LOG_FATAL("Failed to allocate client I/O batch\n");
+    exit(-1);
+  }
+
+  // Nothing is connected, and no buffer allocated, before a retry needs it
+  clt->tcp = malloc(RESOLVERS * TCP_POOL_SIZE * sizeof(struct tcp_conn));
+  if (clt->tcp == NULL) {
+    LOG_FATAL("Failed to allocate client TCP connections\n");
+    exit(-1);
+  }
+  for (unsigned i = 0; i < RESOLVERS * TCP_POOL_SIZE; i++) {
+    tcp_conn_init(&clt->tcp[i], loop, 2 + TCP_MESSAGE_MAX, TCP_SEND_MAX);
+  }
+
+  // Started for the earliest deadline of the transactions' timer wheel
+  ev_init(&clt->timeout_observer, client_handle_timeout);
+  clt->timeout_observer.data = clt;
+  clt->timeout_at = 0.;
 
   int opt = 1;
 
   for (int i = 0; i < RESOLVERS; i++) {
+    memset(&clt->resolvers[i], 0, sizeof(clt->resolvers[i]));
+    clt->resolvers[i].name = upstream_resolver[i];
+    clt->resolvers[i].tls_name = upstream_tls_name[i];
+
     struct addrinfo hints;
     struct addrinfo *addrinfo = NULL;
     memset(&hints, 0, sizeof(hints));
@@ -122,6 +353,7 @@ void client_init(struct dns_client *restrict clt, struct ev_loop *loop,
     if (addrinfo->ai_addr) {
       memcpy(&clt->resolvers[i].addr, addrinfo->ai_addr, addrinfo->ai_addrlen);
       clt->resolvers[i].addrlen = addrinfo->ai_addrlen;
+      clt->resolvers[i].timeout_s = upstream_timeout_ms[i] / 1000.;
     } else {
       LOG_ERROR("Invalid address pointers for memcpy\n");
       return;
@@ -142,44 +374,92 @@ void client_init(struct dns_client *restrict clt, struct ev_loop *loop,
 
     clt->resolvers[i].observer.data = clt;
 
-    clt->timeout_s = 4; // 4 seconds timeout
-    LOG_DEBUG("Initializing timeout timer with value: %f\n", clt->timeout_s);
-    ev_timer_init(&clt->timeout_observer, client_handle_timeout, clt->timeout_s,
-                  0.);
-    LOG_DEBUG("Starting timeout timer\n");
-
-    ev_io_start(clt->loop, &clt->resolvers[i].observer);
+    if (uring != NULL) {
+      uring_recv_start(uring, &clt->resolvers[i].uring_rx,
+                       clt->resolvers[i].socket, client_uring_response, clt,
+                       &clt->stats);
+    } else {
+      ev_io_start(clt->loop, &clt->resolvers[i].observer);
+    }
   }
 }
 
-void client_send_request(struct dns_client *restrict clt,
-                         const char *restrict dns_req, const size_t req_len,
-                         const uint16_t tx_id) {
-  LOG_TRACE("client_send_request(client ptr: %p, dns_req ptr: %p, req_len: "
-            "%zu, tx_id: %u)",
-            clt, dns_req, req_len, tx_id);
+// Expected time until a query sent there is answered or given up on
+static inline double resolver_score(const struct resolver *restrict res) {
+  return (1. - res->loss) * res->srtt + res->loss * res->timeout_s;
+}
 
-  if (sizeof(upstream_resolver) == 0) {
-    LOG_ERROR("sizeof upstream_resolver == 0\n");
+// Rotates among the resolvers close to the best score, and every
+// UPSTREAM_PROBE_INTERVAL-th query among the others
+static inline unsigned client_select_resolver(struct dns_client *restrict clt) {
+  double best = resolver_score(&clt->resolvers[0]);
+  for (unsigned i = 1; i < RESOLVERS; i++) {
+    double score = resolver_score(&clt->resolvers[i]);
+    best = score < best ? score : best;
   }
+  double band = best * UPSTREAM_BAND_PERCENT / 100. + UPSTREAM_SLACK_US / 1e6;
+  bool probe = ++clt->queries % UPSTREAM_PROBE_INTERVAL == 0;
+
+  // With nothing to probe, fall back to the next resolver in turn
+  unsigned selected = (clt->next_resolver + 1) % RESOLVERS;
+  for (unsigned n = 1; n <= RESOLVERS; n++) {
+    unsigned i = (clt->next_resolver + n) % RESOLVERS;
+    bool fast = resolver_score(&clt->resolvers[i]) <= band;
+    if (fast != probe) {
+      selected = i;
+      clt->resolvers[i].probes += probe;
+      break;
+    }
+  }
+  clt->next_resolver = selected;
+  clt->resolvers[selected].selected++;
+  if (clt->metrics != NULL) {
+    metrics_add(&clt->metrics->upstreams[selected].queries, 1);
+  }
+  return selected;
+}
 
-  // Simple round-robin selection of upstream resolver
-  static int current_resolver = 0;
-  current_resolver = (current_resolver + 1) % RESOLVERS;
-
-  struct resolver *res = &clt->resolvers[current_resolver];
-
-  transaction_info *tx_info = find_transaction(tx_id);
+// The best resolver other than the one a query went to first
+static inline unsigned client_hedge_resolver(const struct dns_client *clt,
+                                             const unsigned first) {
+  unsigned hedge = (first + 1) % RESOLVERS;
+  for (unsigned i = 0; i < RESOLVERS; i++) {
+    if (i != first && resolver_score(&clt->resolvers[i]) <
+                          resolver_score(&clt->resolvers[hedge])) {
+      hedge = i;
+    }
+  }
+  return hedge;
+}
 
-  if (tx_info) {
-    tx_info->timestamp = time(NULL); // Record the send time
+// How long a query waits for its resolver before it is hedged
+static inline double resolver_hedge_delay(const struct resolver *res) {
+  if (res->answered == 0) {
+    return res->timeout_s / 4.; // nothing known yet
   }
+  double delay = res->srtt + 4. * res->rttvar;
+  return delay > HEDGE_DELAY_MIN_US / 1e6 ? delay : HEDGE_DELAY_MIN_US / 1e6;
+}
 
+static void client_send_to(struct dns_client *restrict clt,
+                           struct resolver *restrict res,
+                           const char *restrict dns_req, const size_t req_len) {
+  if (clt->tls != NULL) {
+    client_send_tcp(clt, (unsigned)(res - clt->resolvers), dns_req, req_len);
+    return;
+  }
+  if (clt->uring != NULL &&
+      uring_send(clt->uring, res->socket, (struct sockaddr *)&res->addr,
+                 res->addrlen, dns_req, req_len, &clt->stats)) {
+    return;
+  }
   ssize_t sent = sendto(res->socket, dns_req, req_len, 0,
                         (struct sockaddr *)&res->addr, res->addrlen);
+  clt->stats.tx_calls++;
 
   if (sent < 0) {
     LOG_ERROR("sendto resolver failed: %s\n", strerror(errno));
+    clt->stats.tx_dropped++;
 
     // Additional error checking
     if (errno == EDESTADDRREQ) {
@@ -196,38 +476,245 @@ void client_send_request(struct dns_client *restrict clt,
     }
     return;
   }
+  clt->stats.tx_datagrams++;
+}
+
+void client_send_request(struct dns_client *restrict clt,
+                         const char *restrict dns_req, const size_t req_len,
+                         struct transaction *restrict tx) {
+  LOG_TRACE("client_send_request(client ptr: %p, dns_req ptr: %p, req_len: "
+            "%zu, tx ptr: %p)",
+            clt, dns_req, req_len, tx);
+
+  if (sizeof(upstream_resolver) == 0) {
+    LOG_ERROR("sizeof upstream_resolver == 0\n");
+  }
+
+  unsigned selected = client_select_resolver(clt);
+  struct resolver *res = &clt->resolvers[selected];
+  tx->resolver = (uint8_t)selected;
+
+  // Armed even if sending fails, the client gets SERVFAIL either way
+  double now = ev_now(clt->loop);
+  double at = now + res->timeout_s;
+  // Kept for a hedge or a retry over TCP
+  if (req_len <= clt->transactions->request_max) {
+    memcpy(transaction_request(clt->transactions, tx), dns_req, req_len);
+    tx->request_len = (uint16_t)req_len;
+  }
+  if (clt->hedge_ratio > 0. && tx->request_len > 0) {
+    clt->hedge_tokens += clt->hedge_ratio;
+    if (clt->hedge_tokens > HEDGE_BURST) {
+      clt->hedge_tokens = HEDGE_BURST;
+    }
+    double hedge_at = now + resolver_hedge_delay(res);
+    if (hedge_at < at) {
+      tx->hedge_due = true;
+      at = hedge_at;
+    }
+  }
+  timer_wheel_add(&clt->transactions->timeouts, &tx->timer, at);
+  client_schedule_timeout(clt, at);
+
+  client_send_to(clt, res, dns_req, req_len);
+}
+
+bool client_retry_tcp(struct dns_client *restrict clt,
+                      struct transaction *restrict tx) {
+  LOG_TRACE("client_retry_tcp(client ptr: %p, tx ptr: %p)\n", clt, tx);
+  if (tx->over_tcp || tx->request_len == 0) {
+    return false;
+  }
+  struct resolver *res = &clt->resolvers[tx->resolver];
+  if (!client_send_tcp(clt, tx->resolver,
+                       transaction_request(clt->transactions, tx),
+                       tx->request_len)) {
+    return false;
+  }
+
+  tx->over_tcp = true;
+  tx->hedge_due = false;
+  tx->sent_at = ev_now(clt->loop);
+  double at = tx->sent_at + res->timeout_s;
+  timer_wheel_cancel(&clt->transactions->timeouts, &tx->timer);
+  timer_wheel_add(&clt->transactions->timeouts, &tx->timer, at);
+  client_schedule_timeout(clt, at);
+  return true;
+}
+
+// Resend a slow query to a second resolver, if the hedge budget allows
+static void client_send_hedge(struct dns_client *restrict clt,
+                              struct transaction *restrict tx) {
+  if (clt->hedge_tokens < 1.) {
+    clt->hedges_capped++;
+    return;
+  }
+  clt->hedge_tokens -= 1.;
+
+  unsigned hedge = client_hedge_resolver(clt, tx->resolver);
+  struct resolver *res = &clt->resolvers[hedge];
+  tx->hedge = (uint8_t)hedge;
+  tx->hedged_at = ev_now(clt->loop);
+  res->hedges++;
+  if (clt->metrics != NULL) {
+    metrics_add(&clt->metrics->upstreams[hedge].hedges, 1);
+  }
+  LOG_DEBUG("Transaction %u hedged to %s\n", tx->id, res->name);
+  client_send_to(clt, res, transaction_request(clt->transactions, tx),
+                 tx->request_len);
+}
+
+// Called by the wheel for every query that is due for a hedge or got no
+// answer in time
+static void client_expire(struct timer_entry *entry, void *data) {
+  struct dns_client *clt = (struct dns_client *)data;
+  struct transaction *tx = transaction_of_timer(entry);
+  struct resolver *res = &clt->resolvers[tx->resolver];
+  if (tx->hedge_due) {
+    // The timeout still counts from the first send
+    tx->hedge_due = false;
+    client_send_hedge(clt, tx);
+    timer_wheel_add(&clt->transactions->timeouts, &tx->timer,
+                    tx->sent_at + res->timeout_s);
+    return;
+  }
+
+  LOG_WARN("Transaction %u timed out on %s\n", tx->id, res->name);
+  clt->transactions->stats.expired++;
+  res->timeouts++;
+  res->loss += (1. - res->loss) / 32.;
+  if (clt->metrics != NULL) {
+    metrics_add(&clt->metrics->upstreams[tx->resolver].timeouts, 1);
+  }
+  // The proxy answers the client and ends the transaction
+  clt->callback(clt, clt->cb_data, NULL, tx->id, NULL, 0);
+}
+
+// Make the timer fire at the given deadline unless it fires earlier already
+static inline void client_schedule_timeout(struct dns_client *restrict clt,
+                                           const double at) {
+  if (ev_is_active(&clt->timeout_observer) && clt->timeout_at <= at) {
+    return;
+  }
+  // Half a tick late, so that the wheel is sure to have reached the deadline
+  double delay = at - ev_now(clt->loop);
+  delay = (delay > 0. ? delay : 0.) + 0.5 / TIMER_WHEEL_HZ;
+  ev_timer_stop(clt->loop, &clt->timeout_observer);
+  ev_timer_set(&clt->timeout_observer, delay, 0.);
+  ev_timer_start(clt->loop, &clt->timeout_observer);
+  clt->timeout_at = at;
 }
 
-static inline void client_handle_timeout(struct ev_loop *loop,
-                                         ev_timer *watcher, int revents) {
+static void client_handle_timeout(struct ev_loop *loop, ev_timer *watcher,
+                                  int revents) {
   struct dns_client *clt = NULL;
   clt = (struct dns_client *)watcher->data;
   LOG_TRACE("client_handle_timeout(loop ptr: %p, w ptr: %p, revents: %d)\n",
             loop, watcher, revents);
 
-  time_t current_time = time(NULL);
-  transaction_hash_entry *entry = NULL;
-  transaction_hash_entry *tmp = NULL;
+  struct timer_wheel *timeouts = &clt->transactions->timeouts;
+  timer_wheel_expire(timeouts, ev_now(loop), client_expire, clt);
 
-  HASH_ITER(hh, clt->transactions, entry, tmp) {
-    if (difftime(current_time, entry->value->timestamp) > clt->timeout_s) {
-      LOG_WARN("Transaction %u timed out\n", entry->key);
-      // Notify the proxy about the timeout
-      clt->callback(clt, clt->cb_data, NULL, entry->key, NULL, 0);
+  double next = 0.;
+  if (timer_wheel_next(timeouts, &next)) {
+    client_schedule_timeout(clt, next);
+  }
+}
 
-      // Remove the timed-out transaction
-      delete_transaction(entry->value->original_tx_id);
-    }
+static inline bool same_address(const struct sockaddr *restrict a,
+                                const struct sockaddr_storage *restrict b) {
+  if (a->sa_family != b->ss_family) {
+    return false;
+  }
+  if (a->sa_family == AF_INET) {
+    const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+    return x->sin_port == y->sin_port &&
+           x->sin_addr.s_addr == y->sin_addr.s_addr;
   }
+  if (a->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+    return x->sin6_port == y->sin6_port &&
+           memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+  }
+  return false;
+}
+
+void client_record_answer(struct dns_client *restrict clt,
+                          const struct transaction *restrict tx,
+                          const struct sockaddr *restrict addr) {
+  LOG_TRACE("client_record_answer(client ptr: %p, tx ptr: %p, addr ptr: %p)\n",
+            clt, tx, addr);
+  if (tx->over_tcp) {
+    return;
+  }
+  struct resolver *res = &clt->resolvers[tx->resolver];
+  double rtt = ev_now(clt->loop) - tx->sent_at;
+  if (tx->hedge != TRANSACTION_NO_HEDGE &&
+      same_address(addr, &clt->resolvers[tx->hedge].addr)) {
+    res = &clt->resolvers[tx->hedge];
+    rtt = ev_now(clt->loop) - tx->hedged_at;
+    res->hedges_won++;
+  }
+
+  // RFC 6298, the variation is updated with the previous srtt
+  if (res->answered == 0) {
+    res->srtt = rtt;
+    res->rttvar = rtt / 2.;
+  } else {
+    double deviation = rtt > res->srtt ? rtt - res->srtt : res->srtt - rtt;
+    res->rttvar += (deviation - res->rttvar) / 4.;
+    res->srtt += (rtt - res->srtt) / 8.;
+  }
+  res->loss -= res->loss / 32.;
+  res->answered++;
+  if (clt->metrics != NULL) {
+    struct metrics_upstream *upstream =
+        &clt->metrics->upstreams[res - clt->resolvers];
+    metrics_add(&upstream->answers, 1);
+    metrics_observe(&upstream->rtt, rtt);
+  }
+}
 
-  // Restart the timer for the next check
-  ev_timer_again(loop, watcher);
+void client_stats_log(const char *restrict name,
+                      const struct dns_client *restrict clt) {
+  LOG_TRACE("client_stats_log(name: %s, client ptr: %p)\n", name, clt);
+  for (unsigned i = 0; i < RESOLVERS; i++) {
+    const struct resolver *res = &clt->resolvers[i];
+    LOG_INFO("%s upstream %s: %" PRIu64 " selected (%" PRIu64
+             " probes), %" PRIu64 " hedges (%" PRIu64 " won), %" PRIu64
+             " answered, %" PRIu64
+             " timed out, srtt %.2f ms, rttvar %.2f ms, loss %.1f%%\n",
+             name, res->name, res->selected, res->probes, res->hedges,
+             res->hedges_won, res->answered, res->timeouts, res->srtt * 1e3,
+             res->rttvar * 1e3, res->loss * 100.);
+    if (clt->tls != NULL) {
+      LOG_INFO("%s upstream %s: %" PRIu64 " TLS handshakes, %" PRIu64
+               " of them resumed\n",
+               name, res->name, res->tls_handshakes, res->tls_resumed);
+    }
+  }
+  if (clt->hedge_ratio > 0.) {
+    LOG_INFO("%s: %" PRIu64 " hedges held back by the %.0f%% cap\n", name,
+             clt->hedges_capped, clt->hedge_ratio * 100.);
+  }
 }
 
 void client_cleanup(struct dns_client *restrict clt) {
   LOG_TRACE("client_cleanup(client ptr: %p)\n", clt);
+  ev_timer_stop(clt->loop, &clt->timeout_observer);
   for (int i = 0; i < RESOLVERS; i++) {
     ev_io_stop(clt->loop, &clt->resolvers[i].observer);
     close(clt->resolvers[i].socket);
   }
+  for (unsigned i = 0; i < RESOLVERS * TCP_POOL_SIZE; i++) {
+    tcp_conn_free(&clt->tcp[i]);
+  }
+  free(clt->tcp);
+  for (int i = 0; i < RESOLVERS; i++) {
+    SSL_SESSION_free(clt->resolvers[i].tls_session);
+  }
+  SSL_CTX_free(clt->tls);
+  udp_batch_free(&clt->rx);
 }
@@ -0,0 +1,396 @@
+#include "dns-packet.h"
+#include "config.h"
+#include "log.h"
+#include "trie.h"
+
+static inline uint16_t read_u16(const char *restrict p) {
+  uint16_t v = 0;
+  memcpy(&v, p, sizeof(v));
+  return ntohs(v);
+}
+
+static inline uint32_t read_u32(const char *restrict p) {
+  uint32_t v = 0;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static inline void write_u16(char *restrict p, const uint16_t value) {
+  uint16_t v = htons(value);
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void write_u32(char *restrict p, const uint32_t value) {
+  uint32_t v = htonl(value);
+  memcpy(p, &v, sizeof(v));
+}
+
+// packet_skip_name() without the trace, for the parsers in here
+static inline size_t skip_name(const char *restrict msg, const size_t len,
+                               const size_t offset) {
+  size_t pos = offset;
+
+  while (pos < len) {
+    uint8_t label_len = (uint8_t)msg[pos];
+    if (label_len == 0) {
+      return pos + 1;
+    }
+    if ((label_len & 0xC0) == 0xC0) {
+      // A pointer always terminates the name
+      return pos + 2 <= len ? pos + 2 : 0;
+    }
+    if ((label_len & 0xC0) != 0) {
+      return 0; // Reserved label types
+    }
+    pos += (size_t)label_len + 1;
+  }
+  return 0;
+}
+
+// Offset right after the first question, 0 if it is malformed
+static inline size_t question_end(const char *restrict msg, const size_t len) {
+  if (len < DNS_HEADER_SIZE || read_u16(msg + 4) == 0) {
+    return 0;
+  }
+  size_t pos = skip_name(msg, len, DNS_HEADER_SIZE);
+  if (pos == 0 || pos + 4 > len) {
+    return 0;
+  }
+  return pos + 4;
+}
+
+// Number of records in the answer, authority and additional sections
+static inline unsigned record_count(const char *restrict msg) {
+  return (unsigned)read_u16(msg + 6) + read_u16(msg + 8) + read_u16(msg + 10);
+}
+
+// The OPT pseudo record of a message, if it has one
+static inline bool find_opt(const char *restrict msg, const size_t len,
+                            struct packet_rr *restrict opt) {
+  size_t pos = packet_records_offset(msg, len);
+  if (pos == 0) {
+    return false;
+  }
+  for (unsigned i = record_count(msg); i > 0; i--) {
+    if (!packet_rr_next(msg, len, &pos, opt)) {
+      return false;
+    }
+    if (opt->type == DNS_TYPE_OPT) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t packet_skip_name(const char *restrict msg, const size_t len,
+                        const size_t offset) {
+  LOG_TRACE("packet_skip_name(msg ptr: %p, len: %zu, offset: %zu)", msg, len,
+            offset);
+  return skip_name(msg, len, offset);
+}
+
+bool packet_question_key(const char *restrict msg, const size_t len,
+                         char *restrict key, size_t *restrict key_len) {
+  LOG_TRACE("packet_question_key(msg ptr: %p, len: %zu, key ptr: %p)", msg,
+            len, key);
+  if (len < DNS_HEADER_SIZE || read_u16(msg + 4) == 0) {
+    return false;
+  }
+
+  size_t pos = DNS_HEADER_SIZE;
+  size_t out = 0;
+
+  while (pos < len) {
+    uint8_t label_len = (uint8_t)msg[pos];
+    if ((label_len & 0xC0) != 0) {
+      return false; // Compressed question names are not worth the trouble
+    }
+    if (pos + label_len + 1 > len ||
+        out + label_len + 1 > QUESTION_KEY_MAX - 4) {
+      return false;
+    }
+    key[out++] = (char)label_len;
+    for (uint8_t i = 0; i < label_len; i++) {
+      key[out++] = (char)tolower((unsigned char)msg[pos + 1 + i]);
+    }
+    pos += (size_t)label_len + 1;
+    if (label_len == 0) {
+      break;
+    }
+  }
+
+  if (out == 0 || key[out - 1] != 0 || pos + 4 > len) {
+    return false;
+  }
+  memcpy(key + out, msg + pos, 4); // QTYPE and QCLASS
+  *key_len = out + 4;
+  return true;
+}
+
+bool packet_question_parse(const char *restrict msg, const size_t len,
+                           struct packet_question *restrict question) {
+  LOG_TRACE("packet_question_parse(msg ptr: %p, len: %zu, question ptr: %p)",
+            msg, len, question);
+  if (len < DNS_HEADER_SIZE || read_u16(msg + 4) == 0) {
+    return false;
+  }
+
+  const unsigned char *in = (const unsigned char *)msg;
+  char *key = question->key;
+  size_t pos = DNS_HEADER_SIZE;
+  size_t out = 0;
+  unsigned count = 0;
+
+  for (;;) {
+    if (pos >= len) {
+      return false;
+    }
+    uint8_t label_len = in[pos];
+    if (label_len == 0) {
+      break;
+    }
+    // Compressed or reserved label types, or past the 255 byte limit
+    if ((label_len & 0xC0) != 0 || pos + label_len + 1 > len ||
+        out + label_len + 2 > QUESTION_KEY_MAX - 4) {
+      return false;
+    }
+    question->labels[count] = (uint8_t)out;
+    key[out++] = (char)label_len;
+    uint32_t hash = TRIE_HASH_SEED;
+    for (const unsigned char *c = in + pos + 1, *end = c + label_len; c < end;
+         c++) {
+      unsigned char folded = (unsigned char)tolower(*c);
+      key[out++] = (char)folded;
+      hash = trie_hash_step(hash, folded);
+    }
+    question->hashes[count++] = hash;
+    pos += (size_t)label_len + 1;
+  }
+
+  if (pos + 5 > len) {
+    return false;
+  }
+  key[out++] = 0;
+  memcpy(key + out, msg + pos + 1, 4); // QTYPE and QCLASS
+  question->key_len = out + 4;
+  question->label_count = count;
+  return true;
+}
+
+size_t packet_make_response(char *restrict msg, const size_t len,
+                            const uint8_t rcode) {
+  LOG_TRACE("packet_make_response(msg ptr: %p, len: %zu, rcode: %u)", msg, len,
+            rcode);
+  size_t pos = question_end(msg, len);
+  if (pos == 0) {
+    return 0;
+  }
+  msg[2] = (char)(0x80 | (msg[2] & 0x79)); // QR, keep OPCODE and RD
+  msg[3] = (char)(0x80 | (rcode & 0x0F));  // RA
+  write_u16(msg + 4, 1);
+  write_u16(msg + 6, 0);
+  write_u16(msg + 8, 0);
+  write_u16(msg + 10, 0);
+  return pos;
+}
+
+size_t packet_append_answer(char *restrict msg, const size_t len,
+                            const size_t cap, const uint16_t type,
+                            const void *restrict rdata,
+                            const uint16_t rdlength, const uint32_t ttl) {
+  LOG_TRACE("packet_append_answer(msg ptr: %p, len: %zu, cap: %zu, type: %u, "
+            "rdata ptr: %p, rdlength: %u, ttl: %u)",
+            msg, len, cap, type, rdata, rdlength, ttl);
+  // Right after packet_make_response() the question ends the message
+  size_t qend = read_u16(msg + 6) == 0 ? len : question_end(msg, len);
+  if (qend < DNS_HEADER_SIZE + 5 || len + 12 + (size_t)rdlength > cap) {
+    return 0;
+  }
+  char *rr = msg + len;
+  write_u16(rr, 0xC000 | DNS_HEADER_SIZE); // the question's name
+  write_u16(rr + 2, type);
+  memcpy(rr + 4, msg + qend - 2, 2); // QCLASS
+  write_u32(rr + 6, ttl);
+  write_u16(rr + 10, rdlength);
+  memcpy(rr + 12, rdata, rdlength);
+  write_u16(msg + 6, (uint16_t)(read_u16(msg + 6) + 1));
+  return len + 12 + rdlength;
+}
+
+uint16_t packet_question_type(const char *restrict msg, const size_t len) {
+  LOG_TRACE("packet_question_type(msg ptr: %p, len: %zu)", msg, len);
+  size_t pos = question_end(msg, len);
+  return pos == 0 ? 0 : read_u16(msg + pos - 4);
+}
+
+size_t packet_records_offset(const char *restrict msg, const size_t len) {
+  LOG_TRACE("packet_records_offset(msg ptr: %p, len: %zu)", msg, len);
+  if (len < DNS_HEADER_SIZE) {
+    return 0;
+  }
+
+  size_t pos = DNS_HEADER_SIZE;
+  for (uint16_t q = read_u16(msg + 4); q > 0; q--) {
+    pos = skip_name(msg, len, pos);
+    if (pos == 0 || pos + 4 > len) {
+      return 0;
+    }
+    pos += 4; // QTYPE and QCLASS
+  }
+  return pos;
+}
+
+bool packet_rr_next(const char *restrict msg, const size_t len,
+                    size_t *restrict pos, struct packet_rr *restrict rr) {
+  LOG_TRACE("packet_rr_next(msg ptr: %p, len: %zu, pos: %zu)", msg, len, *pos);
+  size_t p = skip_name(msg, len, *pos);
+  if (p == 0 || p + 10 > len) {
+    return false;
+  }
+
+  rr->offset = *pos;
+  rr->type = read_u16(msg + p);
+  rr->rclass = read_u16(msg + p + 2);
+  rr->ttl_offset = p + 4;
+  rr->ttl = read_u32(msg + p + 4);
+  rr->rdlength = read_u16(msg + p + 8);
+  rr->rdata_offset = p + 10;
+
+  if (rr->rdata_offset + rr->rdlength > len) {
+    return false;
+  }
+  *pos = rr->rdata_offset + rr->rdlength;
+  return true;
+}
+
+bool packet_min_ttl(const char *restrict msg, const size_t len,
+                    uint32_t *restrict min_ttl) {
+  LOG_TRACE("packet_min_ttl(msg ptr: %p, len: %zu)", msg, len);
+  size_t pos = packet_records_offset(msg, len);
+  if (pos == 0) {
+    return false;
+  }
+
+  *min_ttl = UINT32_MAX;
+  struct packet_rr rr;
+  for (unsigned i = record_count(msg); i > 0; i--) {
+    if (!packet_rr_next(msg, len, &pos, &rr)) {
+      return false;
+    }
+    if (rr.type != DNS_TYPE_OPT && rr.ttl < *min_ttl) {
+      *min_ttl = rr.ttl;
+    }
+  }
+  return true;
+}
+
+bool packet_negative_ttl(const char *restrict msg, const size_t len,
+                         uint32_t *restrict ttl) {
+  LOG_TRACE("packet_negative_ttl(msg ptr: %p, len: %zu)", msg, len);
+  size_t pos = packet_records_offset(msg, len);
+  if (pos == 0) {
+    return false;
+  }
+
+  struct packet_rr rr;
+  unsigned answers = read_u16(msg + 6);
+  unsigned authority = read_u16(msg + 8);
+  for (unsigned i = 0; i < answers + authority; i++) {
+    if (!packet_rr_next(msg, len, &pos, &rr)) {
+      return false;
+    }
+    // MNAME and RNAME, then SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM
+    if (i >= answers && rr.type == DNS_TYPE_SOA && rr.rdlength >= 22) {
+      uint32_t minimum = read_u32(msg + rr.rdata_offset + rr.rdlength - 4);
+      *ttl = rr.ttl < minimum ? rr.ttl : minimum;
+      return true;
+    }
+  }
+  return false;
+}
+
+void packet_age_ttls(char *restrict msg, const size_t len,
+                     const uint32_t elapsed) {
+  LOG_TRACE("packet_age_ttls(msg ptr: %p, len: %zu, elapsed: %u)", msg, len,
+            elapsed);
+  size_t pos = packet_records_offset(msg, len);
+  if (pos == 0 || elapsed == 0) {
+    return;
+  }
+
+  struct packet_rr rr;
+  for (unsigned i = record_count(msg); i > 0; i--) {
+    if (!packet_rr_next(msg, len, &pos, &rr)) {
+      return;
+    }
+    if (rr.type != DNS_TYPE_OPT) {
+      write_u32(msg + rr.ttl_offset, rr.ttl > elapsed ? rr.ttl - elapsed : 0);
+    }
+  }
+}
+
+void packet_cap_ttls(char *restrict msg, const size_t len, const uint32_t ttl) {
+  LOG_TRACE("packet_cap_ttls(msg ptr: %p, len: %zu, ttl: %u)", msg, len, ttl);
+  size_t pos = packet_records_offset(msg, len);
+  if (pos == 0) {
+    return;
+  }
+
+  struct packet_rr rr;
+  for (unsigned i = record_count(msg); i > 0; i--) {
+    if (!packet_rr_next(msg, len, &pos, &rr)) {
+      return;
+    }
+    if (rr.type != DNS_TYPE_OPT && rr.ttl > ttl) {
+      write_u32(msg + rr.ttl_offset, ttl);
+    }
+  }
+}
+
+uint16_t packet_udp_size(const char *restrict msg, const size_t len) {
+  LOG_TRACE("packet_udp_size(msg ptr: %p, len: %zu)", msg, len);
+  struct packet_rr opt;
+  if (!find_opt(msg, len, &opt) || opt.rclass < UDP_PAYLOAD_MIN) {
+    return UDP_PAYLOAD_MIN; // RFC 6891 treats smaller sizes as 512
+  }
+  return opt.rclass;
+}
+
+void packet_set_udp_size(char *restrict msg, const size_t len,
+                         const uint16_t size) {
+  LOG_TRACE("packet_set_udp_size(msg ptr: %p, len: %zu, size: %u)", msg, len,
+            size);
+  struct packet_rr opt;
+  if (find_opt(msg, len, &opt)) {
+    write_u16(msg + opt.ttl_offset - 2, size); // CLASS holds the size
+  }
+}
+
+size_t packet_truncate(const char *restrict msg, const size_t len,
+                       char *restrict out, const size_t out_len) {
+  LOG_TRACE("packet_truncate(msg ptr: %p, len: %zu, out ptr: %p, out_len: "
+            "%zu)",
+            msg, len, out, out_len);
+  size_t pos = question_end(msg, len);
+  if (pos == 0 || pos > out_len) {
+    return 0;
+  }
+  memcpy(out, msg, pos);
+  out[2] = (char)(out[2] | 0x02); // TC
+  write_u16(out + 4, 1);
+  write_u16(out + 6, 0);
+  write_u16(out + 8, 0);
+  write_u16(out + 10, 0);
+
+  // The OPT record stays, RFC 6891 wants it in truncated answers too
+  struct packet_rr opt;
+  if (find_opt(msg, len, &opt)) {
+    size_t opt_len = opt.rdata_offset + opt.rdlength - opt.offset;
+    if (pos + opt_len <= out_len) {
+      memcpy(out + pos, msg + opt.offset, opt_len);
+      write_u16(out + 10, 1);
+      pos += opt_len;
+    }
+  }
+  return pos;
+}
@@ -1,63 +1,104 @@
 #include "dns-proxy.h"
 #include "config.h" /* Main configuration file */
+#include "dns-packet.h"
 #include "log.h"
 
 inline void proxy_init(struct dns_proxy *restrict prx,
                        struct dns_client *restrict clt,
-                       struct dns_server *restrict srv, struct ev_loop *loop);
+                       struct dns_server *restrict srv, struct ev_loop *loop,
+                       struct cache *restrict cache,
+                       struct cache *restrict negative,
+                       const struct options *restrict opts,
+                       struct metrics *restrict metrics);
 
 void proxy_stop(const struct dns_proxy *restrict prx);
 
+void proxy_stats_log(const char *restrict name,
+                     const struct dns_proxy *restrict prx);
+
 void proxy_handle_request(void *restrict prx, void *restrict data,
                           const struct sockaddr *addr, const uint16_t tx_id,
                           char *restrict dns_req, const size_t dns_req_len);
 
-static inline void
-handle_blacklisted(const struct dns_proxy *prx, const struct sockaddr *addr,
-                   const uint16_t tx_id, char *restrict dns_req,
-                   const size_t dns_req_len, const char *restrict domain);
+static inline void handle_blacklisted(const struct dns_proxy *prx,
+                                      const struct sockaddr *addr,
+                                      const uint16_t tx_id,
+                                      char *restrict dns_req,
+                                      const size_t dns_req_len);
 
 static inline void send_blacklisted_response(const struct dns_proxy *prx,
                                              const struct sockaddr *addr,
-                                             const uint16_t tx_id,
-                                             const char *dns_req,
+                                             char *dns_req,
                                              const size_t dns_req_len);
 
+static inline void send_redirect_response(const struct dns_proxy *prx,
+                                          const struct sockaddr *addr,
+                                          char *dns_req,
+                                          const size_t dns_req_len);
+
+static inline bool answer_from_cache(struct dns_proxy *prx,
+                                     const struct sockaddr *addr,
+                                     const char *dns_req,
+                                     const size_t dns_req_len,
+                                     const char *key, const size_t key_len,
+                                     const uint16_t udp_size, bool *refresh);
+
+static inline void prefetch_request(const struct dns_proxy *prx,
+                                    char *dns_req, const size_t dns_req_len,
+                                    const char *key, const size_t key_len);
+
 static inline void forward_request(const struct dns_proxy *prx,
                                    const struct sockaddr *addr,
-                                   const uint16_t tx_id, const char *dns_req,
-                                   const size_t dns_req_len);
+                                   const uint16_t tx_id, char *dns_req,
+                                   const size_t dns_req_len, const char *key,
+                                   const size_t key_len,
+                                   const uint16_t udp_size);
 
 void proxy_handle_response(void *restrict prx, void *restrict data,
                            const struct sockaddr *addr, const uint16_t tx_id,
-                           const char *restrict dns_res,
-                           const size_t dns_res_len);
+                           char *restrict dns_res, const size_t dns_res_len);
 
-static inline void send_error_response(const struct dns_server *restrict srv,
+static inline void send_error_response(struct dns_server *restrict srv,
                                        const struct sockaddr *restrict addr,
-                                       const uint16_t tx_id);
+                                       char *restrict dns_req,
+                                       const size_t dns_req_len);
 
-static inline bool validate_request(const struct dns_header *restrict header,
-                                    const uint16_t tx_id,
-                                    const char *restrict dns_req,
-                                    const size_t dns_req_len,
-                                    char *restrict domain);
+static inline void observe_reply(const struct dns_proxy *restrict prx,
+                                 const struct transaction *restrict tx);
 
-static inline transaction_info *
-create_transaction_info(const struct sockaddr *clt, const uint16_t tx_id);
+static inline void send_answer(struct dns_proxy *restrict prx,
+                               const struct sockaddr *restrict addr,
+                               const char *restrict msg, const size_t len,
+                               const uint16_t udp_size);
 
-static inline char *create_redirect_packet(char *restrict dns_req,
-                                           const size_t dns_req_len,
-                                           const char *restrict domain);
+static inline void answer_servfail(struct dns_proxy *restrict prx,
+                                   const struct transaction *restrict tx);
+
+static inline void answer_waiters(struct dns_proxy *restrict prx,
+                                  const struct transaction *restrict tx,
+                                  char *restrict dns_res,
+                                  const size_t dns_res_len);
+
+static inline bool answer_stale(struct dns_proxy *restrict prx,
+                                const struct transaction *restrict tx);
 /*---*/
 // IMPLEMENTATION
 
 void proxy_init(struct dns_proxy *prx, struct dns_client *clt,
-                struct dns_server *srv, struct ev_loop *loop) {
-  LOG_TRACE("proxy_init(prx ptr: %p, clt ptr: %p, srv ptr: %p, loop ptr: %p)\n",
-            prx, clt, srv, loop);
+                struct dns_server *srv, struct ev_loop *loop,
+                struct cache *cache, struct cache *negative,
+                const struct options *opts, struct metrics *metrics) {
+  LOG_TRACE("proxy_init(prx ptr: %p, clt ptr: %p, srv ptr: %p, loop ptr: %p, "
+            "cache ptr: %p, negative ptr: %p, opts ptr: %p, metrics ptr: %p)\n",
+            prx, clt, srv, loop, cache, negative, opts, metrics);
   prx->client = clt;
   prx->server = srv;
+  prx->cache = cache;
+  prx->negative = negative;
+  prx->opts = opts;
+  memset(&prx->stats, 0, sizeof(prx->stats));
+  prx->metrics = metrics;
+  clt->metrics = metrics;
 
   prx->loop = loop;
   srv->loop = loop;
@@ -75,6 +116,14 @@ void proxy_stop(const struct dns_proxy *restrict prx) {
   ev_break(prx->loop, EVBREAK_ALL);
 }
 
+void proxy_stats_log(const char *restrict name,
+                     const struct dns_proxy *restrict prx) {
+  LOG_TRACE("proxy_stats_log(name: %s, prx ptr: %p)", name, prx);
+  LOG_INFO("%s: %" PRIu64 " answers truncated for the client, %" PRIu64
+           " truncated upstream\n",
+           name, prx->stats.truncated, prx->stats.upstream_tc);
+}
+
 /**
  * @brief Handle a DNS request in the proxy
  *
@@ -93,19 +142,54 @@ void proxy_handle_request(void *restrict prx, void *restrict data,
             prx, data, addr, tx_id, dns_req, dns_req_len);
   // WARN:
   prx = (struct dns_proxy *)data;
+  // Only taken with metrics, ev_now() is the same for the whole batch
+  struct metrics *metrics = ((struct dns_proxy *)prx)->metrics;
+  double start = metrics != NULL ? metrics_now() : 0.;
+
+  // One walk over the name yields the cache key and the blacklist labels
+  struct packet_question question;
+  if (!packet_question_parse(dns_req, dns_req_len, &question)) {
+    LOG_ERROR("Malformed question in request, tx_id: #%du\n", tx_id);
+    if (metrics != NULL) {
+      metrics_add(&metrics->malformed, 1);
+    }
+    return;
+  }
 
-  const struct dns_header *header = (struct dns_header *)dns_req;
-  char domain[DOMAIN_AVG];
-
-  if (!validate_request(header, tx_id, dns_req, dns_req_len, domain)) {
-    LOG_ERROR("Failed to validate request, tx_id: #%du\n", tx_id);
+  bool blocked =
+      is_question_blacklisted(((struct dns_proxy *)prx)->server, &question);
+  if (metrics != NULL) {
+    metrics_add(&metrics->queries, 1);
+    metrics_observe(&metrics->blacklist, metrics_now() - start);
+  }
+  if (blocked) {
+    handle_blacklisted(prx, addr, tx_id, dns_req, dns_req_len);
+    if (metrics != NULL) {
+      metrics_add(&metrics->blocked, 1);
+      metrics_observe(&metrics->reply, metrics_now() - start);
+    }
     return;
   }
 
-  if (is_blacklisted(domain)) {
-    handle_blacklisted(prx, addr, tx_id, dns_req, dns_req_len, domain);
-  } else {
-    forward_request(prx, addr, tx_id, dns_req, dns_req_len);
+  const char *key = question.key;
+  size_t key_len = question.key_len;
+  // Over TCP any answer fits
+  uint16_t udp_size = server_is_tcp(addr)
+                          ? TCP_MESSAGE_MAX
+                          : packet_udp_size(dns_req, dns_req_len);
+  bool refresh = false;
+  if (!answer_from_cache(prx, addr, dns_req, dns_req_len, key, key_len,
+                         udp_size, &refresh)) {
+    forward_request(prx, addr, tx_id, dns_req, dns_req_len, key, key_len,
+                    udp_size);
+    return;
+  }
+  if (metrics != NULL) {
+    metrics_add(&metrics->cache_hits, 1);
+    metrics_observe(&metrics->reply, metrics_now() - start);
+  }
+  if (refresh) {
+    prefetch_request(prx, dns_req, dns_req_len, key, key_len);
   }
 }
 
@@ -113,15 +197,20 @@ void proxy_handle_request(void *restrict prx, void *restrict data,
  * @brief Handles the DNS response received from an upstream resolver.
  *
  * This function processes the DNS response received from an upstream resolver.
- * It looks up the original transaction, sends the response back to the client,
- * and handles timeout scenarios.
+ * It looks up the transaction by the upstream ID, checks that the response
+ * answers the question that was sent, restores the client's ID and sends the
+ * response back to the client and to every client waiting on the same
+ * question, and handles timeout scenarios. A query that times out or that
+ * the upstream fails with SERVFAIL or REFUSED is answered from the cache
+ * instead, stale entries included, if it has an answer.
  *
  * @param srv Pointer to the server object (unused in this function).
  * @param data Pointer that to be casted to the dns_proxy structure.
  * @param addr Pointer to the sockaddr structure containing the address of the
  * upstream resolver.
- * @param tx_id Transaction ID of the DNS response.
- * @param dns_res Pointer to the buffer containing the DNS response.
+ * @param tx_id Upstream ID of the DNS response.
+ * @param dns_res Pointer to the buffer containing the DNS response, its ID is
+ * rewritten in place.
  * @param dns_res_len Length of the DNS response.
  *
  * @note If dns_res is NULL and dns_res_len is 0, it's treated as a timeout
@@ -131,197 +220,347 @@ void proxy_handle_request(void *restrict prx, void *restrict data,
  * dns_proxy structure.
  *
  * @see dns_proxy
- * @see transaction_info
- * @see find_transaction
- * @see send_error_response
+ * @see transaction_find
+ * @see answer_servfail
  * @see server_send_response
- * @see delete_transaction
+ * @see transaction_end
  */
 void proxy_handle_response(void *restrict srv, void *data,
                            const struct sockaddr *addr, const uint16_t tx_id,
-                           const char *dns_res, const size_t dns_res_len) {
+                           char *dns_res, const size_t dns_res_len) {
   LOG_TRACE("proxy_handle_response(srv ptr: %p, data ptr: %p, addr ptr: %p, "
             "tx_id: %u, "
             "dns_res ptr: %p, dns_res_len: %zu)\n",
             data, data, addr, tx_id, dns_res, dns_res_len);
   // WARN:
   struct dns_proxy *prx = (struct dns_proxy *)data;
+  struct transaction_table *table = prx->client->transactions;
+
+  struct transaction *current = transaction_find(table, tx_id);
+  if (current == NULL) {
+    // Mostly the slower answer to a hedged query
+    LOG_DEBUG("No transaction for upstream ID #%u\n", tx_id);
+    return;
+  }
 
-  transaction_info *current = find_transaction(tx_id);
-  if (current != NULL) {
-    if (dns_res == NULL && dns_res_len == 0) {
-      // This is a timeout notification
-      LOG_WARN("Request with tx_id %u timed out\n", tx_id);
-      send_error_response(prx->server, &current->client_addr,
-                          current->original_tx_id);
+  if (dns_res == NULL && dns_res_len == 0) {
+    // This is a timeout notification
+    LOG_WARN("Request with tx_id %u timed out\n", current->client_id);
+    if (!answer_stale(prx, current)) {
+      answer_servfail(prx, current);
     }
-    server_send_response(prx->server, (struct sockaddr *)&current->client_addr,
-                         dns_res, dns_res_len);
-    delete_transaction(tx_id);
-  } else {
-    LOG_ERROR("No transaction_info for tx_id #%du\n", tx_id);
+    observe_reply(prx, current);
+    transaction_end(table, current);
+    return;
   }
-}
 
-static inline bool validate_request(const struct dns_header *header,
-                                    const uint16_t tx_id, const char *dns_req,
-                                    const size_t dns_req_len, char *domain) {
-  LOG_TRACE("validate_request(header ptr: %p, tx_id: %u, dns_req ptr: %p, "
-            "dns_req_len: %zu, domain ptr: %p)\n",
-            header, tx_id, dns_req, dns_req_len, domain);
-  if (ntohs(header->qd_count) == 0) {
-    LOG_ERROR("No questions in the request for tx_id #%du\n", tx_id);
-    return false;
+  char key[QUESTION_KEY_MAX];
+  size_t key_len = 0;
+  if (!packet_question_key(dns_res, dns_res_len, key, &key_len) ||
+      !transaction_matches(table, current, key, key_len)) {
+    // Spoofed or confused, keep waiting for the real answer
+    LOG_WARN("Response for upstream ID #%u does not match the question\n",
+             tx_id);
+    return;
   }
 
-  size_t query_offset = sizeof(*header);
-  if (!parse_domain_name(dns_req, dns_req_len, query_offset, domain,
-                         DOMAIN_AVG)) {
-    LOG_ERROR("Failed to parse domain name for tx_id #%du\n", tx_id);
-    return false;
+  client_record_answer(prx->client, current, addr);
+  const struct dns_header *header = (const struct dns_header *)dns_res;
+  if (header->tc) {
+    prx->stats.upstream_tc++;
+    // The TCP answer is on its way, a late one over UDP is truncated again
+    if (current->over_tcp || client_retry_tcp(prx->client, current)) {
+      return;
+    }
+    // Passed on as it is, the client retries over TCP itself
   }
+  if ((header->rcode == SERVFAIL || header->rcode == REFUSED) &&
+      answer_stale(prx, current)) {
+    observe_reply(prx, current);
+    transaction_end(table, current);
+    return;
+  }
+
+  *(uint16_t *)dns_res = htons(current->client_id);
+  // Each cache takes only the answers of its kind
+  cache_store(prx->cache, key, key_len, dns_res, dns_res_len,
+              ev_now(prx->loop));
+  cache_store(prx->negative, key, key_len, dns_res, dns_res_len,
+              ev_now(prx->loop));
+  if (current->client_addr_len > 0) {
+    send_answer(prx, (struct sockaddr *)&current->client_addr, dns_res,
+                dns_res_len, current->udp_size);
+  }
+  answer_waiters(prx, current, dns_res, dns_res_len);
+  observe_reply(prx, current);
+  transaction_end(table, current);
+}
 
+// Answers every client of a failed transaction from the cache (RFC 8767)
+static inline bool answer_stale(struct dns_proxy *restrict prx,
+                                const struct transaction *restrict tx) {
+  LOG_TRACE("answer_stale(prx ptr: %p, tx ptr: %p)\n", prx, tx);
+  size_t key_len = 0;
+  const char *key = transaction_key(prx->client->transactions, tx, &key_len);
+  char resp[RESPONSE_MAX];
+  size_t resp_len = cache_lookup_stale(prx->cache, key, key_len, tx->client_id,
+                                       ev_now(prx->loop), resp, sizeof(resp));
+  if (resp_len == 0) {
+    return false;
+  }
+  if (prx->metrics != NULL) {
+    metrics_add(&prx->metrics->stale, 1);
+  }
+  if (tx->client_addr_len > 0) {
+    send_answer(prx, (struct sockaddr *)&tx->client_addr, resp, resp_len,
+                tx->udp_size);
+  }
+  answer_waiters(prx, tx, resp, resp_len);
   return true;
 }
 
-static inline transaction_info *
-create_transaction_info(const struct sockaddr *clt, const uint16_t tx_id) {
-  LOG_TRACE("create_transaction_info(clt ptr: %p, tx_id: %u)\n", clt, tx_id);
-  struct transaction_info *tx_info =
-      malloc(sizeof(struct transaction_info)); /* will be free'd upon deletion
-                                                  of transaction_entry in
-                                                  proxy_handle_respose */
-  if (tx_info == NULL) {
-    LOG_ERROR("Failed transaction_info allocation for tx_id #%du\n", tx_id);
-    return NULL;
-  }
-  tx_info->client_addr = *clt;
-  tx_info->original_tx_id = tx_id;
-  tx_info->client_addr_len = sizeof(*clt);
-  return tx_info;
+// Sends an answer as it is if the client takes that much over UDP, else its
+// truncated form so that the client asks again over TCP
+static inline void send_answer(struct dns_proxy *restrict prx,
+                               const struct sockaddr *restrict addr,
+                               const char *restrict msg, const size_t len,
+                               const uint16_t udp_size) {
+  LOG_TRACE("send_answer(prx ptr: %p, addr ptr: %p, msg ptr: %p, len: %zu, "
+            "udp_size: %u)\n",
+            prx, addr, msg, len, udp_size);
+  if (len <= udp_size) {
+    server_send_response(prx->server, addr, msg, len);
+    return;
+  }
+  char truncated[UDP_PAYLOAD_MIN];
+  size_t truncated_len =
+      packet_truncate(msg, len, truncated, sizeof(truncated));
+  if (truncated_len == 0) {
+    return;
+  }
+  prx->stats.truncated++;
+  server_send_response(prx->server, addr, truncated, truncated_len);
 }
 
-#if REDIRECT == 1
-static inline char *create_redirect_packet(char *dns_req,
-                                           const size_t dns_req_len,
-                                           const char *restrict domain) {
-  LOG_TRACE("create_redirect_packet(dns_req ptr: %p, "
-            "dns_req_len: %zu, domain ptr: %p)",
-            dns_req, dns_req_len, domain);
-
-  const dns_header *header = (dns_header *)dns_req;
-  size_t query_offset = sizeof(*header);
-
-  size_t redir_len = dns_req_len - (strlen(domain) + 2) + strlen(redirect_to);
-  char *redir = (char *)calloc(1, redir_len);
-  if (redir == NULL) {
-    LOG_ERROR("Memory allocation failed for redirect");
-    free(dns_req);
-    return NULL;
-  }
-  // Copy the DNS header from the request to the redirect
-  memcpy(redir, dns_req, sizeof(*header));
-
-  // Copy the question section from redirect_to string
-  size_t redir_query_offset = query_offset;
-  memcpy(redir + redir_query_offset, (const void *)redirect_to,
-         strlen(redirect_to) + 1);
-  // Copy the rest of the query section (QTYPE and QCLASS)
-  size_t rest_of_query_offset = query_offset + strlen(redirect_to) + 1;
-  size_t rest_of_query_len = dns_req_len - (query_offset + strlen(domain) + 2);
-  memcpy(redir + rest_of_query_offset,
-         dns_req + query_offset + strlen(domain) + 2, rest_of_query_len);
-  return redir;
+// Answers every client of a transaction nobody answered with SERVFAIL, built
+// from the question it asked
+static inline void answer_servfail(struct dns_proxy *restrict prx,
+                                   const struct transaction *restrict tx) {
+  LOG_TRACE("answer_servfail(prx ptr: %p, tx ptr: %p)\n", prx, tx);
+  size_t key_len = 0;
+  const char *key = transaction_key(prx->client->transactions, tx, &key_len);
+  char resp[DNS_HEADER_SIZE + QUESTION_KEY_MAX];
+  struct dns_header *header = (struct dns_header *)resp;
+  memset(header, 0, sizeof(*header));
+  header->id = htons(tx->client_id);
+  header->rd = 1;
+  header->qd_count = htons(1);
+  memcpy(resp + sizeof(*header), key, key_len);
+  size_t resp_len =
+      packet_make_response(resp, sizeof(*header) + key_len, SERVFAIL);
+  if (prx->metrics != NULL) {
+    metrics_add(&prx->metrics->servfail, 1);
+  }
+  if (tx->client_addr_len > 0) {
+    server_send_response(prx->server, (struct sockaddr *)&tx->client_addr,
+                         resp, resp_len);
+  }
+  answer_waiters(prx, tx, resp, resp_len);
+}
+
+// Sends the answer to every client that waited on the transaction, each under
+// its own ID
+static inline void answer_waiters(struct dns_proxy *restrict prx,
+                                  const struct transaction *restrict tx,
+                                  char *restrict dns_res,
+                                  const size_t dns_res_len) {
+  LOG_TRACE("answer_waiters(prx ptr: %p, tx ptr: %p, dns_res ptr: %p, "
+            "dns_res_len: %zu)\n",
+            prx, tx, dns_res, dns_res_len);
+  struct transaction_table *table = prx->client->transactions;
+  const struct transaction_waiter *waiter = transaction_first_waiter(table, tx);
+  for (; waiter != NULL; waiter = transaction_next_waiter(table, waiter)) {
+    const struct sockaddr *addr = (const struct sockaddr *)&waiter->addr;
+    *(uint16_t *)dns_res = htons(waiter->client_id);
+    send_answer(prx, addr, dns_res, dns_res_len, waiter->udp_size);
+  }
 }
-#endif
 
 static inline void handle_blacklisted(const struct dns_proxy *prx,
                                       const struct sockaddr *addr,
                                       const uint16_t tx_id, char *dns_req,
-                                      const size_t dns_req_len,
-                                      const char *domain) {
+                                      const size_t dns_req_len) {
   LOG_TRACE("handle_blacklisted(prx ptr: %p, addr ptr: %p, tx_id: %u, "
-            "dns_req ptr: %p, dns_req_len: %zu, domain: %s)\n",
-            prx, addr, tx_id, dns_req, dns_req_len, domain);
-#if REDIRECT == 1
-  handle_redirect(prx, addr, tx_id, dns_req, dns_req_len, domain);
-#else
-  send_blacklisted_response(prx, addr, tx_id, dns_req, dns_req_len);
-#endif
+            "dns_req ptr: %p, dns_req_len: %zu)\n",
+            prx, addr, tx_id, dns_req, dns_req_len);
+  if (prx->opts->redirect != 0) {
+    send_redirect_response(prx, addr, dns_req, dns_req_len);
+  } else {
+    send_blacklisted_response(prx, addr, dns_req, dns_req_len);
+  }
 }
 
-#if REDIRECT == 1
-static inline void handle_redirect(struct dns_proxy *prx, struct sockaddr *addr,
-                                   uint16_t tx_id, char *dns_req,
-                                   size_t dns_req_len, const char *domain) {
-  LOG_TRACE("handle_redirect(prx ptr: %p, addr ptr: %p, tx_id: %u, "
-            "dns_req ptr: %p, dns_req_len: %zu, domain: %p)\n",
-            prx, addr, tx_id, dns_req, dns_req_len, domain);
-
-  char *redir = create_redirect_packet(dns_req, dns_req_len, domain);
-
-  struct transaction_info *tx_info = create_transaction_info(addr, tx_id);
-  add_transaction_entry(tx_info);
-
-  client_send_request(prx->client, redir, dns_req_len, tx_id);
-  free(redir);
-}
-#else
+// The response overwrites the request in the receive buffer
 static inline void send_blacklisted_response(const struct dns_proxy *prx,
                                              const struct sockaddr *addr,
-                                             const uint16_t tx_id,
-                                             const char *restrict dns_req,
+                                             char *restrict dns_req,
                                              const size_t dns_req_len) {
-  char resp[RESPONSE_AVG];
-
-  LOG_TRACE("send_blacklisted_response(prx ptr: %p, addr ptr: %p, tx_id: %u, "
-            "dns_req ptr: %p, dns_req_len: %zu)\n",
-            prx, addr, tx_id, dns_req, dns_req_len);
-
-  memcpy(resp, dns_req, sizeof(struct dns_header));
-  struct dns_header *resp_header = (struct dns_header *)resp;
+  LOG_TRACE("send_blacklisted_response(prx ptr: %p, addr ptr: %p, dns_req "
+            "ptr: %p, dns_req_len: %zu)\n",
+            prx, addr, dns_req, dns_req_len);
+  size_t resp_len =
+      packet_make_response(dns_req, dns_req_len, BLACKLISTED_RESPONSE);
+  if (resp_len == 0) {
+    LOG_ERROR("Malformed question in blocked request\n");
+    return;
+  }
+  server_send_response(prx->server, addr, dns_req, resp_len);
+}
 
-  resp_header->rcode = BLACKLISTED_RESPONSE;
-  resp_header->qr = 1;
-  resp_header->rd = 0;
+// Answers A and AAAA queries with the configured address, everything else
+// that has no address of its kind with an empty NOERROR; built over the
+// request, nothing goes upstream
+static inline void send_redirect_response(const struct dns_proxy *prx,
+                                          const struct sockaddr *addr,
+                                          char *restrict dns_req,
+                                          const size_t dns_req_len) {
+  LOG_TRACE("send_redirect_response(prx ptr: %p, addr ptr: %p, dns_req ptr: "
+            "%p, dns_req_len: %zu)\n",
+            prx, addr, dns_req, dns_req_len);
+  const struct options *opts = prx->opts;
+  uint16_t type = packet_question_type(dns_req, dns_req_len);
+  size_t resp_len = packet_make_response(dns_req, dns_req_len, NOERROR);
+  if (resp_len == 0) {
+    LOG_ERROR("Malformed question in blocked request\n");
+    return;
+  }
+  if (type == DNS_TYPE_A && (opts->redirect & REDIRECT_A)) {
+    resp_len = packet_append_answer(dns_req, resp_len, RESPONSE_MAX, type,
+                                    &opts->redirect_a,
+                                    sizeof(opts->redirect_a), REDIRECT_TTL);
+  } else if (type == DNS_TYPE_AAAA && (opts->redirect & REDIRECT_AAAA)) {
+    resp_len = packet_append_answer(dns_req, resp_len, RESPONSE_MAX, type,
+                                    &opts->redirect_aaaa,
+                                    sizeof(opts->redirect_aaaa), REDIRECT_TTL);
+  }
+  if (resp_len == 0) {
+    LOG_ERROR("No room for the redirect answer\n");
+    return;
+  }
+  server_send_response(prx->server, addr, dns_req, resp_len);
+}
 
+static inline bool answer_from_cache(struct dns_proxy *restrict prx,
+                                     const struct sockaddr *addr,
+                                     const char *restrict dns_req,
+                                     const size_t dns_req_len,
+                                     const char *restrict key,
+                                     const size_t key_len,
+                                     const uint16_t udp_size,
+                                     bool *restrict refresh) {
+  LOG_TRACE("answer_from_cache(prx ptr: %p, addr ptr: %p, dns_req ptr: %p, "
+            "dns_req_len: %zu, key ptr: %p, key_len: %zu, udp_size: %u, "
+            "refresh ptr: %p)\n",
+            prx, addr, dns_req, dns_req_len, key, key_len, udp_size, refresh);
+  char resp[RESPONSE_MAX];
   size_t resp_len =
-      sizeof(struct dns_header) + (dns_req_len - sizeof(struct dns_header));
-  memcpy(resp + sizeof(struct dns_header), dns_req + sizeof(struct dns_header),
-         dns_req_len - sizeof(struct dns_header));
-
-  server_send_response(prx->server, addr, resp, resp_len);
-  // memset(resp, 0, dns_req_len);
+      cache_lookup(prx->cache, key, key_len, dns_req, ev_now(prx->loop), resp,
+                   sizeof(resp), refresh);
+  if (resp_len == 0) {
+    resp_len = cache_lookup(prx->negative, key, key_len, dns_req,
+                            ev_now(prx->loop), resp, sizeof(resp), refresh);
+  }
+  if (resp_len == 0) {
+    return false;
+  }
+  send_answer(prx, addr, resp, resp_len, udp_size);
+  return true;
 }
-#endif
 
+// Sends the request upstream under an ID of our own, so that clients picking
+// the same ID cannot get each other's answers; a question that is already
+// upstream is not sent again
 static inline void forward_request(const struct dns_proxy *restrict prx,
                                    const struct sockaddr *addr,
-                                   const uint16_t tx_id,
-                                   const char *restrict dns_req,
-                                   const size_t dns_req_len) {
+                                   const uint16_t tx_id, char *restrict dns_req,
+                                   const size_t dns_req_len,
+                                   const char *restrict key,
+                                   const size_t key_len,
+                                   const uint16_t udp_size) {
   LOG_TRACE("forward_request(prx ptr: %p, addr ptr: %p, tx_id: %u, "
-            "dns_req ptr: %p, dns_req_len: %zu)\n",
-            prx, addr, tx_id, dns_req, dns_req_len);
-  struct transaction_info *tx_info = create_transaction_info(addr, tx_id);
-  add_transaction_entry(tx_info);
-  client_send_request(prx->client, dns_req, dns_req_len, tx_id);
-}
-
-static inline void send_error_response(const struct dns_server *restrict srv,
-                                       const struct sockaddr *restrict addr,
-                                       const uint16_t tx_id) {
-  LOG_TRACE("send_error_response(server ptr: %p, addr ptr: %p, tx_id %u)", srv,
-            addr, tx_id);
+            "dns_req ptr: %p, dns_req_len: %zu, key ptr: %p, key_len: %zu, "
+            "udp_size: %u)\n",
+            prx, addr, tx_id, dns_req, dns_req_len, key, key_len, udp_size);
+  struct transaction_table *table = prx->client->transactions;
+
+  // The same question is already upstream, wait for its answer
+  struct transaction *pending = transaction_pending(table, key, key_len);
+  if (pending != NULL &&
+      transaction_wait(table, pending, addr, prx->server->addrlen, tx_id,
+                       udp_size)) {
+    return;
+  }
 
-  char error_resp[RESPONSE_AVG];
-  struct dns_header *header = (struct dns_header *)error_resp;
+  struct transaction *tx =
+      transaction_begin(table, addr, prx->server->addrlen, tx_id, udp_size,
+                        key, key_len, ev_now(prx->loop));
+  if (tx == NULL) {
+    LOG_WARN("Too many queries in flight, refusing tx_id #%u\n", tx_id);
+    send_error_response(prx->server, addr, dns_req, dns_req_len);
+    if (prx->metrics != NULL) {
+      metrics_add(&prx->metrics->servfail, 1);
+    }
+    return;
+  }
+  *(uint16_t *)dns_req = htons(tx->id);
+  // Whatever the client takes, the answer is cached for everyone
+  packet_set_udp_size(dns_req, dns_req_len, RESPONSE_MAX);
+  client_send_request(prx->client, dns_req, dns_req_len, tx);
+}
 
-  memset(error_resp, 0, sizeof(struct dns_header));
+// Refreshes a cached answer before it expires; the transaction has no client
+// of its own, only clients that ask once the entry is gone wait on it
+static inline void prefetch_request(const struct dns_proxy *restrict prx,
+                                    char *restrict dns_req,
+                                    const size_t dns_req_len,
+                                    const char *restrict key,
+                                    const size_t key_len) {
+  LOG_TRACE("prefetch_request(prx ptr: %p, dns_req ptr: %p, dns_req_len: %zu, "
+            "key ptr: %p, key_len: %zu)\n",
+            prx, dns_req, dns_req_len, key, key_len);
+  struct transaction_table *table = prx->client->transactions;
+  if (transaction_pending(table, key, key_len) != NULL) {
+    return;
+  }
+  struct transaction *tx =
+      transaction_begin(table, NULL, 0, 0, 0, key, key_len, ev_now(prx->loop));
+  if (tx == NULL) {
+    return; // busy enough already, the entry just expires
+  }
+  *(uint16_t *)dns_req = htons(tx->id);
+  packet_set_udp_size(dns_req, dns_req_len, RESPONSE_MAX);
+  client_send_request(prx->client, dns_req, dns_req_len, tx);
+}
 
-  header->id = tx_id;
-  header->qr = (uint8_t)1;           // This is a response
-  header->rcode = (uint8_t)SERVFAIL; // Server failure
+static inline void send_error_response(struct dns_server *restrict srv,
+                                       const struct sockaddr *restrict addr,
+                                       char *restrict dns_req,
+                                       const size_t dns_req_len) {
+  LOG_TRACE("send_error_response(server ptr: %p, addr ptr: %p, dns_req ptr: "
+            "%p, dns_req_len: %zu)",
+            srv, addr, dns_req, dns_req_len);
+  // Server failure, built over the request
+  size_t resp_len = packet_make_response(dns_req, dns_req_len, SERVFAIL);
+  if (resp_len > 0) {
+    server_send_response(srv, addr, dns_req, resp_len);
+  }
+}
 
-  server_send_response(srv, addr, error_resp, sizeof(error_resp));
+// Time from the query of the client that started a transaction to its answer;
+// clients that waited on it asked later and are not counted
+static inline void observe_reply(const struct dns_proxy *restrict prx,
+                                 const struct transaction *restrict tx) {
+  if (prx->metrics != NULL && tx->client_addr_len > 0) {
+    metrics_observe(&prx->metrics->reply, ev_now(prx->loop) - tx->sent_at);
+  }
 }
@@ -2,12 +2,16 @@
 #include "config.h" /* Main configuration file */
 #include "log.h"
 
-// Creates and bind a listening UDP socket for incoming requests.
+// Creates and bind a listening UDP or TCP socket for incoming requests.
+// With reuseport set, several sockets (one per worker) share the same address
+// and the kernel load-balances datagrams and connections between them.
 static inline int init_socket(const char *restrict listen_addr,
-                              const uint16_t listen_port,
-                              unsigned int *restrict addrlen) {
-  LOG_TRACE("init_socket(listen_addr: %s, listen_port: %d, addrlen ptr: %p)\n",
-            listen_addr, listen_port, addrlen);
+                              const uint16_t listen_port, const int type,
+                              unsigned int *restrict addrlen,
+                              const bool reuseport) {
+  LOG_TRACE("init_socket(listen_addr: %s, listen_port: %d, type: %d, addrlen "
+            "ptr: %p, reuseport: %d)\n",
+            listen_addr, listen_port, type, addrlen, reuseport);
 
   struct addrinfo *addrinfo = NULL;
   struct addrinfo hints;
@@ -31,7 +35,9 @@ static inline int init_socket(const char *restrict listen_addr,
   *addrlen = addrinfo->ai_addrlen;
   saddr->sin_port = htons(listen_port);
 
-  int sockfd = socket(addrinfo->ai_family, SOCK_DGRAM, 0);
+  // The listening TCP socket must not block accept()
+  int sockfd = socket(addrinfo->ai_family,
+                      type == SOCK_STREAM ? type | SOCK_NONBLOCK : type, 0);
   if (sockfd < 0) {
     LOG_FATAL("Error creating socket: %s", strerror(errno));
     freeaddrinfo(addrinfo);
@@ -46,16 +52,24 @@ static inline int init_socket(const char *restrict listen_addr,
     return -1;
   }
 
-  // Set receive buffer size
+  if (reuseport &&
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opts, sizeof(opts)) < 0) {
+    LOG_ERROR("setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+    close(sockfd);
+    freeaddrinfo(addrinfo);
+    return -1;
+  }
+
+  // Set receive buffer size, accepted TCP sockets would inherit it
   int bufsize = 4194304; // 4 MB
-  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) <
-      0) {
+  if (type == SOCK_DGRAM && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF,
+                                       &bufsize, sizeof(bufsize)) < 0) {
     LOG_ERROR("setsockopt(SO_RCVBUF) failed: %s", strerror(errno));
   }
 
   // Set send buffer size
-  if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) <
-      0) {
+  if (type == SOCK_DGRAM && setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF,
+                                       &bufsize, sizeof(bufsize)) < 0) {
     LOG_ERROR("setsockopt(SO_SNDBUF) failed: %s", strerror(errno));
   }
 
@@ -68,6 +82,13 @@ static inline int init_socket(const char *restrict listen_addr,
     ok = false;
   }
 
+  if (ok && type == SOCK_STREAM && listen(sockfd, SOMAXCONN) < 0) {
+    LOG_FATAL("Error listening on %s:%d: %s\n", listen_addr, listen_port,
+              strerror(errno));
+    close(sockfd);
+    ok = false;
+  }
+
   freeaddrinfo(addrinfo);
 
   if (!ok) {
@@ -81,8 +102,10 @@ static inline int init_socket(const char *restrict listen_addr,
  * @brief Callback function for receiving DNS requests
  *
  * This function is called by the event loop when data is available on the
- * server socket. It receives the DNS request, performs basic validation, and
- * invokes the server's callback.
+ * server socket. It drains up to the configured batch size of DNS requests
+ * with a single recvmmsg(), performs basic validation, and invokes the
+ * server's callback for each of them. Responses produced while handling the
+ * batch are flushed together with one sendmmsg().
  *
  * @param loop The event loop (unused in this function)
  * @param obs The I/O watcher object
@@ -99,59 +122,228 @@ static void server_receive_request(struct ev_loop *loop, ev_io *obs,
   struct dns_server *srv = NULL;
   srv = (struct dns_server *)obs->data;
 
-  char buffer[REQUEST_AVG + 1];
-  memset(buffer, 0, sizeof(buffer));
+  unsigned count = udp_batch_recv(&srv->rx, obs->fd, &srv->stats);
 
-  struct sockaddr_storage raddr;
-  socklen_t tmp_addrlen = srv->addrlen;
-  ssize_t len = recvfrom(obs->fd, buffer, REQUEST_AVG, 0,
-                         (struct sockaddr *)&raddr, &tmp_addrlen);
-  if (len < 0) {
-    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-      LOG_ERROR("Recvfrom failed: %s\n", strerror(errno));
+  for (unsigned i = 0; i < count; i++) {
+    char *buffer = udp_batch_buffer(&srv->rx, i);
+    size_t len = srv->rx.msgs[i].msg_len;
+    if (len < sizeof(uint16_t)) {
+      continue; // Silently drop malformed packets
     }
-    return;
+
+    uint16_t tx_id = ntohs(*((uint16_t *)buffer));
+    srv->cb((void *)srv, srv->cb_data, (struct sockaddr *)&srv->rx.addrs[i],
+            tx_id, buffer, len);
   }
-  if (len < (int)sizeof(uint16_t)) {
+
+  server_flush_responses(srv);
+}
+
+// Hands a datagram the ring received to the callback, like
+// server_receive_request() does for each datagram of a batch
+static void server_uring_request(void *restrict data, char *restrict msg,
+                                 const size_t len,
+                                 const struct sockaddr *addr) {
+  LOG_TRACE("server_uring_request(data ptr: %p, msg ptr: %p, len: %zu, addr "
+            "ptr: %p)",
+            data, msg, len, addr);
+  struct dns_server *srv = (struct dns_server *)data;
+  if (len < sizeof(uint16_t)) {
     return; // Silently drop malformed packets
   }
+  uint16_t tx_id = ntohs(*((uint16_t *)msg));
+  srv->cb((void *)srv, srv->cb_data, addr, tx_id, msg, len);
+}
+
+// Sends responses queued outside of server_receive_request (e.g. upstream
+// answers relayed by the proxy) once per event loop iteration.
+static void server_flush_pending(struct ev_loop *loop, ev_prepare *obs,
+                                 int revents) {
+  LOG_TRACE("server_flush_pending(loop ptr: %p, obs ptr: %p, revents: %d)",
+            loop, obs, revents);
+  server_flush_responses((struct dns_server *)obs->data);
+}
+
+// Closes a client connection; responses still on their way to it no longer
+// match the slot's generation and are dropped
+static void server_tcp_close(struct tcp_client *restrict client) {
+  tcp_conn_close(&client->conn);
+  ev_timer_stop(client->conn.loop, &client->idle);
+  client->generation++;
+}
+
+static void server_tcp_idle(struct ev_loop *loop, ev_timer *watcher,
+                            int revents) {
+  LOG_TRACE("server_tcp_idle(loop ptr: %p, watcher ptr: %p, revents: %d)",
+            loop, watcher, revents);
+  server_tcp_close((struct tcp_client *)watcher->data);
+}
+
+// Hands every whole message on a client connection to the callback, each
+// copied out first: building a response over it in place would overwrite the
+// messages pipelined behind it
+static void server_tcp_event(struct ev_loop *loop, ev_io *obs, int revents) {
+  LOG_TRACE("server_tcp_event(loop ptr: %p, obs ptr: %p, revents: %d)", loop,
+            obs, revents);
+  struct tcp_client *client = (struct tcp_client *)obs->data;
+  struct dns_server *srv = client->server;
+  if ((revents & EV_WRITE) && !tcp_conn_flush(&client->conn)) {
+    server_tcp_close(client);
+    return;
+  }
+  if (!(revents & EV_READ)) {
+    return;
+  }
+  if (!tcp_conn_read(&client->conn)) {
+    server_tcp_close(client);
+    return;
+  }
 
-  uint16_t tx_id = ntohs(*((uint16_t *)buffer));
-  srv->cb((void *)srv, srv->cb_data, (struct sockaddr *)&raddr, tx_id, buffer,
-          len);
+  struct sockaddr_storage addr;
+  struct tcp_peer *peer = (struct tcp_peer *)&addr;
+  peer->family = AF_UNSPEC;
+  peer->slot = (uint16_t)(client - srv->tcp);
+  peer->generation = client->generation;
+
+  size_t offset = 0;
+  char *msg = NULL;
+  size_t len = 0;
+  while (tcp_conn_message(&client->conn, &offset, &msg, &len)) {
+    srv->tcp_stats.rx_messages++;
+    if (len < sizeof(uint16_t) || len > RESPONSE_MAX) {
+      continue; // Silently drop malformed messages
+    }
+    memcpy(srv->tcp_request, msg, len);
+    uint16_t tx_id = ntohs(*((uint16_t *)srv->tcp_request));
+    srv->cb((void *)srv, srv->cb_data, (struct sockaddr *)&addr, tx_id,
+            srv->tcp_request, len);
+    if (client->generation != peer->generation) {
+      return; // closed because the response did not fit
+    }
+  }
+  tcp_conn_consume(&client->conn, offset);
+  ev_timer_again(loop, &client->idle);
+}
+
+static void server_tcp_accept(struct ev_loop *loop, ev_io *obs, int revents) {
+  LOG_TRACE("server_tcp_accept(loop ptr: %p, obs ptr: %p, revents: %d)", loop,
+            obs, revents);
+  struct dns_server *srv = (struct dns_server *)obs->data;
+  for (;;) {
+    int fd = accept4(obs->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG_ERROR("accept failed: %s\n", strerror(errno));
+      }
+      return;
+    }
+
+    struct tcp_client *client = NULL;
+    for (unsigned i = 0; i < TCP_CLIENTS_MAX; i++) {
+      if (srv->tcp[i].conn.fd < 0) {
+        client = &srv->tcp[i];
+        break;
+      }
+    }
+    if (client == NULL ||
+        !tcp_conn_open(&client->conn, fd, false, server_tcp_event, client)) {
+      if (client == NULL) {
+        close(fd);
+      }
+      srv->tcp_stats.refused++;
+      continue;
+    }
+    srv->tcp_stats.connections++;
+    ev_timer_again(loop, &client->idle);
+  }
 }
 
 void server_init(struct dns_server *restrict srv, struct ev_loop *loop,
                  req_callback callback, const char *restrict listen_addr,
                  const uint16_t listen_port, void *restrict data,
-                 const hash_entry *restrict blacklist) {
+                 const struct trie *restrict blacklist,
+                 const unsigned batch_size, const bool reuseport,
+                 struct uring *restrict uring) {
   LOG_TRACE("server_init(srv ptr: %p, loop ptr: %p, callback ptr: %p, "
             "listen_addr: %s, "
-            "listen_port: %d, data ptr: %p, blacklist ptr: %p)\n",
-            srv, loop, callback, listen_addr, listen_port, data, blacklist);
+            "listen_port: %d, data ptr: %p, blacklist ptr: %p, batch_size: "
+            "%u, reuseport: %d, uring ptr: %p)\n",
+            srv, loop, callback, listen_addr, listen_port, data, blacklist,
+            batch_size, reuseport, uring);
 
   srv->loop = loop;
-  srv->sockfd = init_socket(listen_addr, listen_port, &srv->addrlen);
+  srv->sockfd = init_socket(listen_addr, listen_port, SOCK_DGRAM,
+                            &srv->addrlen, reuseport);
   if (srv->sockfd < 0) {
     LOG_FATAL("Failed to initialize socket\n");
     return;
   }
+  socklen_t tcp_addrlen = 0;
+  srv->tcp_fd = init_socket(listen_addr, listen_port, SOCK_STREAM,
+                            &tcp_addrlen, reuseport);
+  if (srv->tcp_fd < 0) {
+    LOG_FATAL("Failed to initialize TCP socket\n");
+    return;
+  }
   srv->cb = callback;
   srv->cb_data = data;
   srv->blacklist = blacklist;
+  srv->uring = uring;
+  memset(&srv->stats, 0, sizeof(srv->stats));
+  memset(&srv->tcp_stats, 0, sizeof(srv->tcp_stats));
+
+  // Room for the response to be built over the request
+  if (!udp_batch_init(&srv->rx, batch_size, RESPONSE_MAX) ||
+      !udp_batch_init(&srv->tx, batch_size, RESPONSE_MAX)) {
+    LOG_FATAL("Failed to allocate server I/O batches\n");
+    exit(-1);
+  }
+
+  // Connection buffers are only allocated once a slot is first used
+  srv->tcp = malloc(TCP_CLIENTS_MAX * sizeof(struct tcp_client));
+  srv->tcp_request = malloc(RESPONSE_MAX);
+  if (srv->tcp == NULL || srv->tcp_request == NULL) {
+    LOG_FATAL("Failed to allocate server TCP connections\n");
+    exit(-1);
+  }
+  for (unsigned i = 0; i < TCP_CLIENTS_MAX; i++) {
+    struct tcp_client *client = &srv->tcp[i];
+    tcp_conn_init(&client->conn, loop, 2 + RESPONSE_MAX, TCP_SEND_MAX);
+    client->server = srv;
+    client->generation = 0;
+    ev_init(&client->idle, server_tcp_idle);
+    client->idle.repeat = TCP_IDLE_TIMEOUT;
+    client->idle.data = client;
+  }
+  ev_io_init(&srv->tcp_observer, server_tcp_accept, srv->tcp_fd, EV_READ);
+  srv->tcp_observer.data = srv;
+  ev_io_start(srv->loop, &srv->tcp_observer);
 
   ev_io_init(&srv->observer, server_receive_request, srv->sockfd, EV_READ);
   srv->observer.data = srv;
-  ev_io_start(srv->loop, &srv->observer);
+  if (uring != NULL) {
+    uring_recv_start(uring, &srv->uring_rx, srv->sockfd, server_uring_request,
+                     srv, &srv->stats);
+  } else {
+    ev_io_start(srv->loop, &srv->observer);
+  }
+
+  ev_prepare_init(&srv->flush_observer, server_flush_pending);
+  srv->flush_observer.data = srv;
+  ev_prepare_start(srv->loop, &srv->flush_observer);
 }
 
-bool is_blacklisted(const char *domain) {
-  LOG_TRACE("is_blacklisted(domain ptr: %p)", domain);
-  if (find(domain) == 1) {
-    return true;
-  }
+bool is_blacklisted(const struct dns_server *srv, const char *domain) {
+  LOG_TRACE("is_blacklisted(srv ptr: %p, domain ptr: %p)", srv, domain);
+  return trie_match(srv->blacklist, domain);
+}
 
-  return false;
+bool is_question_blacklisted(const struct dns_server *srv,
+                             const struct packet_question *question) {
+  LOG_TRACE("is_question_blacklisted(srv ptr: %p, question ptr: %p)", srv,
+            question);
+  return trie_match_labels(srv->blacklist, question->key, question->labels,
+                           question->hashes, question->label_count);
 }
 
 bool parse_domain_name(const char *dns_req, const size_t dns_req_len,
@@ -199,24 +391,78 @@ bool parse_domain_name(const char *dns_req, const size_t dns_req_len,
   return true;
 }
 
-void server_send_response(const struct dns_server *restrict srv,
+void server_send_response(struct dns_server *restrict srv,
                           const struct sockaddr *restrict raddr,
                           const char *restrict buffer, const size_t buflen) {
   LOG_TRACE("server_send_response(srv ptr: %p, raddr ptr: %p, buffer ptr: %p, "
             "buflen: %zu)",
             srv, raddr, buffer, buflen);
+  if (server_is_tcp(raddr)) {
+    const struct tcp_peer *peer = (const struct tcp_peer *)raddr;
+    struct tcp_client *client = &srv->tcp[peer->slot];
+    if (client->generation != peer->generation) {
+      srv->tcp_stats.tx_dropped++; // the client hung up
+      return;
+    }
+    if (!tcp_conn_send(&client->conn, buffer, buflen)) {
+      LOG_ERROR("TCP client connection failed or fell behind\n");
+      srv->tcp_stats.tx_dropped++;
+      server_tcp_close(client);
+      return;
+    }
+    srv->tcp_stats.tx_messages++;
+    return;
+  }
+
+  if (srv->uring != NULL
+          ? uring_send(srv->uring, srv->sockfd, raddr, srv->addrlen, buffer,
+                       buflen, &srv->stats)
+          : udp_batch_queue(&srv->tx, srv->sockfd, raddr, srv->addrlen,
+                            buffer, buflen, &srv->stats)) {
+    return;
+  }
+
+  // Does not fit into a batch slot, send it on its own
+  srv->stats.tx_calls++;
   ssize_t sent = sendto(srv->sockfd, buffer, buflen, 0, raddr, srv->addrlen);
   if (sent < 0) {
     LOG_ERROR("sendto client failed: %s", strerror(errno));
+    srv->stats.tx_dropped++;
+    return;
+  }
+  srv->stats.tx_datagrams++;
+}
+
+void server_flush_responses(struct dns_server *restrict srv) {
+  LOG_TRACE("server_flush_responses(srv ptr: %p)", srv);
+  if (srv->tx.pending > 0) {
+    udp_batch_flush(&srv->tx, srv->sockfd, &srv->stats);
+  }
+  if (srv->uring != NULL) {
+    uring_submit(srv->uring);
   }
 }
 
 void server_stop(struct dns_server *restrict srv) {
   LOG_TRACE("server_stop(srv ptr: %p)", srv);
   ev_io_stop(srv->loop, &srv->observer);
+  ev_io_stop(srv->loop, &srv->tcp_observer);
+  for (unsigned i = 0; i < TCP_CLIENTS_MAX; i++) {
+    server_tcp_close(&srv->tcp[i]);
+  }
+  ev_prepare_stop(srv->loop, &srv->flush_observer);
+  server_flush_responses(srv);
 }
 
-void server_cleanup(const struct dns_server *restrict srv) {
+void server_cleanup(struct dns_server *restrict srv) {
   LOG_TRACE("server_cleanup(srv ptr: %p)", srv);
   close(srv->sockfd);
+  close(srv->tcp_fd);
+  for (unsigned i = 0; i < TCP_CLIENTS_MAX; i++) {
+    tcp_conn_free(&srv->tcp[i].conn);
+  }
+  free(srv->tcp);
+  free(srv->tcp_request);
+  udp_batch_free(&srv->rx);
+  udp_batch_free(&srv->tx);
 }
@@ -1,31 +1,235 @@
 // logging.c
 #include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
 
-static log_lvl current_log_level = LOG_LEVEL_INFO;
+log_lvl log_level = LOG_LEVEL_INFO;
 static const char *level_strings[] = {"FATAL", "ERROR", "WARN",
                                       "INFO",  "DEBUG", "TRACE"};
 
-void log_set_level(log_lvl level) { current_log_level = level; }
+// One message, formatted by the thread that logged it
+struct log_record {
+  time_t time;
+  const char *file;
+  int line;
+  log_lvl level;
+  size_t len;
+  char msg[LOG_MSG_MAX];
+};
+
+// Queue of one thread's messages: that thread produces, the writer consumes
+struct log_ring {
+  _Alignas(64) atomic_size_t tail; // next record the thread fills
+  atomic_size_t dropped;           // messages that found the queue full
+  _Alignas(64) atomic_size_t head; // next record the writer takes
+  size_t reported;                 // drops the writer has reported
+  struct log_ring *next;           // queue of another thread
+  struct log_record records[LOG_RING_SIZE];
+};
+
+static struct log_ring *_Atomic rings;    // every thread's queue
+static _Thread_local struct log_ring *own; // the calling thread's queue
+static atomic_bool queued;                // log_start() has run
+static atomic_bool running;               // the writer keeps going
+static pthread_t writer;                  // writer thread
+
+// Serializes writing to stderr and guards everything below
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static char out[1 << 16];     // lines of one batch
+static size_t out_len;        // bytes in out
+static time_t date_time = -1; // second date was made for
+static char date[32];         // ctime() of date_time
+
+void log_set_level(log_lvl level) { log_level = level; }
+
+static void log_fill(struct log_record *restrict rec, log_lvl level,
+                     const char *file, int line, const char *format,
+                     va_list args) {
+  rec->time = time(NULL);
+  rec->file = file;
+  rec->line = line;
+  rec->level = level;
+  int len = vsnprintf(rec->msg, sizeof(rec->msg), format, args);
+  if (len < 0) {
+    len = 0;
+  }
+  rec->len = (size_t)len < sizeof(rec->msg) ? (size_t)len
+                                            : sizeof(rec->msg) - 1;
+}
+
+static void log_write_out(void) {
+  size_t done = 0;
+  while (done < out_len) {
+    ssize_t res = write(STDERR_FILENO, out + done, out_len - done);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break; // nowhere to write to, the lines are lost
+    }
+    done += (size_t)res;
+  }
+  out_len = 0;
+}
+
+static void log_format(const struct log_record *restrict rec) {
+  // Room for the date, level, file and line in front of the message
+  if (sizeof(out) - out_len < LOG_MSG_MAX + 256) {
+    log_write_out();
+  }
+  if (rec->time != date_time) {
+    date_time = rec->time;
+    ctime_r(&date_time, date);
+    date[strlen(date) - 1] = '\0'; // Remove newline
+  }
+  int len = snprintf(out + out_len, 256, "%s [%s] %s:%d: ", date,
+                     level_strings[rec->level], rec->file, rec->line);
+  out_len += len < 256 ? (size_t)len : 255;
+  memcpy(out + out_len, rec->msg, rec->len);
+  out_len += rec->len;
+  out[out_len++] = '\n';
+}
+
+// Moves every queued message into lines, with write_lock held
+static size_t log_drain(void) {
+  size_t count = 0;
+  for (struct log_ring *ring = atomic_load(&rings); ring != NULL;
+       ring = ring->next) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    for (; head != tail; head++, count++) {
+      log_format(&ring->records[head & (LOG_RING_SIZE - 1)]);
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+
+    size_t dropped =
+        atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    if (dropped != ring->reported) {
+      struct log_record rec = {.time = time(NULL),
+                               .file = __FILE__,
+                               .line = __LINE__,
+                               .level = LOG_LEVEL_WARN};
+      int len = snprintf(rec.msg, sizeof(rec.msg),
+                         "%zu messages dropped, the log fell behind",
+                         dropped - ring->reported);
+      rec.len = len > 0 ? (size_t)len : 0;
+      log_format(&rec);
+      ring->reported = dropped;
+    }
+  }
+  log_write_out();
+  return count;
+}
+
+static void *log_writer(void *arg) {
+  const struct timespec idle = {.tv_nsec = LOG_IDLE_MS * 1000000L};
+  while (atomic_load(&running)) {
+    pthread_mutex_lock(&write_lock);
+    size_t count = log_drain();
+    pthread_mutex_unlock(&write_lock);
+    if (count == 0) {
+      nanosleep(&idle, NULL);
+    }
+  }
+  return NULL;
+}
+
+static struct log_ring *log_ring_own(void) {
+  if (own != NULL) {
+    return own;
+  }
+  struct log_ring *ring = aligned_alloc(_Alignof(struct log_ring),
+                                        sizeof(struct log_ring));
+  if (ring == NULL) {
+    return NULL;
+  }
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->dropped, 0);
+  atomic_init(&ring->head, 0);
+  ring->reported = 0;
+  ring->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+  }
+  own = ring;
+  return ring;
+}
 
 void log_message(log_lvl level, const char *file, int line, const char *format,
                  ...) {
-  if (level > current_log_level) {
+  if (level > log_level) {
     return;
   }
 
-  time_t now = 0;
-  time(&now);
-  char *date = ctime(&now);
-  date[strlen(date) - 1] = '\0'; // Remove newline
-
-  fprintf(stderr, "%s [%s] %s:%d: ", date, level_strings[level], file, line);
-
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  struct log_ring *ring = NULL;
+  if (level != LOG_LEVEL_FATAL && atomic_load(&queued)) {
+    ring = log_ring_own();
+  }
+  if (ring != NULL) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == LOG_RING_SIZE) {
+      // Never wait for the writer, it may be stuck on a blocked stderr
+      atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    } else {
+      log_fill(&ring->records[tail & (LOG_RING_SIZE - 1)], level, file, line,
+               format, args);
+      atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+    va_end(args);
+    return;
+  }
+
+  struct log_record rec;
+  log_fill(&rec, level, file, line, format, args);
   va_end(args);
+  // Anything queued before goes first, lines of different threads stay whole
+  pthread_mutex_lock(&write_lock);
+  log_drain();
+  log_format(&rec);
+  log_write_out();
+  pthread_mutex_unlock(&write_lock);
+}
+
+bool log_start(void) {
+  atomic_store(&running, true);
+  // Keep signal delivery on the main thread's default loop
+  sigset_t all;
+  sigset_t old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int res = pthread_create(&writer, NULL, log_writer, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (res != 0) {
+    atomic_store(&running, false);
+    return false;
+  }
+  atomic_store(&queued, true);
+  return true;
+}
 
-  fprintf(stderr, "\n");
-  fflush(stderr);
+void log_stop(void) {
+  if (!atomic_load(&queued)) {
+    return;
+  }
+  atomic_store(&queued, false);
+  atomic_store(&running, false);
+  pthread_join(writer, NULL);
+
+  pthread_mutex_lock(&write_lock);
+  log_drain();
+  struct log_ring *ring = atomic_exchange(&rings, NULL);
+  while (ring != NULL) {
+    struct log_ring *next = ring->next;
+    free(ring);
+    ring = next;
+  }
+  own = NULL;
+  pthread_mutex_unlock(&write_lock);
 }
@@ -13,47 +13,75 @@
 // └─────────────────────────────────────────────────────────┘
 //
 
+#include "blacklist.h"
 #include "config.h"
 #include "dns-proxy.h"
 #include "log.h"
+#include "metrics.h"
+#include "worker.h"
 
 static struct ev_loop *loop;
-static struct dns_server server;
-static struct dns_client client;
-static struct dns_proxy proxy;
+static struct worker *workers;
 static struct options opts;
-hash_entry *blacklist = NULL;
-transaction_hash_entry *transactions = NULL;
+static struct blacklist_reload reload;
+static struct metrics_exporter exporter;
+static const struct metrics **sources;
 
 static void sigint_cb(struct ev_loop *loop, ev_signal *obs, int revents) {
   LOG_TRACE("sigint_cb(loop ptr: %p, obs ptr: %p, revents: %d)\n", loop, obs,
             revents);
   LOG_INFO("Received SIGINT, stopping...\n");
   ev_break(loop, EVBREAK_ALL);
-  server_stop(&server);
-  server_cleanup(&server);
-  client_cleanup(&client);
-  proxy_stop(&proxy);
-  delete_blacklist();
-  delete_all_transactions();
+  metrics_exporter_stop(&exporter);
+  for (unsigned i = 1; i < opts.workers; i++) {
+    worker_join(&workers[i]);
+  }
+  worker_cleanup(&workers[0]);
+  blacklist_reload_stop(&reload);
+  struct trie *list = atomic_load(&blacklist);
+  trie_free(list);
+  free(list);
+}
+
+static void sighup_cb(struct ev_loop *loop, ev_signal *obs, int revents) {
+  LOG_TRACE("sighup_cb(loop ptr: %p, obs ptr: %p, revents: %d)\n", loop, obs,
+            revents);
+  LOG_INFO("Received SIGHUP, reloading the blacklist...\n");
+  blacklist_reload_start(&reload);
 }
 
-static void populate_blacklist(void) {
-  LOG_TRACE("populate_blacklist(void)\n");
-  for (int i = 0; i < BLACKLISTED_DOMAINS; i++) {
-    add_blacklist_entry(BLACKLIST[i]);
+static void publish_blacklist(struct trie *next, void *data) {
+  LOG_TRACE("publish_blacklist(next ptr: %p, data ptr: %p)\n", next, data);
+  for (unsigned i = 0; i < opts.workers; i++) {
+    worker_publish_blacklist(&workers[i], next);
   }
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
 
   loop = EV_DEFAULT;
   options_init(&opts);
-  populate_blacklist();
+  if (!options_parse(&opts, argc, argv)) {
+    return 1;
+  }
+  if (!log_start()) {
+    LOG_WARN("Failed to start the log writer, logging synchronously\n");
+  }
+  struct trie *list = malloc(sizeof(*list));
+  if (list == NULL || !blacklist_load(&opts, list)) {
+    LOG_FATAL("Failed to load the blacklist\n");
+    return 1;
+  }
+  atomic_store(&blacklist, list);
 
   ev_signal signal_observer;
   ev_signal_init(&signal_observer, sigint_cb, SIGINT);
   ev_signal_start(loop, &signal_observer);
+  ev_signal reload_observer;
+  ev_signal_init(&reload_observer, sighup_cb, SIGHUP);
+  ev_signal_start(loop, &reload_observer);
+  // A TCP or TLS peer that hung up must fail the write, not end the process
+  signal(SIGPIPE, SIG_IGN);
 
   if (getuid() != 0) {
     LOG_WARN("Running without sudo privileges port will be changed to "
@@ -62,18 +90,51 @@ int main(void) {
     opts.listen_port = opts.fallback_port;
   }
 
-  server_init(&server, loop, NULL, opts.listen_addr, opts.listen_port, NULL,
-              blacklist);
+  workers = calloc(opts.workers, sizeof(*workers));
+  if (workers == NULL) {
+    LOG_FATAL("Failed to allocate %u workers\n", opts.workers);
+    return 1;
+  }
 
-  client_init(&client, loop, NULL, upstream_resolver, transactions);
+  blacklist_reload_init(&reload, loop, &opts, opts.workers, publish_blacklist,
+                        NULL);
 
-  proxy_init(&proxy, &client, &server, loop);
+  // Worker 0 shares the default loop with the signal watchers
+  worker_init(&workers[0], 0, loop, &opts, &reload);
+  for (unsigned i = 1; i < opts.workers; i++) {
+    if (!worker_spawn(&workers[i], i, &opts, &reload)) {
+      LOG_FATAL("Failed to start worker %u\n", i);
+      exit(-1);
+    }
+  }
+
+  // Scrapes are served on the main loop and read every worker's counters
+  exporter.fd = -1;
+  if (opts.metrics != NULL) {
+    sources = malloc(opts.workers * sizeof(*sources));
+    if (sources == NULL) {
+      LOG_FATAL("Failed to allocate metrics of %u workers\n", opts.workers);
+      exit(-1);
+    }
+    for (unsigned i = 0; i < opts.workers; i++) {
+      sources[i] = &workers[i].metrics;
+    }
+    if (!metrics_exporter_init(&exporter, loop, opts.metrics, sources,
+                               opts.workers)) {
+      LOG_FATAL("Failed to serve metrics on %s\n", opts.metrics);
+      exit(-1);
+    }
+  }
 
-  LOG_INFO("DNS proxy started at %s:%d. Press Ctrl+C to stop.\n",
-           opts.listen_addr, opts.listen_port);
+  LOG_INFO("DNS proxy started at %s:%d with %u worker(s). Press Ctrl+C to "
+           "stop.\n",
+           opts.listen_addr, opts.listen_port, opts.workers);
 
   ev_run(loop, 0);
   ev_loop_destroy(loop);
+  free(workers);
+  free(sources);
+  log_stop();
 
   return 0;
 }
@@ -0,0 +1,507 @@
+#include "metrics.h"
+#include "log.h"
+#include <stdarg.h>
+#include <sys/un.h>
+
+/**
+ * @brief Scalar series: one counter or gauge added up over the workers
+ */
+struct metrics_family {
+  const char *name; /**< Series name */
+  const char *type; /**< "counter" or "gauge" */
+  const char *help; /**< HELP line */
+  size_t offset;    /**< Of the metrics_counter in struct metrics */
+};
+
+static const struct metrics_family metrics_families[] = {
+    {"dns_proxy_queries_total", "counter", "Requests handled",
+     offsetof(struct metrics, queries)},
+    {"dns_proxy_malformed_total", "counter", "Requests dropped as malformed",
+     offsetof(struct metrics, malformed)},
+    {"dns_proxy_blocked_total", "counter", "Requests for blacklisted names",
+     offsetof(struct metrics, blocked)},
+    {"dns_proxy_cache_hits_total", "counter",
+     "Requests answered from the answer or negative cache",
+     offsetof(struct metrics, cache_hits)},
+    {"dns_proxy_servfail_total", "counter",
+     "Requests the proxy answered with SERVFAIL",
+     offsetof(struct metrics, servfail)},
+    {"dns_proxy_stale_answers_total", "counter",
+     "Failed upstream queries answered with expired cache entries",
+     offsetof(struct metrics, stale)},
+    {"dns_proxy_udp_rx_dropped_total", "counter",
+     "Datagrams dropped because they were too large",
+     offsetof(struct metrics, rx_dropped)},
+    {"dns_proxy_udp_tx_dropped_total", "counter",
+     "Datagrams that could not be sent", offsetof(struct metrics, tx_dropped)},
+    {"dns_proxy_upstream_in_flight", "gauge", "Upstream queries in flight",
+     offsetof(struct metrics, in_flight)},
+    {"dns_proxy_cache_bytes", "gauge",
+     "Bytes held by the answer and negative caches",
+     offsetof(struct metrics, cache_bytes)},
+};
+
+static const struct metrics_family metrics_upstream_families[] = {
+    {"dns_proxy_upstream_queries_total", "counter",
+     "Queries sent to the upstream first",
+     offsetof(struct metrics_upstream, queries)},
+    {"dns_proxy_upstream_hedges_total", "counter",
+     "Hedges of slow queries sent to the upstream",
+     offsetof(struct metrics_upstream, hedges)},
+    {"dns_proxy_upstream_answers_total", "counter",
+     "Answers accepted from the upstream",
+     offsetof(struct metrics_upstream, answers)},
+    {"dns_proxy_upstream_timeouts_total", "counter",
+     "Queries the upstream did not answer in time",
+     offsetof(struct metrics_upstream, timeouts)},
+};
+
+/**
+ * @brief Text being rendered, cut short once cap is reached
+ */
+struct metrics_text {
+  char *buf;  /**< Output */
+  size_t cap; /**< Capacity of buf */
+  size_t len; /**< Bytes written */
+};
+
+static void metrics_printf(struct metrics_text *restrict text,
+                           const char *format, ...) {
+  if (text->len + 1 >= text->cap) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(text->buf + text->len, text->cap - text->len, format,
+                      args);
+  va_end(args);
+  if (len > 0) {
+    size_t room = text->cap - text->len - 1;
+    text->len += (size_t)len < room ? (size_t)len : room;
+  }
+}
+
+// Adds up the counter at offset of every worker's struct metrics
+static uint64_t metrics_sum(const struct metrics *const *sources,
+                            const unsigned count, const size_t offset) {
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < count; i++) {
+    const metrics_counter *counter =
+        (const metrics_counter *)((const char *)sources[i] + offset);
+    sum += atomic_load_explicit(counter, memory_order_relaxed);
+  }
+  return sum;
+}
+
+// Exclusive upper bound of a bucket in nanoseconds
+static uint64_t metrics_bucket_bound(const unsigned bucket) {
+  if (bucket < METRICS_SUB_BUCKETS) {
+    return bucket + 1;
+  }
+  unsigned octave = bucket / METRICS_SUB_BUCKETS;
+  uint64_t part = bucket % METRICS_SUB_BUCKETS;
+  return (METRICS_SUB_BUCKETS + part + 1) << (octave - 1);
+}
+
+// One histogram series; buckets are only exported at powers of two, where
+// their bounds line up with Prometheus' "le"
+static void metrics_histogram_render(struct metrics_text *restrict text,
+                                     const struct metrics *const *sources,
+                                     const unsigned count,
+                                     const char *restrict name,
+                                     const char *restrict labels,
+                                     const size_t offset) {
+  const char *sep = labels[0] != '\0' ? "," : "";
+  char braced[80] = "";
+  if (labels[0] != '\0') {
+    snprintf(braced, sizeof(braced), "{%s}", labels);
+  }
+  uint64_t cumulative = 0;
+  unsigned bucket = 0;
+  for (unsigned exp = METRICS_EXPORT_FROM; exp <= METRICS_OCTAVES; exp++) {
+    // Power of two 2^exp ends the buckets up to this one
+    unsigned last = METRICS_SUB_BUCKETS * (exp - 1) - 1;
+    for (; bucket <= last; bucket++) {
+      cumulative += metrics_sum(
+          sources, count,
+          offset + offsetof(struct metrics_histogram, buckets) +
+              bucket * sizeof(metrics_counter));
+    }
+    metrics_printf(text, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name,
+                   labels, sep, (double)(1ull << exp) / 1e9, cumulative);
+  }
+  uint64_t total = metrics_sum(
+      sources, count, offset + offsetof(struct metrics_histogram, count));
+  uint64_t sum_ns = metrics_sum(
+      sources, count, offset + offsetof(struct metrics_histogram, sum_ns));
+  metrics_printf(text, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name,
+                 labels, sep, total);
+  metrics_printf(text, "%s_sum%s %.9f\n", name, braced, (double)sum_ns / 1e9);
+  metrics_printf(text, "%s_count%s %" PRIu64 "\n", name, braced, total);
+}
+
+double metrics_quantile(const struct metrics_histogram *restrict hist,
+                        const double quantile) {
+  uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+  if (count == 0) {
+    return 0.;
+  }
+  double rank = quantile * (double)count;
+  uint64_t cumulative = 0;
+  for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+    cumulative +=
+        atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    if ((double)cumulative >= rank) {
+      return (double)metrics_bucket_bound(i) / 1e9;
+    }
+  }
+  return (double)metrics_bucket_bound(METRICS_BUCKETS - 1) / 1e9;
+}
+
+size_t metrics_render(const struct metrics *const *sources,
+                      const unsigned count, char *restrict out,
+                      const size_t cap) {
+  LOG_TRACE("metrics_render(sources ptr: %p, count: %u, out ptr: %p, cap: "
+            "%zu)\n",
+            sources, count, out, cap);
+  struct metrics_text text = {.buf = out, .cap = cap, .len = 0};
+  if (cap == 0) {
+    return 0;
+  }
+  out[0] = '\0';
+
+  metrics_printf(&text, "# HELP dns_proxy_workers Worker event loops\n"
+                        "# TYPE dns_proxy_workers gauge\n"
+                        "dns_proxy_workers %u\n",
+                 count);
+  for (size_t i = 0;
+       i < sizeof(metrics_families) / sizeof(metrics_families[0]); i++) {
+    const struct metrics_family *family = &metrics_families[i];
+    metrics_printf(&text, "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n",
+                   family->name, family->help, family->name, family->type,
+                   family->name, metrics_sum(sources, count, family->offset));
+  }
+
+  char labels[64];
+  for (size_t i = 0; i < sizeof(metrics_upstream_families) /
+                             sizeof(metrics_upstream_families[0]);
+       i++) {
+    const struct metrics_family *family = &metrics_upstream_families[i];
+    metrics_printf(&text, "# HELP %s %s\n# TYPE %s %s\n", family->name,
+                   family->help, family->name, family->type);
+    for (unsigned r = 0; r < RESOLVERS; r++) {
+      size_t offset = offsetof(struct metrics, upstreams) +
+                      r * sizeof(struct metrics_upstream) + family->offset;
+      metrics_printf(&text, "%s{upstream=\"%s\"} %" PRIu64 "\n", family->name,
+                     upstream_resolver[r],
+                     metrics_sum(sources, count, offset));
+    }
+  }
+
+  metrics_printf(&text, "# HELP dns_proxy_reply_seconds Time from a client "
+                        "query to its answer\n"
+                        "# TYPE dns_proxy_reply_seconds histogram\n");
+  metrics_histogram_render(&text, sources, count, "dns_proxy_reply_seconds",
+                           "", offsetof(struct metrics, reply));
+  metrics_printf(&text, "# HELP dns_proxy_blacklist_lookup_seconds Time of "
+                        "a blacklist lookup\n"
+                        "# TYPE dns_proxy_blacklist_lookup_seconds "
+                        "histogram\n");
+  metrics_histogram_render(&text, sources, count,
+                           "dns_proxy_blacklist_lookup_seconds", "",
+                           offsetof(struct metrics, blacklist));
+  metrics_printf(&text, "# HELP dns_proxy_upstream_rtt_seconds Time from a "
+                        "query to the upstream's UDP answer\n"
+                        "# TYPE dns_proxy_upstream_rtt_seconds histogram\n");
+  for (unsigned r = 0; r < RESOLVERS; r++) {
+    snprintf(labels, sizeof(labels), "upstream=\"%s\"", upstream_resolver[r]);
+    metrics_histogram_render(&text, sources, count,
+                             "dns_proxy_upstream_rtt_seconds", labels,
+                             offsetof(struct metrics, upstreams) +
+                                 r * sizeof(struct metrics_upstream) +
+                                 offsetof(struct metrics_upstream, rtt));
+  }
+  return text.len;
+}
+
+static void metrics_scrape_close(struct metrics_scrape *restrict scrape) {
+  struct ev_loop *loop = scrape->exporter->loop;
+  ev_io_stop(loop, &scrape->observer);
+  ev_timer_stop(loop, &scrape->timeout);
+  close(scrape->fd);
+  scrape->fd = -1;
+  free(scrape->response);
+  scrape->response = NULL;
+}
+
+static void metrics_scrape_timeout(struct ev_loop *loop, ev_timer *watcher,
+                                   int revents) {
+  LOG_TRACE("metrics_scrape_timeout(loop ptr: %p, watcher ptr: %p, revents: "
+            "%d)\n",
+            loop, watcher, revents);
+  metrics_scrape_close((struct metrics_scrape *)watcher->data);
+}
+
+// Renders the response once the whole request head is in
+static bool metrics_scrape_respond(struct metrics_scrape *restrict scrape) {
+  struct metrics_exporter *exp = scrape->exporter;
+  scrape->response = malloc(METRICS_RESPONSE_MAX);
+  if (scrape->response == NULL) {
+    return false;
+  }
+  // Anything else than GET /metrics, GET /metrics?... or GET / is not found
+  const char *status = "404 Not Found";
+  const char *req = scrape->request;
+  size_t body_len = 0;
+  if (strncmp(req, "GET /metrics ", 13) == 0 ||
+      strncmp(req, "GET /metrics?", 13) == 0 ||
+      strncmp(req, "GET / ", 6) == 0) {
+    status = "200 OK";
+    body_len = metrics_render(exp->sources, exp->count, scrape->response,
+                              METRICS_RESPONSE_MAX - 256);
+    exp->served++;
+  }
+
+  char head[256];
+  int head_len = snprintf(head, sizeof(head),
+                          "HTTP/1.1 %s\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n\r\n",
+                          status, body_len);
+  memmove(scrape->response + head_len, scrape->response, body_len);
+  memcpy(scrape->response, head, (size_t)head_len);
+  scrape->response_len = (size_t)head_len + body_len;
+  scrape->sent = 0;
+  return true;
+}
+
+static void metrics_scrape_event(struct ev_loop *loop, ev_io *obs,
+                                 int revents) {
+  LOG_TRACE("metrics_scrape_event(loop ptr: %p, obs ptr: %p, revents: %d)\n",
+            loop, obs, revents);
+  struct metrics_scrape *scrape = (struct metrics_scrape *)obs->data;
+  if (scrape->response == NULL) {
+    ssize_t len = recv(scrape->fd, scrape->request + scrape->request_len,
+                       sizeof(scrape->request) - 1 - scrape->request_len, 0);
+    if (len <= 0) {
+      if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+        metrics_scrape_close(scrape);
+      }
+      return;
+    }
+    scrape->request_len += (size_t)len;
+    scrape->request[scrape->request_len] = '\0';
+    if (strstr(scrape->request, "\r\n\r\n") == NULL &&
+        strstr(scrape->request, "\n\n") == NULL) {
+      if (scrape->request_len == sizeof(scrape->request) - 1) {
+        metrics_scrape_close(scrape); // head too long
+      }
+      return;
+    }
+    if (!metrics_scrape_respond(scrape)) {
+      metrics_scrape_close(scrape);
+      return;
+    }
+    ev_io_stop(loop, &scrape->observer);
+    ev_io_set(&scrape->observer, scrape->fd, EV_WRITE);
+    ev_io_start(loop, &scrape->observer);
+  }
+
+  while (scrape->sent < scrape->response_len) {
+    ssize_t len = send(scrape->fd, scrape->response + scrape->sent,
+                       scrape->response_len - scrape->sent, MSG_NOSIGNAL);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        metrics_scrape_close(scrape);
+      }
+      return;
+    }
+    scrape->sent += (size_t)len;
+  }
+  metrics_scrape_close(scrape);
+}
+
+static void metrics_accept(struct ev_loop *loop, ev_io *obs, int revents) {
+  LOG_TRACE("metrics_accept(loop ptr: %p, obs ptr: %p, revents: %d)\n", loop,
+            obs, revents);
+  struct metrics_exporter *exp = (struct metrics_exporter *)obs->data;
+  for (;;) {
+    int fd = accept4(obs->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG_ERROR("Metrics accept failed: %s\n", strerror(errno));
+      }
+      return;
+    }
+    struct metrics_scrape *scrape = NULL;
+    for (unsigned i = 0; i < METRICS_CLIENTS; i++) {
+      if (exp->scrapes[i].fd < 0) {
+        scrape = &exp->scrapes[i];
+        break;
+      }
+    }
+    if (scrape == NULL) {
+      close(fd);
+      continue;
+    }
+    scrape->fd = fd;
+    scrape->request_len = 0;
+    scrape->response = NULL;
+    ev_io_init(&scrape->observer, metrics_scrape_event, fd, EV_READ);
+    scrape->observer.data = scrape;
+    ev_io_start(loop, &scrape->observer);
+    ev_timer_init(&scrape->timeout, metrics_scrape_timeout, METRICS_TIMEOUT,
+                  0.);
+    scrape->timeout.data = scrape;
+    ev_timer_start(loop, &scrape->timeout);
+  }
+}
+
+// Parses "ip:port", "[ipv6]:port" or a path into a socket address
+static bool metrics_address(const char *restrict addr,
+                            struct sockaddr_storage *restrict out,
+                            socklen_t *restrict out_len) {
+  memset(out, 0, sizeof(*out));
+  if (addr[0] == '/') {
+    struct sockaddr_un *un = (struct sockaddr_un *)out;
+    if (strlen(addr) >= sizeof(un->sun_path)) {
+      return false;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, addr);
+    *out_len = sizeof(*un);
+    return true;
+  }
+
+  char host[INET6_ADDRSTRLEN];
+  const char *colon = strrchr(addr, ':');
+  if (colon == NULL) {
+    return false;
+  }
+  const char *start = addr;
+  size_t host_len = (size_t)(colon - addr);
+  if (addr[0] == '[') {
+    if (host_len < 2 || colon[-1] != ']') {
+      return false;
+    }
+    start++;
+    host_len -= 2;
+  }
+  if (host_len >= sizeof(host)) {
+    return false;
+  }
+  memcpy(host, start, host_len);
+  host[host_len] = '\0';
+  char *end = NULL;
+  long port = strtol(colon + 1, &end, 10);
+  if (*end != '\0' || port < 1 || port > UINT16_MAX) {
+    return false;
+  }
+
+  struct sockaddr_in *in = (struct sockaddr_in *)out;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)out;
+  if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+    in->sin_family = AF_INET;
+    in->sin_port = htons((uint16_t)port);
+    *out_len = sizeof(*in);
+  } else if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons((uint16_t)port);
+    *out_len = sizeof(*in6);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool metrics_exporter_init(struct metrics_exporter *restrict exp,
+                           struct ev_loop *loop, const char *restrict addr,
+                           const struct metrics *const *sources,
+                           const unsigned count) {
+  LOG_TRACE("metrics_exporter_init(exp ptr: %p, loop ptr: %p, addr: %s, "
+            "sources ptr: %p, count: %u)\n",
+            exp, loop, addr, sources, count);
+  memset(exp, 0, sizeof(*exp));
+  exp->loop = loop;
+  exp->fd = -1;
+  exp->sources = sources;
+  exp->count = count;
+  for (unsigned i = 0; i < METRICS_CLIENTS; i++) {
+    exp->scrapes[i].exporter = exp;
+    exp->scrapes[i].fd = -1;
+  }
+
+  struct sockaddr_storage sa;
+  socklen_t sa_len = 0;
+  if (!metrics_address(addr, &sa, &sa_len)) {
+    LOG_ERROR("Metrics address %s is neither ip:port, [ipv6]:port nor a "
+              "path\n",
+              addr);
+    return false;
+  }
+  int fd =
+      socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG_ERROR("Error creating metrics socket: %s\n", strerror(errno));
+    return false;
+  }
+  int on = 1;
+  if (sa.ss_family == AF_UNIX) {
+    unlink(addr); // left behind by an earlier run
+  } else if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+    LOG_ERROR("setsockopt(SO_REUSEADDR) failed: %s\n", strerror(errno));
+  }
+  if (bind(fd, (struct sockaddr *)&sa, sa_len) < 0 ||
+      listen(fd, METRICS_CLIENTS) < 0) {
+    LOG_ERROR("Error listening for metrics on %s: %s\n", addr,
+              strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  exp->fd = fd;
+  exp->path = sa.ss_family == AF_UNIX ? addr : NULL;
+  ev_io_init(&exp->observer, metrics_accept, fd, EV_READ);
+  exp->observer.data = exp;
+  ev_io_start(loop, &exp->observer);
+  LOG_INFO("Serving metrics on %s\n", addr);
+  return true;
+}
+
+void metrics_exporter_stop(struct metrics_exporter *restrict exp) {
+  LOG_TRACE("metrics_exporter_stop(exp ptr: %p)\n", exp);
+  if (exp->fd < 0) {
+    return;
+  }
+  for (unsigned i = 0; i < METRICS_CLIENTS; i++) {
+    if (exp->scrapes[i].fd >= 0) {
+      metrics_scrape_close(&exp->scrapes[i]);
+    }
+  }
+  ev_io_stop(exp->loop, &exp->observer);
+  close(exp->fd);
+  exp->fd = -1;
+  if (exp->path != NULL) {
+    unlink(exp->path);
+  }
+  LOG_INFO("metrics: %" PRIu64 " scrapes served\n", exp->served);
+}
+
+void metrics_stats_log(const char *restrict name,
+                       const struct metrics *restrict metrics) {
+  LOG_TRACE("metrics_stats_log(name: %s, metrics ptr: %p)\n", name, metrics);
+  LOG_INFO("%s: answers took p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms; "
+           "blacklist lookups p50 %.0f ns, p99 %.0f ns\n",
+           name, metrics_quantile(&metrics->reply, .5) * 1e3,
+           metrics_quantile(&metrics->reply, .99) * 1e3,
+           metrics_quantile(&metrics->reply, .999) * 1e3,
+           metrics_quantile(&metrics->blacklist, .5) * 1e9,
+           metrics_quantile(&metrics->blacklist, .99) * 1e9);
+  for (unsigned r = 0; r < RESOLVERS; r++) {
+    const struct metrics_histogram *rtt = &metrics->upstreams[r].rtt;
+    LOG_INFO("%s upstream %s: rtt p50 %.3f ms, p99 %.3f ms\n", name,
+             upstream_resolver[r], metrics_quantile(rtt, .5) * 1e3,
+             metrics_quantile(rtt, .99) * 1e3);
+  }
+}
@@ -0,0 +1,353 @@
+#include "tcp-conn.h"
+#include "log.h"
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <sys/uio.h>
+
+// Watch for writability only while there is something to write
+static inline void update_events(struct tcp_conn *restrict conn) {
+  int events = EV_READ;
+  if (conn->connecting ||
+      (conn->handshaking ? conn->want_write : conn->wlen > 0)) {
+    events |= EV_WRITE;
+  }
+  if ((conn->observer.events & (EV_READ | EV_WRITE)) == events) {
+    return;
+  }
+  ev_io_stop(conn->loop, &conn->observer);
+  ev_io_set(&conn->observer, conn->fd, events);
+  ev_io_start(conn->loop, &conn->observer);
+}
+
+void tcp_conn_init(struct tcp_conn *restrict conn, struct ev_loop *loop,
+                   const size_t rcap, const size_t wcap) {
+  LOG_TRACE("tcp_conn_init(conn ptr: %p, loop ptr: %p, rcap: %zu, wcap: %zu)",
+            conn, loop, rcap, wcap);
+  memset(conn, 0, sizeof(*conn));
+  conn->loop = loop;
+  conn->fd = -1;
+  conn->rcap = rcap;
+  conn->wcap = wcap;
+}
+
+bool tcp_conn_open(struct tcp_conn *restrict conn, const int fd,
+                   const bool connecting,
+                   void (*cb)(struct ev_loop *, ev_io *, int),
+                   void *restrict data) {
+  LOG_TRACE("tcp_conn_open(conn ptr: %p, fd: %d, connecting: %d, data ptr: "
+            "%p)",
+            conn, fd, connecting, data);
+  if (conn->rbuf == NULL) {
+    conn->rbuf = malloc(conn->rcap);
+    conn->wbuf = malloc(conn->wcap);
+    if (conn->rbuf == NULL || conn->wbuf == NULL) {
+      free(conn->rbuf);
+      free(conn->wbuf);
+      conn->rbuf = NULL;
+      conn->wbuf = NULL;
+      close(fd);
+      return false;
+    }
+  }
+  // Small messages back to back, Nagle would hold every second one back
+  int nodelay = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) <
+      0) {
+    LOG_ERROR("setsockopt(TCP_NODELAY) failed: %s\n", strerror(errno));
+  }
+  conn->fd = fd;
+  conn->connecting = connecting;
+  conn->rlen = 0;
+  conn->wlen = 0;
+  ev_io_init(&conn->observer, cb, fd,
+             connecting ? EV_READ | EV_WRITE : EV_READ);
+  conn->observer.data = data;
+  ev_io_start(conn->loop, &conn->observer);
+  return true;
+}
+
+bool tcp_conn_start_tls(struct tcp_conn *restrict conn, SSL *ssl) {
+  LOG_TRACE("tcp_conn_start_tls(conn ptr: %p, ssl ptr: %p)", conn, ssl);
+  if (SSL_set_fd(ssl, conn->fd) != 1) {
+    SSL_free(ssl);
+    tcp_conn_close(conn);
+    return false;
+  }
+  SSL_set_connect_state(ssl);
+  conn->ssl = ssl;
+  conn->handshaking = true;
+  // The first flight goes out once the socket is writable
+  conn->want_write = true;
+  update_events(conn);
+  return true;
+}
+
+// One more step of the TLS handshake, false if it failed
+static bool tls_handshake(struct tcp_conn *restrict conn) {
+  conn->want_write = false;
+  int res = SSL_do_handshake(conn->ssl);
+  if (res == 1) {
+    conn->handshaking = false;
+    return true;
+  }
+  switch (SSL_get_error(conn->ssl, res)) {
+  case SSL_ERROR_WANT_READ:
+    return true;
+  case SSL_ERROR_WANT_WRITE:
+    conn->want_write = true;
+    return true;
+  default: {
+    char reason[128];
+    ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+    long verify = SSL_get_verify_result(conn->ssl);
+    LOG_WARN("TLS handshake failed: %s%s%s\n", reason,
+             verify != X509_V_OK ? ", certificate: " : "",
+             verify != X509_V_OK ? X509_verify_cert_error_string(verify) : "");
+    ERR_clear_error();
+    return false;
+  }
+  }
+}
+
+// Like read(), -1 with EAGAIN when TLS has no whole record yet
+static ssize_t conn_recv(struct tcp_conn *restrict conn, char *buf,
+                         const size_t len) {
+  if (conn->ssl == NULL) {
+    return read(conn->fd, buf, len);
+  }
+  int got = SSL_read(conn->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+  if (got > 0) {
+    return got;
+  }
+  switch (SSL_get_error(conn->ssl, got)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  default:
+    ERR_clear_error();
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+// Like write(), partial writes are enabled on the TLS context
+static ssize_t conn_write(struct tcp_conn *restrict conn, const char *buf,
+                          const size_t len) {
+  if (conn->ssl == NULL) {
+    return write(conn->fd, buf, len);
+  }
+  int sent = SSL_write(conn->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+  if (sent > 0) {
+    return sent;
+  }
+  switch (SSL_get_error(conn->ssl, sent)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  default:
+    ERR_clear_error();
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+bool tcp_conn_read(struct tcp_conn *restrict conn) {
+  LOG_TRACE("tcp_conn_read(conn ptr: %p, rlen: %zu)", conn, conn->rlen);
+  if (conn->handshaking) {
+    if (!tls_handshake(conn)) {
+      return false;
+    }
+    update_events(conn); // done, the queries waiting for it may go out
+    if (conn->handshaking) {
+      return true;
+    }
+  }
+  // TLS hands over at most a record per call, take all there is
+  size_t before = conn->rlen;
+  while (conn->rlen < conn->rcap) {
+    ssize_t got = conn_recv(conn, conn->rbuf + conn->rlen,
+                            conn->rcap - conn->rlen);
+    if (got < 0 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      break;
+    }
+    if (got <= 0) {
+      // Closed by the peer or failed; messages that came before go out
+      // first, the end is seen again on the next call
+      if (conn->rlen > before) {
+        break;
+      }
+      return false;
+    }
+    conn->rlen += (size_t)got;
+    if (conn->ssl == NULL) {
+      break; // the socket reports the rest
+    }
+  }
+  // A message that can never fit would block the connection for good
+  if (conn->rlen >= 2) {
+    size_t first = (size_t)((uint8_t)conn->rbuf[0] << 8 |
+                            (uint8_t)conn->rbuf[1]);
+    if (first + 2 > conn->rcap) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool tcp_conn_message(struct tcp_conn *restrict conn, size_t *restrict offset,
+                      char **msg, size_t *restrict len) {
+  LOG_TRACE("tcp_conn_message(conn ptr: %p, offset: %zu)", conn, *offset);
+  size_t pos = *offset;
+  if (pos + 2 > conn->rlen) {
+    return false;
+  }
+  size_t size =
+      (size_t)((uint8_t)conn->rbuf[pos] << 8 | (uint8_t)conn->rbuf[pos + 1]);
+  if (pos + 2 + size > conn->rlen) {
+    return false;
+  }
+  *msg = conn->rbuf + pos + 2;
+  *len = size;
+  *offset = pos + 2 + size;
+  return true;
+}
+
+void tcp_conn_consume(struct tcp_conn *restrict conn, const size_t offset) {
+  LOG_TRACE("tcp_conn_consume(conn ptr: %p, offset: %zu)", conn, offset);
+  if (offset == 0) {
+    return;
+  }
+  conn->rlen -= offset;
+  memmove(conn->rbuf, conn->rbuf + offset, conn->rlen);
+  if (conn->ssl != NULL && SSL_pending(conn->ssl) > 0) {
+    ev_feed_event(conn->loop, &conn->observer, EV_READ);
+  }
+}
+
+bool tcp_conn_send(struct tcp_conn *restrict conn, const char *restrict msg,
+                   const size_t len) {
+  LOG_TRACE("tcp_conn_send(conn ptr: %p, msg ptr: %p, len: %zu)", conn, msg,
+            len);
+  if (conn->fd < 0 || len > TCP_MESSAGE_MAX) {
+    return false;
+  }
+  char prefix[2] = {(char)(len >> 8), (char)len};
+  size_t done = 0;
+
+  // Nothing queued before it, so it may skip the send buffer
+  if (conn->wlen == 0 && !conn->connecting && conn->ssl == NULL) {
+    struct iovec iov[2] = {{prefix, 2}, {(void *)msg, len}};
+    ssize_t sent = writev(conn->fd, iov, 2);
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != EINTR) {
+      return false;
+    }
+    done = sent > 0 ? (size_t)sent : 0;
+    if (done == len + 2) {
+      return true;
+    }
+  }
+
+  if (conn->wlen + len + 2 - done > conn->wcap) {
+    return false;
+  }
+  if (done < 2) {
+    memcpy(conn->wbuf + conn->wlen, prefix + done, 2 - done);
+    conn->wlen += 2 - done;
+    done = 2;
+  }
+  memcpy(conn->wbuf + conn->wlen, msg + (done - 2), len - (done - 2));
+  conn->wlen += len - (done - 2);
+  update_events(conn);
+  return true;
+}
+
+bool tcp_conn_flush(struct tcp_conn *restrict conn) {
+  LOG_TRACE("tcp_conn_flush(conn ptr: %p, wlen: %zu)", conn, conn->wlen);
+  if (conn->connecting) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+        error != 0) {
+      return false;
+    }
+    conn->connecting = false;
+  }
+  if (conn->handshaking) {
+    if (!tls_handshake(conn)) {
+      return false;
+    }
+    if (conn->handshaking) {
+      update_events(conn);
+      return true;
+    }
+  }
+
+  size_t written = 0;
+  while (written < conn->wlen) {
+    ssize_t sent =
+        conn_write(conn, conn->wbuf + written, conn->wlen - written);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+      }
+      break;
+    }
+    written += (size_t)sent;
+  }
+  conn->wlen -= written;
+  memmove(conn->wbuf, conn->wbuf + written, conn->wlen);
+  update_events(conn);
+  return true;
+}
+
+void tcp_conn_close(struct tcp_conn *restrict conn) {
+  LOG_TRACE("tcp_conn_close(conn ptr: %p, fd: %d)", conn, conn->fd);
+  if (conn->fd < 0) {
+    return;
+  }
+  ev_io_stop(conn->loop, &conn->observer);
+  if (conn->ssl != NULL) {
+    // close_notify if the socket takes it, nobody waits for the reply
+    if (!conn->handshaking) {
+      SSL_shutdown(conn->ssl);
+    }
+    SSL_free(conn->ssl);
+    ERR_clear_error();
+    conn->ssl = NULL;
+  }
+  close(conn->fd);
+  conn->fd = -1;
+  conn->connecting = false;
+  conn->handshaking = false;
+  conn->want_write = false;
+  conn->rlen = 0;
+  conn->wlen = 0;
+}
+
+void tcp_conn_free(struct tcp_conn *restrict conn) {
+  LOG_TRACE("tcp_conn_free(conn ptr: %p)", conn);
+  tcp_conn_close(conn);
+  free(conn->rbuf);
+  free(conn->wbuf);
+  conn->rbuf = NULL;
+  conn->wbuf = NULL;
+}
+
+void tcp_stats_log(const char *restrict name,
+                   const struct tcp_stats *restrict stats) {
+  LOG_TRACE("tcp_stats_log(name: %s, stats ptr: %p)", name, stats);
+  LOG_INFO("%s: %" PRIu64 " TCP connections (%" PRIu64
+           " refused or failed), received %" PRIu64 " messages, sent %" PRIu64
+           ", dropped %" PRIu64 "\n",
+           name, stats->connections, stats->refused, stats->rx_messages,
+           stats->tx_messages, stats->tx_dropped);
+}
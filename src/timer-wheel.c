@@ -0,0 +1,162 @@
+#include "timer-wheel.h"
+#include "log.h"
+
+static inline unsigned level_shift(const unsigned level) {
+  return level * TIMER_WHEEL_BITS;
+}
+
+static inline void wheel_link(struct timer_wheel *restrict wheel,
+                              struct timer_entry *restrict entry) {
+  // expires >= tick, the caller makes sure of it
+  uint64_t delta = entry->expires - wheel->tick;
+  unsigned level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << level_shift(level + 1)) {
+    level++;
+  }
+  if (delta >= (uint64_t)1 << level_shift(TIMER_WHEEL_LEVELS)) {
+    entry->expires =
+        wheel->tick + ((uint64_t)1 << level_shift(TIMER_WHEEL_LEVELS)) - 1;
+  }
+
+  unsigned index = (unsigned)(entry->expires >> level_shift(level)) &
+                   (TIMER_WHEEL_SLOTS - 1);
+  struct timer_entry **head = &wheel->slots[level][index];
+  entry->next = *head;
+  if (entry->next != NULL) {
+    entry->next->pprev = &entry->next;
+  }
+  *head = entry;
+  entry->pprev = head;
+  entry->slot = (uint16_t)(level * TIMER_WHEEL_SLOTS + index);
+  wheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+static inline void wheel_unlink(struct timer_wheel *restrict wheel,
+                                struct timer_entry *restrict entry) {
+  *entry->pprev = entry->next;
+  if (entry->next != NULL) {
+    entry->next->pprev = entry->pprev;
+  }
+  entry->pprev = NULL;
+
+  unsigned level = entry->slot / TIMER_WHEEL_SLOTS;
+  unsigned index = entry->slot % TIMER_WHEEL_SLOTS;
+  if (wheel->slots[level][index] == NULL) {
+    wheel->occupied[level] &= ~((uint64_t)1 << index);
+  }
+}
+
+// Next tick at which a level-0 slot is due or a higher slot cascades
+static inline bool wheel_next_tick(const struct timer_wheel *restrict wheel,
+                                   uint64_t *restrict next) {
+  bool found = false;
+  for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t bits = wheel->occupied[level];
+    if (bits == 0) {
+      continue;
+    }
+    // Rotate so that bit 0 is the slot after the current one; the current
+    // slot itself is only reached again a full turn later
+    uint64_t period = wheel->tick >> level_shift(level);
+    unsigned shift = (unsigned)(period + 1) & (TIMER_WHEEL_SLOTS - 1);
+    uint64_t rotated = bits;
+    if (shift != 0) {
+      rotated = (bits >> shift) | (bits << (TIMER_WHEEL_SLOTS - shift));
+    }
+    uint64_t at = (period + 1 + (uint64_t)__builtin_ctzll(rotated))
+                  << level_shift(level);
+    if (!found || at < *next) {
+      *next = at;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void timer_wheel_init(struct timer_wheel *restrict wheel, const double now) {
+  LOG_TRACE("timer_wheel_init(wheel ptr: %p, now: %f)\n", wheel, now);
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->base = now;
+}
+
+void timer_wheel_add(struct timer_wheel *restrict wheel,
+                     struct timer_entry *restrict entry,
+                     const double deadline) {
+  LOG_TRACE("timer_wheel_add(wheel ptr: %p, entry ptr: %p, deadline: %f)\n",
+            wheel, entry, deadline);
+  double ticks = (deadline - wheel->base) * TIMER_WHEEL_HZ;
+  uint64_t expires = ticks > 0 ? (uint64_t)ticks : 0;
+  if ((double)expires < ticks) {
+    expires++; // round up, never fire early
+  }
+  entry->expires = expires > wheel->tick ? expires : wheel->tick + 1;
+  wheel_link(wheel, entry);
+  wheel->count++;
+}
+
+void timer_wheel_cancel(struct timer_wheel *restrict wheel,
+                        struct timer_entry *restrict entry) {
+  LOG_TRACE("timer_wheel_cancel(wheel ptr: %p, entry ptr: %p)\n", wheel,
+            entry);
+  if (entry->pprev == NULL) {
+    return;
+  }
+  wheel_unlink(wheel, entry);
+  wheel->count--;
+}
+
+size_t timer_wheel_expire(struct timer_wheel *restrict wheel, const double now,
+                          timer_wheel_cb cb, void *data) {
+  LOG_TRACE("timer_wheel_expire(wheel ptr: %p, now: %f, cb ptr: %p, data ptr: "
+            "%p)\n",
+            wheel, now, cb, data);
+  double ticks = (now - wheel->base) * TIMER_WHEEL_HZ;
+  uint64_t target = ticks > 0 ? (uint64_t)ticks : 0;
+  size_t expired = 0;
+
+  uint64_t next = 0;
+  while (wheel_next_tick(wheel, &next) && next <= target) {
+    wheel->tick = next;
+
+    // Top down, so that entries can fall through several levels at once
+    for (unsigned level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+      if ((next & (((uint64_t)1 << level_shift(level)) - 1)) != 0) {
+        continue;
+      }
+      unsigned index =
+          (unsigned)(next >> level_shift(level)) & (TIMER_WHEEL_SLOTS - 1);
+      struct timer_entry *entry = NULL;
+      while ((entry = wheel->slots[level][index]) != NULL) {
+        wheel_unlink(wheel, entry);
+        wheel_link(wheel, entry);
+      }
+    }
+
+    // One at a time, the callback may cancel the entries that follow
+    unsigned index = (unsigned)next & (TIMER_WHEEL_SLOTS - 1);
+    struct timer_entry *entry = NULL;
+    while ((entry = wheel->slots[0][index]) != NULL) {
+      wheel_unlink(wheel, entry);
+      wheel->count--;
+      expired++;
+      cb(entry, data);
+    }
+  }
+
+  if (target > wheel->tick) {
+    wheel->tick = target;
+  }
+  return expired;
+}
+
+bool timer_wheel_next(const struct timer_wheel *restrict wheel,
+                      double *restrict at) {
+  LOG_TRACE("timer_wheel_next(wheel ptr: %p, at ptr: %p)\n", wheel, at);
+  uint64_t next = 0;
+  if (!wheel_next_tick(wheel, &next)) {
+    return false;
+  }
+  *at = wheel->base + (double)next / TIMER_WHEEL_HZ;
+  return true;
+}
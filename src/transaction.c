@@ -0,0 +1,319 @@
+#include "transaction.h"
+#include "log.h"
+#include <stddef.h>
+#include <sys/random.h>
+#include <time.h>
+
+// FNV-1a from a random basis, the key is already folded to lower case
+static inline uint64_t question_hash(const uint64_t seed,
+                                     const char *restrict key,
+                                     const size_t key_len) {
+  uint64_t hash = seed;
+  for (size_t i = 0; i < key_len; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// xorshift64*, unpredictable enough once seeded from getrandom()
+static inline uint64_t next_random(struct transaction_table *restrict table) {
+  table->rng ^= table->rng >> 12;
+  table->rng ^= table->rng << 25;
+  table->rng ^= table->rng >> 27;
+  return table->rng * 0x2545F4914F6CDD1DULL;
+}
+
+bool transaction_table_init(struct transaction_table *restrict table,
+                            const unsigned capacity, const size_t request_max,
+                            const double now) {
+  LOG_TRACE("transaction_table_init(table ptr: %p, capacity: %u, request_max: "
+            "%zu, now: %f)\n",
+            table, capacity, request_max, now);
+  memset(table, 0, sizeof(*table));
+  timer_wheel_init(&table->timeouts, now);
+
+  // The slot index takes the low bits of the ID, at least one bit is left to
+  // the generation
+  uint32_t slots = capacity < 1 ? 1 : capacity;
+  if (slots > TRANSACTION_ID_SPACE / 2) {
+    slots = TRANSACTION_ID_SPACE / 2;
+  }
+  uint32_t index_space = 1;
+  while (index_space < slots) {
+    index_space <<= 1;
+  }
+  table->slots = calloc(slots, sizeof(struct transaction));
+  table->buckets = malloc(index_space * sizeof(uint32_t));
+  table->keys = malloc((size_t)slots * QUESTION_KEY_MAX);
+  table->waiters = malloc(slots * sizeof(struct transaction_waiter));
+  if (request_max > 0) {
+    table->requests = malloc((size_t)slots * request_max);
+    table->request_max = request_max;
+  }
+  if (table->slots == NULL || table->buckets == NULL || table->keys == NULL ||
+      table->waiters == NULL || (request_max > 0 && table->requests == NULL)) {
+    transaction_table_free(table);
+    return false;
+  }
+  table->capacity = slots;
+  table->slot_mask = (uint16_t)(index_space - 1);
+  table->generation_mask = (uint16_t)~table->slot_mask;
+
+  for (uint32_t i = 0; i < slots; i++) {
+    table->slots[i].id = (uint16_t)i;
+    table->slots[i].next_free = i + 1 < slots ? i + 1 : TRANSACTION_NONE;
+  }
+  table->free_head = 0;
+  for (uint32_t i = 0; i < index_space; i++) {
+    table->buckets[i] = TRANSACTION_NONE;
+  }
+  for (uint32_t i = 0; i < slots; i++) {
+    table->waiters[i].next = i + 1 < slots ? i + 1 : TRANSACTION_NONE;
+  }
+  table->waiter_free = 0;
+
+  if (getrandom(&table->rng, sizeof(table->rng), 0) !=
+      (ssize_t)sizeof(table->rng)) {
+    table->rng = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)table;
+  }
+  table->rng |= 1; // xorshift must not start at zero
+  // Names chosen to collide would otherwise pile up in one bucket
+  table->seed = 0xcbf29ce484222325ULL ^ next_random(table);
+  return true;
+}
+
+struct transaction *
+transaction_begin(struct transaction_table *restrict table,
+                  const struct sockaddr *restrict addr,
+                  const socklen_t addr_len, const uint16_t client_id,
+                  const uint16_t udp_size, const char *restrict key,
+                  const size_t key_len, const double now) {
+  LOG_TRACE("transaction_begin(table ptr: %p, addr ptr: %p, addr_len: %u, "
+            "client_id: %u, udp_size: %u, key ptr: %p, key_len: %zu, now: "
+            "%f)\n",
+            table, addr, addr_len, client_id, udp_size, key, key_len, now);
+  if (table->free_head == TRANSACTION_NONE) {
+    table->stats.full++;
+    return NULL;
+  }
+
+  struct transaction *tx = &table->slots[table->free_head];
+  table->free_head = tx->next_free;
+  table->in_use++;
+  table->stats.started++;
+
+  // A fresh random generation, never the one the slot had last time
+  uint16_t previous = tx->id & table->generation_mask;
+  uint16_t generation = (uint16_t)next_random(table) & table->generation_mask;
+  if (generation == previous) {
+    generation = (uint16_t)(generation + table->slot_mask + 1) &
+                 table->generation_mask;
+  }
+  tx->id = generation | (tx->id & table->slot_mask);
+
+  if (addr_len > 0) {
+    memcpy(&tx->client_addr, addr, addr_len);
+  }
+  tx->client_addr_len = addr_len;
+  tx->client_id = client_id;
+  tx->udp_size = udp_size;
+  tx->waiters = TRANSACTION_NONE;
+
+  uint32_t slot = (uint32_t)(tx - table->slots);
+  memcpy(table->keys + (size_t)slot * QUESTION_KEY_MAX, key, key_len);
+  tx->key_len = (uint16_t)key_len;
+  tx->question = question_hash(table->seed, key, key_len);
+  uint32_t *bucket = &table->buckets[tx->question & table->slot_mask];
+  tx->next_pending = *bucket;
+  *bucket = slot;
+
+  tx->sent_at = now;
+  tx->request_len = 0;
+  tx->hedge = TRANSACTION_NO_HEDGE;
+  tx->hedge_due = false;
+  tx->over_tcp = false;
+  tx->in_use = true;
+  return tx;
+}
+
+// Same question, compared in full after the hash
+static inline bool same_question(const struct transaction_table *restrict table,
+                                 const struct transaction *restrict tx,
+                                 const uint64_t hash, const char *restrict key,
+                                 const size_t key_len) {
+  size_t slot = (size_t)(tx - table->slots);
+  const char *own = table->keys + slot * QUESTION_KEY_MAX;
+  return tx->question == hash && tx->key_len == key_len &&
+         memcmp(own, key, key_len) == 0;
+}
+
+struct transaction *
+transaction_pending(const struct transaction_table *restrict table,
+                    const char *restrict key, const size_t key_len) {
+  LOG_TRACE("transaction_pending(table ptr: %p, key ptr: %p, key_len: %zu)\n",
+            table, key, key_len);
+  uint64_t hash = question_hash(table->seed, key, key_len);
+  uint32_t slot = table->buckets[hash & table->slot_mask];
+  while (slot != TRANSACTION_NONE) {
+    struct transaction *tx = &table->slots[slot];
+    if (same_question(table, tx, hash, key, key_len)) {
+      return tx;
+    }
+    slot = tx->next_pending;
+  }
+  return NULL;
+}
+
+const char *transaction_key(const struct transaction_table *restrict table,
+                            const struct transaction *restrict tx,
+                            size_t *restrict key_len) {
+  LOG_TRACE("transaction_key(table ptr: %p, tx ptr: %p, key_len ptr: %p)\n",
+            table, tx, key_len);
+  *key_len = tx->key_len;
+  return table->keys + (size_t)(tx - table->slots) * QUESTION_KEY_MAX;
+}
+
+bool transaction_wait(struct transaction_table *restrict table,
+                      struct transaction *restrict tx,
+                      const struct sockaddr *restrict addr,
+                      const socklen_t addr_len, const uint16_t client_id,
+                      const uint16_t udp_size) {
+  LOG_TRACE("transaction_wait(table ptr: %p, tx ptr: %p, addr ptr: %p, "
+            "addr_len: %u, client_id: %u, udp_size: %u)\n",
+            table, tx, addr, addr_len, client_id, udp_size);
+  if (table->waiter_free == TRANSACTION_NONE) {
+    return false;
+  }
+  uint32_t index = table->waiter_free;
+  struct transaction_waiter *waiter = &table->waiters[index];
+  table->waiter_free = waiter->next;
+
+  memcpy(&waiter->addr, addr, addr_len);
+  waiter->addr_len = addr_len;
+  waiter->client_id = client_id;
+  waiter->udp_size = udp_size;
+  waiter->next = tx->waiters;
+  tx->waiters = index;
+  table->stats.coalesced++;
+  return true;
+}
+
+const struct transaction_waiter *
+transaction_first_waiter(const struct transaction_table *restrict table,
+                         const struct transaction *restrict tx) {
+  LOG_TRACE("transaction_first_waiter(table ptr: %p, tx ptr: %p)\n", table,
+            tx);
+  if (tx->waiters == TRANSACTION_NONE) {
+    return NULL;
+  }
+  return &table->waiters[tx->waiters];
+}
+
+const struct transaction_waiter *
+transaction_next_waiter(const struct transaction_table *restrict table,
+                        const struct transaction_waiter *restrict waiter) {
+  LOG_TRACE("transaction_next_waiter(table ptr: %p, waiter ptr: %p)\n", table,
+            waiter);
+  if (waiter->next == TRANSACTION_NONE) {
+    return NULL;
+  }
+  return &table->waiters[waiter->next];
+}
+
+struct transaction *transaction_find(struct transaction_table *restrict table,
+                                     const uint16_t id) {
+  LOG_TRACE("transaction_find(table ptr: %p, id: %u)\n", table, id);
+  uint32_t slot = id & table->slot_mask;
+  if (slot >= table->capacity || !table->slots[slot].in_use ||
+      table->slots[slot].id != id) {
+    table->stats.stray++;
+    return NULL;
+  }
+  return &table->slots[slot];
+}
+
+struct transaction *transaction_of_timer(struct timer_entry *restrict entry) {
+  LOG_TRACE("transaction_of_timer(entry ptr: %p)\n", entry);
+  return (struct transaction *)((char *)entry -
+                                offsetof(struct transaction, timer));
+}
+
+char *transaction_request(struct transaction_table *restrict table,
+                          const struct transaction *restrict tx) {
+  LOG_TRACE("transaction_request(table ptr: %p, tx ptr: %p)\n", table, tx);
+  if (table->requests == NULL) {
+    return NULL;
+  }
+  return table->requests + (size_t)(tx - table->slots) * table->request_max;
+}
+
+bool transaction_matches(struct transaction_table *restrict table,
+                         const struct transaction *restrict tx,
+                         const char *restrict key, const size_t key_len) {
+  LOG_TRACE("transaction_matches(table ptr: %p, tx ptr: %p, key ptr: %p, "
+            "key_len: %zu)\n",
+            table, tx, key, key_len);
+  if (!same_question(table, tx, question_hash(table->seed, key, key_len), key,
+                     key_len)) {
+    table->stats.stray++;
+    return false;
+  }
+  return true;
+}
+
+void transaction_end(struct transaction_table *restrict table,
+                     struct transaction *restrict tx) {
+  LOG_TRACE("transaction_end(table ptr: %p, tx ptr: %p)\n", table, tx);
+  timer_wheel_cancel(&table->timeouts, &tx->timer);
+
+  uint32_t slot = (uint32_t)(tx - table->slots);
+  uint32_t *link = &table->buckets[tx->question & table->slot_mask];
+  while (*link != slot) {
+    link = &table->slots[*link].next_pending;
+  }
+  *link = tx->next_pending;
+
+  while (tx->waiters != TRANSACTION_NONE) {
+    struct transaction_waiter *waiter = &table->waiters[tx->waiters];
+    uint32_t next = waiter->next;
+    waiter->next = table->waiter_free;
+    table->waiter_free = tx->waiters;
+    tx->waiters = next;
+  }
+
+  tx->in_use = false;
+  tx->next_free = table->free_head;
+  table->free_head = slot;
+  table->in_use--;
+}
+
+void transaction_table_free(struct transaction_table *restrict table) {
+  LOG_TRACE("transaction_table_free(table ptr: %p)\n", table);
+  free(table->slots);
+  free(table->buckets);
+  free(table->keys);
+  free(table->waiters);
+  free(table->requests);
+  table->slots = NULL;
+  table->buckets = NULL;
+  table->keys = NULL;
+  table->waiters = NULL;
+  table->requests = NULL;
+  table->request_max = 0;
+  table->capacity = 0;
+  table->free_head = TRANSACTION_NONE;
+  table->in_use = 0;
+}
+
+void transaction_stats_log(const char *restrict name,
+                           const struct transaction_table *restrict table) {
+  LOG_TRACE("transaction_stats_log(name: %s, table ptr: %p)", name, table);
+  const struct transaction_stats *st = &table->stats;
+  LOG_INFO("%s: %" PRIu64 " queries sent upstream, %" PRIu64
+           " coalesced, %" PRIu64 " expired, %" PRIu64
+           " refused (table full), %" PRIu64
+           " stray answers, %u of %u slots in use\n",
+           name, st->started, st->coalesced, st->expired, st->full, st->stray,
+           table->in_use, table->capacity);
+}
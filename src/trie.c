@@ -0,0 +1,695 @@
+#include "trie.h"
+#include "config.h"
+#include "log.h"
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WILDCARD_BIT 0x80000000U
+#define IMAGE_MAGIC "DNSPTRIE"
+#define IMAGE_BYTE_ORDER 0x01020304U
+
+/**
+ * @brief First bytes of a blacklist image, every offset is from file start
+ */
+struct trie_image_header {
+  char magic[8];          /**< IMAGE_MAGIC, not terminated */
+  uint32_t version;       /**< TRIE_IMAGE_VERSION */
+  uint32_t byte_order;    /**< IMAGE_BYTE_ORDER as written by the compiler */
+  uint32_t node_size;     /**< sizeof(struct trie_node) */
+  uint32_t reserved;      /**< Zero */
+  uint64_t entries;       /**< Number of names compiled in */
+  uint64_t node_count;    /**< Number of nodes */
+  uint64_t labels_len;    /**< Size of the label arena */
+  uint64_t index_slots;   /**< Size of the edge index, 0 if there is none */
+  uint64_t nodes_offset;  /**< Start of the node array */
+  uint64_t labels_offset; /**< Start of the label arena */
+  uint64_t index_offset;  /**< Start of the edge index */
+  uint64_t file_size;     /**< Total size of the image */
+};
+
+/**
+ * @brief State shared by the recursive build steps
+ */
+struct trie_build_ctx {
+  const char *names;       /**< Reversed names */
+  const uint32_t *offsets; /**< Sorted name offsets with wildcard bit */
+  uint32_t *cursors;       /**< Position of every name's next label */
+  struct trie_node *nodes; /**< Nodes built so far */
+  size_t node_count;       /**< Number of nodes built so far */
+  size_t node_cap;         /**< Capacity of nodes */
+};
+
+/**
+ * @brief Sort key of one name: its first bytes packed into an integer
+ */
+struct trie_sort_key {
+  uint64_t prefix; /**< First 8 byte ranks, big-endian, zero padded */
+  uint32_t offset; /**< Name offset with wildcard bit */
+};
+
+// Byte order used for sorting: the end of a name sorts before the label
+// separator, which sorts before every label character, so all names sharing a
+// label sequence are adjacent. Label characters are above ' ', see
+// trie_builder_add(), so they keep their own value.
+static inline unsigned sort_rank(const unsigned char c) {
+  if (c == '\0') {
+    return 0;
+  }
+  return c == '.' ? 1 : c;
+}
+
+static inline uint64_t sort_prefix(const char *restrict name) {
+  uint64_t prefix = 0;
+  size_t i = 0;
+  for (; i < sizeof(prefix) && name[i] != '\0'; i++) {
+    prefix = prefix << 8 | sort_rank((unsigned char)name[i]);
+  }
+  return i < sizeof(prefix) ? prefix << 8 * (sizeof(prefix) - i) : prefix;
+}
+
+// Most names differ within their first bytes, which compare in one step
+static int compare_reversed(const void *a, const void *b, void *arg) {
+  const struct trie_sort_key *ka = (const struct trie_sort_key *)a;
+  const struct trie_sort_key *kb = (const struct trie_sort_key *)b;
+  if (ka->prefix != kb->prefix) {
+    return ka->prefix < kb->prefix ? -1 : 1;
+  }
+  if ((ka->prefix & 0xFF) == 0) {
+    return 0; // Both names ended inside the prefix
+  }
+
+  const char *names = (const char *)arg;
+  const unsigned char *x = (const unsigned char *)names +
+                           (ka->offset & ~WILDCARD_BIT) + sizeof(ka->prefix);
+  const unsigned char *y = (const unsigned char *)names +
+                           (kb->offset & ~WILDCARD_BIT) + sizeof(kb->prefix);
+  while (*x != '\0' && *x == *y) {
+    x++;
+    y++;
+  }
+  return (int)sort_rank(*x) - (int)sort_rank(*y);
+}
+
+static inline bool same_label(const char *restrict label, const size_t len,
+                              const char *restrict stored,
+                              const size_t stored_len) {
+  return len == stored_len && memcmp(label, stored, len) == 0;
+}
+
+static inline uint32_t label_hash(const char *restrict label,
+                                  const size_t len) {
+  uint32_t h = TRIE_HASH_SEED;
+  for (size_t i = 0; i < len; i++) {
+    h = trie_hash_step(h, (unsigned char)label[i]);
+  }
+  return h;
+}
+
+// The label hash mixed with the parent, so equal labels under different
+// parents land in different slots; the label part can be computed up front
+static inline uint32_t edge_hash(const uint32_t parent, const uint32_t hash) {
+  uint32_t h = hash ^ (parent * 0x9E3779B1U);
+  h ^= h >> 16;
+  h *= 0x85EBCA6BU;
+  h ^= h >> 13;
+  return h;
+}
+
+static inline size_t label_length(const char *restrict p) {
+  size_t len = 0;
+  while (p[len] != '\0' && p[len] != '.') {
+    len++;
+  }
+  return len;
+}
+
+void trie_builder_init(struct trie_builder *restrict builder) {
+  LOG_TRACE("trie_builder_init(builder ptr: %p)\n", builder);
+  memset(builder, 0, sizeof(*builder));
+}
+
+bool trie_builder_add(struct trie_builder *restrict builder,
+                      const char *restrict domain, size_t len) {
+  LOG_TRACE("trie_builder_add(builder ptr: %p, domain: %.*s)", builder,
+            (int)len, domain);
+  uint32_t wildcard = 0;
+  if (len >= 2 && domain[0] == '*' && domain[1] == '.') {
+    wildcard = WILDCARD_BIT;
+    domain += 2;
+    len -= 2;
+  }
+  if (len > 0 && domain[len - 1] == '.') {
+    len--;
+  }
+  if (len == 0 || len > DOMAIN_MAX) {
+    return false;
+  }
+
+  if (builder->names_len + len + 1 > builder->names_cap) {
+    size_t cap = builder->names_cap ? builder->names_cap * 2 : 4096;
+    while (cap < builder->names_len + len + 1) {
+      cap *= 2;
+    }
+    if (cap >= WILDCARD_BIT) {
+      LOG_ERROR("Blacklist name arena is full\n");
+      return false;
+    }
+    char *names = realloc(builder->names, cap);
+    if (names == NULL) {
+      return false;
+    }
+    builder->names = names;
+    builder->names_cap = cap;
+  }
+  if (builder->count == builder->cap) {
+    size_t cap = builder->cap ? builder->cap * 2 : 256;
+    uint32_t *offsets = realloc(builder->offsets, cap * sizeof(*offsets));
+    if (offsets == NULL) {
+      return false;
+    }
+    builder->offsets = offsets;
+    builder->cap = cap;
+  }
+
+  // Copy the labels in reverse order, every label itself stays readable
+  char *out = builder->names + builder->names_len;
+  size_t end = len;
+  size_t pos = 0;
+  while (end > 0) {
+    size_t start = end;
+    while (start > 0 && domain[start - 1] != '.') {
+      start--;
+    }
+    size_t label_len = end - start;
+    if (label_len == 0 || label_len > 63) {
+      return false; // Empty or oversized label, nothing was committed yet
+    }
+    if (pos > 0) {
+      out[pos++] = '.';
+    }
+    for (size_t i = start; i < end; i++) {
+      if ((unsigned char)domain[i] <= ' ') {
+        return false; // Blanks and control characters
+      }
+      out[pos++] = (char)tolower((unsigned char)domain[i]);
+    }
+    end = start > 0 ? start - 1 : 0;
+    if (start == 1) {
+      return false; // Leading dot
+    }
+  }
+  out[pos] = '\0';
+
+  builder->offsets[builder->count++] = (uint32_t)builder->names_len | wildcard;
+  builder->names_len += pos + 1;
+  return true;
+}
+
+void trie_builder_free(struct trie_builder *restrict builder) {
+  LOG_TRACE("trie_builder_free(builder ptr: %p)\n", builder);
+  free(builder->names);
+  free(builder->offsets);
+  memset(builder, 0, sizeof(*builder));
+}
+
+static bool reserve_nodes(struct trie_build_ctx *restrict ctx,
+                          const size_t count) {
+  if (ctx->node_count + count <= ctx->node_cap) {
+    return true;
+  }
+  size_t cap = ctx->node_cap ? ctx->node_cap * 2 : 1024;
+  while (cap < ctx->node_count + count) {
+    cap *= 2;
+  }
+  struct trie_node *nodes = realloc(ctx->nodes, cap * sizeof(*nodes));
+  if (nodes == NULL) {
+    return false;
+  }
+  ctx->nodes = nodes;
+  ctx->node_cap = cap;
+  return true;
+}
+
+/*
+ * Creates the children of `node` from the sorted names in [lo, hi), which all
+ * share the labels leading to `node` and whose cursors point right after
+ * them. Names that end at `node` come first and only contribute their flags;
+ * the rest are grouped by their next label into one contiguous child block.
+ */
+static bool build_children(struct trie_build_ctx *restrict ctx,
+                           const uint32_t node, size_t lo, const size_t hi) {
+  while (lo < hi && ctx->names[ctx->cursors[lo]] == '\0') {
+    ctx->nodes[node].flags |=
+        (ctx->offsets[lo] & WILDCARD_BIT) ? TRIE_WILDCARD : TRIE_EXACT;
+    lo++;
+  }
+  if (lo == hi) {
+    return true;
+  }
+
+  size_t groups = 0;
+  for (size_t i = lo; i < hi; i++) {
+    if (i == lo ||
+        !same_label(ctx->names + ctx->cursors[i],
+                    label_length(ctx->names + ctx->cursors[i]),
+                    ctx->names + ctx->cursors[i - 1],
+                    label_length(ctx->names + ctx->cursors[i - 1]))) {
+      groups++;
+    }
+  }
+
+  if (!reserve_nodes(ctx, groups)) {
+    return false;
+  }
+  const uint32_t first = (uint32_t)ctx->node_count;
+  ctx->node_count += groups;
+  ctx->nodes[node].children = first;
+  ctx->nodes[node].child_count = (uint32_t)groups;
+
+  size_t start = lo;
+  for (size_t g = 0; g < groups; g++) {
+    const uint32_t label = ctx->cursors[start];
+    const size_t len = label_length(ctx->names + label);
+    size_t end = start + 1;
+    while (end < hi &&
+           same_label(ctx->names + ctx->cursors[end],
+                      label_length(ctx->names + ctx->cursors[end]),
+                      ctx->names + label, len)) {
+      end++;
+    }
+
+    struct trie_node *child = &ctx->nodes[first + g];
+    memset(child, 0, sizeof(*child));
+    child->label = label;
+    child->label_len = (uint8_t)len;
+
+    for (size_t i = start; i < end; i++) {
+      ctx->cursors[i] += (uint32_t)len;
+      if (ctx->names[ctx->cursors[i]] == '.') {
+        ctx->cursors[i]++;
+      }
+    }
+    if (!build_children(ctx, first + (uint32_t)g, start, end)) {
+      return false;
+    }
+    start = end;
+  }
+  return true;
+}
+
+/*
+ * Hashes the children of every node with more than TRIE_SCAN_MAX of them into
+ * one open-addressing table. Slot value 0 is free, the root is never a child.
+ */
+static bool build_index(struct trie *restrict trie,
+                        const struct trie_node *restrict nodes,
+                        const size_t node_count, const char *restrict labels) {
+  size_t edges = 0;
+  for (size_t n = 0; n < node_count; n++) {
+    if (nodes[n].child_count > TRIE_SCAN_MAX) {
+      edges += nodes[n].child_count;
+    }
+  }
+  if (edges == 0) {
+    return true;
+  }
+
+  size_t size = 64;
+  while (size < edges * 2) {
+    size *= 2;
+  }
+  trie->index = calloc(size, sizeof(uint32_t));
+  if (trie->index == NULL) {
+    return false;
+  }
+  trie->index_mask = size - 1;
+
+  for (size_t n = 0; n < node_count; n++) {
+    if (nodes[n].child_count <= TRIE_SCAN_MAX) {
+      continue;
+    }
+    for (uint32_t c = nodes[n].children;
+         c < nodes[n].children + nodes[n].child_count; c++) {
+      size_t slot =
+          edge_hash((uint32_t)n,
+                    label_hash(labels + nodes[c].label, nodes[c].label_len)) &
+          trie->index_mask;
+      while (trie->index[slot] != 0) {
+        slot = (slot + 1) & trie->index_mask;
+      }
+      trie->index[slot] = c;
+    }
+  }
+  return true;
+}
+
+bool trie_build(struct trie_builder *restrict builder,
+                struct trie *restrict trie) {
+  LOG_TRACE("trie_build(builder ptr: %p, trie ptr: %p)\n", builder, trie);
+  memset(trie, 0, sizeof(*trie));
+
+  struct trie_build_ctx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.names = builder->names;
+  ctx.offsets = builder->offsets;
+
+  if (builder->count > 0) {
+    struct trie_sort_key *keys = malloc(builder->count * sizeof(*keys));
+    if (keys == NULL) {
+      return false;
+    }
+    for (size_t i = 0; i < builder->count; i++) {
+      keys[i].offset = builder->offsets[i];
+      keys[i].prefix =
+          sort_prefix(builder->names + (builder->offsets[i] & ~WILDCARD_BIT));
+    }
+    qsort_r(keys, builder->count, sizeof(*keys), compare_reversed,
+            builder->names);
+
+    for (size_t i = 0; i < builder->count; i++) {
+      builder->offsets[i] = keys[i].offset;
+    }
+    free(keys);
+
+    ctx.cursors = malloc(builder->count * sizeof(uint32_t));
+    if (ctx.cursors == NULL) {
+      return false;
+    }
+    for (size_t i = 0; i < builder->count; i++) {
+      ctx.cursors[i] = builder->offsets[i] & ~WILDCARD_BIT;
+    }
+  }
+
+  if (!reserve_nodes(&ctx, 1)) {
+    free(ctx.cursors);
+    return false;
+  }
+  memset(&ctx.nodes[0], 0, sizeof(ctx.nodes[0]));
+  ctx.node_count = 1;
+
+  bool ok = build_children(&ctx, 0, 0, builder->count);
+  free(ctx.cursors);
+  if (!ok) {
+    free(ctx.nodes);
+    return false;
+  }
+
+  // Keep one copy of every node's label, the full names are no longer needed
+  size_t labels_len = 0;
+  for (size_t n = 1; n < ctx.node_count; n++) {
+    labels_len += ctx.nodes[n].label_len;
+  }
+  char *labels = malloc(labels_len > 0 ? labels_len : 1);
+  if (labels == NULL) {
+    free(ctx.nodes);
+    return false;
+  }
+  size_t pos = 0;
+  for (size_t n = 1; n < ctx.node_count; n++) {
+    memcpy(labels + pos, builder->names + ctx.nodes[n].label,
+           ctx.nodes[n].label_len);
+    ctx.nodes[n].label = (uint32_t)pos;
+    pos += ctx.nodes[n].label_len;
+  }
+
+  struct trie_node *nodes =
+      realloc(ctx.nodes, ctx.node_count * sizeof(struct trie_node));
+  if (nodes != NULL) {
+    ctx.nodes = nodes; // Give back the slack of the last doubling
+  }
+  if (!build_index(trie, ctx.nodes, ctx.node_count, labels)) {
+    free(ctx.nodes);
+    free(labels);
+    return false;
+  }
+
+  trie->nodes = ctx.nodes;
+  trie->node_count = ctx.node_count;
+  trie->labels = labels;
+  trie->labels_len = labels_len;
+  trie->entries = builder->count;
+  trie_builder_free(builder);
+  return true;
+}
+
+size_t trie_size(const struct trie *restrict trie) {
+  LOG_TRACE("trie_size(trie ptr: %p)\n", trie);
+  size_t size = trie->node_count * sizeof(struct trie_node) + trie->labels_len;
+  if (trie->index != NULL) {
+    size += (trie->index_mask + 1) * sizeof(uint32_t);
+  }
+  return size;
+}
+
+// Scans small child blocks, looks wide ones up in the edge index by the
+// label's hash
+static inline const struct trie_node *
+find_child(const struct trie *restrict trie,
+           const struct trie_node *restrict node, const char *restrict label,
+           const size_t len, const uint32_t hash) {
+  const uint32_t first = node->children;
+  const uint32_t last = first + node->child_count;
+
+  if (node->child_count <= TRIE_SCAN_MAX) {
+    for (uint32_t c = first; c < last; c++) {
+      const struct trie_node *child = &trie->nodes[c];
+      if (same_label(label, len, trie->labels + child->label,
+                     child->label_len)) {
+        return child;
+      }
+    }
+    return NULL;
+  }
+
+  const uint32_t parent = (uint32_t)(node - trie->nodes);
+  size_t slot = edge_hash(parent, hash) & trie->index_mask;
+  for (uint32_t c = trie->index[slot]; c != 0; c = trie->index[slot]) {
+    // Children of one node form a range, which identifies the parent
+    if (c >= first && c < last &&
+        same_label(label, len, trie->labels + trie->nodes[c].label,
+                   trie->nodes[c].label_len)) {
+      return &trie->nodes[c];
+    }
+    slot = (slot + 1) & trie->index_mask;
+  }
+  return NULL;
+}
+
+bool trie_match(const struct trie *restrict trie, const char *restrict domain) {
+  LOG_TRACE("trie_match(trie ptr: %p, domain: %s)", trie, domain);
+  if (trie->nodes == NULL) {
+    return false;
+  }
+
+  // Fold the name once, the stored labels are lower case already
+  char name[DOMAIN_MAX + 1]; // room for the trailing dot
+  size_t end = 0;
+  while (domain[end] != '\0') {
+    if (end > DOMAIN_MAX) {
+      return false; // Longer than any name the builder accepts
+    }
+    name[end] = (char)tolower((unsigned char)domain[end]);
+    end++;
+  }
+  if (end > 0 && name[end - 1] == '.') {
+    end--;
+  }
+
+  const struct trie_node *node = &trie->nodes[0];
+  while (end > 0) {
+    size_t start = end;
+    while (start > 0 && name[start - 1] != '.') {
+      start--;
+    }
+    size_t len = end - start;
+    // Only wide nodes need the hash
+    node = find_child(trie, node, name + start, len,
+                      node->child_count > TRIE_SCAN_MAX
+                          ? label_hash(name + start, len)
+                          : 0);
+    if (node == NULL) {
+      return false;
+    }
+    if (start == 0) {
+      break;
+    }
+    if (node->flags & TRIE_WILDCARD) {
+      return true; // A parent domain is blocked with "*."
+    }
+    end = start - 1;
+  }
+  return (node->flags & TRIE_EXACT) != 0;
+}
+
+bool trie_match_labels(const struct trie *restrict trie,
+                       const char *restrict name,
+                       const uint8_t *restrict labels,
+                       const uint32_t *restrict hashes, const unsigned count) {
+  LOG_TRACE("trie_match_labels(trie ptr: %p, name ptr: %p, labels ptr: %p, "
+            "hashes ptr: %p, count: %u)",
+            trie, name, labels, hashes, count);
+  if (trie->nodes == NULL || count == 0) {
+    return false;
+  }
+
+  const struct trie_node *node = &trie->nodes[0];
+  for (unsigned i = count; i-- > 0;) {
+    const char *label = name + labels[i];
+    node = find_child(trie, node, label + 1, (uint8_t)label[0], hashes[i]);
+    if (node == NULL) {
+      return false;
+    }
+    if (i > 0 && (node->flags & TRIE_WILDCARD)) {
+      return true; // A parent domain is blocked with "*."
+    }
+  }
+  return (node->flags & TRIE_EXACT) != 0;
+}
+
+// Sections start on 8 byte boundaries so the mapped arrays are aligned
+static inline uint64_t align8(const uint64_t offset) {
+  return (offset + 7) & ~(uint64_t)7;
+}
+
+// Pads the file from *pos up to offset, then writes len bytes of data
+static bool write_section(FILE *restrict f, uint64_t *restrict pos,
+                          const uint64_t offset, const void *restrict data,
+                          const size_t len) {
+  static const char zeros[8] = {0};
+  if (offset - *pos > sizeof(zeros) ||
+      fwrite(zeros, 1, offset - *pos, f) != offset - *pos ||
+      fwrite(data, 1, len, f) != len) {
+    return false;
+  }
+  *pos = offset + len;
+  return true;
+}
+
+bool trie_save(const struct trie *restrict trie, const char *restrict path) {
+  LOG_TRACE("trie_save(trie ptr: %p, path: %s)\n", trie, path);
+  struct trie_image_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = TRIE_IMAGE_VERSION;
+  header.byte_order = IMAGE_BYTE_ORDER;
+  header.node_size = sizeof(struct trie_node);
+  header.entries = trie->entries;
+  header.node_count = trie->node_count;
+  header.labels_len = trie->labels_len;
+  header.index_slots = trie->index != NULL ? trie->index_mask + 1 : 0;
+  header.nodes_offset = align8(sizeof(header));
+  header.labels_offset =
+      align8(header.nodes_offset + header.node_count * header.node_size);
+  header.index_offset = align8(header.labels_offset + header.labels_len);
+  header.file_size =
+      header.index_offset + header.index_slots * sizeof(uint32_t);
+
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+    LOG_ERROR("Image path %s is too long\n", path);
+    return false;
+  }
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL) {
+    LOG_ERROR("Failed to create %s: %s\n", tmp, strerror(errno));
+    return false;
+  }
+
+  uint64_t pos = 0;
+  bool ok = write_section(f, &pos, 0, &header, sizeof(header)) &&
+            write_section(f, &pos, header.nodes_offset, trie->nodes,
+                          header.node_count * header.node_size) &&
+            write_section(f, &pos, header.labels_offset, trie->labels,
+                          header.labels_len) &&
+            write_section(f, &pos, header.index_offset, trie->index,
+                          header.index_slots * sizeof(uint32_t));
+  ok = fclose(f) == 0 && ok;
+
+  if (!ok || rename(tmp, path) < 0) {
+    LOG_ERROR("Failed to write %s: %s\n", path, strerror(errno));
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+bool trie_map(struct trie *restrict trie, const char *restrict path) {
+  LOG_TRACE("trie_map(trie ptr: %p, path: %s)\n", trie, path);
+  memset(trie, 0, sizeof(*trie));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_ERROR("Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      (size_t)st.st_size < sizeof(struct trie_image_header)) {
+    LOG_ERROR("%s is not a blacklist image\n", path);
+    close(fd);
+    return false;
+  }
+
+  // A shared mapping lets every process use the same page-cache pages
+  size_t size = (size_t)st.st_size;
+  char *image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    LOG_ERROR("Failed to map %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  const struct trie_image_header *header =
+      (const struct trie_image_header *)image;
+  const char *problem = NULL;
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+    problem = "not a blacklist image";
+  } else if (header->version != TRIE_IMAGE_VERSION) {
+    problem = "image version differs, recompile it";
+  } else if (header->byte_order != IMAGE_BYTE_ORDER ||
+             header->node_size != sizeof(struct trie_node)) {
+    problem = "image was compiled for another architecture";
+  } else if (header->file_size != size || header->node_count == 0 ||
+             header->node_count > UINT32_MAX ||
+             header->nodes_offset + header->node_count * header->node_size >
+                 header->labels_offset ||
+             header->labels_offset + header->labels_len >
+                 header->index_offset ||
+             header->index_offset + header->index_slots * sizeof(uint32_t) >
+                 size ||
+             (header->index_slots & (header->index_slots - 1)) != 0 ||
+             header->nodes_offset % 8 != 0 || header->index_offset % 8 != 0) {
+    problem = "image is truncated or corrupt";
+  }
+  if (problem != NULL) {
+    LOG_ERROR("%s: %s\n", path, problem);
+    munmap(image, size);
+    return false;
+  }
+
+  madvise(image, size, MADV_WILLNEED); // Start reading ahead, do not wait
+  trie->nodes = (struct trie_node *)(image + header->nodes_offset);
+  trie->node_count = header->node_count;
+  trie->labels = image + header->labels_offset;
+  trie->labels_len = header->labels_len;
+  trie->entries = header->entries;
+  if (header->index_slots > 0) {
+    trie->index = (uint32_t *)(image + header->index_offset);
+    trie->index_mask = header->index_slots - 1;
+  }
+  trie->image = image;
+  trie->image_len = size;
+  return true;
+}
+
+void trie_free(struct trie *restrict trie) {
+  LOG_TRACE("trie_free(trie ptr: %p)\n", trie);
+  if (trie->image != NULL) {
+    munmap(trie->image, trie->image_len);
+  } else {
+    free(trie->nodes);
+    free(trie->labels);
+    free(trie->index);
+  }
+  memset(trie, 0, sizeof(*trie));
+}
@@ -0,0 +1,133 @@
+#include "udp-batch.h"
+#include "log.h"
+
+bool udp_batch_init(struct udp_batch *restrict batch, const unsigned size,
+                    const size_t slot_len) {
+  LOG_TRACE("udp_batch_init(batch ptr: %p, size: %u, slot_len: %zu)\n", batch,
+            size, slot_len);
+  memset(batch, 0, sizeof(*batch));
+  batch->size = size > 0 ? size : 1;
+  batch->slot_len = slot_len;
+
+  batch->msgs = calloc(batch->size, sizeof(*batch->msgs));
+  batch->iovs = calloc(batch->size, sizeof(*batch->iovs));
+  batch->addrs = calloc(batch->size, sizeof(*batch->addrs));
+  batch->buffers = calloc(batch->size, slot_len);
+  if (!batch->msgs || !batch->iovs || !batch->addrs || !batch->buffers) {
+    LOG_ERROR("Failed to allocate UDP batch of %u slots\n", batch->size);
+    udp_batch_free(batch);
+    return false;
+  }
+
+  for (unsigned i = 0; i < batch->size; i++) {
+    batch->iovs[i].iov_base = udp_batch_buffer(batch, i);
+    batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+  }
+  return true;
+}
+
+void udp_batch_free(struct udp_batch *restrict batch) {
+  LOG_TRACE("udp_batch_free(batch ptr: %p)\n", batch);
+  free(batch->msgs);
+  free(batch->iovs);
+  free(batch->addrs);
+  free(batch->buffers);
+  memset(batch, 0, sizeof(*batch));
+}
+
+unsigned udp_batch_recv(struct udp_batch *restrict batch, const int fd,
+                        struct udp_stats *restrict stats) {
+  LOG_TRACE("udp_batch_recv(batch ptr: %p, fd: %d, stats ptr: %p)", batch, fd,
+            stats);
+  for (unsigned i = 0; i < batch->size; i++) {
+    batch->iovs[i].iov_len = batch->slot_len;
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+    batch->msgs[i].msg_hdr.msg_flags = 0;
+  }
+
+  int count = recvmmsg(fd, batch->msgs, batch->size, MSG_DONTWAIT, NULL);
+  if (count < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      LOG_ERROR("recvmmsg failed: %s\n", strerror(errno));
+    }
+    return 0;
+  }
+
+  stats->rx_calls++;
+  stats->rx_datagrams += (uint64_t)count;
+  for (int i = 0; i < count; i++) {
+    if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      // Only the start of it arrived, nothing to answer from
+      batch->msgs[i].msg_len = 0;
+      stats->rx_truncated++;
+    }
+  }
+  return (unsigned)count;
+}
+
+bool udp_batch_queue(struct udp_batch *restrict batch, const int fd,
+                     const struct sockaddr *addr, const socklen_t addrlen,
+                     const char *restrict buffer, const size_t buflen,
+                     struct udp_stats *restrict stats) {
+  LOG_TRACE("udp_batch_queue(batch ptr: %p, fd: %d, addr ptr: %p, buffer ptr: "
+            "%p, buflen: %zu)",
+            batch, fd, addr, buffer, buflen);
+  if (buflen > batch->slot_len || addrlen > sizeof(struct sockaddr_storage)) {
+    return false;
+  }
+  if (batch->pending == batch->size) {
+    udp_batch_flush(batch, fd, stats);
+  }
+
+  const unsigned i = batch->pending++;
+  memcpy(udp_batch_buffer(batch, i), buffer, buflen);
+  memcpy(&batch->addrs[i], addr, addrlen);
+  batch->iovs[i].iov_len = buflen;
+  batch->msgs[i].msg_hdr.msg_namelen = addrlen;
+  return true;
+}
+
+void udp_batch_flush(struct udp_batch *restrict batch, const int fd,
+                     struct udp_stats *restrict stats) {
+  LOG_TRACE("udp_batch_flush(batch ptr: %p, fd: %d, pending: %u)", batch, fd,
+            batch->pending);
+  unsigned sent = 0;
+
+  while (sent < batch->pending) {
+    int res = sendmmsg(fd, batch->msgs + sent, batch->pending - sent, 0);
+    stats->tx_calls++;
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // The datagram at the head could not be sent, skip it and go on
+      LOG_ERROR("sendmmsg failed: %s\n", strerror(errno));
+      stats->tx_dropped++;
+      sent++;
+      continue;
+    }
+    stats->tx_datagrams += (uint64_t)res;
+    sent += (unsigned)res;
+  }
+  batch->pending = 0;
+}
+
+void udp_stats_log(const char *restrict name, const unsigned batch_size,
+                   const struct udp_stats *restrict stats) {
+  LOG_TRACE("udp_stats_log(name: %s, batch_size: %u, stats ptr: %p)", name,
+            batch_size, stats);
+  double rx_avg = stats->rx_calls
+                      ? (double)stats->rx_datagrams / (double)stats->rx_calls
+                      : 0.;
+  double tx_avg = stats->tx_calls
+                      ? (double)stats->tx_datagrams / (double)stats->tx_calls
+                      : 0.;
+  LOG_INFO("%s: batch size %u, received %" PRIu64 " datagrams in %" PRIu64
+           " calls (%.2f per call), %" PRIu64 " too large, sent %" PRIu64
+           " in %" PRIu64 " calls (%.2f per call), dropped %" PRIu64 "\n",
+           name, batch_size, stats->rx_datagrams, stats->rx_calls, rx_avg,
+           stats->rx_truncated, stats->tx_datagrams, stats->tx_calls, tx_avg,
+           stats->tx_dropped);
+}
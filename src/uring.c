@@ -0,0 +1,480 @@
+#include "uring.h"
+#include "log.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Receives and sends are identified by their address, which is aligned,
+// sends carry a tag in the low bit
+enum {
+  URING_TAG_SEND = 1,
+  URING_TAG_CANCEL = 2,
+}; // user_data tags
+
+static inline int uring_enter(struct uring *restrict ring,
+                              const unsigned to_submit,
+                              const unsigned min_complete,
+                              const unsigned flags) {
+  ring->stats.enters++;
+  return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                      flags, NULL, 0);
+}
+
+// Next free submission queue entry, zeroed; without SQPOLL the kernel only
+// looks at the queue during io_uring_enter(), so it is published right away
+static struct io_uring_sqe *uring_sqe(struct uring *restrict ring) {
+  unsigned tail = *ring->sq_tail;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+      ring->sq_entries) {
+    uring_submit(ring);
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+        ring->sq_entries) {
+      return NULL;
+    }
+  }
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+// Hands a receive buffer (back) to the kernel
+static inline void uring_buffer_give(struct uring *restrict ring,
+                                     const uint16_t bid) {
+  struct io_uring_buf *buf =
+      &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->buffers + bid * ring->buf_len);
+  buf->len = (uint32_t)ring->buf_len;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_arm(struct uring *restrict ring,
+                      struct uring_recv *restrict recv) {
+  struct io_uring_sqe *sqe = uring_sqe(ring);
+  if (sqe == NULL) {
+    // Tried again before the loop polls
+    recv->next = ring->rearm;
+    ring->rearm = recv;
+    return;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = recv->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&recv->msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = (uint64_t)(uintptr_t)recv;
+  recv->armed = true;
+  ring->armed++;
+}
+
+// A provided buffer starts with the recvmsg header and the peer address,
+// the datagram follows with RESPONSE_MAX bytes of room
+static void uring_deliver(struct uring_recv *restrict recv, char *buf) {
+  struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+  recv->stats->rx_datagrams++;
+  if (out->flags & MSG_TRUNC) {
+    recv->stats->rx_truncated++; // nothing to answer from
+    return;
+  }
+  char *msg = buf + sizeof(*out) + recv->msg.msg_namelen;
+  recv->cb(recv->data, msg, out->payloadlen, (struct sockaddr *)(out + 1));
+}
+
+static inline unsigned uring_sending(const struct uring *restrict ring) {
+  return ring->arenas[0].sending + ring->arenas[1].sending;
+}
+
+static void uring_complete_send(struct uring *restrict ring,
+                                const struct io_uring_cqe *restrict cqe) {
+  uintptr_t address = (uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_SEND);
+  struct uring_send *send = (struct uring_send *)address;
+  if (cqe->res < 0) {
+    if (!ring->stopping) {
+      LOG_ERROR("sendmsg failed: %s\n", strerror(-cqe->res));
+    }
+    send->stats->tx_dropped++;
+  } else {
+    send->stats->tx_datagrams++;
+  }
+  struct uring_arena *arena = &ring->arenas[send->arena];
+  if (--arena->sending == 0) {
+    arena->used = 0;
+  }
+}
+
+static void uring_complete(struct uring *restrict ring,
+                           const struct io_uring_cqe *restrict cqe) {
+  ring->stats.completions++;
+  if (cqe->user_data == URING_TAG_CANCEL) {
+    return;
+  }
+  if (cqe->user_data & URING_TAG_SEND) {
+    uring_complete_send(ring, cqe);
+    return;
+  }
+
+  struct uring_recv *recv = (struct uring_recv *)(uintptr_t)cqe->user_data;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (cqe->res >= 0 && !ring->stopping) {
+      uring_deliver(recv, ring->buffers + bid * ring->buf_len);
+    }
+    uring_buffer_give(ring, bid);
+  }
+  if (cqe->flags & IORING_CQE_F_MORE) {
+    return;
+  }
+
+  // The kernel ended the multishot receive
+  recv->armed = false;
+  ring->armed--;
+  if (ring->stopping) {
+    return;
+  }
+  if (cqe->res == -EINVAL) {
+    LOG_FATAL("io_uring multishot receive refused, the kernel is too old for "
+              "it (6.0 or later needed)\n");
+    exit(-1);
+  }
+  if (cqe->res == -ENOBUFS) {
+    ring->stats.no_buffers++;
+  } else if (cqe->res < 0) {
+    LOG_ERROR("recvmsg failed: %s\n", strerror(-cqe->res));
+  }
+  ring->stats.rearmed++;
+  uring_arm(ring, recv);
+}
+
+static void uring_reap(struct uring *restrict ring) {
+  for (;;) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      uring_complete(ring, &ring->cqes[head & ring->cq_mask]);
+      head++;
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) &
+          IORING_SQ_CQ_OVERFLOW)) {
+      return;
+    }
+    // Completions that did not fit wait in the kernel until asked for
+    uring_enter(ring, 0, 0, IORING_ENTER_GETEVENTS);
+  }
+}
+
+static void uring_event(struct ev_loop *loop, ev_io *obs, int revents) {
+  LOG_TRACE("uring_event(loop ptr: %p, obs ptr: %p, revents: %d)", loop, obs,
+            revents);
+  uring_reap((struct uring *)obs->data);
+}
+
+// Sends queued during the iteration and receives to re-arm go out together
+static void uring_prepare(struct ev_loop *loop, ev_prepare *obs, int revents) {
+  LOG_TRACE("uring_prepare(loop ptr: %p, obs ptr: %p, revents: %d)", loop,
+            obs, revents);
+  struct uring *ring = (struct uring *)obs->data;
+  struct uring_recv *recv = ring->rearm;
+  ring->rearm = NULL;
+  while (recv != NULL) {
+    struct uring_recv *next = recv->next;
+    uring_arm(ring, recv);
+    recv = next;
+  }
+  uring_submit(ring);
+}
+
+static bool uring_map(struct uring *restrict ring,
+                      const struct io_uring_params *restrict params) {
+  ring->sq_map_len =
+      params->sq_off.array + params->sq_entries * sizeof(unsigned);
+  size_t cq_len =
+      params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params->features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cq_len > ring->sq_map_len) {
+    ring->sq_map_len = cq_len;
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    ring->sq_map = NULL;
+    return false;
+  }
+  ring->cq_map = ring->sq_map;
+  if (!single) {
+    ring->cq_map =
+        mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      ring->cq_map = NULL;
+      return false;
+    }
+    ring->cq_map_len = cq_len;
+  }
+  ring->sqes_len = params->sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    return false;
+  }
+
+  char *sq = (char *)ring->sq_map;
+  ring->sq_head = (unsigned *)(sq + params->sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+  ring->sq_flags = (unsigned *)(sq + params->sq_off.flags);
+  ring->sq_array = (unsigned *)(sq + params->sq_off.array);
+  ring->sq_mask = *(unsigned *)(sq + params->sq_off.ring_mask);
+  ring->sq_entries = params->sq_entries;
+  char *cq = (char *)ring->cq_map;
+  ring->cq_head = (unsigned *)(cq + params->cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params->cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+  return true;
+}
+
+// Provided buffers (Linux 5.19), all of them handed to the kernel up front
+static bool uring_buffers(struct uring *restrict ring) {
+  ring->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+  if (ring->buf_ring == MAP_FAILED) {
+    ring->buf_ring = NULL;
+    return false;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0) {
+    LOG_WARN("io_uring provided buffer rings unavailable: %s\n",
+             strerror(errno));
+    munmap(ring->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    ring->buf_ring = NULL;
+    return false;
+  }
+
+  ring->buf_len = sizeof(struct io_uring_recvmsg_out) +
+                  sizeof(struct sockaddr_storage) + RESPONSE_MAX;
+  ring->buffers = malloc(URING_BUFFERS * ring->buf_len);
+  if (ring->buffers == NULL) {
+    return false;
+  }
+  for (unsigned i = 0; i < URING_BUFFERS; i++) {
+    uring_buffer_give(ring, (uint16_t)i);
+  }
+  return true;
+}
+
+bool uring_init(struct uring *restrict ring, struct ev_loop *loop) {
+  LOG_TRACE("uring_init(ring ptr: %p, loop ptr: %p)\n", ring, loop);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  ring->loop = loop;
+
+  // Multishot receives complete many times per request
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = URING_ENTRIES * 4;
+  ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (ring->fd < 0) {
+    LOG_WARN("io_uring_setup failed: %s\n", strerror(errno));
+    return false;
+  }
+  if (!(params.features & IORING_FEAT_NODROP)) {
+    LOG_WARN("io_uring may drop completions on this kernel\n");
+    uring_free(ring);
+    return false;
+  }
+  if (!uring_map(ring, &params) || !uring_buffers(ring)) {
+    LOG_WARN("Failed to set up the io_uring queues and buffers\n");
+    uring_free(ring);
+    return false;
+  }
+
+  ring->arenas[0].base = malloc(URING_ARENA);
+  ring->arenas[1].base = malloc(URING_ARENA);
+  if (ring->arenas[0].base == NULL || ring->arenas[1].base == NULL) {
+    LOG_WARN("Failed to allocate io_uring send arenas\n");
+    uring_free(ring);
+    return false;
+  }
+
+  ev_io_init(&ring->observer, uring_event, ring->fd, EV_READ);
+  ring->observer.data = ring;
+  ev_io_start(loop, &ring->observer);
+  ev_prepare_init(&ring->submit_observer, uring_prepare);
+  ring->submit_observer.data = ring;
+  ev_prepare_start(loop, &ring->submit_observer);
+  return true;
+}
+
+void uring_recv_start(struct uring *restrict ring,
+                      struct uring_recv *restrict recv, const int fd,
+                      uring_recv_cb cb, void *data,
+                      struct udp_stats *restrict stats) {
+  LOG_TRACE("uring_recv_start(ring ptr: %p, recv ptr: %p, fd: %d, cb ptr: %p, "
+            "data ptr: %p, stats ptr: %p)\n",
+            ring, recv, fd, cb, data, stats);
+  memset(recv, 0, sizeof(*recv));
+  recv->ring = ring;
+  recv->fd = fd;
+  recv->cb = cb;
+  recv->data = data;
+  recv->stats = stats;
+  recv->msg.msg_namelen = sizeof(struct sockaddr_storage);
+  uring_arm(ring, recv);
+}
+
+bool uring_send(struct uring *restrict ring, const int fd,
+                const struct sockaddr *addr, const socklen_t addrlen,
+                const char *restrict buffer, const size_t buflen,
+                struct udp_stats *restrict stats) {
+  LOG_TRACE("uring_send(ring ptr: %p, fd: %d, addr ptr: %p, buffer ptr: %p, "
+            "buflen: %zu)",
+            ring, fd, addr, buffer, buflen);
+  if (buflen > RESPONSE_MAX || addrlen > sizeof(struct sockaddr_storage)) {
+    return false;
+  }
+  // Kept aligned for the next header
+  size_t need = (sizeof(struct uring_send) + buflen + 15) & ~(size_t)15;
+  struct uring_arena *arena = &ring->arenas[ring->arena];
+  if (arena->used + need > URING_ARENA) {
+    struct uring_arena *other = &ring->arenas[ring->arena ^ 1];
+    if (other->sending > 0) {
+      ring->stats.fallbacks++;
+      return false;
+    }
+    ring->arena ^= 1;
+    arena = other;
+    arena->used = 0;
+  }
+  struct io_uring_sqe *sqe = uring_sqe(ring);
+  if (sqe == NULL) {
+    ring->stats.fallbacks++;
+    return false;
+  }
+
+  struct uring_send *send = (struct uring_send *)(arena->base + arena->used);
+  arena->used += need;
+  arena->sending++;
+  memcpy(send + 1, buffer, buflen);
+  memset(&send->msg, 0, sizeof(send->msg));
+  send->iov.iov_base = send + 1;
+  send->iov.iov_len = buflen;
+  send->msg.msg_iov = &send->iov;
+  send->msg.msg_iovlen = 1;
+  memcpy(&send->addr, addr, addrlen);
+  send->msg.msg_name = &send->addr;
+  send->msg.msg_namelen = addrlen;
+  send->stats = stats;
+  send->arena = ring->arena;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+  sqe->len = 1;
+  sqe->user_data = (uint64_t)(uintptr_t)send | URING_TAG_SEND;
+  return true;
+}
+
+void uring_submit(struct uring *restrict ring) {
+  LOG_TRACE("uring_submit(ring ptr: %p)", ring);
+  unsigned pending =
+      *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (pending == 0) {
+    return;
+  }
+  int res = uring_enter(ring, pending, 0, 0);
+  if (res < 0) {
+    // EBUSY: completions overflowed, reaping them lets the rest through
+    if (errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+      LOG_ERROR("io_uring_enter failed: %s\n", strerror(errno));
+    }
+    return;
+  }
+  ring->stats.submitted += (uint64_t)res;
+}
+
+void uring_free(struct uring *restrict ring) {
+  LOG_TRACE("uring_free(ring ptr: %p)\n", ring);
+  if (ring->fd < 0) {
+    return;
+  }
+  ev_io_stop(ring->loop, &ring->observer);
+  ev_prepare_stop(ring->loop, &ring->submit_observer);
+
+  // Nothing may write into the buffers or read the arenas once freed
+  ring->stopping = true;
+  ring->rearm = NULL;
+  if (ring->sqes != NULL && (ring->armed > 0 || uring_sending(ring) > 0)) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe != NULL) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+      sqe->user_data = URING_TAG_CANCEL;
+    }
+    uring_submit(ring);
+    while (ring->armed > 0 || uring_sending(ring) > 0) {
+      if (uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+          errno != EINTR) {
+        LOG_ERROR("io_uring_enter failed: %s\n", strerror(errno));
+        break;
+      }
+      uring_reap(ring);
+    }
+  }
+
+  if (ring->buf_ring != NULL) {
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = 0;
+    syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_PBUF_RING,
+            &reg, 1);
+    munmap(ring->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+  }
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_len);
+  }
+  if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_len);
+  }
+  if (ring->sq_map != NULL) {
+    munmap(ring->sq_map, ring->sq_map_len);
+  }
+  close(ring->fd);
+  free(ring->buffers);
+  free(ring->arenas[0].base);
+  free(ring->arenas[1].base);
+  ring->fd = -1;
+  ring->buf_ring = NULL;
+  ring->buffers = NULL;
+  ring->arenas[0].base = NULL;
+  ring->arenas[1].base = NULL;
+  ring->sqes = NULL;
+  ring->sq_map = NULL;
+  ring->cq_map = NULL;
+}
+
+void uring_stats_log(const char *restrict name,
+                     const struct uring *restrict ring) {
+  LOG_TRACE("uring_stats_log(name: %s, ring ptr: %p)", name, ring);
+  const struct uring_stats *st = &ring->stats;
+  double avg = st->enters ? (double)st->submitted / (double)st->enters : 0.;
+  LOG_INFO("%s: io_uring, %" PRIu64 " requests submitted in %" PRIu64
+           " io_uring_enter() calls (%.2f per call), %" PRIu64
+           " completions, receives armed again %" PRIu64 " times (%" PRIu64
+           " out of buffers), %" PRIu64 " sends did not fit\n",
+           name, st->submitted, st->enters, avg, st->completions, st->rearmed,
+           st->no_buffers, st->fallbacks);
+}
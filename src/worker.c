@@ -0,0 +1,196 @@
+#include "worker.h"
+#include "log.h"
+#include <signal.h>
+
+static void worker_stop_cb(struct ev_loop *loop, ev_async *obs, int revents) {
+  LOG_TRACE("worker_stop_cb(loop ptr: %p, obs ptr: %p, revents: %d)\n", loop,
+            obs, revents);
+  ev_break(loop, EVBREAK_ALL);
+}
+
+// Runs on the worker's loop, so no lookup is in progress during the switch
+static void worker_reload_cb(struct ev_loop *loop, ev_async *obs,
+                             int revents) {
+  LOG_TRACE("worker_reload_cb(loop ptr: %p, obs ptr: %p, revents: %d)\n", loop,
+            obs, revents);
+  struct worker *w = (struct worker *)obs->data;
+  struct trie *next = atomic_exchange(&w->next_blacklist, NULL);
+  if (next != NULL) {
+    w->server.blacklist = next;
+    blacklist_reload_ack(w->reload);
+  }
+}
+
+// Gauges and counters kept elsewhere are copied in once per loop iteration,
+// not on every change
+static void worker_metrics_cb(struct ev_loop *loop, ev_prepare *obs,
+                              int revents) {
+  struct worker *w = (struct worker *)obs->data;
+  struct metrics *metrics = &w->metrics;
+  metrics_set(&metrics->in_flight, w->transactions.in_use);
+  metrics_set(&metrics->cache_bytes, w->cache.used + w->negative.used);
+  metrics_set(&metrics->rx_dropped,
+              w->server.stats.rx_truncated + w->client.stats.rx_truncated);
+  metrics_set(&metrics->tx_dropped,
+              w->server.stats.tx_dropped + w->client.stats.tx_dropped);
+}
+
+static void worker_watch(struct worker *restrict w) {
+  ev_async_init(&w->stop_observer, worker_stop_cb);
+  ev_async_start(w->loop, &w->stop_observer);
+  ev_async_init(&w->reload_observer, worker_reload_cb);
+  w->reload_observer.data = w;
+  ev_async_start(w->loop, &w->reload_observer);
+}
+
+static void *worker_run(void *arg) {
+  struct worker *w = (struct worker *)arg;
+  LOG_TRACE("worker_run(worker ptr: %p)\n", w);
+
+  worker_init(w, w->id, w->loop, w->opts, w->reload);
+  ev_run(w->loop, 0);
+  worker_cleanup(w);
+  ev_loop_destroy(w->loop);
+  return NULL;
+}
+
+void worker_init(struct worker *restrict w, const unsigned id,
+                 struct ev_loop *loop, const struct options *restrict opts,
+                 struct blacklist_reload *restrict reload) {
+  LOG_TRACE("worker_init(worker ptr: %p, id: %u, loop ptr: %p, opts ptr: %p, "
+            "reload ptr: %p)\n",
+            w, id, loop, opts, reload);
+  w->id = id;
+  w->loop = loop;
+  w->opts = opts;
+  w->reload = reload;
+  if (id == 0) {
+    // Spawned workers watch from worker_spawn() on, before their thread runs,
+    // so that nothing sent to them in between is lost
+    worker_watch(w);
+  }
+
+  // One ring serves the UDP sockets of both sides
+  struct uring *uring = NULL;
+  w->uring.fd = -1;
+  if (opts->uring) {
+    if (uring_init(&w->uring, loop)) {
+      uring = &w->uring;
+    } else {
+      LOG_WARN("Worker %u falls back to libev for UDP\n", id);
+    }
+  }
+
+  server_init(&w->server, loop, NULL, opts->listen_addr, opts->listen_port,
+              NULL, atomic_load(&blacklist), opts->batch_size,
+              opts->workers > 1, uring);
+  // Requests are kept to be resent as hedges or over TCP after a TC answer
+  if (!transaction_table_init(&w->transactions, opts->inflight, REQUEST_MAX,
+                              ev_now(loop))) {
+    LOG_FATAL("Failed to allocate transaction table of worker %u\n", id);
+    exit(-1);
+  }
+  client_init(&w->client, loop, NULL, NULL, &w->transactions,
+              opts->batch_size, opts->hedging, opts->tls, opts->tls_ca, uring);
+  // Each worker gets an equal share of the total budget
+  cache_init(&w->cache, opts->cache_size / opts->workers, opts->stale,
+             opts->prefetch);
+  cache_init_negative(&w->negative, opts->neg_size / opts->workers,
+                      opts->neg_ttl);
+  proxy_init(&w->proxy, &w->client, &w->server, loop, &w->cache,
+             &w->negative, opts, opts->metrics != NULL ? &w->metrics : NULL);
+  if (opts->metrics != NULL) {
+    ev_prepare_init(&w->metrics_observer, worker_metrics_cb);
+    w->metrics_observer.data = w;
+    ev_prepare_start(loop, &w->metrics_observer);
+  }
+}
+
+bool worker_spawn(struct worker *restrict w, const unsigned id,
+                  const struct options *restrict opts,
+                  struct blacklist_reload *restrict reload) {
+  LOG_TRACE("worker_spawn(worker ptr: %p, id: %u, opts ptr: %p, reload ptr: "
+            "%p)\n",
+            w, id, opts, reload);
+  w->id = id;
+  w->opts = opts;
+  w->reload = reload;
+  w->loop = ev_loop_new(EVFLAG_AUTO);
+  if (w->loop == NULL) {
+    LOG_ERROR("Failed to create event loop for worker %u\n", id);
+    return false;
+  }
+  worker_watch(w);
+
+  // Keep signal delivery on the main thread's default loop
+  sigset_t all;
+  sigset_t old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int res = pthread_create(&w->thread, NULL, worker_run, w);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (res != 0) {
+    LOG_ERROR("Failed to start worker %u: %s\n", id, strerror(res));
+    ev_loop_destroy(w->loop);
+    return false;
+  }
+  return true;
+}
+
+void worker_publish_blacklist(struct worker *restrict w, struct trie *next) {
+  LOG_TRACE("worker_publish_blacklist(worker ptr: %p, next ptr: %p)\n", w,
+            next);
+  atomic_store(&w->next_blacklist, next);
+  ev_async_send(w->loop, &w->reload_observer);
+}
+
+void worker_join(struct worker *restrict w) {
+  LOG_TRACE("worker_join(worker ptr: %p)\n", w);
+  ev_async_send(w->loop, &w->stop_observer);
+  pthread_join(w->thread, NULL);
+}
+
+void worker_cleanup(struct worker *restrict w) {
+  LOG_TRACE("worker_cleanup(worker ptr: %p)\n", w);
+  char name[32];
+
+  ev_async_stop(w->loop, &w->stop_observer);
+  ev_async_stop(w->loop, &w->reload_observer);
+  if (w->proxy.metrics != NULL) {
+    ev_prepare_stop(w->loop, &w->metrics_observer);
+  }
+  server_stop(&w->server);
+  // Sends still in flight are accounted before the counters are logged
+  uring_free(&w->uring);
+  snprintf(name, sizeof(name), "worker %u server", w->id);
+  udp_stats_log(name, w->server.rx.size, &w->server.stats);
+  tcp_stats_log(name, &w->server.tcp_stats);
+  snprintf(name, sizeof(name), "worker %u client", w->id);
+  udp_stats_log(name, w->client.rx.size, &w->client.stats);
+  client_stats_log(name, &w->client);
+  tcp_stats_log(name, &w->client.tcp_stats);
+  if (w->server.uring != NULL) {
+    snprintf(name, sizeof(name), "worker %u", w->id);
+    uring_stats_log(name, &w->uring);
+  }
+  snprintf(name, sizeof(name), "worker %u cache", w->id);
+  cache_stats_log(name, &w->cache);
+  snprintf(name, sizeof(name), "worker %u negative cache", w->id);
+  cache_stats_log(name, &w->negative);
+  snprintf(name, sizeof(name), "worker %u transactions", w->id);
+  transaction_stats_log(name, &w->transactions);
+  snprintf(name, sizeof(name), "worker %u proxy", w->id);
+  proxy_stats_log(name, &w->proxy);
+  if (w->proxy.metrics != NULL) {
+    snprintf(name, sizeof(name), "worker %u", w->id);
+    metrics_stats_log(name, &w->metrics);
+  }
+
+  server_cleanup(&w->server);
+  client_cleanup(&w->client);
+  proxy_stop(&w->proxy);
+  cache_free(&w->cache);
+  cache_free(&w->negative);
+  transaction_table_free(&w->transactions);
+}
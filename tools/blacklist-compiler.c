@@ -0,0 +1,62 @@
+// DNS-Proxy blacklist compiler
+//
+// Compiles the built-in BLACKLIST and blocklist files into a binary image
+// that `dns-proxy -i` maps at startup instead of parsing anything.
+//
+// Usage: ./blacklist-compiler -o image [-f file]...
+
+#include "blacklist.h"
+#include "log.h"
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s -o image [-f file]...\n"
+          "  -o  image to write, replaced atomically\n"
+          "  -f  blocklist in hosts or one-domain-per-line format, repeat for "
+          "up to %d files\n",
+          prog, BLACKLIST_FILES_MAX);
+}
+
+int main(int argc, char *argv[]) {
+  struct options opts;
+  options_init(&opts);
+  const char *output = NULL;
+
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "o:f:h")) != -1) {
+    switch (opt) {
+    case 'o':
+      output = optarg;
+      break;
+    case 'f':
+      if (opts.blacklist_file_count == BLACKLIST_FILES_MAX) {
+        LOG_ERROR("At most %d blacklist files are supported\n",
+                  BLACKLIST_FILES_MAX);
+        return 1;
+      }
+      opts.blacklist_files[opts.blacklist_file_count++] = optarg;
+      break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (output == NULL) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  struct trie trie;
+  if (!blacklist_load(&opts, &trie)) {
+    return 1;
+  }
+  bool ok = trie_save(&trie, output);
+  if (ok) {
+    LOG_INFO("Wrote %s: image version %d, %zu names, %zu nodes, %.1f MiB\n",
+             output, TRIE_IMAGE_VERSION, trie.entries, trie.node_count,
+             (double)trie_size(&trie) / (1 << 20));
+  }
+  trie_free(&trie);
+  return ok ? 0 : 1;
+}